@@ -0,0 +1,46 @@
+#!/bin/sh
+# Harness throughput benchmark: plays scm-mock-engine against itself with 1, 8, 32 and 128 concurrent games,
+# and reports games/s, plies/s, harness CPU time per ply, and scaling efficiency relative to 1 game.
+# The mock engine moves instantly and ends every game by mate at a fixed ply, so the results measure the
+# harness's own overhead rather than engine thinking time.
+#
+# usage: ./bench.sh [slot counts...]
+# environment: SCM (default ./scm), MOCK (default ./scm-mock-engine), PLIES (default 100),
+#              GAMES_PER_SLOT (default 4), INFO (info lines per move, default 10)
+
+SCM=${SCM:-./scm}
+MOCK=${MOCK:-./scm-mock-engine}
+PLIES=${PLIES:-100}
+GAMES_PER_SLOT=${GAMES_PER_SLOT:-4}
+INFO=${INFO:-10}
+SLOTS="$*"
+[ -z "$SLOTS" ] && SLOTS="1 8 32 128"
+
+for f in "$SCM" "$MOCK"; do
+   if [ ! -x "$f" ]; then
+      echo "Error: $f not found. Build scm and scm-mock-engine first (see README)."
+      exit 1
+   fi
+done
+
+printf "%6s %8s %10s %10s %12s %12s %11s\n" slots games "games/s" "plies/s" "cpu us/ply" "cpu % core" efficiency
+base=""
+for n in $SLOTS; do
+   games=$((n * GAMES_PER_SLOT))
+   out=$("$SCM" --e1 "$MOCK --end mate --endply $PLIES --info $INFO" --e2 "$MOCK --info $INFO" \
+                --threads "$n" --games "$games" --tc 600000 --inc 0 --stats < /dev/null)
+   stats=$(echo "$out" | grep "^Statistics:")
+   cpu=$(echo "$out" | grep "^Harness CPU:")
+   if [ -z "$stats" ]; then
+      echo "$out" | tail -5
+      echo "Error: run with $n slots failed."
+      exit 1
+   fi
+   gps=$(echo "$stats" | awk '{ for (i = 1; i < NF; i++) if ($(i + 1) == "games/s,") print $i }')
+   pps=$(echo "$stats" | awk '{ for (i = 1; i < NF; i++) if ($(i + 1) == "plies/s") print $i }')
+   us=$(echo "$cpu" | awk '{ for (i = 1; i < NF; i++) if ($(i + 1) == "us/ply") print $i }')
+   pct=$(echo "$cpu" | sed 's/.*(\([0-9.]*\)% of one core).*/\1/')
+   [ -z "$base" ] && base=$(awk -v p="$pps" -v n="$n" 'BEGIN { print p / n }')
+   eff=$(awk -v p="$pps" -v n="$n" -v b="$base" 'BEGIN { printf "%.1f%%", 100.0 * p / (n * b) }')
+   printf "%6s %8s %10s %10s %12s %12s %11s\n" "$n" "$games" "$gps" "$pps" "$us" "$pct" "$eff"
+done
@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+typedef unsigned int uint;
+
+// index of least significant set bit. x must not be 0.
+inline uint lsb64(uint64_t x)
+{
+#ifdef _MSC_VER
+   unsigned long index;
+   _BitScanForward64(&index, x);
+   return (uint)index;
+#else
+   return (uint)__builtin_ctzll(x);
+#endif
+}
+
+inline uint popcount64(uint64_t x)
+{
+#ifdef _MSC_VER
+   return (uint)__popcnt64(x);
+#else
+   return (uint)__builtin_popcountll(x);
+#endif
+}
+
+// returns the index of the least significant set bit, and clears it. x must not be 0.
+inline uint pop_lsb64(uint64_t &x)
+{
+   uint index = lsb64(x);
+   x &= (x - 1);
+   return index;
+}
+
+// Bitboard256 is a "wide" bitboard for boards with more than 64 squares (e.g. the 14x14 four player chess board).
+struct Bitboard256
+{
+   uint64_t w[4];
+
+   void clear_all(void) { w[0] = w[1] = w[2] = w[3] = 0; }
+   void set(uint sq) { w[sq >> 6] |= (1ULL << (sq & 63)); }
+   void clear(uint sq) { w[sq >> 6] &= ~(1ULL << (sq & 63)); }
+   bool test(uint sq) const { return ((w[sq >> 6] >> (sq & 63)) & 1) != 0; }
+   bool empty(void) const { return ((w[0] | w[1] | w[2] | w[3]) == 0); }
+   uint count(void) const { return popcount64(w[0]) + popcount64(w[1]) + popcount64(w[2]) + popcount64(w[3]); }
+
+   // returns the index of the lowest set square and clears it. The bitboard must not be empty.
+   uint pop_lsb(void)
+   {
+      for (uint i = 0; i < 4; i++)
+         if (w[i] != 0)
+            return (i * 64) + pop_lsb64(w[i]);
+      return 0;
+   }
+
+   Bitboard256 operator&(const Bitboard256 &b) const { return {{w[0] & b.w[0], w[1] & b.w[1], w[2] & b.w[2], w[3] & b.w[3]}}; }
+   Bitboard256 operator|(const Bitboard256 &b) const { return {{w[0] | b.w[0], w[1] | b.w[1], w[2] | b.w[2], w[3] | b.w[3]}}; }
+   Bitboard256 operator~(void) const { return {{~w[0], ~w[1], ~w[2], ~w[3]}}; }
+};
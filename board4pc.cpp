@@ -0,0 +1,688 @@
+#include "board4pc.h"
+
+const string fen4_start_position =
+   "R-0,0,0,0-1,1,1,1-1,1,1,1-0,0,0,0-0-"
+   "x,x,x,yR,yN,yB,yK,yQ,yB,yN,yR,x,x,x/x,x,x,yP,yP,yP,yP,yP,yP,yP,yP,x,x,x/x,x,x,8,x,x,x/"
+   "bR,bP,10,gP,gR/bN,bP,10,gP,gN/bB,bP,10,gP,gB/bQ,bP,10,gP,gK/bK,bP,10,gP,gQ/bB,bP,10,gP,gB/bN,bP,10,gP,gN/bR,bP,10,gP,gR/"
+   "x,x,x,8,x,x,x/x,x,x,rP,rP,rP,rP,rP,rP,rP,rP,x,x,x/x,x,x,rR,rN,rB,rQ,rK,rB,rN,rR,x,x,x";
+
+static const char player_chars[] = "rbyg";
+static const char piece_chars[] = "PNBRQK";
+
+// pawn direction of movement for each player: {file delta, rank delta}
+static const int pawn_forward[4][2] = {{0, 1}, {1, 0}, {0, -1}, {-1, 0}};
+
+// pawn capture directions for each player
+static const int pawn_capture[4][2][2] = {{{-1, 1}, {1, 1}}, {{1, -1}, {1, 1}}, {{-1, -1}, {1, -1}}, {{-1, -1}, {-1, 1}}};
+
+static const int knight_offsets[8][2] = {{1, 2}, {2, 1}, {2, -1}, {1, -2}, {-1, -2}, {-2, -1}, {-2, 1}, {-1, 2}};
+static const int king_offsets[8][2] = {{1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}, {0, -1}, {1, -1}};
+static const int rook_directions[4][2] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+static const int bishop_directions[4][2] = {{1, 1}, {-1, 1}, {-1, -1}, {1, -1}};
+
+// home squares of each player's king, kingside rook and queenside rook (used for castling).
+static const uint king_home[4] = {7, 84, 188, 111};
+static const uint kingside_rook_home[4] = {10, 42, 185, 153};
+static const uint queenside_rook_home[4] = {3, 140, 192, 55};
+
+#define SQ(file, rank)  ((uint)((rank) * B4_SIZE + (file)))
+#define FILE_OF(sq)     ((int)(sq) % B4_SIZE)
+#define RANK_OF(sq)     ((int)(sq) / B4_SIZE)
+
+// Bitboard with all 160 playable squares set (the 14x14 board minus the four 3x3 corners).
+static Bitboard256 make_valid_squares_mask(void)
+{
+   Bitboard256 mask;
+   mask.clear_all();
+   for (int rank = 0; rank < B4_SIZE; rank++)
+      for (int file = 0; file < B4_SIZE; file++)
+         if (!(((file < 3) || (file > 10)) && ((rank < 3) || (rank > 10))))
+            mask.set(SQ(file, rank));
+   return mask;
+}
+
+static const Bitboard256 valid_squares = make_valid_squares_mask();
+
+// how far a pawn of the given player has advanced (0 = player's first rank).
+static int pawn_progress(player_4pc player, int file, int rank)
+{
+   if (player == RED)
+      return rank;
+   if (player == BLUE)
+      return file;
+   if (player == YELLOW)
+      return (B4_SIZE - 1) - rank;
+   return (B4_SIZE - 1) - file;
+}
+
+Board4pc::Board4pc(void)
+{
+   clear();
+}
+
+bool Board4pc::is_valid_square(int file, int rank)
+{
+   if ((file < 0) || (file >= B4_SIZE) || (rank < 0) || (rank >= B4_SIZE))
+      return false;
+   return valid_squares.test(SQ(file, rank));
+}
+
+void Board4pc::clear(void)
+{
+   for (uint i = 0; i < 4; i++)
+   {
+      m_occupied[i].clear_all();
+      m_castle_kingside[i] = false;
+      m_castle_queenside[i] = false;
+      m_ep_square[i] = -1;
+   }
+   for (uint i = 0; i < 6; i++)
+      m_pieces[i].clear_all();
+   for (uint i = 0; i < B4_NUM_SQUARES; i++)
+      m_board[i] = EMPTY_SQUARE;
+   m_turn = RED;
+   m_halfmove_clock = 0;
+   m_captured_king = NO_PLAYER;
+   m_error = "";
+}
+
+void Board4pc::put_piece(uint sq, player_4pc player, piece_type piece)
+{
+   m_board[sq] = (uint8_t)((player << 3) | piece);
+   m_occupied[player].set(sq);
+   m_pieces[piece].set(sq);
+}
+
+void Board4pc::remove_piece(uint sq)
+{
+   if (m_board[sq] == EMPTY_SQUARE)
+      return;
+   m_occupied[m_board[sq] >> 3].clear(sq);
+   m_pieces[m_board[sq] & 7].clear(sq);
+   m_board[sq] = EMPTY_SQUARE;
+}
+
+void Board4pc::set_start_position(void)
+{
+   set_fen4(fen4_start_position);
+}
+
+// FEN4 format: turn-eliminated-castling_kingside-castling_queenside-points-halfmove_clock-[{extra info}-]board
+// e.g. "R-0,0,0,0-1,1,1,1-1,1,1,1-0,0,0,0-0-x,x,x,yR,yN,..."
+int Board4pc::set_fen4(const string &fen4)
+{
+   vector<string> fields;
+   size_t pos = 0;
+
+   clear();
+
+   for (int i = 0; i < 6; i++)
+   {
+      size_t end = fen4.find('-', pos);
+      if (end == string::npos)
+      {
+         m_error = "missing FEN4 fields";
+         return 0;
+      }
+      fields.push_back(fen4.substr(pos, end - pos));
+      pos = end + 1;
+   }
+   if ((pos < fen4.length()) && (fen4[pos] == '{'))
+   {
+      size_t end = fen4.find('}', pos);
+      if (end == string::npos)
+      {
+         m_error = "unterminated {} field";
+         return 0;
+      }
+      parse_en_passant(fen4.substr(pos, end - pos + 1));
+      pos = end + 1;
+      if ((pos < fen4.length()) && (fen4[pos] == '-'))
+         pos++;
+   }
+
+   if ((fields[0] == "R") || (fields[0] == "r"))
+      m_turn = RED;
+   else if ((fields[0] == "B") || (fields[0] == "b"))
+      m_turn = BLUE;
+   else if ((fields[0] == "Y") || (fields[0] == "y"))
+      m_turn = YELLOW;
+   else if ((fields[0] == "G") || (fields[0] == "g"))
+      m_turn = GREEN;
+   else
+   {
+      m_error = "invalid player to move: " + fields[0];
+      return 0;
+   }
+
+   for (int i = 1; i <= 3; i++)
+   {
+      if ((fields[i].length() != 7) || (fields[i][1] != ',') || (fields[i][3] != ',') || (fields[i][5] != ','))
+      {
+         m_error = "invalid FEN4 field: " + fields[i];
+         return 0;
+      }
+      for (uint p = 0; p < 4; p++)
+      {
+         bool flag = (fields[i][p * 2] == '1');
+         if (i == 1 && flag)
+         {
+            m_error = "eliminated players are not supported in teams mode";
+            return 0;
+         }
+         if (i == 2)
+            m_castle_kingside[p] = flag;
+         if (i == 3)
+            m_castle_queenside[p] = flag;
+      }
+   }
+   m_halfmove_clock = atoi(fields[5].c_str());
+
+   if (parse_board(fen4.substr(pos)) == 0)
+      return 0;
+
+   for (uint p = 0; p < 4; p++)
+      if ((m_occupied[p] & m_pieces[KING]).count() != 1)
+      {
+         m_error = string("player ") + player_chars[p] + " must have exactly one king";
+         return 0;
+      }
+
+   return 1;
+}
+
+int Board4pc::parse_board(const string &board)
+{
+   int rank = B4_SIZE - 1;
+   int file = 0;
+   size_t pos = 0;
+
+   while (1)
+   {
+      size_t end = board.find_first_of(",/", pos);
+      string token = board.substr(pos, (end == string::npos) ? string::npos : (end - pos));
+
+      if (token == "x")
+         file++;
+      else if (!token.empty() && isdigit(token[0]))
+         file += atoi(token.c_str());
+      else if (token.length() == 2)
+      {
+         const char *p = strchr(player_chars, token[0]);
+         const char *t = strchr(piece_chars, token[1]);
+         if ((p == nullptr) || (t == nullptr) || !is_valid_square(file, rank))
+         {
+            m_error = "invalid piece " + token + " on rank " + to_string(rank + 1);
+            return 0;
+         }
+         put_piece(SQ(file, rank), (player_4pc)(p - player_chars), (piece_type)(t - piece_chars));
+         file++;
+      }
+      else
+      {
+         m_error = "invalid board token: " + token;
+         return 0;
+      }
+
+      if (file > B4_SIZE)
+      {
+         m_error = "too many squares on rank " + to_string(rank + 1);
+         return 0;
+      }
+
+      if ((end == string::npos) || (board[end] == '/'))
+      {
+         if (file != B4_SIZE)
+         {
+            m_error = "wrong number of squares on rank " + to_string(rank + 1);
+            return 0;
+         }
+         if (end == string::npos)
+            break;
+         rank--;
+         file = 0;
+         if (rank < 0)
+         {
+            m_error = "too many ranks";
+            return 0;
+         }
+      }
+      pos = end + 1;
+   }
+
+   if (rank != 0)
+   {
+      m_error = "too few ranks";
+      return 0;
+   }
+   return 1;
+}
+
+// chess.com FEN4 may contain en passant info, e.g. {'enPassant':('','e3:e4','','')}
+// Each entry is "skipped square:pawn square" for the pawn that just made a double move.
+void Board4pc::parse_en_passant(const string &info)
+{
+   size_t pos = info.find("enPassant");
+   if (pos == string::npos)
+      return;
+   pos = info.find('(', pos);
+   if (pos == string::npos)
+      return;
+
+   for (uint p = 0; p < 4; p++)
+   {
+      size_t end = info.find_first_of(",)", pos + 1);
+      if (end == string::npos)
+         return;
+      string entry = info.substr(pos + 1, end - pos - 1);
+      size_t start = entry.find_first_not_of("' ");
+      if ((start != string::npos) && isalpha(entry[start]))
+      {
+         int file = entry[start] - 'a';
+         int rank = atoi(entry.c_str() + start + 1) - 1;
+         if (is_valid_square(file, rank))
+            m_ep_square[p] = SQ(file, rank);
+      }
+      pos = end;
+   }
+}
+
+bool Board4pc::is_opponent(player_4pc player, uint sq)
+{
+   return m_occupied[(player + 1) % 4].test(sq) || m_occupied[(player + 3) % 4].test(sq);
+}
+
+uint Board4pc::king_square(player_4pc player)
+{
+   Bitboard256 king = m_occupied[player] & m_pieces[KING];
+   return king.pop_lsb();
+}
+
+bool Board4pc::is_attacked(uint sq, player_4pc attacker)
+{
+   int file = FILE_OF(sq);
+   int rank = RANK_OF(sq);
+   uint8_t pawn = (uint8_t)((attacker << 3) | PAWN);
+   uint8_t knight = (uint8_t)((attacker << 3) | KNIGHT);
+   uint8_t bishop = (uint8_t)((attacker << 3) | BISHOP);
+   uint8_t rook = (uint8_t)((attacker << 3) | ROOK);
+   uint8_t queen = (uint8_t)((attacker << 3) | QUEEN);
+   uint8_t king = (uint8_t)((attacker << 3) | KING);
+
+   for (uint i = 0; i < 2; i++)
+   {
+      int f = file - pawn_capture[attacker][i][0];
+      int r = rank - pawn_capture[attacker][i][1];
+      if (is_valid_square(f, r) && (m_board[SQ(f, r)] == pawn))
+         return true;
+   }
+   for (uint i = 0; i < 8; i++)
+   {
+      int f = file + knight_offsets[i][0];
+      int r = rank + knight_offsets[i][1];
+      if (is_valid_square(f, r) && (m_board[SQ(f, r)] == knight))
+         return true;
+      f = file + king_offsets[i][0];
+      r = rank + king_offsets[i][1];
+      if (is_valid_square(f, r) && (m_board[SQ(f, r)] == king))
+         return true;
+   }
+   for (uint i = 0; i < 4; i++)
+   {
+      int f = file + rook_directions[i][0];
+      int r = rank + rook_directions[i][1];
+      while (is_valid_square(f, r))
+      {
+         uint8_t piece = m_board[SQ(f, r)];
+         if (piece != EMPTY_SQUARE)
+         {
+            if ((piece == rook) || (piece == queen))
+               return true;
+            break;
+         }
+         f += rook_directions[i][0];
+         r += rook_directions[i][1];
+      }
+      f = file + bishop_directions[i][0];
+      r = rank + bishop_directions[i][1];
+      while (is_valid_square(f, r))
+      {
+         uint8_t piece = m_board[SQ(f, r)];
+         if (piece != EMPTY_SQUARE)
+         {
+            if ((piece == bishop) || (piece == queen))
+               return true;
+            break;
+         }
+         f += bishop_directions[i][0];
+         r += bishop_directions[i][1];
+      }
+   }
+   return false;
+}
+
+bool Board4pc::in_check(player_4pc player)
+{
+   uint sq = king_square(player);
+   return is_attacked(sq, (player_4pc)((player + 1) % 4)) || is_attacked(sq, (player_4pc)((player + 3) % 4));
+}
+
+void Board4pc::add_pawn_move(move_4pc *moves, uint &n, uint from, uint to, uint8_t flags)
+{
+   if (pawn_progress(m_turn, FILE_OF(to), RANK_OF(to)) >= (B4_PROMOTION_RANK - 1))
+   {
+      for (uint piece = QUEEN; piece >= KNIGHT; piece--)
+         moves[n++] = {(uint8_t)from, (uint8_t)to, (uint8_t)piece, flags};
+   }
+   else
+      moves[n++] = {(uint8_t)from, (uint8_t)to, (uint8_t)NO_PIECE, flags};
+}
+
+void Board4pc::add_castling_moves(move_4pc *moves, uint &n)
+{
+   uint king_sq = king_home[m_turn];
+   if (m_board[king_sq] != (uint8_t)((m_turn << 3) | KING))
+      return;
+
+   for (uint side = 0; side < 2; side++)
+   {
+      if (!((side == 0) ? m_castle_kingside[m_turn] : m_castle_queenside[m_turn]))
+         continue;
+      uint rook_sq = (side == 0) ? kingside_rook_home[m_turn] : queenside_rook_home[m_turn];
+      if (m_board[rook_sq] != (uint8_t)((m_turn << 3) | ROOK))
+         continue;
+
+      // step from the king towards the rook (same rank, or same file for blue and green)
+      int step = (RANK_OF(king_sq) == RANK_OF(rook_sq)) ? 1 : B4_SIZE;
+      if (rook_sq < king_sq)
+         step = -step;
+
+      bool ok = true;
+      for (int sq = (int)king_sq + step; sq != (int)rook_sq; sq += step)
+         if (m_board[sq] != EMPTY_SQUARE)
+            ok = false;
+      for (int i = 0; (i <= 2) && ok; i++)
+      {
+         uint sq = (uint)((int)king_sq + (i * step));
+         if (is_attacked(sq, (player_4pc)((m_turn + 1) % 4)) || is_attacked(sq, (player_4pc)((m_turn + 3) % 4)))
+            ok = false;
+      }
+      if (ok)
+         moves[n++] = {(uint8_t)king_sq, (uint8_t)((int)king_sq + 2 * step), (uint8_t)NO_PIECE,
+                       (uint8_t)((side == 0) ? MOVE_CASTLE_KINGSIDE : MOVE_CASTLE_QUEENSIDE)};
+   }
+}
+
+uint Board4pc::generate_pseudo_legal_moves(move_4pc *moves)
+{
+   uint n = 0;
+   Bitboard256 own = m_occupied[m_turn];
+
+   while (!own.empty())
+   {
+      uint from = own.pop_lsb();
+      int file = FILE_OF(from);
+      int rank = RANK_OF(from);
+      piece_type piece = (piece_type)(m_board[from] & 7);
+
+      if (piece == PAWN)
+      {
+         int f = file + pawn_forward[m_turn][0];
+         int r = rank + pawn_forward[m_turn][1];
+         if (is_valid_square(f, r) && (m_board[SQ(f, r)] == EMPTY_SQUARE))
+         {
+            add_pawn_move(moves, n, from, SQ(f, r), MOVE_NORMAL);
+            if (pawn_progress(m_turn, file, rank) == 1)
+            {
+               f += pawn_forward[m_turn][0];
+               r += pawn_forward[m_turn][1];
+               if (is_valid_square(f, r) && (m_board[SQ(f, r)] == EMPTY_SQUARE))
+                  moves[n++] = {(uint8_t)from, (uint8_t)SQ(f, r), (uint8_t)NO_PIECE, MOVE_DOUBLE_PUSH};
+            }
+         }
+         for (uint i = 0; i < 2; i++)
+         {
+            f = file + pawn_capture[m_turn][i][0];
+            r = rank + pawn_capture[m_turn][i][1];
+            if (!is_valid_square(f, r))
+               continue;
+            uint to = SQ(f, r);
+            if (is_opponent(m_turn, to))
+               add_pawn_move(moves, n, from, to, MOVE_NORMAL);
+            else if (m_board[to] == EMPTY_SQUARE)
+            {
+               // en passant: an opponent's pawn skipped over this square with its last move, and is still there.
+               for (uint i2 = 1; i2 <= 3; i2 += 2)
+               {
+                  uint p = (m_turn + i2) % 4;
+                  int f2 = f + pawn_forward[p][0];
+                  int r2 = r + pawn_forward[p][1];
+                  if ((m_ep_square[p] == (int)to) && is_valid_square(f2, r2) && (m_board[SQ(f2, r2)] == (uint8_t)((p << 3) | PAWN)))
+                     moves[n++] = {(uint8_t)from, (uint8_t)to, (uint8_t)NO_PIECE, MOVE_EN_PASSANT};
+               }
+            }
+         }
+      }
+      else if ((piece == KNIGHT) || (piece == KING))
+      {
+         const int (*offsets)[2] = (piece == KNIGHT) ? knight_offsets : king_offsets;
+         for (uint i = 0; i < 8; i++)
+         {
+            int f = file + offsets[i][0];
+            int r = rank + offsets[i][1];
+            if (is_valid_square(f, r) && ((m_board[SQ(f, r)] == EMPTY_SQUARE) || is_opponent(m_turn, SQ(f, r))))
+               moves[n++] = {(uint8_t)from, (uint8_t)SQ(f, r), (uint8_t)NO_PIECE, MOVE_NORMAL};
+         }
+      }
+      else
+      {
+         for (uint d = 0; d < 8; d++)
+         {
+            const int *dir = (d < 4) ? rook_directions[d] : bishop_directions[d - 4];
+            if (((d < 4) && (piece == BISHOP)) || ((d >= 4) && (piece == ROOK)))
+               continue;
+            int f = file + dir[0];
+            int r = rank + dir[1];
+            while (is_valid_square(f, r))
+            {
+               uint to = SQ(f, r);
+               if (m_board[to] != EMPTY_SQUARE)
+               {
+                  if (is_opponent(m_turn, to))
+                     moves[n++] = {(uint8_t)from, (uint8_t)to, (uint8_t)NO_PIECE, MOVE_NORMAL};
+                  break;
+               }
+               moves[n++] = {(uint8_t)from, (uint8_t)to, (uint8_t)NO_PIECE, MOVE_NORMAL};
+               f += dir[0];
+               r += dir[1];
+            }
+         }
+      }
+   }
+
+   add_castling_moves(moves, n);
+   return n;
+}
+
+// A move is legal if it doesn't leave the player's own king attacked by either opponent.
+// Capturing an opponent's king (possible when a player's teammate discovers an attack on it) is legal.
+uint Board4pc::generate_legal_moves(move_4pc *moves)
+{
+   move_4pc pseudo_legal[B4_MAX_MOVES];
+   uint num_pseudo_legal = generate_pseudo_legal_moves(pseudo_legal);
+   uint n = 0;
+   player_4pc player = m_turn;
+
+   for (uint i = 0; i < num_pseudo_legal; i++)
+   {
+      Board4pc board = *this;
+      board.make_move(pseudo_legal[i]);
+      if ((board.m_captured_king != NO_PLAYER) || !board.in_check(player))
+         moves[n++] = pseudo_legal[i];
+   }
+   return n;
+}
+
+void Board4pc::make_move(const move_4pc &move)
+{
+   player_4pc player = m_turn;
+   piece_type piece = (piece_type)(m_board[move.from] & 7);
+   bool capture = (m_board[move.to] != EMPTY_SQUARE);
+
+   if (capture)
+   {
+      if ((m_board[move.to] & 7) == KING)
+         m_captured_king = (player_4pc)(m_board[move.to] >> 3);
+      remove_piece(move.to);
+   }
+   remove_piece(move.from);
+   put_piece(move.to, player, (move.promotion != NO_PIECE) ? (piece_type)move.promotion : piece);
+
+   if (move.flags == MOVE_EN_PASSANT)
+   {
+      // only an opponent's pawn can be captured (teammates are players 2 apart), as in the move generator
+      for (uint p = 0; p < 4; p++)
+         if ((m_ep_square[p] == (int)move.to) && (((p ^ (uint)player) & 1) == 1))
+         {
+            int f = FILE_OF(move.to) + pawn_forward[p][0];
+            int r = RANK_OF(move.to) + pawn_forward[p][1];
+            if (is_valid_square(f, r) && (m_board[SQ(f, r)] == (uint8_t)((p << 3) | PAWN)))
+            {
+               remove_piece(SQ(f, r));
+               break;
+            }
+         }
+      capture = true;
+   }
+   else if ((move.flags == MOVE_CASTLE_KINGSIDE) || (move.flags == MOVE_CASTLE_QUEENSIDE))
+   {
+      uint rook_sq = (move.flags == MOVE_CASTLE_KINGSIDE) ? kingside_rook_home[player] : queenside_rook_home[player];
+      remove_piece(rook_sq);
+      put_piece((move.from + move.to) / 2, player, ROOK);
+   }
+
+   if (piece == KING)
+   {
+      m_castle_kingside[player] = false;
+      m_castle_queenside[player] = false;
+   }
+   for (uint p = 0; p < 4; p++)
+   {
+      if ((move.from == kingside_rook_home[p]) || (move.to == kingside_rook_home[p]))
+         m_castle_kingside[p] = false;
+      if ((move.from == queenside_rook_home[p]) || (move.to == queenside_rook_home[p]))
+         m_castle_queenside[p] = false;
+   }
+
+   m_ep_square[player] = (move.flags == MOVE_DOUBLE_PUSH) ? (int)((move.from + move.to) / 2) : -1;
+   m_halfmove_clock = ((piece == PAWN) || capture) ? 0 : (m_halfmove_clock + 1);
+   m_turn = (player_4pc)((player + 1) % 4);
+}
+
+// parse_move finds the legal move matching move_text. Accepted formats: "h2h4", "j5j4q", "h2-h4", "j5-j4=Q",
+// "O-O" / "O-O-O", and castling written as the king moving onto its own rook ("h1k1").
+int Board4pc::parse_move(const string &move_text, move_4pc &move)
+{
+   move_4pc moves[B4_MAX_MOVES];
+   uint num_moves = generate_legal_moves(moves);
+   int castle_flags = MOVE_NORMAL;
+   int from = -1, to = -1;
+   piece_type promotion = NO_PIECE;
+
+   if ((move_text == "O-O") || (move_text == "0-0"))
+      castle_flags = MOVE_CASTLE_KINGSIDE;
+   else if ((move_text == "O-O-O") || (move_text == "0-0-0"))
+      castle_flags = MOVE_CASTLE_QUEENSIDE;
+   else
+   {
+      int squares[2];
+      size_t i = 0;
+      for (uint s = 0; s < 2; s++)
+      {
+         while ((i < move_text.length()) && ((move_text[i] == '-') || (move_text[i] == 'x')))
+            i++;
+         if ((i >= move_text.length()) || (move_text[i] < 'a') || (move_text[i] > 'n'))
+            return 0;
+         int file = move_text[i++] - 'a';
+         if ((i >= move_text.length()) || !isdigit(move_text[i]))
+            return 0;
+         int rank = 0;
+         while ((i < move_text.length()) && isdigit(move_text[i]))
+            rank = rank * 10 + (move_text[i++] - '0');
+         if (!is_valid_square(file, rank - 1))
+            return 0;
+         squares[s] = SQ(file, rank - 1);
+      }
+      from = squares[0];
+      to = squares[1];
+      if ((i < move_text.length()) && (move_text[i] == '='))
+         i++;
+      if (i < move_text.length())
+      {
+         const char *t = strchr(piece_chars, toupper(move_text[i]));
+         if ((t == nullptr) || (*t == 'P') || (*t == 'K'))
+            return 0;
+         promotion = (piece_type)(t - piece_chars);
+      }
+   }
+
+   for (uint i = 0; i < num_moves; i++)
+   {
+      const move_4pc &m = moves[i];
+      bool castling = (m.flags == MOVE_CASTLE_KINGSIDE) || (m.flags == MOVE_CASTLE_QUEENSIDE);
+
+      if (castle_flags != MOVE_NORMAL)
+      {
+         if (m.flags == castle_flags)
+         {
+            move = m;
+            return 1;
+         }
+         continue;
+      }
+      if (m.from != from)
+         continue;
+      if (castling)
+      {
+         uint rook_sq = (m.flags == MOVE_CASTLE_KINGSIDE) ? kingside_rook_home[m_turn] : queenside_rook_home[m_turn];
+         if ((m.to == to) || (rook_sq == (uint)to))
+         {
+            move = m;
+            return 1;
+         }
+      }
+      // A promotion move without a promotion piece is taken to be a queen promotion.
+      else if ((m.to == to) && ((m.promotion == promotion) || ((promotion == NO_PIECE) && (m.promotion == QUEEN))))
+      {
+         move = m;
+         return 1;
+      }
+   }
+   return 0;
+}
+
+int Board4pc::apply_move(const string &move_text)
+{
+   move_4pc move;
+   if (parse_move(move_text, move) == 0)
+      return 0;
+   make_move(move);
+   return 1;
+}
+
+// get_game_result returns the teams result for the current position: a player with no legal moves is
+// checkmated (that player's team loses) if in check, otherwise it is stalemate (draw).
+game_result Board4pc::get_game_result(void)
+{
+   move_4pc moves[B4_MAX_MOVES];
+
+   if (m_captured_king != NO_PLAYER)
+      return (team_of(m_captured_king) == WHITE) ? BLACK_WIN : WHITE_WIN;
+
+   if (generate_legal_moves(moves) != 0)
+      return UNFINISHED;
+
+   if (in_check(m_turn))
+      return (team_of(m_turn) == WHITE) ? BLACK_WIN : WHITE_WIN;
+   return DRAW;
+}
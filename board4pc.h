@@ -0,0 +1,77 @@
+#pragma once
+#include "engine.h"
+#include "bitboard.h"
+
+// Board4pc is a 14x14 board for 4 player chess (teams: Red/Yellow vs Blue/Green), as used by chess.com and FEN4.
+// Red is at the bottom (rank 1), Blue at the left (file a), Yellow at the top (rank 14), Green at the right (file n).
+// Squares are numbered rank * 14 + file, and the 3x3 corners are not part of the board.
+
+#define B4_SIZE            14
+#define B4_NUM_SQUARES     196
+#define B4_MAX_MOVES       512
+#define B4_PROMOTION_RANK  11   // pawns promote when reaching their 11th rank (teams rules)
+
+extern const string fen4_start_position;
+
+enum player_4pc
+{
+   RED,
+   BLUE,
+   YELLOW,
+   GREEN,
+   NO_PLAYER
+};
+
+struct move_4pc
+{
+   uint8_t from;
+   uint8_t to;
+   uint8_t promotion;   // piece_type, or NO_PIECE
+   uint8_t flags;
+};
+
+class Board4pc
+{
+private:
+   Bitboard256 m_occupied[4];            // squares occupied by each player
+   Bitboard256 m_pieces[6];              // squares occupied by each piece type (any player)
+   uint8_t m_board[B4_NUM_SQUARES];      // (player << 3) | piece_type, or EMPTY_SQUARE
+   player_4pc m_turn;
+   bool m_castle_kingside[4];
+   bool m_castle_queenside[4];
+   int m_ep_square[4];                   // square skipped by each player's last double pawn push, or -1
+   uint m_halfmove_clock;
+   player_4pc m_captured_king;           // player whose king was captured, or NO_PLAYER
+   string m_error;
+
+   static const uint8_t EMPTY_SQUARE = 0xFF;
+
+public:
+   Board4pc(void);
+   int set_fen4(const string &fen4);
+   void set_start_position(void);
+   int apply_move(const string &move_text);
+   int parse_move(const string &move_text, move_4pc &move);
+   void make_move(const move_4pc &move);
+   uint generate_legal_moves(move_4pc *moves);
+   bool in_check(player_4pc player);
+   game_result get_game_result(void);
+   player_4pc side_to_move(void) { return m_turn; }
+   const string &get_error(void) { return m_error; }
+
+   static bool is_valid_square(int file, int rank);
+   static player_color team_of(player_4pc player) { return ((player == RED) || (player == YELLOW)) ? WHITE : BLACK; }
+
+private:
+   void clear(void);
+   void put_piece(uint sq, player_4pc player, piece_type piece);
+   void remove_piece(uint sq);
+   bool is_attacked(uint sq, player_4pc attacker);
+   bool is_opponent(player_4pc player, uint sq);
+   uint king_square(player_4pc player);
+   uint generate_pseudo_legal_moves(move_4pc *moves);
+   void add_pawn_move(move_4pc *moves, uint &n, uint from, uint to, uint8_t flags);
+   void add_castling_moves(move_4pc *moves, uint &n);
+   int parse_board(const string &board);
+   void parse_en_passant(const string &info);
+};
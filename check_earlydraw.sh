@@ -0,0 +1,43 @@
+#!/bin/sh
+# Early draw adjudication check: plays scm-mock-engine against itself with --earlydraw, first with only the first engine
+# reporting a drawish score, then with both. The games must only be adjudicated a draw when both engines are drawish.
+#
+# usage: ./check_earlydraw.sh
+# environment: SCM (default ./scm), MOCK (default ./scm-mock-engine), GAMES (default 4)
+
+SCM=${SCM:-./scm}
+MOCK=${MOCK:-./scm-mock-engine}
+GAMES=${GAMES:-4}
+
+for f in "$SCM" "$MOCK"; do
+   if [ ! -x "$f" ]; then
+      echo "Error: $f not found. Build scm and scm-mock-engine first (see README)."
+      exit 1
+   fi
+done
+
+pgn=$(mktemp)
+trap 'rm -f "$pgn"' EXIT
+
+# adjudicated <score of the second engine>: the number of games adjudicated a draw
+adjudicated()
+{
+   rm -f "$pgn"
+   "$SCM" --e1 "$MOCK --info 1 --score 0" --e2 "$MOCK --info 1 --score $1" --games "$GAMES" --tc 600000 --inc 0 \
+          --earlydraw --drawscore 25 --drawmoves 20 --drawstart 0 --maxmoves 100 --pgn "$pgn" < /dev/null > /dev/null
+   grep -c '^\[Termination "adjudication"\]' "$pgn"
+}
+
+status=0
+n=$(adjudicated 500)
+if [ "$n" -ne 0 ]; then
+   echo "Error: $n of $GAMES games adjudicated a draw with only one engine drawish."
+   status=1
+fi
+n=$(adjudicated 10)
+if [ "$n" -ne "$GAMES" ]; then
+   echo "Error: $n of $GAMES games adjudicated a draw with both engines drawish."
+   status=1
+fi
+[ $status -eq 0 ] && echo "Early draw adjudication: OK"
+exit $status
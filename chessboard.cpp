@@ -0,0 +1,677 @@
+#include "chessboard.h"
+
+const string fen_start_position = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+
+static const char piece_chars[] = "PNBRQK";
+
+static const int knight_offsets[8][2] = {{1, 2}, {2, 1}, {2, -1}, {1, -2}, {-1, -2}, {-2, -1}, {-2, 1}, {-1, 2}};
+static const int king_offsets[8][2] = {{1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}, {0, -1}, {1, -1}};
+static const int rook_directions[4][2] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+static const int bishop_directions[4][2] = {{1, 1}, {-1, 1}, {-1, -1}, {1, -1}};
+
+#define SQ(file, rank)  ((uint)((rank) * 8 + (file)))
+#define FILE_OF(sq)     ((int)(sq) & 7)
+#define RANK_OF(sq)     ((int)(sq) >> 3)
+#define BIT(sq)         (1ULL << (sq))
+
+// precomputed attack tables and Zobrist hash keys
+struct board_tables
+{
+   uint64_t knight_attacks[64];
+   uint64_t king_attacks[64];
+   uint64_t pawn_attacks[2][64];
+   uint64_t piece_keys[2][6][64];
+   uint64_t castling_keys[16];
+   uint64_t ep_keys[8];
+   uint64_t side_key;
+};
+
+static uint64_t splitmix64(uint64_t &state)
+{
+   uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+   return z ^ (z >> 31);
+}
+
+static uint64_t offset_attacks(uint sq, const int (*offsets)[2], uint num_offsets)
+{
+   uint64_t attacks = 0;
+   for (uint i = 0; i < num_offsets; i++)
+   {
+      int file = FILE_OF(sq) + offsets[i][0];
+      int rank = RANK_OF(sq) + offsets[i][1];
+      if ((file >= 0) && (file < 8) && (rank >= 0) && (rank < 8))
+         attacks |= BIT(SQ(file, rank));
+   }
+   return attacks;
+}
+
+static board_tables make_board_tables(void)
+{
+   static const int white_pawn_captures[2][2] = {{-1, 1}, {1, 1}};
+   static const int black_pawn_captures[2][2] = {{-1, -1}, {1, -1}};
+   board_tables t;
+   uint64_t seed = 0x5C4E55A1ULL;
+
+   for (uint sq = 0; sq < 64; sq++)
+   {
+      t.knight_attacks[sq] = offset_attacks(sq, knight_offsets, 8);
+      t.king_attacks[sq] = offset_attacks(sq, king_offsets, 8);
+      t.pawn_attacks[WHITE][sq] = offset_attacks(sq, white_pawn_captures, 2);
+      t.pawn_attacks[BLACK][sq] = offset_attacks(sq, black_pawn_captures, 2);
+   }
+   for (uint c = 0; c < 2; c++)
+      for (uint p = 0; p < 6; p++)
+         for (uint sq = 0; sq < 64; sq++)
+            t.piece_keys[c][p][sq] = splitmix64(seed);
+   for (uint i = 0; i < 16; i++)
+      t.castling_keys[i] = splitmix64(seed);
+   for (uint i = 0; i < 8; i++)
+      t.ep_keys[i] = splitmix64(seed);
+   t.side_key = splitmix64(seed);
+   return t;
+}
+
+static const board_tables tables = make_board_tables();
+
+static uint64_t slider_attacks(uint sq, uint64_t occupied, const int (*directions)[2])
+{
+   uint64_t attacks = 0;
+   for (uint d = 0; d < 4; d++)
+   {
+      int file = FILE_OF(sq) + directions[d][0];
+      int rank = RANK_OF(sq) + directions[d][1];
+      while ((file >= 0) && (file < 8) && (rank >= 0) && (rank < 8))
+      {
+         attacks |= BIT(SQ(file, rank));
+         if (occupied & BIT(SQ(file, rank)))
+            break;
+         file += directions[d][0];
+         rank += directions[d][1];
+      }
+   }
+   return attacks;
+}
+
+string square_name(uint sq)
+{
+   string s = "a1";
+   s[0] = (char)('a' + FILE_OF(sq));
+   s[1] = (char)('1' + RANK_OF(sq));
+   return s;
+}
+
+// move_name returns a move in engine (UCI) format, e.g. "e7e8q". Castling is the king's move, e.g. "e1g1".
+string move_name(const chess_move &move)
+{
+   string s = square_name(move.from) + square_name(move.to);
+   if (move.promotion != NO_PIECE)
+      s += (char)tolower(piece_chars[move.promotion]);
+   return s;
+}
+
+ChessBoard::ChessBoard(void)
+{
+   clear();
+}
+
+void ChessBoard::clear(void)
+{
+   for (uint c = 0; c < 2; c++)
+   {
+      m_occupied[c] = 0;
+      for (uint p = 0; p < 6; p++)
+         m_pieces[c][p] = 0;
+   }
+   for (uint sq = 0; sq < 64; sq++)
+      m_board[sq] = EMPTY_SQUARE;
+   m_turn = WHITE;
+   m_castling = 0;
+   m_ep_square = -1;
+   m_halfmove_clock = 0;
+   m_fullmove_number = 1;
+   m_history_count = 0;
+   m_result_reason = "";
+   m_error = "";
+}
+
+void ChessBoard::put_piece(uint sq, player_color color, piece_type piece)
+{
+   m_board[sq] = (uint8_t)((color << 3) | piece);
+   m_pieces[color][piece] |= BIT(sq);
+   m_occupied[color] |= BIT(sq);
+}
+
+void ChessBoard::remove_piece(uint sq)
+{
+   if (m_board[sq] == EMPTY_SQUARE)
+      return;
+   m_pieces[m_board[sq] >> 3][m_board[sq] & 7] &= ~BIT(sq);
+   m_occupied[m_board[sq] >> 3] &= ~BIT(sq);
+   m_board[sq] = EMPTY_SQUARE;
+}
+
+void ChessBoard::set_start_position(void)
+{
+   set_fen(fen_start_position);
+}
+
+int ChessBoard::set_fen(const string &fen)
+{
+   vector<string> fields = get_tokens(fen);
+   int rank = 7, file = 0;
+
+   clear();
+
+   if (fields.size() < 2)
+   {
+      m_error = "missing FEN fields";
+      return 0;
+   }
+   for (size_t i = 0; i < fields[0].length(); i++)
+   {
+      char c = fields[0][i];
+      if (c == '/')
+      {
+         if (file != 8)
+         {
+            m_error = "invalid board";
+            return 0;
+         }
+         rank--;
+         file = 0;
+      }
+      else if ((c >= '1') && (c <= '8'))
+         file += c - '0';
+      else
+      {
+         const char *p = strchr(piece_chars, toupper(c));
+         if ((p == nullptr) || (file > 7) || (rank < 0))
+         {
+            m_error = "invalid board";
+            return 0;
+         }
+         put_piece(SQ(file, rank), isupper(c) ? WHITE : BLACK, (piece_type)(p - piece_chars));
+         file++;
+      }
+   }
+   if ((rank != 0) || (file != 8))
+   {
+      m_error = "invalid board";
+      return 0;
+   }
+   if ((popcount64(m_pieces[WHITE][KING]) != 1) || (popcount64(m_pieces[BLACK][KING]) != 1))
+   {
+      m_error = "each side must have exactly one king";
+      return 0;
+   }
+
+   if ((fields[1] != "w") && (fields[1] != "b"))
+   {
+      m_error = "invalid side to move";
+      return 0;
+   }
+   m_turn = (fields[1] == "w") ? WHITE : BLACK;
+
+   if ((fields.size() > 2) && (fields[2] != "-"))
+   {
+      for (size_t i = 0; i < fields[2].length(); i++)
+      {
+         char c = fields[2][i];
+         if (c == 'K')
+            m_castling |= WHITE_KINGSIDE;
+         else if (c == 'Q')
+            m_castling |= WHITE_QUEENSIDE;
+         else if (c == 'k')
+            m_castling |= BLACK_KINGSIDE;
+         else if (c == 'q')
+            m_castling |= BLACK_QUEENSIDE;
+         else
+         {
+            m_error = "unsupported castling rights (Chess960 is not supported)";
+            return 0;
+         }
+      }
+   }
+   // drop castling rights that don't match the king and rook placement.
+   if (m_board[SQ(4, 0)] != ((WHITE << 3) | KING))
+      m_castling &= ~(WHITE_KINGSIDE | WHITE_QUEENSIDE);
+   if (m_board[SQ(4, 7)] != ((BLACK << 3) | KING))
+      m_castling &= ~(BLACK_KINGSIDE | BLACK_QUEENSIDE);
+   if (m_board[SQ(7, 0)] != ((WHITE << 3) | ROOK))
+      m_castling &= ~WHITE_KINGSIDE;
+   if (m_board[SQ(0, 0)] != ((WHITE << 3) | ROOK))
+      m_castling &= ~WHITE_QUEENSIDE;
+   if (m_board[SQ(7, 7)] != ((BLACK << 3) | ROOK))
+      m_castling &= ~BLACK_KINGSIDE;
+   if (m_board[SQ(0, 7)] != ((BLACK << 3) | ROOK))
+      m_castling &= ~BLACK_QUEENSIDE;
+
+   if ((fields.size() > 3) && (fields[3].length() == 2) && (fields[3][0] >= 'a') && (fields[3][0] <= 'h') &&
+       ((fields[3][1] == '3') || (fields[3][1] == '6')))
+      m_ep_square = SQ(fields[3][0] - 'a', fields[3][1] - '1');
+   if (fields.size() > 4)
+      m_halfmove_clock = atoi(fields[4].c_str());
+   if (fields.size() > 5)
+      m_fullmove_number = atoi(fields[5].c_str());
+
+   if (is_attacked(lsb64(m_pieces[m_turn ^ 1][KING]), m_turn))
+   {
+      m_error = "side not to move is in check";
+      return 0;
+   }
+
+   add_to_history();
+   return 1;
+}
+
+void ChessBoard::add_to_history(void)
+{
+   m_history[m_history_count % MAX_HISTORY] = hash();
+   m_history_count++;
+}
+
+bool ChessBoard::is_attacked(uint sq, player_color attacker)
+{
+   uint64_t occupied = m_occupied[WHITE] | m_occupied[BLACK];
+   if (tables.pawn_attacks[attacker ^ 1][sq] & m_pieces[attacker][PAWN])
+      return true;
+   if (tables.knight_attacks[sq] & m_pieces[attacker][KNIGHT])
+      return true;
+   if (tables.king_attacks[sq] & m_pieces[attacker][KING])
+      return true;
+   if (slider_attacks(sq, occupied, rook_directions) & (m_pieces[attacker][ROOK] | m_pieces[attacker][QUEEN]))
+      return true;
+   if (slider_attacks(sq, occupied, bishop_directions) & (m_pieces[attacker][BISHOP] | m_pieces[attacker][QUEEN]))
+      return true;
+   return false;
+}
+
+bool ChessBoard::in_check(player_color color)
+{
+   return is_attacked(lsb64(m_pieces[color][KING]), (player_color)(color ^ 1));
+}
+
+void ChessBoard::add_pawn_moves(chess_move *moves, uint &n, uint from, uint to, uint8_t flags)
+{
+   if ((RANK_OF(to) == 7) || (RANK_OF(to) == 0))
+   {
+      for (uint piece = QUEEN; piece >= KNIGHT; piece--)
+         moves[n++] = {(uint8_t)from, (uint8_t)to, (uint8_t)piece, flags};
+   }
+   else
+      moves[n++] = {(uint8_t)from, (uint8_t)to, (uint8_t)NO_PIECE, flags};
+}
+
+uint ChessBoard::generate_pseudo_legal_moves(chess_move *moves)
+{
+   uint n = 0;
+   player_color us = m_turn;
+   player_color them = (player_color)(us ^ 1);
+   uint64_t occupied = m_occupied[WHITE] | m_occupied[BLACK];
+   uint64_t targets = ~m_occupied[us];
+   int forward = (us == WHITE) ? 8 : -8;
+   int start_rank = (us == WHITE) ? 1 : 6;
+
+   uint64_t pawns = m_pieces[us][PAWN];
+   while (pawns)
+   {
+      uint from = pop_lsb64(pawns);
+      uint to = from + forward;
+      if (!(occupied & BIT(to)))
+      {
+         add_pawn_moves(moves, n, from, to, MOVE_NORMAL);
+         if ((RANK_OF(from) == start_rank) && !(occupied & BIT(to + forward)))
+            moves[n++] = {(uint8_t)from, (uint8_t)(to + forward), (uint8_t)NO_PIECE, MOVE_DOUBLE_PUSH};
+      }
+      uint64_t captures = tables.pawn_attacks[us][from] & m_occupied[them];
+      while (captures)
+         add_pawn_moves(moves, n, from, pop_lsb64(captures), MOVE_NORMAL);
+      if ((m_ep_square >= 0) && (tables.pawn_attacks[us][from] & BIT(m_ep_square)))
+         moves[n++] = {(uint8_t)from, (uint8_t)m_ep_square, (uint8_t)NO_PIECE, MOVE_EN_PASSANT};
+   }
+
+   for (uint piece = KNIGHT; piece <= KING; piece++)
+   {
+      uint64_t bb = m_pieces[us][piece];
+      while (bb)
+      {
+         uint from = pop_lsb64(bb);
+         uint64_t attacks;
+         if (piece == KNIGHT)
+            attacks = tables.knight_attacks[from];
+         else if (piece == BISHOP)
+            attacks = slider_attacks(from, occupied, bishop_directions);
+         else if (piece == ROOK)
+            attacks = slider_attacks(from, occupied, rook_directions);
+         else if (piece == QUEEN)
+            attacks = slider_attacks(from, occupied, bishop_directions) | slider_attacks(from, occupied, rook_directions);
+         else
+            attacks = tables.king_attacks[from];
+         attacks &= targets;
+         while (attacks)
+            moves[n++] = {(uint8_t)from, (uint8_t)pop_lsb64(attacks), (uint8_t)NO_PIECE, MOVE_NORMAL};
+      }
+   }
+
+   // castling: the squares between king and rook must be empty, and the king must not pass through check.
+   uint king_sq = (us == WHITE) ? SQ(4, 0) : SQ(4, 7);
+   uint kingside = (us == WHITE) ? WHITE_KINGSIDE : BLACK_KINGSIDE;
+   uint queenside = (us == WHITE) ? WHITE_QUEENSIDE : BLACK_QUEENSIDE;
+   if ((m_castling & kingside) && !(occupied & (BIT(king_sq + 1) | BIT(king_sq + 2))) &&
+       !is_attacked(king_sq, them) && !is_attacked(king_sq + 1, them) && !is_attacked(king_sq + 2, them))
+      moves[n++] = {(uint8_t)king_sq, (uint8_t)(king_sq + 2), (uint8_t)NO_PIECE, MOVE_CASTLE_KINGSIDE};
+   if ((m_castling & queenside) && !(occupied & (BIT(king_sq - 1) | BIT(king_sq - 2) | BIT(king_sq - 3))) &&
+       !is_attacked(king_sq, them) && !is_attacked(king_sq - 1, them) && !is_attacked(king_sq - 2, them))
+      moves[n++] = {(uint8_t)king_sq, (uint8_t)(king_sq - 2), (uint8_t)NO_PIECE, MOVE_CASTLE_QUEENSIDE};
+
+   return n;
+}
+
+uint ChessBoard::generate_legal_moves(chess_move *moves)
+{
+   chess_move pseudo_legal[MAX_MOVES];
+   uint num_pseudo_legal = generate_pseudo_legal_moves(pseudo_legal);
+   uint n = 0;
+
+   for (uint i = 0; i < num_pseudo_legal; i++)
+   {
+      ChessBoard board = *this;
+      board.make_move(pseudo_legal[i]);
+      if (!board.in_check(m_turn))
+         moves[n++] = pseudo_legal[i];
+   }
+   return n;
+}
+
+void ChessBoard::make_move(const chess_move &move)
+{
+   player_color us = m_turn;
+   piece_type piece = (piece_type)(m_board[move.from] & 7);
+   bool capture = (m_board[move.to] != EMPTY_SQUARE);
+
+   remove_piece(move.to);
+   remove_piece(move.from);
+   put_piece(move.to, us, (move.promotion != NO_PIECE) ? (piece_type)move.promotion : piece);
+
+   if (move.flags == MOVE_EN_PASSANT)
+   {
+      remove_piece((us == WHITE) ? (move.to - 8) : (move.to + 8));
+      capture = true;
+   }
+   else if (move.flags == MOVE_CASTLE_KINGSIDE)
+   {
+      remove_piece(move.to + 1);
+      put_piece(move.to - 1, us, ROOK);
+   }
+   else if (move.flags == MOVE_CASTLE_QUEENSIDE)
+   {
+      remove_piece(move.to - 2);
+      put_piece(move.to + 1, us, ROOK);
+   }
+
+   // castling rights are lost when the king or a rook moves, or a rook is captured.
+   static const uint castling_mask_a1 = ~(uint)WHITE_QUEENSIDE, castling_mask_h1 = ~(uint)WHITE_KINGSIDE;
+   static const uint castling_mask_a8 = ~(uint)BLACK_QUEENSIDE, castling_mask_h8 = ~(uint)BLACK_KINGSIDE;
+   if (piece == KING)
+      m_castling &= (us == WHITE) ? ~(uint)(WHITE_KINGSIDE | WHITE_QUEENSIDE) : ~(uint)(BLACK_KINGSIDE | BLACK_QUEENSIDE);
+   if ((move.from == SQ(0, 0)) || (move.to == SQ(0, 0)))
+      m_castling &= castling_mask_a1;
+   if ((move.from == SQ(7, 0)) || (move.to == SQ(7, 0)))
+      m_castling &= castling_mask_h1;
+   if ((move.from == SQ(0, 7)) || (move.to == SQ(0, 7)))
+      m_castling &= castling_mask_a8;
+   if ((move.from == SQ(7, 7)) || (move.to == SQ(7, 7)))
+      m_castling &= castling_mask_h8;
+
+   m_ep_square = (move.flags == MOVE_DOUBLE_PUSH) ? ((move.from + move.to) / 2) : -1;
+   if ((piece == PAWN) || capture)
+   {
+      m_halfmove_clock = 0;
+      m_history_count = 0;
+   }
+   else
+      m_halfmove_clock++;
+   if (us == BLACK)
+      m_fullmove_number++;
+   m_turn = (player_color)(us ^ 1);
+}
+
+// Note: make_move doesn't record the position for repetition detection; apply_move does.
+// parse_move finds the legal move matching a move in coordinate notation, e.g. "e2e4", "e7e8q".
+// Castling may also be given as "O-O" / "O-O-O", or as the king capturing its own rook ("e1h1").
+int ChessBoard::parse_move(const string &move_text, chess_move &move)
+{
+   chess_move moves[MAX_MOVES];
+   uint num_moves = generate_legal_moves(moves);
+   int castle_flags = MOVE_NORMAL;
+   uint from = 0, to = 0;
+   piece_type promotion = NO_PIECE;
+
+   if ((move_text == "O-O") || (move_text == "0-0"))
+      castle_flags = MOVE_CASTLE_KINGSIDE;
+   else if ((move_text == "O-O-O") || (move_text == "0-0-0"))
+      castle_flags = MOVE_CASTLE_QUEENSIDE;
+   else
+   {
+      if ((move_text.length() < 4) || (move_text[0] < 'a') || (move_text[0] > 'h') || (move_text[1] < '1') || (move_text[1] > '8') ||
+          (move_text[2] < 'a') || (move_text[2] > 'h') || (move_text[3] < '1') || (move_text[3] > '8'))
+         return 0;
+      from = SQ(move_text[0] - 'a', move_text[1] - '1');
+      to = SQ(move_text[2] - 'a', move_text[3] - '1');
+      if (move_text.length() > 4)
+      {
+         const char *p = strchr("nbrq", tolower(move_text[4]));
+         if ((p == nullptr) || (move_text[4] == 0))
+            return 0;
+         promotion = (piece_type)(KNIGHT + (p - "nbrq"));
+      }
+   }
+
+   for (uint i = 0; i < num_moves; i++)
+   {
+      const chess_move &m = moves[i];
+      if (castle_flags != MOVE_NORMAL)
+      {
+         if (m.flags == castle_flags)
+         {
+            move = m;
+            return 1;
+         }
+         continue;
+      }
+      if ((m.from != from) || (m.promotion != promotion))
+         continue;
+      if ((m.to == to) ||
+          ((m.flags == MOVE_CASTLE_KINGSIDE) && (to == m.to + 1u)) ||
+          ((m.flags == MOVE_CASTLE_QUEENSIDE) && (to == m.to - 2u)))
+      {
+         move = m;
+         return 1;
+      }
+   }
+   return 0;
+}
+
+// parse_san finds the legal move written in Standard Algebraic Notation, e.g. "Nbd7", "exd6", "e8=Q+" or "O-O".
+// Check and annotation marks are ignored. Returns 0 (with the error set) if the move is illegal or ambiguous.
+int ChessBoard::parse_san(const string &san, chess_move &move)
+{
+   string text = san;
+   while (!text.empty() && (strchr("+#!?", text.back()) != nullptr))
+      text.pop_back();
+
+   chess_move moves[MAX_MOVES];
+   uint num_moves = generate_legal_moves(moves);
+
+   int castle_flags = MOVE_NORMAL;
+   if ((text == "O-O") || (text == "0-0"))
+      castle_flags = MOVE_CASTLE_KINGSIDE;
+   else if ((text == "O-O-O") || (text == "0-0-0"))
+      castle_flags = MOVE_CASTLE_QUEENSIDE;
+   if (castle_flags != MOVE_NORMAL)
+   {
+      for (uint i = 0; i < num_moves; i++)
+      {
+         if (moves[i].flags == castle_flags)
+         {
+            move = moves[i];
+            return 1;
+         }
+      }
+      m_error = "illegal move " + san;
+      return 0;
+   }
+
+   piece_type piece = PAWN;
+   size_t pos = 0;
+   const char *p = (text.empty()) ? nullptr : strchr(piece_chars + 1, text[0]);
+   if ((p != nullptr) && (*p != 0))
+   {
+      piece = (piece_type)(p - piece_chars);
+      pos = 1;
+   }
+
+   piece_type promotion = NO_PIECE;
+   size_t end = text.length();
+   if ((end > 0) && (strchr("NBRQ", text[end - 1]) != nullptr) && (text[end - 1] != 0))
+   {
+      promotion = (piece_type)(strchr(piece_chars, text[end - 1]) - piece_chars);
+      end--;
+      if ((end > 0) && (text[end - 1] == '='))
+         end--;
+   }
+   if ((end < pos + 2) || (text[end - 2] < 'a') || (text[end - 2] > 'h') || (text[end - 1] < '1') || (text[end - 1] > '8'))
+   {
+      m_error = "invalid move " + san;
+      return 0;
+   }
+   uint to = SQ(text[end - 2] - 'a', text[end - 1] - '1');
+
+   // disambiguation: the from square's file and/or rank
+   int from_file = -1, from_rank = -1;
+   for (size_t i = pos; i < end - 2; i++)
+   {
+      char c = text[i];
+      if ((c >= 'a') && (c <= 'h'))
+         from_file = c - 'a';
+      else if ((c >= '1') && (c <= '8'))
+         from_rank = c - '1';
+      else if ((c != 'x') && (c != ':') && (c != '-'))
+      {
+         m_error = "invalid move " + san;
+         return 0;
+      }
+   }
+
+   uint num_matches = 0;
+   for (uint i = 0; i < num_moves; i++)
+   {
+      const chess_move &m = moves[i];
+      if ((m.to != to) || (piece_on(m.from) != piece) || (m.promotion != promotion) ||
+          (m.flags == MOVE_CASTLE_KINGSIDE) || (m.flags == MOVE_CASTLE_QUEENSIDE))
+         continue;
+      if (((from_file != -1) && ((int)FILE_OF(m.from) != from_file)) || ((from_rank != -1) && ((int)RANK_OF(m.from) != from_rank)))
+         continue;
+      move = m;
+      num_matches++;
+   }
+   if (num_matches != 1)
+   {
+      m_error = ((num_matches == 0) ? "illegal move " : "ambiguous move ") + san;
+      return 0;
+   }
+   return 1;
+}
+
+int ChessBoard::apply_move(const string &move_text)
+{
+   chess_move move;
+   if (parse_move(move_text, move) == 0)
+      return 0;
+   make_move(move);
+   add_to_history();
+   return 1;
+}
+
+bool ChessBoard::ep_capture_possible(void)
+{
+   return (m_ep_square >= 0) && (tables.pawn_attacks[m_turn ^ 1][m_ep_square] & m_pieces[m_turn][PAWN]);
+}
+
+// Zobrist hash of the position. The en passant square only counts if an en passant capture is possible,
+// so that positions which are the same for repetition purposes get the same hash.
+uint64_t ChessBoard::hash(void)
+{
+   uint64_t h = (m_turn == BLACK) ? tables.side_key : 0;
+   for (uint c = 0; c < 2; c++)
+      for (uint p = 0; p < 6; p++)
+      {
+         uint64_t bb = m_pieces[c][p];
+         while (bb)
+            h ^= tables.piece_keys[c][p][pop_lsb64(bb)];
+      }
+   h ^= tables.castling_keys[m_castling];
+   if (ep_capture_possible())
+      h ^= tables.ep_keys[FILE_OF(m_ep_square)];
+   return h;
+}
+
+// insufficient mating material: K v K, K+minor v K, or K+B v K+B with bishops on same colored squares.
+bool ChessBoard::has_insufficient_material(void)
+{
+   const uint64_t dark_squares = 0xAA55AA55AA55AA55ULL;
+   for (uint c = 0; c < 2; c++)
+      if (m_pieces[c][PAWN] || m_pieces[c][ROOK] || m_pieces[c][QUEEN])
+         return false;
+
+   uint64_t minors = m_pieces[WHITE][KNIGHT] | m_pieces[WHITE][BISHOP] | m_pieces[BLACK][KNIGHT] | m_pieces[BLACK][BISHOP];
+   if (popcount64(minors) <= 1)
+      return true;
+
+   uint64_t bishops = m_pieces[WHITE][BISHOP] | m_pieces[BLACK][BISHOP];
+   if ((minors == bishops) && (((bishops & dark_squares) == 0) || ((bishops & ~dark_squares) == 0)))
+      return true;
+   return false;
+}
+
+game_result ChessBoard::get_game_result(void)
+{
+   chess_move moves[MAX_MOVES];
+
+   if (generate_legal_moves(moves) == 0)
+   {
+      if (in_check(m_turn))
+      {
+         m_result_reason = "checkmate";
+         return (m_turn == WHITE) ? BLACK_WIN : WHITE_WIN;
+      }
+      m_result_reason = "stalemate";
+      return DRAW;
+   }
+   if (m_halfmove_clock >= 100)
+   {
+      m_result_reason = "50-move rule";
+      return DRAW;
+   }
+   if (has_insufficient_material())
+   {
+      m_result_reason = "insufficient material";
+      return DRAW;
+   }
+
+   uint repetitions = 0;
+   uint num_positions = (m_history_count < MAX_HISTORY) ? m_history_count : MAX_HISTORY;
+   uint64_t h = m_history[(m_history_count - 1) % MAX_HISTORY];
+   for (uint i = 0; i < num_positions; i++)
+      if (m_history[i] == h)
+         repetitions++;
+   if (repetitions >= 3)
+   {
+      m_result_reason = "repetition";
+      return DRAW;
+   }
+
+   return UNFINISHED;
+}
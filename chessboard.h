@@ -0,0 +1,83 @@
+#pragma once
+#include "engine.h"
+#include "bitboard.h"
+
+// ChessBoard is a standard 8x8 chess board, used to track games when the harness's own rules are enabled
+// (move legality, checkmate/stalemate and draw detection), and for tablebase probing.
+// Squares are numbered a1 = 0, b1 = 1, ... h8 = 63.
+
+#define MAX_MOVES 256
+#define MAX_HISTORY 128   // enough for the 100 plies allowed by the 50-move rule
+
+// castling rights
+#define WHITE_KINGSIDE   1
+#define WHITE_QUEENSIDE  2
+#define BLACK_KINGSIDE   4
+#define BLACK_QUEENSIDE  8
+
+extern const string fen_start_position;
+
+struct chess_move
+{
+   uint8_t from;
+   uint8_t to;
+   uint8_t promotion;   // piece_type, or NO_PIECE
+   uint8_t flags;
+};
+
+class ChessBoard
+{
+private:
+   uint64_t m_pieces[2][6];      // squares occupied by each color's pieces of each type
+   uint64_t m_occupied[2];       // squares occupied by each color
+   uint8_t m_board[64];          // (color << 3) | piece_type, or EMPTY_SQUARE
+   player_color m_turn;
+   uint m_castling;
+   int m_ep_square;              // en passant target square, or -1
+   uint m_halfmove_clock;
+   uint m_fullmove_number;
+   uint64_t m_history[MAX_HISTORY];   // ring buffer of position hashes since the last capture or pawn move
+   uint m_history_count;
+   const char *m_result_reason;
+   string m_error;
+
+   static const uint8_t EMPTY_SQUARE = 0xFF;
+
+public:
+   ChessBoard(void);
+   int set_fen(const string &fen);
+   void set_start_position(void);
+   int apply_move(const string &move_text);
+   int parse_move(const string &move_text, chess_move &move);
+   int parse_san(const string &san, chess_move &move);
+   void make_move(const chess_move &move);
+   uint generate_legal_moves(chess_move *moves);
+   bool in_check(player_color color);
+   game_result get_game_result(void);
+   const char *get_result_reason(void) { return m_result_reason; }
+   const string &get_error(void) { return m_error; }
+   uint64_t hash(void);
+
+   player_color side_to_move(void) { return m_turn; }
+   uint64_t pieces(player_color color, piece_type piece) { return m_pieces[color][piece]; }
+   uint64_t occupied(player_color color) { return m_occupied[color]; }
+   uint num_pieces(void) { return popcount64(m_occupied[WHITE] | m_occupied[BLACK]); }
+   uint castling_rights(void) { return m_castling; }
+   int ep_square(void) { return m_ep_square; }
+   uint halfmove_clock(void) { return m_halfmove_clock; }
+   piece_type piece_on(uint sq) { return (m_board[sq] == EMPTY_SQUARE) ? NO_PIECE : (piece_type)(m_board[sq] & 7); }
+
+private:
+   void clear(void);
+   void put_piece(uint sq, player_color color, piece_type piece);
+   void remove_piece(uint sq);
+   void add_to_history(void);
+   bool is_attacked(uint sq, player_color attacker);
+   uint generate_pseudo_legal_moves(chess_move *moves);
+   void add_pawn_moves(chess_move *moves, uint &n, uint from, uint to, uint8_t flags);
+   bool has_insufficient_material(void);
+   bool ep_capture_possible(void);
+};
+
+string square_name(uint sq);
+string move_name(const chess_move &move);
@@ -0,0 +1,407 @@
+#include "control.h"
+#include "events.h"
+#include <boost/program_options/parsers.hpp>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <cstring>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+struct control_client
+{
+   int fd;
+   string input;              // received, not yet a whole line
+   string output;             // replies not yet sent
+   bool input_closed;         // the client has sent everything: it's closed once its replies are sent
+   bool closed;
+};
+
+// control_match is a queued, running or finished match.
+struct control_match
+{
+   uint64_t id;
+   string spec;
+   match_state state;
+   string results;            // JSON object, or empty
+   options_info options;      // until the match starts
+   bool cancel;               // the running match was cancelled
+};
+
+static const char *match_state_names[] = {"queued", "running", "done", "cancelled", "failed"};
+
+static atomic<bool> control_running(false);
+static atomic<bool> control_stopping(false);    // shutdown requested (or SIGINT)
+static string control_path;
+static int control_listen_fd = -1;
+static int control_wakeup[2] = {-1, -1};        // pipe that wakes up the server thread when it's stopped
+static thread control_thread;
+static match_parser control_parser;
+static mutex control_mutex;                     // protects control_matches and control_next_id
+static condition_variable control_queued_cv;    // a match was queued
+static deque<control_match> control_matches;    // in the order they were queued
+static uint64_t control_next_id = 1;
+static vector<control_client> control_clients;  // only used by the server thread
+
+// control_request_stop makes the daemon stop the running match and exit. It's async-signal-safe.
+void control_request_stop(void)
+{
+   control_stopping = true;
+}
+
+bool control_stop_requested(void)
+{
+   return control_stopping;
+}
+
+// find_match returns the match with the given id, or nullptr. It's called with control_mutex locked.
+static control_match *find_match(uint64_t id)
+{
+   for (auto it = control_matches.rbegin(); it != control_matches.rend(); ++it)
+      if (it->id == id)
+         return &*it;
+   return nullptr;
+}
+
+// control_next_match waits for the next queued match, and marks it as running. Returns false if the daemon is stopping.
+bool control_next_match(match_request &request)
+{
+   unique_lock<mutex> lock(control_mutex);
+   while (!control_stopping)
+   {
+      for (control_match &match : control_matches)
+      {
+         if (match.state == MATCH_QUEUED)
+         {
+            match.state = MATCH_RUNNING;
+            request.id = match.id;
+            request.spec = match.spec;
+            request.options = move(match.options);
+            return true;
+         }
+      }
+      // the stop request comes from a signal handler, which can't notify the condition variable
+      control_queued_cv.wait_for(lock, 200ms);
+   }
+   return false;
+}
+
+// control_cancel_requested returns true if the running match has been cancelled, or the daemon is stopping.
+bool control_cancel_requested(uint64_t id)
+{
+   if (control_stopping)
+      return true;
+   lock_guard<mutex> lock(control_mutex);
+   control_match *match = find_match(id);
+   return (match != nullptr) && match->cancel;
+}
+
+// control_update_match sets the running match's results so far.
+void control_update_match(uint64_t id, const string &results)
+{
+   lock_guard<mutex> lock(control_mutex);
+   control_match *match = find_match(id);
+   if (match != nullptr)
+      match->results = results;
+}
+
+void control_end_match(uint64_t id, match_state state, const string &results)
+{
+   lock_guard<mutex> lock(control_mutex);
+   control_match *match = find_match(id);
+   if (match != nullptr)
+   {
+      match->state = state;
+      match->results = results;
+   }
+   // the oldest finished matches are forgotten
+   while ((control_matches.size() > CONTROL_MAX_MATCHES) && (control_matches.front().state > MATCH_RUNNING))
+      control_matches.pop_front();
+}
+
+const char *match_state_name(match_state state)
+{
+   return match_state_names[state];
+}
+
+// match_json writes a match as a JSON object's members. It's called with control_mutex locked.
+static void match_json(ostream &out, const control_match &match)
+{
+   out << "\"id\":" << match.id << ",\"state\":\"" << match_state_name(match.state) << "\",\"spec\":" << json_string{match.spec}
+       << ",\"results\":" << (match.results.empty() ? "null" : match.results);
+}
+
+static string error_reply(const string &message)
+{
+   ostringstream reply;
+   reply << "{\"reply\":\"error\",\"message\":" << json_string{message} << "}\n";
+   return reply.str();
+}
+
+// control_request handles a client's request, and returns the reply.
+static string control_request(const string &line)
+{
+   size_t start = line.find_first_not_of(" \t");
+   if (start == string::npos)
+      return "";
+   size_t end = line.find_first_of(" \t", start);
+   string command = line.substr(start, (end == string::npos) ? string::npos : end - start);
+   string arguments = (end == string::npos) ? "" : line.substr(end + 1);
+   lstrip(arguments);
+   ostringstream reply;
+
+   if (command == "match")
+   {
+      vector<string> args;
+      try
+      {
+         args = boost::program_options::split_unix(arguments);
+      }
+      catch (exception &e)
+      {
+         return error_reply(string("invalid match options: ") + e.what());
+      }
+      control_match match = {0, arguments, MATCH_QUEUED, "", {}, false};
+      string error;
+      if (control_parser(args, match.options, error) == 0)
+         return error_reply(error);
+
+      uint position = 0;
+      uint64_t id;
+      {
+         lock_guard<mutex> lock(control_mutex);
+         for (control_match &queued : control_matches)
+            position += (queued.state <= MATCH_RUNNING);
+         id = match.id = control_next_id++;
+         control_matches.push_back(move(match));
+      }
+      LogLine() << "Match " << id << " queued: " << arguments << "\n";
+      control_queued_cv.notify_one();
+      reply << "{\"reply\":\"queued\",\"id\":" << id << ",\"position\":" << position << "}\n";
+      return reply.str();
+   }
+
+   if (command == "status")
+   {
+      lock_guard<mutex> lock(control_mutex);
+      reply << "{\"reply\":\"status\",\"matches\":[";
+      bool first = true;
+      for (control_match &match : control_matches)
+      {
+         if (match.state > MATCH_RUNNING)
+            continue;
+         reply << (first ? "{" : ",{");
+         match_json(reply, match);
+         reply << "}";
+         first = false;
+      }
+      reply << "]}\n";
+      return reply.str();
+   }
+
+   if ((command == "result") || (command == "cancel"))
+   {
+      char *id_end;
+      uint64_t id = strtoull(arguments.c_str(), &id_end, 10);
+      lock_guard<mutex> lock(control_mutex);
+      control_match *match = find_match(id);
+      if (arguments.empty() || (*id_end != 0) || (match == nullptr))
+         return error_reply("no match " + arguments);
+      if (command == "result")
+      {
+         reply << "{\"reply\":\"result\",";
+         match_json(reply, *match);
+         reply << "}\n";
+         return reply.str();
+      }
+      if (match->state == MATCH_QUEUED)
+         match->state = MATCH_CANCELLED;
+      else if (match->state == MATCH_RUNNING)
+         match->cancel = true;
+      else
+         return error_reply("match " + arguments + " has already ended");
+      reply << "{\"reply\":\"cancelled\",\"id\":" << id << "}\n";
+      return reply.str();
+   }
+
+   if (command == "shutdown")
+   {
+      control_request_stop();
+      return "{\"reply\":\"shutdown\"}\n";
+   }
+
+   return error_reply("unknown request: " + command);
+}
+
+#ifndef WIN32
+static void control_server(void);
+
+int control_start(const string &path, match_parser parser)
+{
+   sockaddr_un address = {};
+   if (path.length() >= sizeof(address.sun_path))
+   {
+      cout << "Error: control socket path is too long: " << path << "\n";
+      return 0;
+   }
+   address.sun_family = AF_UNIX;
+   strcpy(address.sun_path, path.c_str());
+
+   unlink(path.c_str()); // left over from an earlier daemon
+   control_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if ((control_listen_fd < 0) || (bind(control_listen_fd, (sockaddr *)&address, sizeof(address)) != 0) ||
+       (listen(control_listen_fd, 16) != 0) || (pipe(control_wakeup) != 0))
+   {
+      cout << "Error: could not open control socket " << path << ": " << strerror(errno) << "\n";
+      if (control_listen_fd >= 0)
+         close(control_listen_fd);
+      control_listen_fd = -1;
+      return 0;
+   }
+   for (int i = 0; i < 2; i++)
+      fcntl(control_wakeup[i], F_SETFL, fcntl(control_wakeup[i], F_GETFL) | O_NONBLOCK | O_CLOEXEC);
+
+   control_path = path;
+   control_parser = parser;
+   control_running = true;
+   control_thread = thread(control_server);
+   return 1;
+}
+
+// control_stop closes the control socket. Replies that the clients haven't taken yet are dropped.
+void control_stop(void)
+{
+   if (!control_running)
+      return;
+   control_running = false;
+   char c = 0;
+   if (write(control_wakeup[1], &c, 1) < 0)
+      cout << "Error: could not wake up the control server thread.\n";
+   control_thread.join();
+
+   for (control_client &client : control_clients)
+      close(client.fd);
+   control_clients.clear();
+   close(control_listen_fd);
+   close(control_wakeup[0]);
+   close(control_wakeup[1]);
+   control_listen_fd = -1;
+   unlink(control_path.c_str());
+}
+
+// control_receive reads a client's requests, and queues the replies.
+static void control_receive(control_client &client)
+{
+   char buf[4096];
+   while (true)
+   {
+      ssize_t n = recv(client.fd, buf, sizeof(buf), MSG_DONTWAIT);
+      if (n == 0)
+         client.input_closed = true;
+      if (n <= 0)
+      {
+         if ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+            client.closed = true;
+         break;
+      }
+      client.input.append(buf, n);
+   }
+
+   size_t pos = 0, end;
+   while ((end = client.input.find('\n', pos)) != string::npos)
+   {
+      string line = client.input.substr(pos, end - pos);
+      rstrip(line);
+      client.output += control_request(line);
+      pos = end + 1;
+   }
+   client.input.erase(0, pos);
+   if (client.input.length() > CONTROL_MAX_LINE)
+      client.closed = true;
+}
+
+// control_send writes a client's queued replies, until the socket would block.
+static void control_send(control_client &client)
+{
+   while (!client.output.empty())
+   {
+      ssize_t n = send(client.fd, client.output.data(), client.output.length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (n < 0)
+      {
+         if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+            client.closed = true;
+         return;
+      }
+      client.output.erase(0, n);
+   }
+   if (client.input_closed)
+      client.closed = true;
+}
+
+// control_server accepts clients, and answers their requests.
+static void control_server(void)
+{
+   vector<pollfd> fds;
+
+   while (control_running.load(memory_order_acquire))
+   {
+      for (size_t i = 0; i < control_clients.size();)
+      {
+         if (control_clients[i].closed)
+         {
+            close(control_clients[i].fd);
+            control_clients.erase(control_clients.begin() + i);
+         }
+         else
+            i++;
+      }
+
+      fds.clear();
+      fds.push_back({control_listen_fd, POLLIN, 0});
+      fds.push_back({control_wakeup[0], POLLIN, 0});
+      for (control_client &client : control_clients)
+         fds.push_back({client.fd, (short)((client.input_closed ? 0 : POLLIN) | (client.output.empty() ? 0 : POLLOUT)), 0});
+
+      if (poll(fds.data(), fds.size(), 500) < 0)
+         continue;
+
+      char buf[256];
+      while (read(control_wakeup[0], buf, sizeof(buf)) > 0)
+         ;
+
+      for (size_t i = 2; i < fds.size(); i++)
+      {
+         control_client &client = control_clients[i - 2];
+         if (fds[i].revents & POLLIN)
+            control_receive(client);
+         else if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+            client.closed = true;
+         if (!client.closed)
+            control_send(client);
+      }
+      if (fds[0].revents & POLLIN)
+      {
+         int fd;
+         while ((fd = accept4(control_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+            control_clients.push_back(control_client{fd, "", "", false, false});
+      }
+   }
+}
+#else
+int control_start(const string &path, match_parser parser)
+{
+   cout << "Error: --daemon is not supported on Windows\n";
+   return 0;
+}
+
+void control_stop(void)
+{
+}
+#endif
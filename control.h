@@ -0,0 +1,53 @@
+#pragma once
+#include "engine.h"
+#include <functional>
+
+// Daemon mode (--daemon <path>). scm keeps running, and plays the matches queued by the clients of a control socket (a
+// Unix domain socket at path), one after another. Each request is one line, answered by one JSON object on one line:
+//    match <options>   queue a match. Its options are scm's command line options (quoted as in a shell), and the options
+//                      the daemon was started with are the defaults, e.g.
+//                      match --e1 ./new --e2 ./base --tc 10000 --inc 100 --games 20000 --sprt 0,5,0.05,0.05
+//                      {"reply":"queued","id":1,"position":0}     (position: matches queued or running before it)
+//    status            the running and queued matches:
+//                      {"reply":"status","matches":[{"id":1,"state":"running","spec":"...","results":{...}}, ...]}
+//    result <id>       {"reply":"result","id":1,"state":"done","spec":"...","results":{...}}
+//    cancel <id>       remove a queued match, or stop the running one: {"reply":"cancelled","id":1}
+//    shutdown          stop the running match, and the daemon: {"reply":"shutdown"}
+// Errors are {"reply":"error","message":"..."}. A match's state is queued, running, done, cancelled or failed (it couldn't
+// start: the reason is in the daemon's output). Its results (the members of the "stats" event) are updated about once a
+// second while it runs. Live events (--events) are published across matches, with "match_start" and "match_end" events.
+//
+// An engine is kept running from one match to the next if its file name and options are the same, so a queue of
+// matches doesn't pay for starting the engines (and loading their networks) every time.
+
+#define CONTROL_MAX_LINE     65536    // longest request; a client that sends a longer one is disconnected
+#define CONTROL_MAX_MATCHES  10000    // finished matches kept for "result"
+
+// match_parser parses a queued match's options. It returns 0, and sets error, if they're invalid.
+typedef function<int(const vector<string> &args, options_info &match_options, string &error)> match_parser;
+
+enum match_state
+{
+   MATCH_QUEUED,
+   MATCH_RUNNING,
+   MATCH_DONE,
+   MATCH_CANCELLED,
+   MATCH_FAILED
+};
+
+struct match_request
+{
+   uint64_t id;
+   string spec;               // the options, as sent by the client
+   options_info options;
+};
+
+int control_start(const string &path, match_parser parser);
+void control_stop(void);
+void control_request_stop(void);
+bool control_stop_requested(void);
+bool control_next_match(match_request &request);
+bool control_cancel_requested(uint64_t id);
+void control_update_match(uint64_t id, const string &results);
+void control_end_match(uint64_t id, match_state state, const string &results);
+const char *match_state_name(match_state state);
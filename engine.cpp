@@ -1,4 +1,19 @@
 #include "engine.h"
+#include "trace.h"
+#include <thread>
+#ifdef __linux__
+#include <boost/process/extend.hpp>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <cerrno>
+#endif
+#ifndef WIN32
+#include <signal.h>
+#endif
 
 namespace bp = boost::process;
 
@@ -9,7 +24,11 @@ Engine::Engine(void)
 {
    m_uci = false;
    m_child_proc = nullptr;
+   m_pid = 0;
+   m_out_fd = -1;
+   m_read_pos = 0;
    m_number = FIRST;
+   m_slot = 0;
    m_color = BLACK;
    m_result = UNFINISHED;
    m_resigned = false;
@@ -23,6 +42,17 @@ Engine::Engine(void)
    m_xb_feature_usermove = false;
    m_xb_force_mode = false;
    m_debug = false;
+   m_node_limit = 0;
+   m_depth_limit = 0;
+   m_nodes = 0;
+   m_search_time_ms = 0;
+   m_setup_time = chrono::nanoseconds(0);
+   m_timed_out = false;
+   m_deadline = chrono::steady_clock::time_point::max();
+   m_replay = false;
+   m_replay_eof = false;
+   m_replay_diverged = false;
+   m_replay_sent_us = 0;
    m_score = 0;
    m_line.reserve(200);
 }
@@ -36,33 +66,113 @@ Engine::~Engine(void)
          m_child_proc->terminate();
       delete m_child_proc;
    }
+#ifdef __linux__
+   if (m_waiter.exit_fd >= 0)
+      close(m_waiter.exit_fd);   // the executor has stopped
+#endif
 }
 
-int Engine::load_engine(const string &eng_file_name, int ID, engine_number engine_num, bool uci)
+#ifdef __linux__
+// open_pidfd returns a pidfd for the process (Linux 5.3 or later), or -1.
+static int open_pidfd(int pid)
+{
+#ifdef SYS_pidfd_open
+   return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+   (void)pid;
+   return -1;
+#endif
+}
+#endif
+
+int Engine::load_engine(const string &eng_file_name, int ID, uint slot, engine_number engine_num, bool uci)
 {
    m_file_name = eng_file_name;
    m_name = (engine_num == FIRST) ? "Engine1 (" + m_file_name + ")" : "Engine2 (" + m_file_name + ")";
 
    if (m_child_proc != nullptr)
    {
+      // restarting the engine: the new process gets new pipes
+      m_pid = 0;
       if (m_child_proc->running())
          m_child_proc->terminate();
       delete m_child_proc;
+      m_child_proc = nullptr;
+      executor.unwatch_exit(&m_waiter);
+      m_in_stream = bp::opstream();
+      m_out_stream = bp::ipstream();
    }
-   try
+   m_is_ready = false;
+   m_quit_cmd_sent = false;
+   m_timed_out = false;
+   m_limit_breach.clear();
+   m_xb_features_done = false;
+   m_xb_feature_ping = false;
+   m_xb_feature_colors = false;
+   m_xb_feature_setboard = true;
+   m_xb_feature_usermove = false;
+   m_xb_force_mode = false;
+   m_replay = !options.replay_filename.empty();
+   if (m_replay)
    {
-      m_child_proc = new bp::child(eng_file_name, bp::std_out > m_out_stream, bp::std_in < m_in_stream);
+      m_replay_eof = false;
+      m_replay_sent_time = chrono::steady_clock::now();
    }
-   catch (...)
+   else
    {
-      return 0;
+      if (m_limits.prepare((engine_num == FIRST) ? options.limits_1 : options.limits_2, ID, m_name) == 0)
+         return 0;
+      try
+      {
+#ifdef __linux__
+         // the limits are set in the child process, before it executes the engine
+         m_child_proc = new bp::child(eng_file_name, bp::std_out > m_out_stream, bp::std_in < m_in_stream,
+                                      bp::extend::on_exec_setup = [this](auto &exec)
+                                      {
+                                         if (m_limits.apply() == 0)
+                                         {
+                                            exec.set_error(error_code(errno, system_category()), m_limits.failed_step());
+                                            _exit(EXIT_FAILURE);
+                                         }
+                                      });
+#else
+         m_child_proc = new bp::child(eng_file_name, bp::std_out > m_out_stream, bp::std_in < m_in_stream);
+#endif
+      }
+      catch (bp::process_error &e)
+      {
+         LogLine() << "Error: could not start " << m_name << ": " << e.what() << "\n";
+         m_limits.started();
+         m_pid = 0;
+         return 0;
+      }
+      catch (...)
+      {
+         m_limits.started();
+         m_pid = 0;
+         return 0;
+      }
+      m_limits.started();
+      m_pid = m_child_proc->id();
+#ifdef __linux__
+      // the engine's output is read straight from the pipe, so a game can wait for it without blocking its thread
+      m_out_fd = m_out_stream.pipe().native_source();
+      fcntl(m_out_fd, F_SETFL, fcntl(m_out_fd, F_GETFL) | O_NONBLOCK);
+      m_read_buffer.clear();
+      m_read_pos = 0;
+      // the process's exit is an event for the executor (without a pidfd, is_running asks for the process's status)
+      int pidfd = open_pidfd(m_pid);
+      if ((pidfd >= 0) && (executor.watch_exit(&m_waiter, pidfd) == 0))
+         close(pidfd);
+#endif
    }
 
    m_ID = ID;
+   m_slot = slot;
    m_number = engine_num;
    m_uci = uci;
 
-   m_debug = (m_number == FIRST) ? options.debug_1 : options.debug_2;
+   new_match();
 
    if (m_uci)
       send_engine_cmd("uci");
@@ -72,18 +182,43 @@ int Engine::load_engine(const string &eng_file_name, int ID, engine_number engin
    return 1;
 }
 
-int Engine::get_features(void)
+// restart replaces an engine that stopped responding with a new process. The caller must set its options again.
+int Engine::restart(void)
+{
+   return load_engine(m_file_name, m_ID, m_slot, m_number, m_uci);
+}
+
+// new_match takes the match's per-engine settings that aren't engine options, e.g. when a daemon mode match reuses an
+// engine that's still running from the last one.
+void Engine::new_match(void)
+{
+   m_debug = (m_number == FIRST) ? options.debug_1 : options.debug_2;
+   m_node_limit = (m_number == FIRST) ? options.node_limit_1 : options.node_limit_2;
+   m_depth_limit = options.depth_limit;
+}
+
+// hang_deadline returns the deadline for a reply to a readiness check or the xboard features (--hangtime).
+chrono::steady_clock::time_point Engine::hang_deadline(void)
+{
+   if (options.hang_time_ms == 0)
+      return chrono::steady_clock::time_point::max();
+   return chrono::steady_clock::now() + chrono::milliseconds(options.hang_time_ms);
+}
+
+Task<int> Engine::get_features(void)
 {
    if (m_xb_features_done)
-      return 1; // only need to get features once
+      co_return 1; // only need to get features once
 
    send_engine_cmd("protover 2");
    m_is_ready = false;
+   chrono::steady_clock::time_point deadline = hang_deadline();
 
    while (1)
    {
-      if (readline() == 0)
-         return 0;
+      int line_read = co_await readline(deadline);
+      if (line_read == 0)
+         co_return 0;
       if (m_line[0] == '#')
          continue;
 
@@ -103,7 +238,7 @@ int Engine::get_features(void)
       {
          m_xb_features_done = true;
          m_is_ready = true;
-         return 1;
+         co_return 1;
       }
       else if (m_line.find("protover", 0) != string::npos)
       {
@@ -111,7 +246,7 @@ int Engine::get_features(void)
          m_xb_feature_setboard = false;
          m_xb_features_done = true;
          m_is_ready = true;
-         return 1;
+         co_return 1;
       }
    }
 }
@@ -121,36 +256,199 @@ void Engine::send_engine_cmd(const string &cmd)
    if (is_running())
    {
       if (m_debug)
-         cout << "TO ENGINE " << m_ID << ": " << cmd << "\n";
+         LogLine(m_slot, m_number, LOG_DEBUG) << "TO ENGINE " << m_ID << ": " << cmd << "\n";
+      if (m_replay)
+      {
+         replay_engine_cmd(cmd);
+         return;
+      }
+      if (log_tracing())
+         log_write(m_slot, m_number, LOG_TRACE_TO, cmd.c_str(), cmd.length());
       m_in_stream << cmd << "\n";
       m_in_stream.flush();
    }
 }
 
+// replay_engine_cmd checks that the harness sends the same commands that were recorded. If it doesn't (e.g. the
+// trace was recorded with different options, or by a different version), the replayed engine output may not fit.
+void Engine::replay_engine_cmd(const string &cmd)
+{
+   trace_entry entry;
+   if (!trace_replay.next_to_engine(m_slot, m_number, entry))
+   {
+      if (!m_replay_diverged)
+         LogLine(m_slot, m_number) << "Warning: replay of " << m_name << " (" << m_ID << ") diverged: \"" << cmd << "\" was not recorded\n";
+      m_replay_diverged = true;
+      return;
+   }
+   if ((entry.text != cmd) && !m_replay_diverged)
+   {
+      LogLine(m_slot, m_number) << "Warning: replay of " << m_name << " (" << m_ID << ") diverged: sent \"" << cmd << "\", recorded \"" << entry.text << "\"\n";
+      m_replay_diverged = true;
+   }
+   m_replay_sent_us = entry.time_us;
+   m_replay_sent_time = chrono::steady_clock::now();
+}
+
 void Engine::send_quit_cmd(void)
 {
    m_quit_cmd_sent = true;
+   m_quit_time = chrono::steady_clock::now();
    send_engine_cmd("quit");
 }
 
-int Engine::readline(void)
+// end_wait marks the wait for the engine's output as over, so kill_if_hung leaves the process alone from then on (it may
+// exit, be reaped and be replaced by load_engine).
+void Engine::end_wait(void)
 {
-   // note: getline is blocking.
+   lock_guard<mutex> lock(m_wait_mutex);
+   m_deadline = chrono::steady_clock::time_point::max();
+}
+
+// readline returns the next line from the engine, or 0 if the engine disconnected, or the deadline passed first
+// (m_timed_out is then set). On Linux, the game is suspended until the engine sends a line. Elsewhere, getline blocks
+// the thread, and the deadline is only enforced by kill_if_hung.
+Task<int> Engine::readline(chrono::steady_clock::time_point deadline)
+{
+   if (m_replay)
+      co_return co_await replay_readline();
+
+   m_timed_out = false;
+#ifdef __linux__
+   bool eof = false;
+   while (true)
+   {
+      size_t end = m_read_buffer.find('\n', m_read_pos);
+      if (end != string::npos)
+      {
+         m_line.assign(m_read_buffer, m_read_pos, end - m_read_pos);
+         m_read_pos = end + 1;
+         break;
+      }
+      // Only whole lines are returned (like getline, a partial last line before EOF is dropped).
+      if (m_read_pos > 0)
+      {
+         m_read_buffer.erase(0, m_read_pos);
+         m_read_pos = 0;
+      }
+      size_t size = m_read_buffer.size();
+      m_read_buffer.resize(size + ENGINE_READ_SIZE);
+      ssize_t n = read(m_out_fd, &m_read_buffer[size], ENGINE_READ_SIZE);
+      m_read_buffer.resize(size + ((n > 0) ? n : 0));
+      if (n > 0)
+         continue;
+      if ((n < 0) && (errno == EINTR))
+         continue;
+      if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+      {
+         if (m_waiter.exited)
+         {
+            // the engine has exited, and its output pipe is still held open (e.g. by a process it started)
+            eof = true;
+            break;
+         }
+         m_deadline = deadline;
+         bool readable = co_await wait_readable{m_out_fd, m_waiter, deadline};
+         end_wait();
+         if (!readable)
+         {
+            m_timed_out = true;
+            break;
+         }
+         continue;
+      }
+      eof = true;
+      break;
+   }
+#else
+   m_deadline = deadline;
    getline(m_out_stream, m_line);
-   if (m_out_stream.eof())
+   end_wait();
+   bool eof = m_out_stream.eof();
+#endif
+   if (m_timed_out)
    {
+      // with kill_if_hung, the engine has been killed, and eof is also set: make is_running see that
+      if (eof)
+         co_await await_exit(100ms);
+      if (log_tracing())
+         log_write(m_slot, m_number, LOG_TRACE_TIMEOUT, "", 0);
       if (m_debug)
-         cout << "ENGINE " << m_ID << " DISCONNECTED\n";
-      return 0;
+         LogLine(m_slot, m_number, LOG_DEBUG) << "ENGINE " << m_ID << " TIMED OUT\n";
+      co_return 0;
    }
+   if (eof)
+   {
+      co_await await_exit(100ms);   // the process normally exits as its output closes: make is_running see that
+      if (m_limits.active() && !m_quit_cmd_sent)
+      {
+         uint64_t max_rss_kb;
+         int status = exit_status(max_rss_kb);
+         m_limit_breach = m_limits.check_breach(status, max_rss_kb);
+      }
+      if (log_tracing())
+         log_write(m_slot, m_number, LOG_TRACE_EOF, m_limit_breach.c_str(), m_limit_breach.length());
+      if (m_debug)
+         LogLine(m_slot, m_number, LOG_DEBUG) << "ENGINE " << m_ID << " DISCONNECTED\n";
+      co_return 0;
+   }
+   if (log_tracing())
+      log_write(m_slot, m_number, LOG_TRACE_FROM, m_line.c_str(), m_line.length());
    rstrip(m_line);
    lstrip(m_line);
    if (m_debug)
-      cout << "FROM ENGINE " << m_ID << ": " << m_line << "\n";
-   return 1;
+      LogLine(m_slot, m_number, LOG_DEBUG) << "FROM ENGINE " << m_ID << ": " << m_line << "\n";
+   co_return 1;
 }
 
-int Engine::wait_for_ready(bool check_output)
+// replay_readline returns the next recorded line from the engine. With --realtime, it waits until the line is due,
+// i.e. the same amount of time after the last command was sent as in the recording.
+Task<int> Engine::replay_readline(void)
+{
+   trace_entry entry;
+   m_timed_out = false;
+   if (m_replay_eof || !trace_replay.next_from_engine(m_slot, m_number, entry))
+      entry.kind = LOG_TRACE_EOF;
+   if (entry.kind == LOG_TRACE_TIMEOUT)
+   {
+      m_timed_out = true;
+      if (m_debug)
+         LogLine(m_slot, m_number, LOG_DEBUG) << "ENGINE " << m_ID << " TIMED OUT\n";
+      co_return 0;
+   }
+   if (entry.kind == LOG_TRACE_EOF)
+   {
+      m_replay_eof = true;
+      m_limit_breach = move(entry.text);   // recorded if the engine's process breached its limits
+      if (m_debug)
+         LogLine(m_slot, m_number, LOG_DEBUG) << "ENGINE " << m_ID << " DISCONNECTED\n";
+      co_return 0;
+   }
+   if (options.replay_realtime && (entry.time_us > m_replay_sent_us))
+      co_await sleep_until(m_replay_sent_time + chrono::microseconds(entry.time_us - m_replay_sent_us));
+
+   m_line = move(entry.text);
+   rstrip(m_line);
+   lstrip(m_line);
+   if (m_debug)
+      LogLine(m_slot, m_number, LOG_DEBUG) << "FROM ENGINE " << m_ID << ": " << m_line << "\n";
+   co_return 1;
+}
+
+Task<int> Engine::wait_for_ready(bool check_output)
+{
+   send_ready_cmd();
+   co_return co_await wait_for_ready_reply(check_output);
+}
+
+// send_stop_cmd tells an engine to stop searching, e.g. after it lost on time, or its game was adjudicated. An xboard
+// engine is put in force mode (the next game's "new" ends it).
+void Engine::send_stop_cmd(void)
+{
+   send_engine_cmd(m_uci ? "stop" : "force");
+}
+
+void Engine::send_ready_cmd(void)
 {
    m_is_ready = false;
    if (m_uci)
@@ -159,17 +457,23 @@ int Engine::wait_for_ready(bool check_output)
       send_engine_cmd("ping 1");
    else
       send_engine_cmd("protover 2");
+}
+
+Task<int> Engine::wait_for_ready_reply(bool check_output)
+{
+   chrono::steady_clock::time_point deadline = hang_deadline();
 
    while (1)
    {
-      if (readline() == 0)
-         return 0;
+      int line_read = co_await readline(deadline);
+      if (line_read == 0)
+         co_return 0;
       if (m_uci)
       {
          if (m_line.rfind("readyok", 0) == 0)
          {
             m_is_ready = true;
-            return 1;
+            co_return 1;
          }
       }
       else if (m_xb_feature_ping)
@@ -177,7 +481,7 @@ int Engine::wait_for_ready(bool check_output)
          if (m_line.rfind("pong 1", 0) == 0)
          {
             m_is_ready = true;
-            return 1;
+            co_return 1;
          }
       }
       else
@@ -185,7 +489,7 @@ int Engine::wait_for_ready(bool check_output)
          if ((m_line.find("done=1", 0) != string::npos) || (m_line.find("protover", 0) != string::npos))
          {
             m_is_ready = true;
-            return 1;
+            co_return 1;
          }
       }
       if (check_output)
@@ -193,7 +497,23 @@ int Engine::wait_for_ready(bool check_output)
    }
 }
 
-int Engine::engine_new_game_setup(player_color color, player_color turn, int64_t start_time_ms, int64_t inc_time_ms, int64_t fixed_time_ms, const string &fen, const string &variant)
+// engine_new_game_request sends the new game command and the readiness check, without waiting for the reply, so both
+// engines of a game can clear their hash tables etc. at the same time. engine_new_game_setup waits for the reply.
+Task<int> Engine::engine_new_game_request(void)
+{
+   if (!m_uci)
+   {
+      int features_read = co_await get_features();
+      if (features_read == 0)
+         co_return 0;
+   }
+   m_setup_start_time = chrono::steady_clock::now();
+   send_engine_cmd(m_uci ? "ucinewgame" : "new");
+   send_ready_cmd();
+   co_return 1;
+}
+
+Task<int> Engine::engine_new_game_setup(player_color color, player_color turn, int64_t start_time_ms, int64_t inc_time_ms, int64_t fixed_time_ms, const string &fen, const string &moves, const string &variant)
 {
    m_result = UNFINISHED;
    m_resigned = false;
@@ -202,31 +522,26 @@ int Engine::engine_new_game_setup(player_color color, player_color turn, int64_t
    m_score = 0;
    m_opponent_move = "none";
 
+   int ready = co_await wait_for_ready_reply(false);
+   if (ready == 0)
+      co_return 0;
+   m_setup_time = chrono::steady_clock::now() - m_setup_start_time;
+
    if (m_uci)
    {
-      send_engine_cmd("ucinewgame");
-      if (!wait_for_ready(false))
-         return 0;
-
       if (!variant.empty())
          send_engine_cmd("setoption name UCI_Variant value " + variant);
 
       if (turn == color)
       {
-         if (!fen.empty())
-            send_engine_cmd("position fen " + fen);
-         else
-            send_engine_cmd("position startpos");
+         string position = fen.empty() ? "position startpos" : "position fen " + fen;
+         if (!moves.empty())
+            position += " moves " + moves;
+         send_engine_cmd(position);
       }
    }
    else
    {
-      if (!get_features())
-         return 0;
-      send_engine_cmd("new");
-      if (!wait_for_ready(false))
-         return 0;
-
       if (!variant.empty())
          send_engine_cmd("variant " + variant);
 
@@ -242,9 +557,29 @@ int Engine::engine_new_game_setup(player_color color, player_color turn, int64_t
             xb_edit_board(fen);
       }
 
+      // the opening's moves are played in force mode; the engine to move is sent "go" when the game starts
+      if (!moves.empty())
+      {
+         if (!m_xb_force_mode)
+         {
+            send_engine_cmd("force");
+            m_xb_force_mode = true;
+         }
+         for (const string &move : get_tokens(moves))
+            send_engine_cmd(m_xb_feature_usermove ? "usermove " + move : move);
+      }
+
       send_engine_cmd("easy");
       send_engine_cmd("post");
-      if (fixed_time_ms)
+      if (m_depth_limit)
+         send_engine_cmd("sd " + to_string(m_depth_limit));
+      if (m_node_limit)
+      {
+         // with "nps", the engine searches (nps * time) nodes, so one second per move is the node limit.
+         send_engine_cmd("nps " + to_string(m_node_limit));
+         send_engine_cmd("st 1");
+      }
+      else if (fixed_time_ms)
       {
          if ((fixed_time_ms % 1000) == 0)
             send_engine_cmd("st " + to_string((fixed_time_ms) / 1000));
@@ -258,16 +593,16 @@ int Engine::engine_new_game_setup(player_color color, player_color turn, int64_t
          if ((start_time_ms % 60000) == 0)
          {
             if ((inc_time_ms % 1000) == 0)
-               snprintf(cmd, 100, "level 0 %d %d", (int)start_time_ms / 60000, (int)inc_time_ms / 1000);
+               snprintf(cmd, 100, "level %u %d %d", options.tc_moves_to_go, (int)start_time_ms / 60000, (int)inc_time_ms / 1000);
             else
-               snprintf(cmd, 100, "level 0 %d %0.3f", (int)start_time_ms / 60000, (float)inc_time_ms / 1000.0);
+               snprintf(cmd, 100, "level %u %d %0.3f", options.tc_moves_to_go, (int)start_time_ms / 60000, (float)inc_time_ms / 1000.0);
          }
          else
          {
             if ((inc_time_ms % 1000) == 0)
-               snprintf(cmd, 100, "level 0 %d:%02d %d", (int)start_time_ms / 60000, (int)(start_time_ms % 60000) / 1000, (int)inc_time_ms / 1000);
+               snprintf(cmd, 100, "level %u %d:%02d %d", options.tc_moves_to_go, (int)start_time_ms / 60000, (int)(start_time_ms % 60000) / 1000, (int)inc_time_ms / 1000);
             else
-               snprintf(cmd, 100, "level 0 %d:%02d %0.3f", (int)start_time_ms / 60000, (int)(start_time_ms % 60000) / 1000, (float)inc_time_ms / 1000.0);
+               snprintf(cmd, 100, "level %u %d:%02d %0.3f", options.tc_moves_to_go, (int)start_time_ms / 60000, (int)(start_time_ms % 60000) / 1000, (float)inc_time_ms / 1000.0);
          }
 
          send_engine_cmd(cmd);
@@ -283,18 +618,13 @@ int Engine::engine_new_game_setup(player_color color, player_color turn, int64_t
       }
    }
 
-   return 1;
+   co_return 1;
 }
 
 void Engine::engine_new_game_start(int64_t start_time_ms, int64_t inc_time_ms, int64_t fixed_time_ms)
 {
    if (m_uci)
-   {
-      if (fixed_time_ms != 0)
-         send_engine_cmd("go movetime " + to_string(fixed_time_ms));
-      else
-         send_engine_cmd("go wtime " + to_string(start_time_ms) + " btime " + to_string(start_time_ms) + " winc " + to_string(inc_time_ms) + " binc " + to_string(inc_time_ms));
-   }
+      send_engine_cmd(uci_go_cmd(start_time_ms, start_time_ms, inc_time_ms, fixed_time_ms, options.tc_moves_to_go));
    else
    {
       send_engine_cmd("go");
@@ -302,14 +632,19 @@ void Engine::engine_new_game_start(int64_t start_time_ms, int64_t inc_time_ms, i
    }
 }
 
-int Engine::get_engine_move(void)
+// get_engine_move reads the engine's output until it sends its move, or returns 0 if it disconnects, or if the deadline
+// (its clock + --margin, or time_point::max() for none) passes first.
+Task<int> Engine::get_engine_move(chrono::steady_clock::time_point deadline)
 {
    m_move = "";
+   m_nodes = 0;
+   m_search_time_ms = 0;
 
    while (1)
    {
-      if (readline() == 0)
-         return 0;
+      int line_read = co_await readline(deadline);
+      if (line_read == 0)
+         co_return 0;
       if (m_uci)
       {
          if (m_line.rfind("bestmove", 0) == 0)
@@ -324,7 +659,7 @@ int Engine::get_engine_move(void)
                m_move = "";
             }
 
-            return 1;
+            co_return 1;
          }
       }
       else
@@ -336,17 +671,18 @@ int Engine::get_engine_move(void)
             // If move ends with a comma, the 2nd part of the move will be on the next line.
             if (m_move[m_move.length() - 1] == ',')
             {
-               if (readline() == 0)
-                  return 0;
+               int line_read = co_await readline(deadline);
+               if (line_read == 0)
+                  co_return 0;
                if (m_line.rfind("move ", 0) == 0)
                   m_move.append(m_line.substr(5));
             }
-            return 1;
+            co_return 1;
          }
       }
       check_engine_output();
       if (m_result != UNFINISHED)
-         return 1;
+         co_return 1;
    }
 }
 
@@ -361,9 +697,11 @@ void Engine::check_engine_output(void)
       if (m_line.rfind("info", 0) == 0)
       {
          // check for score. e.g. "info score cp 123" or "info score mate -3"
+         // also keep the search's node count and time, e.g. "info ... nodes 123456 time 789", for the metrics.
          tokens = get_tokens(m_line);
-         for (size_t i = 1; i < tokens.size() - 2; i++)
-            if (tokens[i] == "score")
+         for (size_t i = 1; i + 1 < tokens.size(); i++)
+         {
+            if ((tokens[i] == "score") && (i + 2 < tokens.size()))
             {
                if (tokens[i + 1] == "cp")
                {
@@ -379,18 +717,23 @@ void Engine::check_engine_output(void)
                   m_score = (n <= 0) ? (mate_score_neg + n) : (mate_score + n);
                }
             }
+            else if (tokens[i] == "nodes")
+               m_nodes = strtoull(tokens[i + 1].c_str(), nullptr, 10);
+            else if (tokens[i] == "time")
+               m_search_time_ms = strtoull(tokens[i + 1].c_str(), nullptr, 10);
+         }
       }
 
       if (m_line.rfind("info string", 0) == 0)
       {
          if (m_line.find("Invalid move", 0) != string::npos)
          {
-            cout << "Illegal move reported by " << m_name << "\n";
+            LogLine(m_slot, m_number) << "Illegal move reported by " << m_name << "\n";
             m_result = ERROR_ILLEGAL_MOVE;
          }
          else if (m_line.find("Invalid FEN", 0) != string::npos)
          {
-            cout << "Invalid position reported by " << m_name << "\n";
+            LogLine(m_slot, m_number) << "Invalid position reported by " << m_name << "\n";
             m_result = ERROR_INVALID_POSITION;
          }
          // 4pchess (https://github.com/obryanlouis/4pchess) uses "RY won" / "BG won" / "Stalemate".
@@ -415,12 +758,12 @@ void Engine::check_engine_output(void)
       if ((m_line.rfind("Illegal move:", 0) == 0) ||
           (m_line.rfind("Error (unknown command): " + m_opponent_move) == 0))
       {
-         cout << "Illegal move reported by " << m_name << "\n";
+         LogLine(m_slot, m_number) << "Illegal move reported by " << m_name << "\n";
          m_result = ERROR_ILLEGAL_MOVE;
       }
       else if (m_line.rfind("tellusererror Illegal position", 0) == 0)
       {
-         cout << "Invalid position reported by " << m_name << "\n";
+         LogLine(m_slot, m_number) << "Invalid position reported by " << m_name << "\n";
          m_result = ERROR_INVALID_POSITION;
       }
       else if (m_line.rfind("resign", 0) == 0)
@@ -438,10 +781,13 @@ void Engine::check_engine_output(void)
          m_offered_draw = true;
       else if (isdigit(m_line[0]))
       {
-         int ply, score, time, nodes;
+         int ply, score;
+         int64_t time, nodes;
          stringstream ss(m_line);
          if (ss >> ply >> score >> time >> nodes)
          {
+            m_nodes = nodes;
+            m_search_time_ms = time * 10;
             m_score = score;
             if (m_score > (mate_score + 999))
                m_score = (mate_score + 999);
@@ -452,7 +798,30 @@ void Engine::check_engine_output(void)
    }
 }
 
-void Engine::send_move_and_clocks_to_engine(const string &move, const string &startfen, const string &movelist, int64_t engine_clock_ms, int64_t opp_clock_ms, int64_t inc_ms, int64_t fixed_time_ms)
+// uci_go_cmd returns the "go" command for the engine's search limit (nodes and/or depth), or time control.
+string Engine::uci_go_cmd(int64_t wtime_ms, int64_t btime_ms, int64_t inc_ms, int64_t fixed_time_ms, uint moves_to_go)
+{
+   string cmd = "go";
+
+   if (m_node_limit || m_depth_limit)
+   {
+      if (m_node_limit)
+         cmd += " nodes " + to_string(m_node_limit);
+      if (m_depth_limit)
+         cmd += " depth " + to_string(m_depth_limit);
+   }
+   else if (fixed_time_ms != 0)
+      cmd += " movetime " + to_string(fixed_time_ms);
+   else
+   {
+      cmd += " wtime " + to_string(wtime_ms) + " btime " + to_string(btime_ms) + " winc " + to_string(inc_ms) + " binc " + to_string(inc_ms);
+      if (moves_to_go)
+         cmd += " movestogo " + to_string(moves_to_go);
+   }
+   return cmd;
+}
+
+void Engine::send_move_and_clocks_to_engine(const string &move, const string &startfen, const string &movelist, int64_t engine_clock_ms, int64_t opp_clock_ms, int64_t inc_ms, int64_t fixed_time_ms, uint moves_to_go)
 {
    m_opponent_move = move;
    if (m_uci)
@@ -462,19 +831,14 @@ void Engine::send_move_and_clocks_to_engine(const string &move, const string &st
       else
          send_engine_cmd("position fen " + startfen + " moves " + movelist);
 
-      if (fixed_time_ms == 0)
-      {
-         int64_t wtime, btime;
-         wtime = (m_color == WHITE) ? engine_clock_ms : opp_clock_ms;
-         btime = (m_color == WHITE) ? opp_clock_ms : engine_clock_ms;
-         send_engine_cmd("go wtime " + to_string(wtime) + " btime " + to_string(btime) + " winc " + to_string(inc_ms) + " binc " + to_string(inc_ms));
-      }
-      else
-         send_engine_cmd("go movetime " + to_string(fixed_time_ms));
+      int64_t wtime, btime;
+      wtime = (m_color == WHITE) ? engine_clock_ms : opp_clock_ms;
+      btime = (m_color == WHITE) ? opp_clock_ms : engine_clock_ms;
+      send_engine_cmd(uci_go_cmd(wtime, btime, inc_ms, fixed_time_ms, moves_to_go));
    }
    else
    {
-      if (fixed_time_ms == 0)
+      if ((fixed_time_ms == 0) && (m_node_limit == 0))
       {
          send_engine_cmd("time " + to_string(engine_clock_ms / 10));
          send_engine_cmd("otim " + to_string(opp_clock_ms / 10));
@@ -508,22 +872,226 @@ void Engine::send_result_to_engine(game_result result)
 
 bool Engine::is_running(void)
 {
+   if (m_replay)
+      return !m_replay_eof && !m_quit_cmd_sent;
    if (m_child_proc != nullptr)
+   {
+#ifdef __linux__
+      // with a pidfd, the executor's poller tells when the process has exited, and it's only reaped then
+      if ((m_waiter.exit_fd >= 0) && !m_waiter.exited)
+         return true;
+#endif
       if (m_child_proc->running())
          return true;
+   }
    return false;
 }
 
+// await_exit waits up to timeout for the engine process to exit, without blocking the thread: with a pidfd, until the
+// executor sees it exit, otherwise by checking on it every 5 ms. It's used once the engine has closed its output. The
+// process isn't reaped, so exit_status can still read its status and resource usage.
+Task<void> Engine::await_exit(chrono::milliseconds timeout)
+{
+   chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + timeout;
+   while (!has_exited() && (chrono::steady_clock::now() < deadline))
+   {
+      if (m_waiter.exit_fd >= 0)
+         co_await wait_exit{m_waiter, deadline};
+      else
+         co_await sleep_until(min(deadline, chrono::steady_clock::now() + 5ms));
+   }
+}
+
+// has_exited tells whether the engine process has exited. On Linux, it doesn't reap the process (is_running does).
+bool Engine::has_exited(void)
+{
+#ifdef __linux__
+   if (m_waiter.exit_fd >= 0)
+      return m_waiter.exited;
+   siginfo_t info = {};
+   return (m_pid == 0) || (waitid(P_PID, m_pid, &info, WEXITED | WNOHANG | WNOWAIT) != 0) || (info.si_pid != 0);
+#else
+   return !is_running();
+#endif
+}
+
+int Engine::get_pid(void)
+{
+   return m_pid;
+}
+
+// exit_status returns the wait status of the engine process, and its peak resident memory (KB) in max_rss_kb (0 if it
+// isn't known), or -1 if it's still running (see await_exit), or its status isn't known. On Linux, it must be called
+// before the process is reaped.
+int Engine::exit_status(uint64_t &max_rss_kb)
+{
+   max_rss_kb = 0;
+#ifdef __linux__
+   // unlike its glibc wrapper, the waitid system call also returns the process's resource usage (WNOWAIT: without
+   // reaping it)
+   siginfo_t info = {};
+   rusage usage = {};
+   if ((m_pid == 0) || (syscall(SYS_waitid, P_PID, (id_t)m_pid, &info, WEXITED | WNOHANG | WNOWAIT, &usage) != 0) ||
+       (info.si_pid == 0))
+      return -1;
+   max_rss_kb = usage.ru_maxrss;
+   return (info.si_code == CLD_EXITED) ? W_EXITCODE(info.si_status, 0) : W_EXITCODE(0, info.si_status);
+#else
+   try
+   {
+      if (m_child_proc->running())
+         return -1;
+      return m_child_proc->native_exit_code();
+   }
+   catch (...)
+   {
+      return -1;
+   }
+#endif
+}
+
+// can_restart tells whether the engine failed in a way that restarting it fixes: it didn't reply in time (--hangtime),
+// or its process ended because it breached its resource limits (--limits1, --limits2).
+bool Engine::can_restart(void)
+{
+   return m_timed_out || !m_limit_breach.empty();
+}
+
+// terminate asks an engine that didn't exit after "quit" to exit, with SIGTERM. (Not on Windows: it's killed instead.)
+void Engine::terminate(void)
+{
+#ifndef WIN32
+   if (!m_replay && is_running() && (m_pid != 0))
+   {
+      // the process can't have been reaped (and its pid reused) while it's running
+      kill(m_pid, SIGTERM);
+      LogLine(m_slot, m_number) << m_name << " (" << m_ID << "): did not quit, sent SIGTERM\n";
+   }
+#endif
+}
+
 // This function may need to be used if engine doesn't respond to "quit" command in a timely manner.
 void Engine::force_exit(void)
 {
    if (is_running())
    {
-      m_child_proc->terminate();
-      cout << m_name << " (" << m_ID << "): forced exit\n";
+      if (m_replay)
+      {
+         m_replay_eof = true;
+         return;
+      }
+      m_child_proc->terminate();   // kills and reaps the process
+      m_waiter.exited = true;
+      LogLine(m_slot, m_number) << m_name << " (" << m_ID << "): forced exit\n";
    }
 }
 
+// wait_for_exit waits for engines that were sent "quit" to exit, all at once: an engine that hasn't exited
+// ENGINE_QUIT_TIME_MS after its quit command is sent SIGTERM, and is killed if it still hasn't ENGINE_TERM_TIME_MS
+// later. On Linux, the engines' pidfds are polled, so each one is reaped as soon as it exits, and the wait only takes
+// as long as the slowest engine.
+void Engine::wait_for_exit(const vector<Engine *> &engines)
+{
+   struct exiting_engine
+   {
+      Engine *engine;
+      chrono::steady_clock::time_point deadline;
+      bool terminated;        // sent SIGTERM
+   };
+   vector<exiting_engine> exiting;
+   for (Engine *engine : engines)
+      if (engine->is_running())
+         exiting.push_back(exiting_engine{engine, engine->m_quit_time + chrono::milliseconds(ENGINE_QUIT_TIME_MS), false});
+#ifdef __linux__
+   vector<pollfd> fds;
+#endif
+
+   while (!exiting.empty())
+   {
+      auto now = chrono::steady_clock::now();
+      auto next_deadline = chrono::steady_clock::time_point::max();
+      bool all_pidfds = true;
+      for (size_t i = 0; i < exiting.size();)
+      {
+         exiting_engine &e = exiting[i];
+         if (e.engine->is_running() && (now >= e.deadline))
+         {
+            if (e.terminated)
+               e.engine->force_exit();
+            else
+            {
+               e.engine->terminate();
+               e.terminated = true;
+               e.deadline = now + chrono::milliseconds(ENGINE_TERM_TIME_MS);
+            }
+         }
+         if (!e.engine->is_running())
+         {
+            exiting[i] = exiting.back();
+            exiting.pop_back();
+            continue;
+         }
+         next_deadline = min(next_deadline, e.deadline);
+#ifdef __linux__
+         all_pidfds = all_pidfds && (e.engine->m_waiter.exit_fd >= 0);
+#else
+         all_pidfds = false;
+#endif
+         i++;
+      }
+      if (exiting.empty())
+         break;
+
+      auto wait = chrono::ceil<chrono::milliseconds>(next_deadline - now);
+      int timeout_ms = (int)max(wait.count(), (int64_t)0);
+      if (!all_pidfds)
+         timeout_ms = min(timeout_ms, ENGINE_EXIT_POLL_MS);
+#ifdef __linux__
+      fds.clear();
+      for (exiting_engine &e : exiting)
+         if (e.engine->m_waiter.exit_fd >= 0)
+            fds.push_back(pollfd{e.engine->m_waiter.exit_fd, POLLIN, 0});
+      if (poll(fds.data(), fds.size(), timeout_ms) > 0)
+      {
+         // the executor's poller also sees the exits, but may already have stopped (or be about to)
+         size_t f = 0;
+         for (exiting_engine &e : exiting)
+            if (e.engine->m_waiter.exit_fd >= 0)
+               if (fds[f++].revents != 0)
+                  e.engine->m_waiter.exited = true;
+      }
+#else
+      this_thread::sleep_for(chrono::milliseconds(timeout_ms));
+#endif
+   }
+}
+
+// kill_if_hung ends an engine that is still being waited for well after the wait's deadline (by --hangtime, or at least
+// a second). That only happens if the game can't act on the deadline itself: on systems where the engine's output is
+// read with a blocking read, or if the executor is badly overloaded. The game then sees the wait time out, and reaps the
+// process. It's called by the main thread: m_wait_mutex keeps the wait from ending meanwhile, so the process is the
+// one being waited for, and hasn't been reaped (or replaced).
+void Engine::kill_if_hung(void)
+{
+   if ((m_deadline.load() == chrono::steady_clock::time_point::max()) || m_replay)
+      return;
+   lock_guard<mutex> lock(m_wait_mutex);
+   chrono::steady_clock::time_point deadline = m_deadline;
+   if (deadline == chrono::steady_clock::time_point::max())
+      return;
+   if (chrono::steady_clock::now() < deadline + chrono::milliseconds(max(options.hang_time_ms, 1000u)))
+      return;
+   m_timed_out = true;
+   m_deadline = chrono::steady_clock::time_point::max();
+#ifdef WIN32
+   m_child_proc->terminate();
+#else
+   if (m_pid != 0)
+      kill(m_pid, SIGKILL);
+#endif
+   LogLine(m_slot, m_number) << m_name << " (" << m_ID << "): hung, killed\n";
+}
+
 // Note: The following functions: has_checkmate, is_checkmated, is_checkmating, and is_getting_checkmated
 // all rely on the engine's eval score, and not all engines always provide the eval score all the time.
 
@@ -557,6 +1125,24 @@ bool Engine::is_drawish(void)
    return ((uint)ABS(m_score) <= options.draw_score);
 }
 
+bool Engine::is_resigning(void)
+{
+   // true if engine's score is bad enough to resign (score <= -resignscore).
+   return (m_score <= -(int)options.resign_score);
+}
+
+bool Engine::is_winning(void)
+{
+   // true if engine's score is good enough for the opponent to resign (score >= resignscore).
+   return (m_score >= (int)options.resign_score);
+}
+
+// is_search_limited returns true if the engine searches to a fixed number of nodes or depth, rather than using its clock.
+bool Engine::is_search_limited(void)
+{
+   return (m_node_limit != 0) || (m_depth_limit != 0);
+}
+
 bool Engine::got_decisive_result(void)
 {
    return ((m_result == WHITE_WIN) || (m_result == BLACK_WIN) || (m_result == DRAW));
@@ -598,6 +1184,16 @@ string Engine::get_eval(void)
    return s;
 }
 
+// get_eval_json returns the last score as a JSON member: "score":<centipawns>, or "mate":<moves> (negative if mated).
+string Engine::get_eval_json(void)
+{
+   if (m_score > mate_score)
+      return "\"mate\":" + to_string(m_score - mate_score);
+   else if (m_score <= mate_score_neg)
+      return "\"mate\":-" + to_string(mate_score_neg - m_score);
+   return "\"score\":" + to_string(m_score);
+}
+
 // This function is only for old xboard engines that support the "edit" command instead of the "setboard" command.
 // This function will only work for normal chess.
 void Engine::xb_edit_board(const string &fen)
@@ -728,6 +1324,18 @@ player_color get_color_to_move_from_fen(const string &fen)
    if (fen.find(" b ") != string::npos)
       return BLACK;
 
-   cout << "Warning: couldn't get color to move from FEN: " << fen << "\n";
+   LogLine() << "Warning: couldn't get color to move from FEN: " << fen << "\n";
    return WHITE;
 }
+
+// 64-bit FNV-1a hash
+uint64_t hash_string(const string &s)
+{
+   uint64_t hash = 14695981039346656037ULL;
+   for (size_t i = 0; i < s.length(); i++)
+   {
+      hash ^= (unsigned char)s[i];
+      hash *= 1099511628211ULL;
+   }
+   return hash;
+}
@@ -1,10 +1,18 @@
+#pragma once
 #include <boost/process.hpp>
+#include "executor.h"
+#include "enginelimits.h"
 #include <string>
 #include <iostream>
 #include <vector>
 #include <cctype>
 #include <sstream>
+#include <chrono>
 
+#define ENGINE_READ_SIZE      4096     // bytes read from an engine's output pipe at a time (Linux)
+#define ENGINE_QUIT_TIME_MS   500      // at shutdown, time an engine has to exit after "quit", before it's sent SIGTERM
+#define ENGINE_TERM_TIME_MS   200      // ... and then to exit after SIGTERM, before it's killed
+#define ENGINE_EXIT_POLL_MS   10       // interval for checking engines without a pidfd at shutdown
 #define ABS(a)                (((a) > 0) ? (a) : (0 - (a)))
 
 namespace bp = boost::process;
@@ -31,6 +39,24 @@ enum player_color
    BLACK
 };
 
+enum piece_type
+{
+   PAWN,
+   KNIGHT,
+   BISHOP,
+   ROOK,
+   QUEEN,
+   KING,
+   NO_PIECE
+};
+
+// move flags (used by the built-in boards)
+#define MOVE_NORMAL           0
+#define MOVE_DOUBLE_PUSH      1
+#define MOVE_EN_PASSANT       2
+#define MOVE_CASTLE_KINGSIDE  3
+#define MOVE_CASTLE_QUEENSIDE 4
+
 enum engine_number
 {
    FIRST,
@@ -42,25 +68,43 @@ void lstrip(string &s);
 string get_first_token(const string &s, size_t pos);
 vector<string> get_tokens(const string &s);
 player_color get_color_to_move_from_fen(const string &fen);
+uint64_t hash_string(const string &s);
 
 class Engine
 {
+   friend class MicroBench;
+
 public:
    bool m_uci;
    uint m_ID;                 // 1 through N, where N = total number of engine instances running
    engine_number m_number;    // FIRST or SECOND
+   uint m_slot;               // index of the game manager running this engine
    string m_file_name;
    string m_name;
    string m_move;
    bool m_is_ready;
    bool m_quit_cmd_sent;
+   chrono::steady_clock::time_point m_quit_time;   // when the quit command was sent
    bool m_resigned;
    bool m_offered_draw;
+   uint64_t m_nodes;             // nodes searched for the last move, as reported by the engine
+   uint64_t m_search_time_ms;    // search time for the last move, as reported by the engine
+   chrono::nanoseconds m_setup_time;   // time taken by the last new game setup, until the engine was ready
+   atomic<bool> m_timed_out;           // the last wait for the engine's output ended at its deadline
 
 private:
    bp::child *m_child_proc;
+   EngineLimits m_limits;           // --limits1, --limits2
+   string m_limit_breach;           // why the engine's last process ended at its limits, or empty
+   atomic<int> m_pid;               // the engine process, or 0. Read by the main thread (m_child_proc may be replaced).
    bp::opstream m_in_stream;
    bp::ipstream m_out_stream;
+   int m_out_fd;                    // Linux: m_out_stream's pipe, read directly (non-blocking)
+   string m_read_buffer;            // Linux: output read from the engine, not yet returned by readline
+   size_t m_read_pos;
+   fd_waiter m_waiter;              // Linux: waits for m_out_fd, and the process's exit (its pidfd)
+   atomic<chrono::steady_clock::time_point> m_deadline;   // deadline of the current wait for output, or time_point::max()
+   mutex m_wait_mutex;              // held while a wait ends (m_deadline is reset), and by kill_if_hung
    game_result m_result;
    string m_line;
    string m_opponent_move;
@@ -73,6 +117,14 @@ private:
    bool m_xb_feature_usermove;      // xboard only
    bool m_xb_force_mode;            // xboard only
    bool m_debug;
+   uint m_node_limit;               // nodes per move (--nodes1, --nodes2), or 0
+   uint m_depth_limit;              // depth per move (--depth), or 0
+   chrono::steady_clock::time_point m_setup_start_time;
+   bool m_replay;                   // replaying a trace (--replay) instead of running the engine
+   bool m_replay_eof;               // replay only
+   bool m_replay_diverged;          // replay only
+   uint64_t m_replay_sent_us;       // replay only: recorded time of the last command sent
+   chrono::steady_clock::time_point m_replay_sent_time;   // replay only
 
    const int mate_score = 100000;
    const int mate_score_neg = (0 - mate_score);
@@ -81,31 +133,55 @@ public:
    // functions
    Engine(void);
    ~Engine(void);
-   int load_engine(const string &eng_file_name, int ID, engine_number engine_num, bool uci);
+   int load_engine(const string &eng_file_name, int ID, uint slot, engine_number engine_num, bool uci);
    void send_engine_cmd(const string &cmd);
    void send_quit_cmd(void);
-   int get_engine_move(void);
-   int wait_for_ready(bool check_output);
-   int engine_new_game_setup(player_color color, player_color turn, int64_t start_time_ms, int64_t inc_time_ms, int64_t fixed_time_ms, const string &fen, const string &variant);
+   int restart(void);
+   void new_match(void);
+   Task<int> get_engine_move(chrono::steady_clock::time_point deadline);
+   Task<int> wait_for_ready(bool check_output);
+   void send_ready_cmd(void);
+   void send_stop_cmd(void);
+   Task<int> wait_for_ready_reply(bool check_output);
+   Task<int> engine_new_game_request(void);
+   Task<int> engine_new_game_setup(player_color color, player_color turn, int64_t start_time_ms, int64_t inc_time_ms, int64_t fixed_time_ms, const string &fen, const string &moves, const string &variant);
    void engine_new_game_start(int64_t start_time_ms, int64_t inc_time_ms, int64_t fixed_time_ms);
-   void send_move_and_clocks_to_engine(const string &move, const string &startfen, const string &movelist, int64_t engine_clock_ms, int64_t opp_clock_ms, int64_t inc_ms, int64_t fixed_time_ms);
+   void send_move_and_clocks_to_engine(const string &move, const string &startfen, const string &movelist, int64_t engine_clock_ms, int64_t opp_clock_ms, int64_t inc_ms, int64_t fixed_time_ms, uint moves_to_go);
    void send_result_to_engine(game_result result);
    bool is_running(void);
+   int get_pid(void);
+   void terminate(void);
    void force_exit(void);
+   void kill_if_hung(void);
+   static void wait_for_exit(const vector<Engine *> &engines);
+   const string &limit_breach(void) { return m_limit_breach; }
+   bool can_restart(void);
    bool has_checkmate(void);
    bool is_checkmated(void);
    bool is_checkmating(void);
    bool is_getting_checkmated(void);
    bool is_drawish(void);
+   bool is_resigning(void);
+   bool is_winning(void);
+   bool is_search_limited(void);
    bool got_decisive_result(void);
    game_result get_game_result(void);
    void update_game_result(void);
    string get_eval(void);
+   string get_eval_json(void);
    void xb_edit_board(const string &fen);
 
 private:
-   int readline(void);
-   int get_features(void);
+   Task<int> readline(chrono::steady_clock::time_point deadline);
+   void end_wait(void);
+   chrono::steady_clock::time_point hang_deadline(void);
+   string uci_go_cmd(int64_t wtime_ms, int64_t btime_ms, int64_t inc_ms, int64_t fixed_time_ms, uint moves_to_go);
+   Task<int> replay_readline(void);
+   void replay_engine_cmd(const string &cmd);
+   Task<int> get_features(void);
+   int exit_status(uint64_t &max_rss_kb);
+   bool has_exited(void);
+   Task<void> await_exit(chrono::milliseconds timeout);
    void check_engine_output(void);
 };
 
@@ -119,28 +195,65 @@ struct options_info
    uint num_cores_2;
    uint mem_size_1;
    uint mem_size_2;
+   uint mem_slack_mb;
+   engine_limits limits_1;
+   engine_limits limits_2;
+   string cgroup_dir;
    vector<string> custom_commands_1;
    vector<string> custom_commands_2;
    bool debug_1;
    bool debug_2;
 
    bool print_moves;
+   bool print_stats;
    bool continue_on_error;
    bool fourplayerchess;
+   bool use_rules;
    bool pgn4_format;
    bool early_win;
    bool early_draw;
    uint draw_score;
    uint draw_moves;
+   uint draw_start;
+   bool early_resign;
+   uint resign_score;
+   uint resign_moves;
    uint tc_ms;
    uint tc_inc_ms;
    uint tc_fixed_time_move_ms;
+   uint tc_moves_to_go;
+   uint node_limit_1;
+   uint node_limit_2;
+   uint depth_limit;
    uint margin_ms;
+   uint hang_time_ms;
    uint num_games_to_play;
+   bool sprt;
+   double sprt_elo0;          // --sprt: H0 and H1 Elo difference (first engine - second engine)
+   double sprt_elo1;
+   double sprt_alpha;         // --sprt: false positive and false negative rates
+   double sprt_beta;
    uint num_threads;
+   uint num_workers;
+   bool adaptive_threads;
+   uint min_threads;
+   uint max_latency_ms;
+   uint max_nps_drop;
    uint max_moves;
+   uint repetition_cycle;
    string fens_filename;
+   uint book_plies;
    string variant;
    string pgn_filename;
    string pgn4_filename;
+   string syzygy_path;
+   uint log_sinks;
+   string log_prefix;
+   string metrics_filename;
+   uint sample_ms;
+   string events_path;
+   string record_filename;
+   string replay_filename;
+   bool replay_realtime;
+   string daemon_path;
 };
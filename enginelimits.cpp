@@ -0,0 +1,349 @@
+#include "enginelimits.h"
+#include "logger.h"
+#include <cstring>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+static string cgroup_dir;     // --cgroup, if its children can have the memory, cpu and pids controllers
+
+// parse_engine_limits parses a limits spec, e.g. "mem=512,cpu=100,nice=5". Returns 0 if it's invalid.
+int parse_engine_limits(const string &spec, engine_limits &limits)
+{
+   limits = {0, 0, 0, false, 0, -1};
+   size_t pos = 0;
+   while (pos < spec.length())
+   {
+      size_t end = spec.find(',', pos);
+      if (end == string::npos)
+         end = spec.length();
+      string item = spec.substr(pos, end - pos);
+      pos = end + 1;
+      size_t eq = item.find('=');
+      if (eq == string::npos)
+         return 0;
+      string name = item.substr(0, eq);
+      string value = item.substr(eq + 1);
+
+      if (name == "sched")
+      {
+#ifdef __linux__
+         if (value == "other")
+            limits.sched_policy = SCHED_OTHER;
+         else if (value == "batch")
+            limits.sched_policy = SCHED_BATCH;
+         else if (value == "idle")
+            limits.sched_policy = SCHED_IDLE;
+         else
+            return 0;
+#endif
+         continue;
+      }
+
+      char *value_end;
+      long n = strtol(value.c_str(), &value_end, 10);
+      if (value.empty() || (*value_end != 0))
+         return 0;
+      if (name == "nice")
+      {
+         if ((n < -20) || (n > 19))
+            return 0;
+         limits.set_nice = true;
+         limits.nice = (int)n;
+         continue;
+      }
+      if ((n <= 0) || (n > 100000000))
+         return 0;
+      if (name == "mem")
+         limits.mem_mb = (uint)n;
+      else if (name == "cpu")
+         limits.cpu_percent = (uint)n;
+      else if (name == "procs")
+         limits.max_procs = (uint)n;
+      else
+         return 0;
+   }
+   return 1;
+}
+
+bool engine_limits_set(const engine_limits &limits)
+{
+   return (limits.mem_mb != 0) || (limits.cpu_percent != 0) || (limits.max_procs != 0) || limits.set_nice || (limits.sched_policy != -1);
+}
+
+#ifdef __linux__
+// read_file reads a (small) cgroup file into text.
+static int read_file(const string &path, string &text)
+{
+   char buf[4096];
+   int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+   if (fd < 0)
+      return 0;
+   text.clear();
+   ssize_t n;
+   while ((n = read(fd, buf, sizeof(buf))) > 0)
+      text.append(buf, n);
+   close(fd);
+   return (n == 0);
+}
+
+static int write_file(const string &path, const string &text)
+{
+   int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+   if (fd < 0)
+      return 0;
+   ssize_t n = write(fd, text.data(), text.length());
+   int saved_errno = errno;
+   close(fd);
+   errno = saved_errno;
+   return (n == (ssize_t)text.length());
+}
+
+// event_count returns the count of a key in a cgroup events file, e.g. "oom_kill" in memory.events.
+static uint64_t event_count(const string &path, const char *key)
+{
+   string text;
+   if (read_file(path, text) == 0)
+      return 0;
+   size_t len = strlen(key);
+   for (size_t pos = 0; pos < text.length();)
+   {
+      size_t end = text.find('\n', pos);
+      if (end == string::npos)
+         end = text.length();
+      if ((text.compare(pos, len, key) == 0) && (text[pos + len] == ' '))
+         return strtoull(text.c_str() + pos + len + 1, nullptr, 10);
+      pos = end + 1;
+   }
+   return 0;
+}
+
+// cgroup_init enables the memory, cpu and pids controllers for the children of --cgroup. If it can't, the engines are
+// limited with rlimits instead. Returns 0 if the cgroup can't be used.
+int cgroup_init(const string &dir)
+{
+   string controllers;
+   if (read_file(dir + "/cgroup.controllers", controllers) == 0)
+   {
+      LogLine() << "Error: " << dir << " is not a cgroup v2 directory: " << strerror(errno) << ". Engine limits are set with rlimits instead.\n";
+      return 0;
+   }
+   for (const char *controller : {"memory", "cpu", "pids"})
+   {
+      if (controllers.find(controller) == string::npos)
+      {
+         LogLine() << "Error: the " << controller << " controller is not available in cgroup " << dir << ". Engine limits are set with rlimits instead.\n";
+         return 0;
+      }
+   }
+   // this fails if scm itself (or any other process) is in dir: a cgroup with controllers for its children can't have processes
+   if (write_file(dir + "/cgroup.subtree_control", "+memory +cpu +pids") == 0)
+   {
+      LogLine() << "Error: could not enable the memory, cpu and pids controllers in cgroup " << dir << ": " << strerror(errno)
+                << ". Engine limits are set with rlimits instead.\n";
+      return 0;
+   }
+   cgroup_dir = dir;
+   return 1;
+}
+
+EngineLimits::EngineLimits(void)
+{
+   m_limits = {0, 0, 0, false, 0, -1};
+   m_procs_fd = -1;
+   m_oom_kills = 0;
+   m_pids_max_hits = 0;
+   m_failed_step = "";
+}
+
+EngineLimits::~EngineLimits(void)
+{
+   remove();
+}
+
+// prepare is called before each of the engine instance's processes is started. The instance's cgroup is created with
+// its first process, and reused for the processes that replace it.
+int EngineLimits::prepare(const engine_limits &limits, uint ID, const string &name)
+{
+   m_limits = limits;
+   if (!engine_limits_set(m_limits) || cgroup_dir.empty())
+      return 1;
+
+   if (m_cgroup.empty())
+   {
+      string cgroup = cgroup_dir + "/scm-" + to_string(getpid()) + "-" + to_string(ID);
+      if ((mkdir(cgroup.c_str(), 0755) != 0) && (errno != EEXIST))
+      {
+         LogLine() << "Error: could not create cgroup " << cgroup << " for " << name << ": " << strerror(errno) << "\n";
+         return 0;
+      }
+      m_cgroup = cgroup;
+      m_oom_kills = event_count(m_cgroup + "/memory.events", "oom_kill");
+      m_pids_max_hits = event_count(m_cgroup + "/pids.events", "max");
+   }
+
+   string mem_max = "max", cpu_max = "max", pids_max = "max";
+   if (m_limits.mem_mb)
+      mem_max = to_string((uint64_t)m_limits.mem_mb << 20);
+   if (m_limits.cpu_percent)
+      cpu_max = to_string((uint64_t)m_limits.cpu_percent * 1000) + " 100000";
+   if (m_limits.max_procs)
+      pids_max = to_string(m_limits.max_procs);
+   if ((write_file(m_cgroup + "/memory.max", mem_max) == 0) || (write_file(m_cgroup + "/cpu.max", cpu_max) == 0) ||
+       (write_file(m_cgroup + "/pids.max", pids_max) == 0))
+   {
+      LogLine() << "Error: could not set the limits of cgroup " << m_cgroup << " for " << name << ": " << strerror(errno) << "\n";
+      return 0;
+   }
+   // the memory limit is on memory the engine uses, not on what's swapped out (memory.swap.max only exists with swap)
+   if (m_limits.mem_mb)
+      write_file(m_cgroup + "/memory.swap.max", "0");
+
+   m_procs_fd = open((m_cgroup + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+   if (m_procs_fd < 0)
+   {
+      LogLine() << "Error: could not open " << m_cgroup << "/cgroup.procs for " << name << ": " << strerror(errno) << "\n";
+      return 0;
+   }
+   return 1;
+}
+
+// apply sets the limits of the forked child, before it executes the engine: it moves itself into the cgroup (or sets
+// its rlimits), and sets its niceness and scheduling class. Returns 0, with errno and failed_step set, if it can't.
+int EngineLimits::apply(void)
+{
+   if (m_procs_fd >= 0)
+   {
+      // writing "0" moves the writing process
+      if (write(m_procs_fd, "0", 1) != 1)
+      {
+         m_failed_step = "could not join the engine's cgroup";
+         return 0;
+      }
+   }
+   else if (m_limits.mem_mb)
+   {
+      rlimit limit;
+      limit.rlim_cur = limit.rlim_max = (rlim_t)m_limits.mem_mb << 20;
+      if (setrlimit(RLIMIT_AS, &limit) != 0)
+      {
+         m_failed_step = "could not set the address space limit";
+         return 0;
+      }
+   }
+   if (m_limits.sched_policy != -1)
+   {
+      sched_param param = {};
+      if (sched_setscheduler(0, m_limits.sched_policy, &param) != 0)
+      {
+         m_failed_step = "could not set the scheduling class";
+         return 0;
+      }
+   }
+   if (m_limits.set_nice && (setpriority(PRIO_PROCESS, 0, m_limits.nice) != 0))
+   {
+      m_failed_step = "could not set the niceness";
+      return 0;
+   }
+   return 1;
+}
+
+// started is called once the engine process has been started (or couldn't be).
+void EngineLimits::started(void)
+{
+   if (m_procs_fd >= 0)
+      close(m_procs_fd);
+   m_procs_fd = -1;
+}
+
+// check_breach tells why an engine process that ended breached its limits, or returns an empty string if it didn't.
+// exit_status is the process's wait status, or -1 if it isn't known, and max_rss_kb its peak resident memory.
+// Without a cgroup, a process that hits its address space limit isn't told apart from one that crashes, so it's only
+// taken for a breach if it also used at least half of its limit (the address space also counts memory that's reserved
+// but not used, e.g. thread stacks and malloc arenas). Otherwise it's handled as a disconnected engine.
+string EngineLimits::check_breach(int exit_status, uint64_t max_rss_kb)
+{
+   if (!m_cgroup.empty())
+   {
+      uint64_t oom_kills = event_count(m_cgroup + "/memory.events", "oom_kill");
+      uint64_t pids_max_hits = event_count(m_cgroup + "/pids.events", "max");
+      bool oom_killed = (oom_kills > m_oom_kills);
+      bool pids_max_hit = (pids_max_hits > m_pids_max_hits);
+      m_oom_kills = oom_kills;
+      m_pids_max_hits = pids_max_hits;
+      if (oom_killed)
+         return "was killed for using more than its memory limit (mem=" + to_string(m_limits.mem_mb) + " MB)";
+      if (pids_max_hit)
+         return "exited after it couldn't start a thread or process at its limit (procs=" + to_string(m_limits.max_procs) + ")";
+      return "";
+   }
+   if ((m_limits.mem_mb == 0) || (exit_status == -1) || (max_rss_kb * 2 < ((uint64_t)m_limits.mem_mb << 10)))
+      return "";
+   string usage = " after using " + to_string(max_rss_kb >> 10) + " MB of its memory limit (mem=" + to_string(m_limits.mem_mb) + " MB)";
+   if (WIFSIGNALED(exit_status))
+      return "was killed by signal " + to_string(WTERMSIG(exit_status)) + usage;
+   if (WIFEXITED(exit_status) && (WEXITSTATUS(exit_status) != 0))
+      return "exited with status " + to_string(WEXITSTATUS(exit_status)) + usage;
+   return "";
+}
+
+// remove removes the engine instance's cgroup, once its processes have ended.
+void EngineLimits::remove(void)
+{
+   started();
+   if (!m_cgroup.empty())
+      rmdir(m_cgroup.c_str());
+   m_cgroup.clear();
+}
+#else
+int cgroup_init(const string &dir)
+{
+   LogLine() << "Error: --cgroup is only supported on Linux\n";
+   return 0;
+}
+
+EngineLimits::EngineLimits(void)
+{
+   m_limits = {0, 0, 0, false, 0, -1};
+   m_procs_fd = -1;
+   m_oom_kills = 0;
+   m_pids_max_hits = 0;
+   m_failed_step = "";
+}
+
+EngineLimits::~EngineLimits(void)
+{
+}
+
+int EngineLimits::prepare(const engine_limits &limits, uint ID, const string &name)
+{
+   m_limits = limits;
+   if (engine_limits_set(m_limits))
+      LogLine() << "Error: engine limits (--limits1, --limits2) are only supported on Linux\n";
+   return 1;
+}
+
+int EngineLimits::apply(void)
+{
+   return 1;
+}
+
+void EngineLimits::started(void)
+{
+}
+
+string EngineLimits::check_breach(int exit_status, uint64_t max_rss_kb)
+{
+   return "";
+}
+
+void EngineLimits::remove(void)
+{
+}
+#endif
@@ -0,0 +1,62 @@
+#pragma once
+#include <string>
+#include <cstdint>
+
+using namespace std;
+
+typedef unsigned int uint;
+
+// Per-engine resource limits (--limits1, --limits2), applied when an engine process is started (Linux). A limits spec
+// is a comma-separated list of:
+//    mem=MB         memory
+//    cpu=PERCENT    CPU quota, in percent of one core (e.g. 200: two cores)
+//    procs=N        processes and threads
+//    nice=N         niceness (-20 to 19; lowering it needs privileges)
+//    sched=CLASS    scheduling class: other, batch or idle
+// With --cgroup DIR (a cgroup v2 directory that scm may create cgroups in, e.g. one delegated by systemd), each engine
+// instance runs in its own cgroup DIR/scm-<pid>-<ID>, with memory.max, cpu.max and pids.max set from the limits.
+// Without a cgroup (or if the memory, cpu and pids controllers can't be enabled for DIR's children), mem limits the
+// process's address space (RLIMIT_AS), which also counts memory that's reserved but not used, and cpu and procs aren't
+// enforced.
+//
+// An engine whose process ends because it breached a limit (killed by the cgroup's OOM killer, unable to start a
+// thread at pids.max, or, without a cgroup, crashing after using half of its address space limit) loses the game and
+// is restarted, like an engine that stops responding, instead of ending the match.
+
+struct engine_limits
+{
+   uint mem_mb;            // 0: no limit
+   uint cpu_percent;       // 0: no limit
+   uint max_procs;         // 0: no limit
+   bool set_nice;
+   int nice;
+   int sched_policy;       // SCHED_OTHER, SCHED_BATCH or SCHED_IDLE, or -1 to leave it unchanged
+};
+
+int parse_engine_limits(const string &spec, engine_limits &limits);
+bool engine_limits_set(const engine_limits &limits);
+int cgroup_init(const string &dir);
+
+// EngineLimits applies an engine instance's limits to its processes, and tells whether a process that ended breached
+// them. apply runs in the forked child before it executes the engine, so it only makes async-signal-safe calls.
+class EngineLimits
+{
+private:
+   engine_limits m_limits;
+   string m_cgroup;           // the engine instance's cgroup, or empty
+   int m_procs_fd;            // the cgroup's cgroup.procs, open while the process is started
+   uint64_t m_oom_kills;      // the cgroup's breach counters already reported
+   uint64_t m_pids_max_hits;
+   const char *m_failed_step; // what apply couldn't do
+
+public:
+   EngineLimits(void);
+   ~EngineLimits(void);
+   int prepare(const engine_limits &limits, uint ID, const string &name);
+   int apply(void);
+   void started(void);
+   const char *failed_step(void) { return m_failed_step; }
+   bool active(void) { return engine_limits_set(m_limits); }
+   string check_breach(int exit_status, uint64_t max_rss_kb);
+   void remove(void);
+};
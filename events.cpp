@@ -0,0 +1,254 @@
+#include "events.h"
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <cstring>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+struct events_client
+{
+   int fd;
+   deque<string> queue;
+   size_t sent;            // bytes of the first queued event already sent
+   uint64_t dropped;       // events dropped since the client was last told
+   bool closed;
+};
+
+static atomic<bool> events_running(false);
+static string events_path;
+static int events_listen_fd = -1;
+static int events_wakeup[2] = {-1, -1};   // pipe that wakes up the server thread when events are queued
+static thread events_thread;
+static mutex events_mutex;                // protects events_clients
+static vector<events_client> events_clients;
+
+ostream &operator<<(ostream &out, const json_string &s)
+{
+   out << '"';
+   for (unsigned char c : s.text)
+   {
+      if ((c == '"') || (c == '\\'))
+         out << '\\' << c;
+      else if (c == '\n')
+         out << "\\n";
+      else if (c == '\r')
+         out << "\\r";
+      else if (c == '\t')
+         out << "\\t";
+      else if (c < 0x20)
+      {
+         char buf[8];
+         snprintf(buf, sizeof(buf), "\\u%04x", c);
+         out << buf;
+      }
+      else
+         out << c;
+   }
+   out << '"';
+   return out;
+}
+
+bool events_enabled(void)
+{
+   return events_running.load(memory_order_relaxed);
+}
+
+#ifndef WIN32
+static void events_server(void);
+
+int events_start(const string &path)
+{
+   sockaddr_un address = {};
+   if (path.length() >= sizeof(address.sun_path))
+   {
+      cout << "Error: events socket path is too long: " << path << "\n";
+      return 0;
+   }
+   address.sun_family = AF_UNIX;
+   strcpy(address.sun_path, path.c_str());
+
+   unlink(path.c_str()); // left over from an earlier match
+   events_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if ((events_listen_fd < 0) || (bind(events_listen_fd, (sockaddr *)&address, sizeof(address)) != 0) ||
+       (listen(events_listen_fd, 16) != 0) || (pipe(events_wakeup) != 0))
+   {
+      cout << "Error: could not open events socket " << path << ": " << strerror(errno) << "\n";
+      if (events_listen_fd >= 0)
+         close(events_listen_fd);
+      events_listen_fd = -1;
+      return 0;
+   }
+   for (int i = 0; i < 2; i++)
+      fcntl(events_wakeup[i], F_SETFL, fcntl(events_wakeup[i], F_GETFL) | O_NONBLOCK);
+
+   events_path = path;
+   events_running = true;
+   events_thread = thread(events_server);
+   return 1;
+}
+
+// events_stop sends the events that are still queued (as far as the clients take them without waiting), and closes
+// the socket. It must be called after log_stop, so that all events have been published.
+void events_stop(void)
+{
+   if (!events_running)
+      return;
+   events_running = false;
+   char c = 0;
+   if (write(events_wakeup[1], &c, 1) < 0)
+      cout << "Error: could not wake up the events server thread.\n";
+   events_thread.join();
+
+   for (events_client &client : events_clients)
+      close(client.fd);
+   events_clients.clear();
+   close(events_listen_fd);
+   close(events_wakeup[0]);
+   close(events_wakeup[1]);
+   events_listen_fd = -1;
+   unlink(events_path.c_str());
+}
+
+// events_publish queues an event for every client. It's called by the log sink thread.
+void events_publish(uint64_t time_us, const string &event)
+{
+   char time_member[32];
+   snprintf(time_member, sizeof(time_member), "{\"time\":%llu.%06llu,", (unsigned long long)(time_us / 1000000), (unsigned long long)(time_us % 1000000));
+   string line = time_member;
+   line.append(event, 1, string::npos);  // the event's own members follow the '{'
+   line += '\n';
+
+   {
+      lock_guard<mutex> lock(events_mutex);
+      if (events_clients.empty())
+         return;
+      for (events_client &client : events_clients)
+      {
+         // one place is kept for the "dropped" event
+         if (client.queue.size() + 1 >= EVENTS_QUEUE_SIZE)
+         {
+            client.dropped++;
+            continue;
+         }
+         if (client.dropped)
+         {
+            client.queue.push_back(string(time_member) + "\"event\":\"dropped\",\"count\":" + to_string(client.dropped) + "}\n");
+            client.dropped = 0;
+         }
+         client.queue.push_back(line);
+      }
+   }
+   char c = 0;
+   if (write(events_wakeup[1], &c, 1) < 0)
+      return; // the pipe is full, so the server thread will wake up anyway
+}
+
+// events_send writes a client's queued events, until the socket would block.
+static void events_send(events_client &client)
+{
+   while (!client.queue.empty())
+   {
+      const string &line = client.queue.front();
+      ssize_t n = send(client.fd, line.data() + client.sent, line.length() - client.sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (n < 0)
+      {
+         if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+            client.closed = true;
+         return;
+      }
+      client.sent += n;
+      if (client.sent < line.length())
+         return;
+      client.queue.pop_front();
+      client.sent = 0;
+   }
+}
+
+// events_server accepts clients, and sends them the queued events.
+static void events_server(void)
+{
+   vector<pollfd> fds;
+
+   while (true)
+   {
+      bool running = events_running.load(memory_order_acquire);
+      {
+         lock_guard<mutex> lock(events_mutex);
+         for (events_client &client : events_clients)
+            events_send(client);
+         for (size_t i = 0; i < events_clients.size();)
+         {
+            if (events_clients[i].closed)
+            {
+               close(events_clients[i].fd);
+               events_clients.erase(events_clients.begin() + i);
+            }
+            else
+               i++;
+         }
+         if (!running)
+            return;
+
+         fds.clear();
+         fds.push_back({events_listen_fd, POLLIN, 0});
+         fds.push_back({events_wakeup[0], POLLIN, 0});
+         for (events_client &client : events_clients)
+            fds.push_back({client.fd, (short)(client.queue.empty() ? POLLIN : (POLLIN | POLLOUT)), 0});
+      }
+
+      if (poll(fds.data(), fds.size(), 500) < 0)
+         continue;
+
+      char buf[256];
+      while (read(events_wakeup[0], buf, sizeof(buf)) > 0)
+         ;
+
+      lock_guard<mutex> lock(events_mutex);
+      // the clients polled are the first ones in events_clients: clients are only added or removed by this thread
+      for (size_t i = 2; i < fds.size(); i++)
+      {
+         events_client &client = events_clients[i - 2];
+         if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+            client.closed = true;
+         else if (fds[i].revents & POLLIN)
+         {
+            // clients don't send anything, so this is the end of the connection
+            ssize_t n = recv(client.fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if ((n == 0) || ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)))
+               client.closed = true;
+         }
+      }
+      if (fds[0].revents & POLLIN)
+      {
+         int fd;
+         while ((fd = accept4(events_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+         {
+            events_client client = {fd, {}, 0, 0, false};
+            client.queue.push_back("{\"event\":\"hello\",\"version\":" + to_string(EVENTS_VERSION) + "}\n");
+            events_clients.push_back(move(client));
+         }
+      }
+   }
+}
+#else
+int events_start(const string &path)
+{
+   cout << "Error: --events is not supported on Windows\n";
+   return 0;
+}
+
+void events_stop(void)
+{
+}
+
+void events_publish(uint64_t time_us, const string &event)
+{
+}
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+#include "logger.h"
+
+// Live match events (--events). Games and the match manager log events as JSON objects at the LOG_EVENT level, e.g.
+//    LogLine(m_slot, LOG_NO_ENGINE, LOG_EVENT) << "{\"event\":\"move\",\"move\":" << json_string(move) << "}";
+// The log sink thread adds the time and hands each event to the event server, which sends it, one JSON object per
+// line, to every client connected to a Unix domain socket. Nothing waits for a slow client: each client has a bounded
+// queue, and events that don't fit are dropped (the client is then sent a "dropped" event with the number lost).
+// Events are also dropped, rather than waited for, if a game's log ring is full.
+//
+// Events: "hello" (on connect), "game_start", "move", "game_end", "stats" (about once a second, and at the end of the
+// match), "error", and in daemon mode (--daemon) "match_start" and "match_end" around each queued match.
+
+#define EVENTS_VERSION       1
+#define EVENTS_QUEUE_SIZE    10000    // events queued for each client, before events are dropped
+
+// json_string writes a string as a quoted, escaped JSON string, e.g. LogLine() << json_string(name);
+struct json_string
+{
+   const string &text;
+};
+
+ostream &operator<<(ostream &out, const json_string &s);
+
+int events_start(const string &path);
+void events_stop(void);
+bool events_enabled(void);
+void events_publish(uint64_t time_us, const string &event);
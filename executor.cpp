@@ -0,0 +1,327 @@
+#include "executor.h"
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#define EXECUTOR_MAX_EVENTS 64
+#define EXECUTOR_EXIT_TAG   1     // set in the epoll data of a waiter's pidfd (watch_exit), to tell it from its fd
+
+Executor executor;
+
+// run_detached owns a spawned task: its frame is freed as soon as the task has finished.
+struct detached_task
+{
+   struct promise_type
+   {
+      detached_task get_return_object(void) { return detached_task{coroutine_handle<promise_type>::from_promise(*this)}; }
+      suspend_always initial_suspend(void) noexcept { return {}; }
+      suspend_never final_suspend(void) noexcept { return {}; }
+      void return_void(void) {}
+      void unhandled_exception(void) { terminate(); }
+   };
+
+   coroutine_handle<promise_type> handle;
+};
+
+static detached_task run_detached(Task<void> task)
+{
+   co_await task;
+}
+
+Executor::Executor(void)
+{
+   m_running = false;
+#ifdef __linux__
+   m_epoll_fd = -1;
+   m_wakeup_fd = -1;
+#endif
+}
+
+Executor::~Executor(void)
+{
+   stop();
+}
+
+int Executor::start(uint num_workers)
+{
+#ifdef __linux__
+   m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+   m_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if ((m_epoll_fd < 0) || (m_wakeup_fd < 0))
+      return 0;
+   epoll_event event = {};
+   event.events = EPOLLIN;
+   event.data.ptr = nullptr;
+   if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wakeup_fd, &event) != 0)
+      return 0;
+#endif
+
+   m_running = true;
+   for (uint i = 0; i < max(num_workers, 1u); i++)
+      m_workers.emplace_back(&Executor::worker, this);
+#ifdef __linux__
+   m_poller = thread(&Executor::poller, this);
+#endif
+   return 1;
+}
+
+// stop ends the worker threads, once they've run the coroutines that are ready. Coroutines that are still waiting
+// are not resumed.
+void Executor::stop(void)
+{
+   {
+      lock_guard<mutex> lock(m_mutex);
+      if (!m_running)
+         return;
+      m_running = false;
+   }
+   m_ready_cv.notify_all();
+#ifdef __linux__
+   uint64_t one = 1;
+   if (write(m_wakeup_fd, &one, sizeof(one)) < 0)
+      LogLine() << "Error: could not wake up the executor's poller thread.\n";
+   m_poller.join();
+   close(m_epoll_fd);
+   close(m_wakeup_fd);
+   m_epoll_fd = -1;
+   m_wakeup_fd = -1;
+#endif
+   for (thread &worker : m_workers)
+      worker.join();
+   m_workers.clear();
+}
+
+// spawn starts a task on a worker thread. The task must not return before everything it uses is done with,
+// since nobody waits for it.
+void Executor::spawn(Task<void> task)
+{
+   schedule(run_detached(move(task)).handle);
+}
+
+void Executor::schedule(coroutine_handle<> handle)
+{
+   {
+      lock_guard<mutex> lock(m_mutex);
+      m_ready.push_back(resume_item{handle, log_get_context()});
+   }
+   m_ready_cv.notify_one();
+}
+
+void Executor::worker(void)
+{
+   while (true)
+   {
+      resume_item item;
+      {
+         unique_lock<mutex> lock(m_mutex);
+         m_ready_cv.wait(lock, [this] { return !m_ready.empty() || !m_running; });
+         if (m_ready.empty())
+            return;
+         item = m_ready.front();
+         m_ready.pop_front();
+      }
+      log_set_context(item.context);
+      item.handle.resume();
+   }
+}
+
+// resume_when_readable queues the coroutine to be resumed once fd is readable, or the deadline has passed. With fd -1,
+// only the waiter's process exiting (watch_exit) or the deadline resume it. The coroutine may be resumed (on another
+// thread) before this returns, so the caller must not touch the coroutine's state afterwards.
+void Executor::resume_when_readable(int fd, fd_waiter *waiter, chrono::steady_clock::time_point deadline, coroutine_handle<> handle)
+{
+   bool earliest = false;
+   {
+      lock_guard<mutex> lock(m_mutex);
+      waiter->item = resume_item{handle, log_get_context()};
+      waiter->wait_id++;
+      waiter->pending = true;
+      waiter->timed_out = false;
+      if (waiter->exited)
+      {
+         // the process writing to fd has already exited: there's nothing to wait for
+         resume_waiter(waiter, false);
+         return;
+      }
+      if (deadline != chrono::steady_clock::time_point::max())
+      {
+         earliest = m_timers.empty() || (deadline < m_timers.top().due);
+         m_timers.push(timer_item{deadline, waiter->item, waiter, waiter->wait_id});
+      }
+#ifdef __linux__
+      // fd is armed while the lock is held: once it's released, the wait may end (e.g. at its deadline), and the fd be
+      // closed by its owner.
+      if (fd >= 0)
+      {
+         epoll_event event = {};
+         event.events = EPOLLIN | EPOLLONESHOT;
+         event.data.ptr = waiter;
+         // fds stay registered, disabled by EPOLLONESHOT until the next wait, and are removed by the kernel when closed.
+         if ((epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd, &event) != 0) && ((errno != ENOENT) || (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)))
+            resume_waiter(waiter, false);   // can't wait for it: resume right away, and the next read returns the error
+      }
+#else
+      (void)fd;
+      resume_waiter(waiter, false);
+#endif
+   }
+#ifdef __linux__
+   if (earliest)
+   {
+      uint64_t one = 1;
+      if (write(m_wakeup_fd, &one, sizeof(one)) < 0)
+         LogLine() << "Error: could not wake up the executor's poller thread.\n";
+   }
+#else
+   (void)earliest;
+#endif
+}
+
+// resume_waiter queues a waiting coroutine, unless it was already queued (by its fd, or its deadline). It's called
+// with m_mutex locked.
+void Executor::resume_waiter(fd_waiter *waiter, bool timed_out)
+{
+   if (!waiter->pending)
+      return;
+   waiter->pending = false;
+   waiter->timed_out = timed_out;
+   m_ready.push_back(waiter->item);
+   m_ready_cv.notify_one();
+}
+
+void Executor::resume_at(chrono::steady_clock::time_point due, coroutine_handle<> handle)
+{
+   bool earliest;
+   {
+      lock_guard<mutex> lock(m_mutex);
+      earliest = m_timers.empty() || (due < m_timers.top().due);
+      m_timers.push(timer_item{due, resume_item{handle, log_get_context()}, nullptr, 0});
+   }
+#ifdef __linux__
+   if (earliest)
+   {
+      uint64_t one = 1;
+      if (write(m_wakeup_fd, &one, sizeof(one)) < 0)
+         LogLine() << "Error: could not wake up the executor's poller thread.\n";
+   }
+#else
+   (void)earliest;
+#endif
+}
+
+// watch_exit makes the exit of a process (its pidfd) end the waiter's waits. The waiter owns the pidfd from then on.
+// Returns 0 if the pidfd can't be watched (the caller then still owns it).
+int Executor::watch_exit(fd_waiter *waiter, int pidfd)
+{
+#ifdef __linux__
+   lock_guard<mutex> lock(m_mutex);
+   waiter->exited = false;
+   epoll_event event = {};
+   event.events = EPOLLIN | EPOLLONESHOT;   // a process only exits once
+   event.data.u64 = (uint64_t)waiter | EXECUTOR_EXIT_TAG;
+   if ((m_epoll_fd < 0) || (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, pidfd, &event) != 0))
+      return 0;
+   waiter->exit_fd = pidfd;
+   return 1;
+#else
+   (void)waiter;
+   (void)pidfd;
+   return 0;
+#endif
+}
+
+// unwatch_exit stops watching the waiter's process, and closes its pidfd, so the waiter can be used for another process.
+void Executor::unwatch_exit(fd_waiter *waiter)
+{
+#ifdef __linux__
+   lock_guard<mutex> lock(m_mutex);
+   if (waiter->exit_fd >= 0)
+   {
+      if (m_epoll_fd >= 0)
+         epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, waiter->exit_fd, nullptr);
+      close(waiter->exit_fd);
+      waiter->exit_fd = -1;
+   }
+   waiter->exited = false;
+#else
+   (void)waiter;
+#endif
+}
+
+#ifdef __linux__
+// poller waits for the engines' output and the timers, and queues the coroutines that can continue.
+void Executor::poller(void)
+{
+   epoll_event events[EXECUTOR_MAX_EVENTS];
+
+   while (m_running)
+   {
+      int timeout_ms = -1;
+      {
+         lock_guard<mutex> lock(m_mutex);
+         if (!m_timers.empty())
+         {
+            auto wait = chrono::ceil<chrono::milliseconds>(m_timers.top().due - chrono::steady_clock::now());
+            timeout_ms = (int)max(wait.count(), (int64_t)0);
+         }
+      }
+
+      int n = epoll_wait(m_epoll_fd, events, EXECUTOR_MAX_EVENTS, timeout_ms);
+      if ((n < 0) && (errno != EINTR))
+      {
+         LogLine() << "Error: epoll_wait failed in the executor.\n";
+         return;
+      }
+
+      {
+         lock_guard<mutex> lock(m_mutex);
+         for (int i = 0; i < n; i++)
+         {
+            uint64_t data = events[i].data.u64;
+            if (data == 0)
+            {
+               uint64_t count;
+               while (read(m_wakeup_fd, &count, sizeof(count)) > 0)
+                  ;  // just a wakeup
+               continue;
+            }
+            if (data & EXECUTOR_EXIT_TAG)
+               process_exited((fd_waiter *)(data & ~(uint64_t)EXECUTOR_EXIT_TAG));
+            else
+               resume_waiter((fd_waiter *)data, false);
+         }
+         auto now = chrono::steady_clock::now();
+         while (!m_timers.empty() && (m_timers.top().due <= now))
+         {
+            const timer_item &timer = m_timers.top();
+            if (timer.waiter == nullptr)
+            {
+               m_ready.push_back(timer.item);
+               m_ready_cv.notify_one();
+            }
+            else if (timer.waiter->wait_id == timer.wait_id)
+               resume_waiter(timer.waiter, true);   // else the wait it was for has already ended
+            m_timers.pop();
+         }
+      }
+   }
+}
+
+// process_exited handles a waiter's pidfd becoming readable: its process has exited. It's called with m_mutex locked.
+// The event may be stale (returned by epoll_wait before the waiter's pidfd was replaced by unwatch_exit and
+// watch_exit), so the current pidfd is checked.
+void Executor::process_exited(fd_waiter *waiter)
+{
+   if (waiter->exit_fd < 0)
+      return;
+   pollfd fd = {waiter->exit_fd, POLLIN, 0};
+   if (poll(&fd, 1, 0) <= 0)
+      return;
+   waiter->exited = true;
+   resume_waiter(waiter, false);
+}
+#endif
@@ -0,0 +1,229 @@
+#pragma once
+#include "logger.h"
+#include <coroutine>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <queue>
+#include <atomic>
+#include <chrono>
+#include <utility>
+
+// Games run as coroutines on a small pool of worker threads, instead of one thread per game. Engine I/O and game code
+// are coroutines returning Task<T>, which co_await engine output (wait_readable), timers (sleep_until) and each other,
+// so a game only occupies a worker thread while it has something to do. A poller thread waits for all engines' output
+// with epoll, and queues the coroutines whose engine has sent output (or whose timer has expired) for the workers.
+// A suspended game costs its coroutine frames (a few KB) instead of a thread's stack.
+//
+// On other systems, wait_readable doesn't suspend (the engine's output is read with a blocking read, and deadlines are
+// not enforced), so the executor has one worker thread per game, like a thread per game.
+
+// Task<T> is a coroutine that starts when it's awaited, and resumes its caller (returning a T) when it finishes.
+// An exception that escapes a task ends the program, like one that escapes a thread.
+template <class T> class Task;
+
+struct task_promise_base
+{
+   coroutine_handle<> m_caller;
+
+   struct final_awaiter
+   {
+      bool await_ready(void) noexcept { return false; }
+      template <class P> coroutine_handle<> await_suspend(coroutine_handle<P> task) noexcept
+      {
+         coroutine_handle<> caller = task.promise().m_caller;
+         return caller ? caller : noop_coroutine();
+      }
+      void await_resume(void) noexcept {}
+   };
+
+   suspend_always initial_suspend(void) noexcept { return {}; }
+   final_awaiter final_suspend(void) noexcept { return {}; }
+   void unhandled_exception(void) { terminate(); }
+};
+
+template <class T> struct task_promise : task_promise_base
+{
+   T m_value{};
+   Task<T> get_return_object(void);
+   void return_value(T value) { m_value = move(value); }
+};
+
+template <> struct task_promise<void> : task_promise_base
+{
+   Task<void> get_return_object(void);
+   void return_void(void) {}
+};
+
+template <class T> class Task
+{
+public:
+   typedef task_promise<T> promise_type;
+
+private:
+   coroutine_handle<promise_type> m_handle;
+
+public:
+   explicit Task(coroutine_handle<promise_type> handle) : m_handle(handle) {}
+   Task(Task &&other) noexcept : m_handle(exchange(other.m_handle, nullptr)) {}
+   Task(const Task &) = delete;
+   Task &operator=(const Task &) = delete;
+   ~Task(void)
+   {
+      if (m_handle)
+         m_handle.destroy();
+   }
+
+   bool await_ready(void) noexcept { return false; }
+   coroutine_handle<> await_suspend(coroutine_handle<> caller) noexcept
+   {
+      m_handle.promise().m_caller = caller;
+      return m_handle;   // symmetric transfer: the task runs right away, on the caller's thread
+   }
+   T await_resume(void)
+   {
+      if constexpr (!is_void_v<T>)
+         return move(m_handle.promise().m_value);
+   }
+};
+
+template <class T> Task<T> task_promise<T>::get_return_object(void)
+{
+   return Task<T>(coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline Task<void> task_promise<void>::get_return_object(void)
+{
+   return Task<void>(coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+// resume_item is a suspended coroutine, and its logger state (slot ring and ply), which is restored when it's resumed.
+struct resume_item
+{
+   coroutine_handle<> handle;
+   log_context context;
+};
+
+// fd_waiter is a coroutine waiting for an fd to become readable, or for a deadline. It's kept by the fd's owner (e.g. an
+// Engine) rather than in the coroutine frame, since the poller may still see the fd or the deadline of an earlier wait
+// after the coroutine was resumed: those are recognized by wait_id, and ignored. Its members are protected by the
+// executor's mutex (exited is also read without it).
+// With watch_exit, the exit of the process writing to the fd (its pidfd becoming readable) also ends the wait, and
+// every later one, so a game sees an engine exit right away, even if the engine's output pipe is still held open.
+struct fd_waiter
+{
+   resume_item item{};
+   uint64_t wait_id = 0;      // incremented for each wait
+   bool pending = false;      // the coroutine is waiting, and hasn't been queued to resume yet
+   bool timed_out = false;    // the last wait ended at its deadline
+   int exit_fd = -1;          // Linux: pidfd of the process writing to the fd (watch_exit), or -1
+   atomic<bool> exited = false;  // the process has exited
+};
+
+class Executor
+{
+private:
+   struct timer_item
+   {
+      chrono::steady_clock::time_point due;
+      resume_item item;
+      fd_waiter *waiter;      // the deadline of a wait for an fd, or nullptr for sleep_until
+      uint64_t wait_id;
+      bool operator>(const timer_item &other) const { return due > other.due; }
+   };
+
+   vector<thread> m_workers;
+   mutex m_mutex;
+   condition_variable m_ready_cv;
+   deque<resume_item> m_ready;
+   priority_queue<timer_item, vector<timer_item>, greater<timer_item>> m_timers;
+   atomic<bool> m_running;
+#ifdef __linux__
+   thread m_poller;
+   int m_epoll_fd;
+   int m_wakeup_fd;           // eventfd that wakes up the poller, when a timer is added or the executor stops
+#endif
+
+public:
+   Executor(void);
+   ~Executor(void);
+   int start(uint num_workers);
+   void stop(void);
+   void spawn(Task<void> task);
+   void schedule(coroutine_handle<> handle);
+   void resume_when_readable(int fd, fd_waiter *waiter, chrono::steady_clock::time_point deadline, coroutine_handle<> handle);
+   void resume_at(chrono::steady_clock::time_point due, coroutine_handle<> handle);
+   int watch_exit(fd_waiter *waiter, int pidfd);
+   void unwatch_exit(fd_waiter *waiter);
+
+private:
+   void worker(void);
+   void resume_waiter(fd_waiter *waiter, bool timed_out);
+#ifdef __linux__
+   void poller(void);
+   void process_exited(fd_waiter *waiter);
+#endif
+};
+
+extern Executor executor;
+
+// co_await wait_readable{fd, waiter, deadline} suspends until fd can be read (with O_NONBLOCK set), or has hung up,
+// and returns true, or returns false if the deadline (time_point::max() for none) passes first.
+struct wait_readable
+{
+   int fd;
+   fd_waiter &waiter;
+   chrono::steady_clock::time_point deadline;
+
+   bool await_ready(void) noexcept
+   {
+#ifdef __linux__
+      return false;
+#else
+      return true;
+#endif
+   }
+   void await_suspend(coroutine_handle<> handle) { executor.resume_when_readable(fd, &waiter, deadline, handle); }
+   bool await_resume(void) noexcept
+   {
+#ifdef __linux__
+      return !waiter.timed_out;
+#else
+      return true;
+#endif
+   }
+};
+
+// co_await wait_exit{waiter, deadline} suspends until the waiter's process has exited (watch_exit), and returns true, or
+// returns false if the deadline passes first. It may also return false early (e.g. for an earlier wait's fd event), so
+// it's called in a loop. The waiter's fd isn't waited for.
+struct wait_exit
+{
+   fd_waiter &waiter;
+   chrono::steady_clock::time_point deadline;
+
+   bool await_ready(void) noexcept { return waiter.exited || (waiter.exit_fd < 0); }
+   void await_suspend(coroutine_handle<> handle) { executor.resume_when_readable(-1, &waiter, deadline, handle); }
+   bool await_resume(void) noexcept { return waiter.exited; }
+};
+
+// co_await sleep_until(time) suspends until the given time.
+struct sleep_until
+{
+   chrono::steady_clock::time_point due;
+
+   bool await_ready(void)
+   {
+      if (chrono::steady_clock::now() >= due)
+         return true;
+#ifndef __linux__
+      this_thread::sleep_until(due);
+      return true;
+#else
+      return false;
+#endif
+   }
+   void await_suspend(coroutine_handle<> handle) { executor.resume_at(due, handle); }
+   void await_resume(void) noexcept {}
+};
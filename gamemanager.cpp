@@ -1,89 +1,290 @@
 #include "gamemanager.h"
+#include "tablebase.h"
+#include "trace.h"
+#include "events.h"
 
 extern struct options_info options;
 
 GameManager::GameManager(void)
 {
    m_turn = WHITE;
-   m_engine1_wins = 0;
-   m_engine2_wins = 0;
-   m_draws = 0;
-   m_engine1_losses_on_time = 0;
-   m_engine2_losses_on_time = 0;
-   m_illegal_move_games = 0;
+   m_slot = 0;
+   m_metrics = nullptr;
+   m_match_totals = nullptr;
    m_thread_running = false;
    m_swap_sides = false;
    m_loss_on_time = false;
+   m_forfeit = "";
+   m_engine_hung[0] = m_engine_hung[1] = false;
+   m_limit_breached[0] = m_limit_breached[1] = false;
    m_repetition_draw = false;
-   m_error = false;
-   m_engine_disconnected = false;
+   m_rules_active = false;
+   m_tb_adjudicated = false;
+   m_rules_termination = "";
+   m_adjudication = "";
    m_num_moves = 0;
-   m_drawish_count = 0;
    m_white_clock_ms = chrono::milliseconds(0);
    m_black_clock_ms = chrono::milliseconds(0);
-   m_pgn_valid = false;
+   m_new_game_requested = false;
    m_move_list.reserve(1000);
+   for (int i = 0; i < 2; i++)
+   {
+      m_drawish_count[i] = 0;
+      m_losing_count[i] = 0;
+      m_winning_count[i] = 0;
+   }
+   new_match();
 }
 
 GameManager::~GameManager(void)
 {
 }
 
-void GameManager::game_runner(void)
+// new_match sets up the slot for a match's options, and clears the last match's errors (daemon mode runs several
+// matches with the same slots).
+void GameManager::new_match(void)
+{
+   m_error = false;
+   m_engine_disconnected = false;
+
+   // A cycle of moves that returns to the same position takes at least two moves from each player.
+   uint num_players = (options.fourplayerchess) ? 4 : 2;
+   m_repetition.configure(num_players * 2, options.repetition_cycle, num_players);
+}
+
+// game_runner plays games in the slot until there are no more for it: the first game is given by the match manager,
+// and each following one is claimed as soon as the last one's result is known. Both engines are then sent the new game
+// command right away, so they set up for the next game while the finished game's PGN and results are stored.
+// game_runner is a coroutine on the executor's worker threads: while it waits for the engines, other slots' games run.
+Task<void> GameManager::game_runner(void)
 {
    game_result result;
+   bool next_game;
 
-   m_timestamp = chrono::steady_clock::now();
-   m_loss_on_time = false;
-   m_repetition_draw = false;
-   m_thread_running = true;
-   m_num_moves = 0;
-   m_drawish_count = 0;
-   m_move_list = "";
-   m_move_vector.clear();
+   log_attach_slot(m_slot);
+   m_new_game_requested = false;
 
-   result = run_engine_game(chrono::milliseconds(options.tc_ms), chrono::milliseconds(options.tc_inc_ms),
-                            chrono::milliseconds(options.tc_fixed_time_move_ms));
+   do
+   {
+      m_timestamp = chrono::steady_clock::now();
+      m_loss_on_time = false;
+      m_forfeit = "";
+      m_engine_hung[0] = m_engine_hung[1] = false;
+      m_limit_breached[0] = m_limit_breached[1] = false;
+      m_repetition_draw = false;
+      m_tb_adjudicated = false;
+      m_rules_termination = "";
+      m_adjudication = "";
+      m_thread_running = true;
+      m_num_moves = 0;
+      m_move_list.clear();
+      m_moves.clear();
+      m_repetition.reset();
+      for (int i = 0; i < 2; i++)
+      {
+         m_drawish_count[i] = 0;
+         m_losing_count[i] = 0;
+         m_winning_count[i] = 0;
+      }
 
-   if (m_num_moves > 0)
-      store_pgn(result, m_swap_sides ? m_engine2.m_file_name : m_engine1.m_file_name, m_swap_sides ? m_engine1.m_file_name : m_engine2.m_file_name,
-                chrono::milliseconds(options.tc_ms), chrono::milliseconds(options.tc_inc_ms), chrono::milliseconds(options.tc_fixed_time_move_ms));
+      result = co_await run_engine_game(chrono::milliseconds(options.tc_ms), chrono::milliseconds(options.tc_inc_ms),
+                                        chrono::milliseconds(options.tc_fixed_time_move_ms));
+      m_game_end_time = chrono::steady_clock::now();
 
-   if (result == ERROR_ENGINE_DISCONNECTED)
-      m_engine_disconnected = true;
-   else if (result == ERROR_ILLEGAL_MOVE)
-      m_illegal_move_games++;
-   else if (((result == WHITE_WIN) && !m_swap_sides) || ((result == BLACK_WIN) && m_swap_sides))
+      book_position next_opening;
+      bool next_swap_sides = false;
+      next_game = (result != ERROR_ENGINE_DISCONNECTED) && (!m_error || options.continue_on_error) &&
+                  m_claim_next_game(m_slot, next_opening, next_swap_sides);
+      if (next_game)
+      {
+         m_timestamp = chrono::steady_clock::now();
+         m_new_game_requested = (co_await request_new_game() != 0);
+      }
+
+      if (m_num_moves > 0)
+         store_pgn(result, m_swap_sides ? m_engine2.m_file_name : m_engine1.m_file_name, m_swap_sides ? m_engine1.m_file_name : m_engine2.m_file_name,
+                   chrono::milliseconds(options.tc_ms), chrono::milliseconds(options.tc_inc_ms), chrono::milliseconds(options.tc_fixed_time_move_ms));
+
+      result_counts counts = {};
+      counts.games_completed = 1;
+      counts.plies = m_num_moves;
+      if (result == ERROR_ENGINE_DISCONNECTED)
+      {
+         m_engine_disconnected = true;
+         counts.disconnects[m_engine1.is_running() ? SECOND : FIRST] = 1;
+      }
+      else if (result == ERROR_ILLEGAL_MOVE)
+         counts.illegal_move_games = 1;
+      else if (((result == WHITE_WIN) && !m_swap_sides) || ((result == BLACK_WIN) && m_swap_sides))
+      {
+         counts.wins[FIRST] = 1;
+         if (m_loss_on_time)
+            counts.losses_on_time[SECOND] = 1;
+      }
+      else if (((result == BLACK_WIN) && !m_swap_sides) || ((result == WHITE_WIN) && m_swap_sides))
+      {
+         counts.wins[SECOND] = 1;
+         if (m_loss_on_time)
+            counts.losses_on_time[FIRST] = 1;
+      }
+      else if (result == DRAW)
+         counts.draws = 1;
+      for (int i = 0; i < 2; i++)
+      {
+         if (m_engine_hung[i])
+            counts.hangs[i] = 1;
+         if (m_limit_breached[i])
+            counts.limit_breaches[i] = 1;
+      }
+
+      if ((result == ERROR_ILLEGAL_MOVE) || (result == ERROR_INVALID_POSITION) || (result == UNDETERMINED))
+      {
+         LogLine(m_slot) << "\n" << m_fen << "\n" << m_move_list << "\n";
+         if (m_num_moves > 0)
+            LogLine(m_slot) << "\n" << m_pgn << "\n";
+      }
+
+      if (events_enabled())
+         publish_game_end(result);
+
+      if (m_num_moves > 0)
+         publish_pgn();
+
+      m_metrics->results.add(counts);
+      m_match_totals->add(counts);
+
+      if (next_game)
+      {
+         m_fen = move(next_opening.fen);
+         m_opening_moves = move(next_opening.moves);
+         m_swap_sides = next_swap_sides;
+      }
+   } while (next_game);
+
+   m_thread_running = false;
+}
+
+// publish_pgn hands the game's PGN over to the match manager. If the match manager has taken all earlier games, the
+// buffers are simply swapped: m_pgn gets the (empty) buffer that the match manager last gave back.
+void GameManager::publish_pgn(void)
+{
+   lock_guard<mutex> lock(m_pgn_mutex);
+   if (m_pgn_pending.empty())
+      m_pgn_pending.swap(m_pgn);
+   else
+      m_pgn_pending.append(m_pgn);
+}
+
+// take_pgn swaps the PGN of the games finished since the last call into pgn. pgn's old contents are discarded, but its
+// memory is kept for later games.
+void GameManager::take_pgn(string &pgn)
+{
+   pgn.clear();
+   lock_guard<mutex> lock(m_pgn_mutex);
+   pgn.swap(m_pgn_pending);
+}
+
+// publish_game_start, publish_move and publish_game_end publish the game's events (--events, see events.h).
+void GameManager::publish_game_start(Engine *white_engine, Engine *black_engine)
+{
+   LogLine(m_slot, LOG_NO_ENGINE, LOG_EVENT) << "{\"event\":\"game_start\",\"slot\":" << m_slot << ",\"white\":" << json_string{white_engine->m_file_name}
+                                             << ",\"black\":" << json_string{black_engine->m_file_name} << ",\"white_engine\":" << white_engine->m_number + 1
+                                             << ",\"fen\":" << json_string{m_fen} << ",\"opening_moves\":" << json_string{m_opening_moves} << "}";
+}
+
+void GameManager::publish_move(Engine *engine, player_color color, chrono::milliseconds elapsed_time_ms, chrono::milliseconds clock_ms)
+{
+   LogLine(m_slot, engine->m_number, LOG_EVENT) << "{\"event\":\"move\",\"slot\":" << m_slot << ",\"ply\":" << m_num_moves << ",\"side\":\""
+                                                << ((color == WHITE) ? "white" : "black") << "\",\"engine\":" << engine->m_number + 1 << ",\"move\":"
+                                                << json_string{engine->m_move} << "," << engine->get_eval_json() << ",\"nodes\":" << engine->m_nodes
+                                                << ",\"time_ms\":" << elapsed_time_ms.count() << ",\"clock_ms\":" << clock_ms.count() << "}";
+}
+
+void GameManager::publish_game_end(game_result result)
+{
+   const char *result_str = "*";
+   int winner = 0;
+   if (result == WHITE_WIN)
    {
-      m_engine1_wins++;
-      if (m_loss_on_time)
-         m_engine2_losses_on_time++;
+      result_str = "1-0";
+      winner = m_swap_sides ? 2 : 1;
    }
-   else if (((result == BLACK_WIN) && !m_swap_sides) || ((result == WHITE_WIN) && m_swap_sides))
+   else if (result == BLACK_WIN)
    {
-      m_engine2_wins++;
-      if (m_loss_on_time)
-         m_engine1_losses_on_time++;
+      result_str = "0-1";
+      winner = m_swap_sides ? 1 : 2;
    }
    else if (result == DRAW)
-      m_draws++;
+      result_str = "1/2-1/2";
 
-   if ((result == ERROR_ILLEGAL_MOVE) || (result == ERROR_INVALID_POSITION) || (result == UNDETERMINED))
+   LogLine(m_slot, LOG_NO_ENGINE, LOG_EVENT) << "{\"event\":\"game_end\",\"slot\":" << m_slot << ",\"result\":\"" << result_str << "\",\"winner\":" << winner
+                                             << ",\"termination\":" << json_string{termination_reason(result)} << ",\"plies\":" << m_num_moves << "}";
+}
+
+// termination_reason describes how the game ended, e.g. "checkmate", "time forfeit" or "Draw adjudicated".
+string GameManager::termination_reason(game_result result)
+{
+   if (result == ERROR_ENGINE_DISCONNECTED)
+      return "disconnect";
+   if (result == ERROR_ILLEGAL_MOVE)
+      return "illegal move";
+   if (result == ERROR_INVALID_POSITION)
+      return "invalid position";
+   if ((result != WHITE_WIN) && (result != BLACK_WIN) && (result != DRAW))
+      return "undetermined";
+   if (m_loss_on_time)
+      return "time forfeit";
+   if (m_forfeit[0] != 0)
+      return m_forfeit;
+   if (m_tb_adjudicated)
+      return "tablebase";
+   if (m_adjudication[0] != 0)
+      return m_adjudication;
+   if (result == DRAW)
    {
-      cout << "\n" << m_fen << "\n" << m_move_list << "\n";
-      if (m_num_moves > 0)
-         cout << "\n" << m_pgn << "\n";
+      if (m_repetition_draw)
+         return "repetition";
+      if (m_engine1.m_offered_draw && m_engine2.m_offered_draw)
+         return "agreement";
+      if (m_num_moves >= options.max_moves)
+         return "max moves";
+      if (m_rules_termination[0] != 0)
+         return m_rules_termination;
+      return "draw";
    }
+   if (m_engine1.m_resigned || m_engine2.m_resigned)
+      return "resignation";
+   return "checkmate";
+}
 
-   m_thread_running = false;
+// request_new_game sends the new game command to both engines, without waiting for them to be ready.
+Task<int> GameManager::request_new_game(void)
+{
+   Engine *engines[2] = {&m_engine1, &m_engine2};
+   for (Engine *engine : engines)
+   {
+      int requested = co_await engine->engine_new_game_request();
+      if (requested == 0)
+      {
+         if (!engine->m_quit_cmd_sent && !engine->m_timed_out)
+            LogLine(m_slot, engine->m_number) << "Error: " << engine->m_name << " could not start a new game.\n";
+         co_return 0;
+      }
+   }
+   co_return 1;
 }
 
-game_result GameManager::run_engine_game(chrono::milliseconds start_time_ms, chrono::milliseconds increment_ms, chrono::milliseconds fixed_time_ms)
+Task<game_result> GameManager::run_engine_game(chrono::milliseconds start_time_ms, chrono::milliseconds increment_ms, chrono::milliseconds fixed_time_ms)
 {
    chrono::milliseconds elapsed_time_ms;
    game_result result = UNFINISHED;
    Engine *white_engine;
    Engine *black_engine;
+   uint white_moves = 0, black_moves = 0;
+   chrono::steady_clock::time_point move_received;
+   Engine *flagged_engine = nullptr;   // lost on time at its deadline, while still searching
+   Engine *failed_engine = nullptr;    // lost because its process ended at its resource limits
+   Engine *searching_engine = nullptr; // still searching when the game ended (adjudication, --maxmoves)
 
    if (m_swap_sides)
    {
@@ -107,24 +308,65 @@ game_result GameManager::run_engine_game(chrono::milliseconds start_time_ms, chr
       m_black_clock_ms = start_time_ms;
    }
 
-   this_thread::sleep_for(100ms);
-
    m_turn = get_color_to_move_from_fen(m_fen);
 
-   if (white_engine->engine_new_game_setup(WHITE, m_turn, start_time_ms.count(), increment_ms.count(), fixed_time_ms.count(), m_fen, options.variant) == 0)
+   // Both engines get the new game command before waiting for either one to be ready, so the setup takes as long as
+   // the slower engine's, rather than the sum of both. Usually it was already sent when the last game ended.
+   if (!m_new_game_requested)
    {
+      int requested = co_await request_new_game();
+      if (requested == 0)
+      {
+         if (white_engine->can_restart())
+            co_return co_await forfeit_game(white_engine, black_engine, BLACK_WIN);
+         if (black_engine->can_restart())
+            co_return co_await forfeit_game(black_engine, white_engine, WHITE_WIN);
+         co_return ERROR_ENGINE_DISCONNECTED;
+      }
+   }
+   m_new_game_requested = false;
+
+   if ((start_rules_tracking() == 0) || (play_opening_moves() == 0))
+   {
+      // the engines' replies to the new game request are still to be read
+      co_await white_engine->wait_for_ready_reply(false);
+      co_await black_engine->wait_for_ready_reply(false);
+      m_error = true;
+      co_return ERROR_INVALID_POSITION;
+   }
+
+   int white_set_up = co_await white_engine->engine_new_game_setup(WHITE, m_turn, start_time_ms.count(), increment_ms.count(), fixed_time_ms.count(), m_fen, m_opening_moves, options.variant);
+   if (white_set_up == 0)
+   {
+      if (white_engine->can_restart())
+         co_return co_await forfeit_game(white_engine, black_engine, BLACK_WIN);
       if (!white_engine->m_quit_cmd_sent)
-         cout << "Error: " << white_engine->m_name << " could not start a new game.\n";
-      return ERROR_ENGINE_DISCONNECTED;
+         LogLine(m_slot, white_engine->m_number) << "Error: " << white_engine->m_name << " could not start a new game.\n";
+      co_return ERROR_ENGINE_DISCONNECTED;
    }
-   if (black_engine->engine_new_game_setup(BLACK, m_turn, start_time_ms.count(), increment_ms.count(), fixed_time_ms.count(), m_fen, options.variant) == 0)
+   int black_set_up = co_await black_engine->engine_new_game_setup(BLACK, m_turn, start_time_ms.count(), increment_ms.count(), fixed_time_ms.count(), m_fen, m_opening_moves, options.variant);
+   if (black_set_up == 0)
    {
+      if (black_engine->can_restart())
+         co_return co_await forfeit_game(black_engine, white_engine, WHITE_WIN);
       if (!black_engine->m_quit_cmd_sent)
-         cout << "Error: " << black_engine->m_name << " could not start a new game.\n";
-      return ERROR_ENGINE_DISCONNECTED;
+         LogLine(m_slot, black_engine->m_number) << "Error: " << black_engine->m_name << " could not start a new game.\n";
+      co_return ERROR_ENGINE_DISCONNECTED;
    }
+   m_metrics->add_setup_time(white_engine->m_number, white_engine->m_setup_time);
+   m_metrics->add_setup_time(black_engine->m_number, black_engine->m_setup_time);
 
-   this_thread::sleep_for(100ms);
+   // Both engines must have processed the setup (e.g. a variant or position) before the first engine's clock starts.
+   white_engine->send_ready_cmd();
+   black_engine->send_ready_cmd();
+   int white_ready = co_await white_engine->wait_for_ready_reply(false);
+   int black_ready = co_await black_engine->wait_for_ready_reply(false);
+   if ((white_ready == 0) && white_engine->can_restart())
+      co_return co_await forfeit_game(white_engine, black_engine, BLACK_WIN);
+   if ((black_ready == 0) && black_engine->can_restart())
+      co_return co_await forfeit_game(black_engine, white_engine, WHITE_WIN);
+   if ((white_ready == 0) || (black_ready == 0))
+      co_return ERROR_ENGINE_DISCONNECTED;
 
    if (m_turn == WHITE)
       white_engine->engine_new_game_start(start_time_ms.count(), increment_ms.count(), fixed_time_ms.count());
@@ -132,6 +374,10 @@ game_result GameManager::run_engine_game(chrono::milliseconds start_time_ms, chr
       black_engine->engine_new_game_start(start_time_ms.count(), increment_ms.count(), fixed_time_ms.count());
 
    m_timestamp = chrono::steady_clock::now();
+   if (m_game_end_time.time_since_epoch().count() != 0)
+      m_metrics->add_idle_time(m_timestamp - m_game_end_time);
+   if (events_enabled())
+      publish_game_start(white_engine, black_engine);
 
    while ((white_engine->get_game_result() == UNFINISHED) && (black_engine->get_game_result() == UNFINISHED) && (m_num_moves < options.max_moves))
    {
@@ -139,76 +385,162 @@ game_result GameManager::run_engine_game(chrono::milliseconds start_time_ms, chr
       if (adjudicate_result != UNFINISHED)
       {
          result = adjudicate_result;
+         searching_engine = (m_turn == WHITE) ? white_engine : black_engine;
          break;
       }
 
       if (m_turn == WHITE)
       {
-         if (!white_engine->get_engine_move())
+         int move_read = co_await white_engine->get_engine_move(move_deadline(white_engine, m_white_clock_ms));
+         if (move_read == 0)
          {
+            if (white_engine->m_timed_out)
+            {
+               m_white_clock_ms = chrono::milliseconds(0 - (int)options.margin_ms);
+               LogLine(m_slot, white_engine->m_number) << white_engine->m_name << " (white) ran out of time. " << m_white_clock_ms.count() << " ms\n";
+               m_loss_on_time = true;
+               flagged_engine = white_engine;
+               result = BLACK_WIN;
+               break;
+            }
+            if (white_engine->can_restart())
+            {
+               // its process ended at its resource limits
+               failed_engine = white_engine;
+               result = BLACK_WIN;
+               break;
+            }
             if (!white_engine->m_quit_cmd_sent)
-               cout << "Error: " << white_engine->m_name << " disconnected.\n";
-            return ERROR_ENGINE_DISCONNECTED;
+               LogLine(m_slot, white_engine->m_number) << "Error: " << white_engine->m_name << " disconnected.\n";
+            co_return ERROR_ENGINE_DISCONNECTED;
          }
          if (white_engine->m_move.empty())
             break; // no legal moves
-         elapsed_time_ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - m_timestamp);
-         m_white_clock_ms = m_white_clock_ms - elapsed_time_ms;
-         if (m_white_clock_ms.count() < (0 - (int)options.margin_ms))
+         move_received = chrono::steady_clock::now();
+         metrics_add(m_metrics->nodes[white_engine->m_number], white_engine->m_nodes);
+         metrics_add(m_metrics->search_ms[white_engine->m_number], white_engine->m_search_time_ms);
+         elapsed_time_ms = get_move_time();
+         white_moves++;
+         if (!white_engine->is_search_limited())
          {
-            cout << white_engine->m_name << " (white) ran out of time. " << m_white_clock_ms.count() << " ms\n";
-            m_loss_on_time = true;
-            result = BLACK_WIN;
-            break;
+            m_white_clock_ms = m_white_clock_ms - elapsed_time_ms;
+            if (m_white_clock_ms.count() < (0 - (int)options.margin_ms))
+            {
+               LogLine(m_slot, white_engine->m_number) << white_engine->m_name << " (white) ran out of time. " << m_white_clock_ms.count() << " ms\n";
+               m_loss_on_time = true;
+               result = BLACK_WIN;
+               break;
+            }
+            m_white_clock_ms = add_time(m_white_clock_ms, white_moves, start_time_ms, increment_ms, fixed_time_ms);
          }
-         m_white_clock_ms = (fixed_time_ms.count() ? (fixed_time_ms) : (m_white_clock_ms + increment_ms));
 
          move_played(white_engine->m_move);
-         black_engine->send_move_and_clocks_to_engine(white_engine->m_move, m_fen, m_move_list, m_black_clock_ms.count(), m_white_clock_ms.count(), increment_ms.count(), fixed_time_ms.count());
+         result = check_move_with_rules(white_engine, white_engine->m_move);
+         if (result == UNFINISHED)
+            black_engine->send_move_and_clocks_to_engine(white_engine->m_move, m_fen, m_move_list, m_black_clock_ms.count(), m_white_clock_ms.count(), increment_ms.count(), fixed_time_ms.count(), moves_to_go(black_moves));
          m_timestamp = chrono::steady_clock::now();
+         m_metrics->add_latency(m_timestamp - move_received);
          if (options.print_moves)
-            cout << "white moved: " << white_engine->m_move << ",   elapsed: " << elapsed_time_ms.count() << " ms,   white clock: "
-                 << m_white_clock_ms.count() << " ms,  eval: " << white_engine->get_eval() << "\n";
+            LogLine(m_slot) << "white moved: " << white_engine->m_move << ",   elapsed: " << elapsed_time_ms.count() << " ms,   white clock: "
+                            << m_white_clock_ms.count() << " ms,  eval: " << white_engine->get_eval() << "\n";
+         if (events_enabled())
+            publish_move(white_engine, WHITE, elapsed_time_ms, m_white_clock_ms);
+         if (result != UNFINISHED)
+            break;
       }
       else
       {
-         if (!black_engine->get_engine_move())
+         int move_read = co_await black_engine->get_engine_move(move_deadline(black_engine, m_black_clock_ms));
+         if (move_read == 0)
          {
+            if (black_engine->m_timed_out)
+            {
+               m_black_clock_ms = chrono::milliseconds(0 - (int)options.margin_ms);
+               LogLine(m_slot, black_engine->m_number) << black_engine->m_name << " (black) ran out of time. " << m_black_clock_ms.count() << " ms\n";
+               m_loss_on_time = true;
+               flagged_engine = black_engine;
+               result = WHITE_WIN;
+               break;
+            }
+            if (black_engine->can_restart())
+            {
+               // its process ended at its resource limits
+               failed_engine = black_engine;
+               result = WHITE_WIN;
+               break;
+            }
             if (!black_engine->m_quit_cmd_sent)
-               cout << "Error: " << black_engine->m_name << " disconnected.\n";
-            return ERROR_ENGINE_DISCONNECTED;
+               LogLine(m_slot, black_engine->m_number) << "Error: " << black_engine->m_name << " disconnected.\n";
+            co_return ERROR_ENGINE_DISCONNECTED;
          }
          if (black_engine->m_move.empty())
             break; // no legal moves
-         elapsed_time_ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - m_timestamp);
-         m_black_clock_ms = m_black_clock_ms - elapsed_time_ms;
-         if (m_black_clock_ms.count() < (0 - (int)options.margin_ms))
+         move_received = chrono::steady_clock::now();
+         metrics_add(m_metrics->nodes[black_engine->m_number], black_engine->m_nodes);
+         metrics_add(m_metrics->search_ms[black_engine->m_number], black_engine->m_search_time_ms);
+         elapsed_time_ms = get_move_time();
+         black_moves++;
+         if (!black_engine->is_search_limited())
          {
-            cout << black_engine->m_name << " (black) ran out of time. " << m_black_clock_ms.count() << " ms\n";
-            m_loss_on_time = true;
-            result = WHITE_WIN;
-            break;
+            m_black_clock_ms = m_black_clock_ms - elapsed_time_ms;
+            if (m_black_clock_ms.count() < (0 - (int)options.margin_ms))
+            {
+               LogLine(m_slot, black_engine->m_number) << black_engine->m_name << " (black) ran out of time. " << m_black_clock_ms.count() << " ms\n";
+               m_loss_on_time = true;
+               result = WHITE_WIN;
+               break;
+            }
+            m_black_clock_ms = add_time(m_black_clock_ms, black_moves, start_time_ms, increment_ms, fixed_time_ms);
          }
-         m_black_clock_ms = (fixed_time_ms.count() ? (fixed_time_ms) : (m_black_clock_ms + increment_ms));
 
          move_played(black_engine->m_move);
-         white_engine->send_move_and_clocks_to_engine(black_engine->m_move, m_fen, m_move_list, m_white_clock_ms.count(), m_black_clock_ms.count(), increment_ms.count(), fixed_time_ms.count());
+         result = check_move_with_rules(black_engine, black_engine->m_move);
+         if (result == UNFINISHED)
+            white_engine->send_move_and_clocks_to_engine(black_engine->m_move, m_fen, m_move_list, m_white_clock_ms.count(), m_black_clock_ms.count(), increment_ms.count(), fixed_time_ms.count(), moves_to_go(white_moves));
          m_timestamp = chrono::steady_clock::now();
+         m_metrics->add_latency(m_timestamp - move_received);
          if (options.print_moves)
-            cout << "black moved: " << black_engine->m_move << ",   elapsed: " << elapsed_time_ms.count() << " ms,   black clock: "
-                 << m_black_clock_ms.count() << " ms,  eval: " << black_engine->get_eval() << "\n";
+            LogLine(m_slot) << "black moved: " << black_engine->m_move << ",   elapsed: " << elapsed_time_ms.count() << " ms,   black clock: "
+                            << m_black_clock_ms.count() << " ms,  eval: " << black_engine->get_eval() << "\n";
+         if (events_enabled())
+            publish_move(black_engine, BLACK, elapsed_time_ms, m_black_clock_ms);
+         if (result != UNFINISHED)
+            break;
       }
 
       m_turn = (m_turn == WHITE) ? BLACK : WHITE;
    }
 
+   if ((result == UNFINISHED) && (m_num_moves >= options.max_moves))
+      searching_engine = (m_turn == WHITE) ? white_engine : black_engine;
+   if (searching_engine != nullptr)
+   {
+      // Its move must be read before the next game's new game request is sent (a UCI engine replies to a readiness check
+      // while it's searching). With an unfinished result, that's done by reading its output below.
+      searching_engine->send_stop_cmd();
+      if (result != UNFINISHED)
+      {
+         int stopped = co_await searching_engine->wait_for_ready(false);
+         if ((stopped == 0) && searching_engine->can_restart())
+            restart_failed_engine(searching_engine);
+      }
+   }
+
    if (result == UNFINISHED)
    {
       // In case there is unread data (which may contain game result) from engine where result isn't known yet:
       if (white_engine->get_game_result() == UNFINISHED)
-         white_engine->wait_for_ready(true);
+      {
+         int white_flushed = co_await white_engine->wait_for_ready(true);
+         if ((white_flushed == 0) && white_engine->can_restart())
+            restart_failed_engine(white_engine);
+      }
       if (black_engine->get_game_result() == UNFINISHED)
-         black_engine->wait_for_ready(true);
+      {
+         int black_flushed = co_await black_engine->wait_for_ready(true);
+         if ((black_flushed == 0) && black_engine->can_restart())
+            restart_failed_engine(black_engine);
+      }
 
       result = determine_game_result(white_engine, black_engine);
    }
@@ -216,36 +548,140 @@ game_result GameManager::run_engine_game(chrono::milliseconds start_time_ms, chr
    white_engine->send_result_to_engine(result);
    black_engine->send_result_to_engine(result);
 
-   return result;
+   if (flagged_engine != nullptr)
+   {
+      int recovered = co_await recover_engine(flagged_engine);
+      if (recovered == 0)
+         co_return ERROR_ENGINE_DISCONNECTED;
+   }
+   if (failed_engine != nullptr)
+   {
+      if (restart_failed_engine(failed_engine) == 0)
+         co_return ERROR_ENGINE_DISCONNECTED;
+      m_forfeit = "resource limit";
+   }
+
+   co_return result;
 }
 
-bool GameManager::is_engine_unresponsive(void)
+// move_deadline returns when the engine to move runs out of time: when its clock has gone below zero by --margin.
+// The game then ends at that moment, without waiting any longer for the engine's move.
+chrono::steady_clock::time_point GameManager::move_deadline(Engine *engine, chrono::milliseconds clock_ms)
 {
-   if (m_thread_running)
+   if (engine->is_search_limited())
+      return chrono::steady_clock::time_point::max();
+   return m_timestamp + clock_ms + chrono::milliseconds(options.margin_ms);
+}
+
+// restart_failed_engine replaces an engine that didn't reply in time (--hangtime), or whose process ended because it
+// breached its resource limits (--limits1, --limits2), with a new process, so only the current game is affected.
+// Returns 0 if the engine can't be restarted.
+int GameManager::restart_failed_engine(Engine *engine)
+{
+   if (engine->m_quit_cmd_sent)
+      return 0; // the match is ending
+   if (engine->m_timed_out)
+   {
+      LogLine(m_slot, engine->m_number) << "Error: " << engine->m_name << " (" << engine->m_ID << ") is not responding. Restarting it.\n";
+      m_engine_hung[engine->m_number] = true;
+   }
+   else
+   {
+      LogLine(m_slot, engine->m_number) << "Error: " << engine->m_name << " (" << engine->m_ID << ") " << engine->limit_breach() << ". Restarting it.\n";
+      m_limit_breached[engine->m_number] = true;
+   }
+   if (engine->restart() == 0)
+   {
+      LogLine(m_slot, engine->m_number) << "Error: could not restart " << engine->m_name << "\n";
+      return 0;
+   }
+   m_configure_engine(engine);
+   return 1;
+}
+
+// recover_engine gets an engine that lost on time while it was still searching ready for the next game: it's told to
+// stop, and is restarted if it doesn't reply to a readiness check in time.
+Task<int> GameManager::recover_engine(Engine *engine)
+{
+   if (!engine->is_running())
+      co_return restart_failed_engine(engine);   // killed by kill_hung_engines
+   engine->send_stop_cmd();
+   int ready = co_await engine->wait_for_ready(false);
+   if (ready != 0)
+      co_return 1;
+   if (engine->can_restart())
+      co_return restart_failed_engine(engine);
+   if (!engine->m_quit_cmd_sent)
+      LogLine(m_slot, engine->m_number) << "Error: " << engine->m_name << " disconnected.\n";
+   co_return 0;
+}
+
+// forfeit_game ends a game that couldn't start, because an engine didn't reply in time or its process ended at its
+// resource limits: the engine loses the game (result), and is restarted.
+Task<game_result> GameManager::forfeit_game(Engine *engine, Engine *opponent, game_result result)
+{
+   const char *forfeit = engine->m_timed_out ? "hang" : "resource limit";
+   if (restart_failed_engine(engine) == 0)
+      co_return ERROR_ENGINE_DISCONNECTED;
+   m_forfeit = forfeit;
+
+   // The opponent's reply to the new game request must be read here, or it would be taken as the reply to its next
+   // readiness check.
+   if (!opponent->m_is_ready)
    {
-      chrono::milliseconds elapsed_time_ms;
-      elapsed_time_ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - m_timestamp);
-      chrono::milliseconds clock_ms = (m_turn == WHITE) ? m_white_clock_ms : m_black_clock_ms;
+      int opponent_ready = co_await opponent->wait_for_ready_reply(false);
+      if ((opponent_ready == 0) && (!opponent->can_restart() || (restart_failed_engine(opponent) == 0)))
+         co_return ERROR_ENGINE_DISCONNECTED;
+   }
+   co_return result;
+}
 
-      if ((elapsed_time_ms > 5s) && (!m_engine1.m_is_ready || !m_engine2.m_is_ready))
-      {
-         if (!m_engine1.m_is_ready)
-            cout << "Error: " << m_engine1.m_name << " (" << m_engine1.m_ID << ") is not ready after 5 seconds.\n";
-         else
-            cout << "Error: " << m_engine2.m_name << " (" << m_engine2.m_ID << ") is not ready after 5 seconds.\n";
-         return true;
-      }
+// add_time returns a side's clock after it has made its moves_made'th move: the increment is added, and with
+// --movestogo, the base time is added again at each time control.
+chrono::milliseconds GameManager::add_time(chrono::milliseconds clock_ms, uint moves_made, chrono::milliseconds start_time_ms,
+                                           chrono::milliseconds increment_ms, chrono::milliseconds fixed_time_ms)
+{
+   if (fixed_time_ms.count())
+      return fixed_time_ms;
+   clock_ms += increment_ms;
+   if (options.tc_moves_to_go && ((moves_made % options.tc_moves_to_go) == 0))
+      clock_ms += start_time_ms;
+   return clock_ms;
+}
 
-      if ((clock_ms - elapsed_time_ms) < -10s)
-      {
-         if (((m_turn == WHITE) && !m_swap_sides) || ((m_turn == BLACK) && m_swap_sides))
-            cout << "Error: " << m_engine1.m_name << " (" << m_engine1.m_ID << ") is not moving (clock < -10s).\n";
-         else
-            cout << "Error: " << m_engine2.m_name << " (" << m_engine2.m_ID << ") is not moving (clock < -10s).\n";
-         return true;
-      }
+// moves_to_go returns the number of moves a side has left until the next time control (--movestogo), or 0.
+uint GameManager::moves_to_go(uint moves_made)
+{
+   if (options.tc_moves_to_go == 0)
+      return 0;
+   return options.tc_moves_to_go - (moves_made % options.tc_moves_to_go);
+}
+
+// get_move_time returns the time taken by the move just played. When replaying a trace, the recorded times are used,
+// so the clocks (and any losses on time) are the same as in the recording.
+chrono::milliseconds GameManager::get_move_time(void)
+{
+   if (!options.replay_filename.empty())
+      return chrono::milliseconds(trace_replay.next_clock(m_slot));
+
+   chrono::milliseconds elapsed_time_ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - m_timestamp);
+   if (log_tracing())
+   {
+      string text = to_string(elapsed_time_ms.count());
+      log_write(m_slot, LOG_NO_ENGINE, LOG_TRACE_CLOCK, text.c_str(), text.length());
+   }
+   return elapsed_time_ms;
+}
+
+// kill_hung_engines is called by the main thread, to end engines that are still being waited for well after their
+// deadline (see Engine::kill_if_hung).
+void GameManager::kill_hung_engines(void)
+{
+   if (m_thread_running)
+   {
+      m_engine1.kill_if_hung();
+      m_engine2.kill_if_hung();
    }
-   return false;
 }
 
 game_result GameManager::determine_game_result(Engine *white_engine, Engine *black_engine)
@@ -275,7 +711,7 @@ game_result GameManager::determine_game_result(Engine *white_engine, Engine *bla
    }
    else if (white_engine->got_decisive_result() && black_engine->got_decisive_result() && (white_result != black_result))
    {
-      cout << "Error: engines disagree on game result. " << white_result << ", " << black_result << "; " << white_engine->m_offered_draw << ", " << black_engine->m_offered_draw << "\n";
+      LogLine(m_slot) << "Error: engines disagree on game result. " << white_result << ", " << black_result << "; " << white_engine->m_offered_draw << ", " << black_engine->m_offered_draw << "\n";
       m_error = true;
       result = UNDETERMINED;
    }
@@ -303,7 +739,7 @@ game_result GameManager::determine_game_result(Engine *white_engine, Engine *bla
    }
    else if (m_num_moves >= options.max_moves)
    {
-      cout << "Draw due to maximum number of moves reached\n";
+      LogLine(m_slot) << "Draw due to maximum number of moves reached\n";
       result = DRAW;
    }
    else if ((white_result == UNFINISHED) && (black_result == UNFINISHED))
@@ -320,6 +756,37 @@ game_result GameManager::determine_game_result(Engine *white_engine, Engine *bla
    return result;
 }
 
+// PGN is formatted straight into m_pgn, which is cleared (but keeps its memory) for each game, and numbers are printed
+// with to_chars, so no memory is allocated once the buffers have grown to fit a game.
+static void append_uint(string &out, uint64_t n)
+{
+   char buf[24];
+   out.append(buf, to_chars(buf, buf + sizeof(buf), n).ptr - buf);
+}
+
+static void append_tag(string &out, const char *name, string_view value)
+{
+   out += '[';
+   out += name;
+   out += " \"";
+   out += value;
+   out += "\"]\n";
+}
+
+static string_view format_time_control(char *buf, uint moves_to_go, int64_t base_time, int64_t inc_time)
+{
+   char *p = buf;
+   if (moves_to_go)
+   {
+      p = to_chars(p, buf + 64, moves_to_go).ptr;
+      *p++ = '/';
+   }
+   p = to_chars(p, buf + 64, base_time).ptr;
+   *p++ = '+';
+   p = to_chars(p, buf + 64, inc_time).ptr;
+   return string_view(buf, p - buf);
+}
+
 void GameManager::store_pgn(game_result result, const string &white_name, const string &black_name,
                             chrono::milliseconds start_time_ms, chrono::milliseconds increment_ms, chrono::milliseconds fixed_time_ms)
 {
@@ -329,17 +796,22 @@ void GameManager::store_pgn(game_result result, const string &white_name, const
       return;
    }
 
-   stringstream temp_pgn;
-   string result_str;
+   string &pgn = m_pgn;
+   const char *result_str;
    int black_first = 0;
+   char buf[64];
 
+   pgn.clear();
    if (!options.variant.empty())
-      temp_pgn << "[Variant \"" << options.variant << "\"]\n";
+      append_tag(pgn, "Variant", options.variant);
    int64_t base_time_seconds = fixed_time_ms.count() ? 0 : (start_time_ms.count() / 1000);
    int64_t inc_time_seconds = fixed_time_ms.count() ? (fixed_time_ms.count() / 1000) : (increment_ms.count() / 1000);
-   temp_pgn << "[TimeControl \"" << base_time_seconds << "+" << inc_time_seconds << "\"]\n";
-   temp_pgn << "[White \"" << white_name << "\"]\n";
-   temp_pgn << "[Black \"" << black_name << "\"]\n";
+   if (m_engine1.is_search_limited() && m_engine2.is_search_limited())
+      append_tag(pgn, "TimeControl", "-");
+   else
+      append_tag(pgn, "TimeControl", format_time_control(buf, fixed_time_ms.count() ? 0 : options.tc_moves_to_go, base_time_seconds, inc_time_seconds));
+   append_tag(pgn, "White", white_name);
+   append_tag(pgn, "Black", black_name);
 
    if (result == WHITE_WIN)
       result_str = "1-0";
@@ -350,104 +822,124 @@ void GameManager::store_pgn(game_result result, const string &white_name, const
    else
       result_str = "*";
 
-   temp_pgn << "[Result \"" << result_str << "\"]\n";
+   append_tag(pgn, "Result", result_str);
+   if ((m_adjudication[0] != 0) || m_tb_adjudicated)
+      append_tag(pgn, "Termination", "adjudication");
 
    if (!m_fen.empty())
    {
-      temp_pgn << "[SetUp \"1\"]\n";
-      temp_pgn << "[FEN \"" << m_fen << "\"]\n";
+      append_tag(pgn, "SetUp", "1");
+      append_tag(pgn, "FEN", m_fen);
       if (get_color_to_move_from_fen(m_fen) == BLACK)
       {
          black_first = 1;
-         temp_pgn << "\n1... ";
+         pgn += "\n1... ";
       }
    }
-   for (int i = 0; i < m_move_vector.size(); i++)
+   for (int i = 0; i < m_moves.size(); i++)
    {
       int j = i + black_first;
-      if ((j % 10) == 0)
-         temp_pgn << "\n" << ((j / 2) + 1) << ". " << m_move_vector[i];
-      else if ((j % 2) == 0)
-         temp_pgn << " " << ((j / 2) + 1) << ". " << m_move_vector[i];
+      if ((j % 2) == 0)
+      {
+         pgn += ((j % 10) == 0) ? '\n' : ' ';
+         append_uint(pgn, (j / 2) + 1);
+         pgn += ". ";
+      }
       else
-         temp_pgn << " " << m_move_vector[i];
+         pgn += ' ';
+      m_moves.append_move(i, pgn);
    }
 
+   pgn += ' ';
    if ((result == DRAW) && m_repetition_draw)
-      result_str = "{Draw by repetition} 1/2-1/2";
+      pgn += "{Draw by repetition} ";
    else if ((result == DRAW) && m_engine1.m_offered_draw && m_engine2.m_offered_draw)
-      result_str = "{Draw by agreement} 1/2-1/2";
+      pgn += "{Draw by agreement} ";
    else if ((result == DRAW) && (m_num_moves >= options.max_moves))
-      result_str = "{Draw due to max moves reached} 1/2-1/2";
-   else if ((result == DRAW) && options.early_draw && (m_drawish_count >= options.draw_moves))
-      result_str = "{Draw adjudicated} 1/2-1/2";
+      pgn += "{Draw due to max moves reached} ";
+   else if (m_adjudication[0] != 0)
+   {
+      pgn += '{';
+      pgn += m_adjudication;
+      pgn += "} ";
+   }
+   else if ((result == DRAW) && (m_rules_termination[0] != 0))
+   {
+      pgn += "{Draw by ";
+      pgn += m_rules_termination;
+      pgn += "} ";
+   }
+   else if (m_tb_adjudicated)
+      pgn += "{Tablebase adjudication} ";
    else if ((m_loss_on_time) && (result == WHITE_WIN))
-      result_str = "{White wins on time} 1-0";
+      pgn += "{White wins on time} ";
    else if ((m_loss_on_time) && (result == BLACK_WIN))
-      result_str = "{Black wins on time} 0-1";
-
-   temp_pgn << " " << result_str << "\n\n";
-
-   m_pgn = temp_pgn.str();
-   m_pgn_valid.store(true, memory_order_release);
+      pgn += "{Black wins on time} ";
+   pgn += result_str;
+   pgn += "\n\n";
 }
 
 void GameManager::store_pgn4(game_result result, const string &white_name, const string &black_name,
                              chrono::milliseconds start_time_ms, chrono::milliseconds increment_ms, chrono::milliseconds fixed_time_ms)
 {
-   stringstream temp_pgn;
+   string &pgn = m_pgn;
    int first_player = 0;
+   const char *terminal = nullptr;  // PGN4 marks the end of the game like a move
+   char buf[64];
 
    if ((result == WHITE_WIN) || (result == BLACK_WIN))
    {
-      if (m_engine1.m_resigned || m_engine2.m_resigned)
-         m_move_vector.push_back("R"); // resignation
+      if (m_engine1.m_resigned || m_engine2.m_resigned || ((m_adjudication[0] != 0) && (strcmp(m_adjudication, "Mate adjudicated") != 0)))
+         terminal = "R"; // resignation, or adjudicated resignation
       else if (m_loss_on_time)
-         m_move_vector.push_back("T"); // loss on time
+         terminal = "T"; // loss on time
       else
-         m_move_vector.push_back("#"); // checkmate
+         terminal = "#"; // checkmate
    }
    else if (result == DRAW)
    {
       if ((m_repetition_draw) ||
           (m_engine1.m_offered_draw && m_engine2.m_offered_draw) ||
           (m_num_moves >= options.max_moves) ||
-          (options.early_draw && (m_drawish_count >= options.draw_moves)))
-         m_move_vector.push_back("D"); // Draw by repetition, or draw by agreement, or draw adjudicated
+          (m_adjudication[0] != 0))
+         terminal = "D"; // Draw by repetition, or draw by agreement, or draw adjudicated
       else
-         m_move_vector.push_back("S"); // Stalemate or other draw
+         terminal = "S"; // Stalemate or other draw
    }
 
-   temp_pgn << "[Variant \"Teams\"]\n";
-   temp_pgn << "[RuleVariants \"EnPassant\"]\n";
+   pgn.clear();
+   append_tag(pgn, "Variant", "Teams");
+   append_tag(pgn, "RuleVariants", "EnPassant");
    int64_t base_time_minutes = fixed_time_ms.count() ? 0 : (start_time_ms.count() / 60000);
    int64_t inc_time_seconds = fixed_time_ms.count() ? (fixed_time_ms.count() / 1000) : (increment_ms.count() / 1000);
-   temp_pgn << "[TimeControl \"" << base_time_minutes << "+" << inc_time_seconds << "\"]\n";
-   temp_pgn << "[Red \"" << white_name << "\"]\n";
-   temp_pgn << "[Blue \"" << black_name << "\"]\n";
+   append_tag(pgn, "TimeControl", format_time_control(buf, 0, base_time_minutes, inc_time_seconds));
+   append_tag(pgn, "Red", white_name);
+   append_tag(pgn, "Blue", black_name);
 
-   if (result == WHITE_WIN)
-      temp_pgn << "[Result \"1-0\"]\n";
-   else if (result == BLACK_WIN)
-      temp_pgn << "[Result \"0-1\"]\n";
+   if ((result == WHITE_WIN) || (result == BLACK_WIN))
+   {
+      append_tag(pgn, "Result", (result == WHITE_WIN) ? "1-0" : "0-1");
+      if (m_adjudication[0] != 0)
+         append_tag(pgn, "Termination", m_adjudication);
+   }
    else if (result == DRAW)
    {
-      temp_pgn << "[Result \"1/2-1/2\"]\n";
+      append_tag(pgn, "Result", "1/2-1/2");
       if (m_repetition_draw)
-         temp_pgn << "[Termination \"Draw by repetition\"]\n";
+         append_tag(pgn, "Termination", "Draw by repetition");
       else if (m_engine1.m_offered_draw && m_engine2.m_offered_draw)
-         temp_pgn << "[Termination \"Draw by agreement\"]\n";
+         append_tag(pgn, "Termination", "Draw by agreement");
       else if (m_num_moves >= options.max_moves)
-         temp_pgn << "[Termination \"Draw due to max moves reached\"]\n";
-      else if (options.early_draw && (m_drawish_count >= options.draw_moves))
-         temp_pgn << "[Termination \"Draw adjudicated\"]\n";
+         append_tag(pgn, "Termination", "Draw due to max moves reached");
+      else if (m_adjudication[0] != 0)
+         append_tag(pgn, "Termination", m_adjudication);
    }
    else
-      temp_pgn << "[Result \"*\"]\n";
+      append_tag(pgn, "Result", "*");
 
    if (!m_fen.empty())
    {
-      temp_pgn << "[StartFen4 \"" << m_fen << "\"]\n";
+      append_tag(pgn, "StartFen4", m_fen);
       if (m_fen.rfind("R-", 0) == 0)
          first_player = 0;
       else if (m_fen.rfind("B-", 0) == 0)
@@ -457,103 +949,438 @@ void GameManager::store_pgn4(game_result result, const string &white_name, const
       else if (m_fen.rfind("G-", 0) == 0)
          first_player = 3;
    }
-   for (int i = 0; i < m_move_vector.size(); i++)
+   size_t num_moves = m_moves.size() + (terminal ? 1 : 0);
+   for (int i = 0; i < num_moves; i++)
    {
       int j = i + first_player;
-      convert_move_to_PGN4_format(m_move_vector[i]);
       if (((j % 4) == 0) || (i == 0))
-         temp_pgn << "\n" << ((j / 4) + 1) << ". " << m_move_vector[i];
+      {
+         pgn += '\n';
+         append_uint(pgn, (j / 4) + 1);
+         pgn += ". ";
+      }
+      else
+         pgn += " .. ";
+      if (i < m_moves.size())
+         m_moves.append_pgn4_move(i, pgn);
       else
-         temp_pgn << " .. " << m_move_vector[i];
+         pgn += terminal;
    }
-   temp_pgn << "\n\n";
-
-   m_pgn = temp_pgn.str();
-   m_pgn_valid.store(true, memory_order_release);
+   pgn += "\n\n";
 }
 
 void GameManager::move_played(const string &move)
 {
-   m_move_list.append(move + " ");
-   m_move_vector.push_back(move);
+   m_move_list.append(move);
+   m_move_list.push_back(' ');
+   m_moves.add(move);
+   m_repetition.add_ply(hash_string(move));
    m_num_moves++;
+   log_set_ply(m_num_moves);
+}
+
+// start_rules_tracking sets up the harness's own board for the new game, if rules are enabled and available.
+// Standard chess positions are also tracked for tablebase adjudication.
+int GameManager::start_rules_tracking(void)
+{
+   if (options.fourplayerchess)
+      m_rules_active = options.use_rules;
+   else
+      m_rules_active = options.variant.empty() && (options.use_rules || !options.syzygy_path.empty());
+   if (!m_rules_active)
+      return 1;
+
+   if (options.fourplayerchess)
+   {
+      if (m_fen.empty())
+         m_board4pc.set_start_position();
+      else if (m_board4pc.set_fen4(m_fen) == 0)
+      {
+         LogLine(m_slot) << "Error: invalid FEN4 (" << m_board4pc.get_error() << "): " << m_fen << "\n";
+         return 0;
+      }
+   }
+   else
+   {
+      if (m_fen.empty())
+         m_chessboard.set_start_position();
+      else if (m_chessboard.set_fen(m_fen) == 0)
+      {
+         if (options.use_rules)
+         {
+            LogLine(m_slot) << "Error: invalid FEN (" << m_chessboard.get_error() << "): " << m_fen << "\n";
+            return 0;
+         }
+         LogLine(m_slot) << "Warning: tablebase adjudication disabled for this game, FEN not supported (" << m_chessboard.get_error() << "): " << m_fen << "\n";
+         m_rules_active = false;
+      }
+   }
+   return 1;
+}
+
+// play_opening_moves plays the opening's book moves (if any), before the engines take over. They're part of the game
+// (move list, PGN, repetition and rules tracking), but take no time off the clocks. Returns 0 if a move is illegal.
+int GameManager::play_opening_moves(void)
+{
+   if (m_opening_moves.empty())
+      return 1;
+   vector<string> moves = get_tokens(m_opening_moves);
+   for (const string &move : moves)
+   {
+      move_played(move);
+      if (m_rules_active)
+      {
+         int applied = options.fourplayerchess ? m_board4pc.apply_move(move) : m_chessboard.apply_move(move);
+         if (applied == 0)
+         {
+            LogLine(m_slot) << "Error: illegal opening move " << move << "\n";
+            return 0;
+         }
+      }
+      m_turn = (m_turn == WHITE) ? BLACK : WHITE;
+   }
+   return 1;
+}
+
+// check_move_with_rules applies the move to the harness's own board, if rules tracking is active.
+// It returns ERROR_ILLEGAL_MOVE for an illegal move, the game result if the move ended the game, or UNFINISHED.
+game_result GameManager::check_move_with_rules(Engine *engine, const string &move)
+{
+   game_result result;
+
+   if (!m_rules_active)
+      return UNFINISHED;
+
+   if (options.fourplayerchess)
+   {
+      if (m_board4pc.apply_move(move) == 0)
+      {
+         LogLine(m_slot, engine->m_number) << "Illegal move " << move << " played by " << engine->m_name << "\n";
+         m_error = true;
+         return ERROR_ILLEGAL_MOVE;
+      }
+      return m_board4pc.get_game_result();
+   }
+
+   if (m_chessboard.apply_move(move) == 0)
+   {
+      if (options.use_rules)
+      {
+         LogLine(m_slot, engine->m_number) << "Illegal move " << move << " played by " << engine->m_name << "\n";
+         m_error = true;
+         return ERROR_ILLEGAL_MOVE;
+      }
+      LogLine(m_slot) << "Warning: tablebase adjudication disabled for this game, could not apply move " << move << "\n";
+      m_rules_active = false;
+      return UNFINISHED;
+   }
+
+   if (options.use_rules)
+   {
+      result = m_chessboard.get_game_result();
+      if (result == DRAW)
+      {
+         m_rules_termination = m_chessboard.get_result_reason();
+         m_repetition_draw = (strcmp(m_rules_termination, "repetition") == 0);
+         LogLine(m_slot) << "Draw by " << m_rules_termination << " (# moves = " << m_num_moves << ")\n";
+      }
+      if (result != UNFINISHED)
+         return result;
+   }
+
+   if (!options.syzygy_path.empty())
+   {
+      result = tablebase_probe_wdl(m_chessboard);
+      if (result != UNFINISHED)
+      {
+         LogLine(m_slot) << "Tablebase adjudication (# moves = " << m_num_moves << ")\n";
+         m_tb_adjudicated = true;
+         return result;
+      }
+   }
+   return UNFINISHED;
 }
 
 game_result GameManager::check_for_adjudication(Engine *white_engine, Engine *black_engine)
 {
    if (white_engine->m_offered_draw && black_engine->m_offered_draw)
    {
-      cout << "Draw by agreement (# moves = " << m_num_moves << ")\n";
+      LogLine(m_slot) << "Draw by agreement (# moves = " << m_num_moves << ")\n";
       return DRAW;
    }
    if (check_for_repetition_draw())
    {
-      cout << "Draw by repetition (# moves = " << m_num_moves << ")\n";
+      LogLine(m_slot) << "Draw by repetition (# moves = " << m_num_moves << ")\n";
       m_repetition_draw = true;
       return DRAW;
    }
    if (options.early_win)
    {
       if (white_engine->is_checkmating() && black_engine->is_getting_checkmated())
+      {
+         m_adjudication = "Mate adjudicated";
          return WHITE_WIN;
+      }
       if (black_engine->is_checkmating() && white_engine->is_getting_checkmated())
+      {
+         m_adjudication = "Mate adjudicated";
          return BLACK_WIN;
+      }
    }
-   if (options.early_draw && (m_num_moves > 40))
+
+   if (m_num_moves == 0)
+      return UNFINISHED;
+
+   // Only the engine that just moved has a new score, so each side's counts are advanced on its own moves.
+   if (m_turn == WHITE)
+      update_adjudication_counts(black_engine, BLACK);
+   else
+      update_adjudication_counts(white_engine, WHITE);
+
+   if (options.early_resign)
    {
-      if (white_engine->is_drawish() && black_engine->is_drawish())
-         m_drawish_count++;
-      else
-         m_drawish_count = 0;
-      if (m_drawish_count >= options.draw_moves)
+      if ((m_losing_count[WHITE] >= options.resign_moves) && (m_winning_count[BLACK] >= options.resign_moves))
+      {
+         LogLine(m_slot) << "Adjudicated " << (options.fourplayerchess ? "Red/Yellow" : "White") << " resignation (# moves = " << m_num_moves << ")\n";
+         m_adjudication = options.fourplayerchess ? "Red/Yellow resign (adjudicated)" : "White resigns (adjudicated)";
+         return BLACK_WIN;
+      }
+      if ((m_losing_count[BLACK] >= options.resign_moves) && (m_winning_count[WHITE] >= options.resign_moves))
       {
-         cout << "Adjudicated draw (# moves = " << m_num_moves << ")\n";
-         return DRAW;
+         LogLine(m_slot) << "Adjudicated " << (options.fourplayerchess ? "Blue/Green" : "Black") << " resignation (# moves = " << m_num_moves << ")\n";
+         m_adjudication = options.fourplayerchess ? "Blue/Green resign (adjudicated)" : "Black resigns (adjudicated)";
+         return WHITE_WIN;
       }
    }
+   // Both engines' scores must be drawish: each side's streak must cover its half of the "drawmoves" moves.
+   if (options.early_draw && (min(m_drawish_count[WHITE], m_drawish_count[BLACK]) * 2 >= options.draw_moves))
+   {
+      LogLine(m_slot) << "Adjudicated draw (# moves = " << m_num_moves << ")\n";
+      m_adjudication = "Draw adjudicated";
+      return DRAW;
+   }
 
    return UNFINISHED;
 }
 
+void GameManager::update_adjudication_counts(Engine *engine, player_color color)
+{
+   // Drawish moves only count once "drawstart" moves have been played.
+   if (engine->is_drawish() && (m_num_moves > options.draw_start))
+      m_drawish_count[color]++;
+   else
+      m_drawish_count[color] = 0;
+   if (engine->is_resigning())
+      m_losing_count[color]++;
+   else
+      m_losing_count[color] = 0;
+   if (engine->is_winning())
+      m_winning_count[color]++;
+   else
+      m_winning_count[color] = 0;
+}
+
 // check_for_repetition_draw will detect if both sides are repeating moves over and over.
 // if true is returned, then there has definitely been a 3-fold (or more) repetition of position.
 bool GameManager::check_for_repetition_draw(void)
 {
-   uint length_for_repeating_sequence = (options.fourplayerchess) ? 8 : 4;
-   if (m_num_moves > length_for_repeating_sequence * 5)
+   return m_repetition.repetition_detected();
+}
+
+RepetitionDetector::RepetitionDetector(void)
+{
+   m_min_cycle = 4;
+   m_max_cycle = 4;
+   m_cycle_step = 2;
+   reset();
+}
+
+// Cycle lengths min_cycle, min_cycle + cycle_step, ... up to max_cycle (plies) are checked.
+void RepetitionDetector::configure(uint min_cycle, uint max_cycle, uint cycle_step)
+{
+   if (cycle_step == 0)
+      cycle_step = 1;
+   if (min_cycle == 0)
+      min_cycle = cycle_step;
+   if (min_cycle > MAX_REPETITION_CYCLE)
+      min_cycle = MAX_REPETITION_CYCLE;
+   if (max_cycle < min_cycle)
+      max_cycle = min_cycle;
+   if (max_cycle > MAX_REPETITION_CYCLE)
+      max_cycle = MAX_REPETITION_CYCLE;
+   m_min_cycle = min_cycle;
+   m_max_cycle = max_cycle;
+   m_cycle_step = cycle_step;
+   reset();
+}
+
+void RepetitionDetector::reset(void)
+{
+   m_num_plies = 0;
+   m_detected_cycle = 0;
+   for (uint p = 0; p <= MAX_REPETITION_CYCLE; p++)
+      m_run[p] = 0;
+}
+
+// add_ply returns true if the ply just added completes a threefold repetition of a move cycle.
+bool RepetitionDetector::add_ply(uint64_t hash)
+{
+   uint index = m_num_plies % MAX_REPETITION_CYCLE;
+
+   for (uint p = m_min_cycle; p <= m_max_cycle; p += m_cycle_step)
+   {
+      if ((m_num_plies >= p) && (m_ring[(m_num_plies - p) % MAX_REPETITION_CYCLE] == hash))
+      {
+         if (++m_run[p] >= (2 * p))
+            m_detected_cycle = p;
+      }
+      else
+         m_run[p] = 0;
+   }
+
+   // The ring entry for this ply is overwritten only after the comparisons above,
+   // since for p == MAX_REPETITION_CYCLE it still holds the move from p plies ago.
+   m_ring[index] = hash;
+   m_num_plies++;
+
+   return (m_detected_cycle != 0);
+}
+
+#define MOVE_TEXT_FLAG  0x80000000u  // the record is an offset into m_text, rather than a packed coordinate move
+
+MoveArena::MoveArena(void)
+{
+   m_moves.reserve(1024);
+   m_text.reserve(256);
+}
+
+void MoveArena::clear(void)
+{
+   m_moves.clear();
+   m_text.clear();
+}
+
+// parse_square reads a square name ("a1" .. "n14") at move[i], and returns its file and rank (0 based) packed in 8 bits,
+// or -1. Only names that print back exactly the same are accepted, e.g. not "a01".
+static int parse_square(const string &move, size_t &i)
+{
+   if ((i + 1 >= move.length()) || (move[i] < 'a') || (move[i] > 'n') || (move[i + 1] < '1') || (move[i + 1] > '9'))
+      return -1;
+   int file = move[i] - 'a';
+   int rank = move[i + 1] - '1';
+   i += 2;
+   if ((rank == 0) && (i < move.length()) && (move[i] >= '0') && (move[i] <= '4'))
+      rank = 9 + (move[i++] - '0');
+   return file | (rank << 4);
+}
+
+static char *print_square(char *p, uint32_t square)
+{
+   uint rank = ((square >> 4) & 0xF) + 1;
+   *p++ = 'a' + (square & 0xF);
+   if (rank >= 10)
+      *p++ = '1';
+   *p++ = '0' + (rank % 10);
+   return p;
+}
+
+void MoveArena::add(const string &move)
+{
+   size_t i = 0;
+   int from = parse_square(move, i);
+   int to = (from < 0) ? -1 : parse_square(move, i);
+   if (to >= 0)
    {
-      string move_sequence;
+      uint32_t record = from | (to << 8);
+      if ((i + 1 == move.length()) && (move[i] >= 'a') && (move[i] <= 'z'))
+         record |= (move[i++] - 'a' + 1) << 16;
+      if (i == move.length())
+      {
+         m_moves.push_back(record);
+         return;
+      }
+   }
 
-      for (uint i = m_num_moves - length_for_repeating_sequence; i < m_num_moves; i++)
-         move_sequence.append(m_move_vector[i] + " ");
+   m_moves.push_back(MOVE_TEXT_FLAG | (uint32_t)m_text.length());
+   m_text.append(move);
+   m_text.push_back('\0');
+}
 
-      size_t pos = m_move_list.length() - (3 * move_sequence.length());
-      if (m_move_list.find(move_sequence + move_sequence + move_sequence, pos) != string::npos)
-         return true;
+// append_move appends the i'th move's text to out.
+void MoveArena::append_move(size_t i, string &out) const
+{
+   uint32_t record = m_moves[i];
+   if (record & MOVE_TEXT_FLAG)
+   {
+      out += m_text.c_str() + (record & ~MOVE_TEXT_FLAG);
+      return;
    }
-   return false;
+
+   char buf[MOVE_TEXT_MAX];
+   char *p = print_square(buf, record);
+   p = print_square(p, record >> 8);
+   if (record >> 16)
+      *p++ = 'a' + (record >> 16) - 1;
+   out.append(buf, p - buf);
+}
+
+// append_pgn4_move appends the i'th move to out in PGN4 format (see append_PGN4_move).
+void MoveArena::append_pgn4_move(size_t i, string &out) const
+{
+   uint32_t record = m_moves[i];
+   if (record & MOVE_TEXT_FLAG)
+   {
+      append_PGN4_move(out, m_text.c_str() + (record & ~MOVE_TEXT_FLAG));
+      return;
+   }
+
+   char buf[MOVE_TEXT_MAX];
+   char *p = print_square(buf, record);
+   *p++ = '-';
+   p = print_square(p, record >> 8);
+   if (record >> 16)
+   {
+      *p++ = '=';
+      *p++ = 'A' + (record >> 16) - 1;
+   }
+   out.append(buf, p - buf);
 }
 
 // PGN4 / chess.com format uses dashes, e.g. "h2-h3" instead of "h2h3"
 // PGN4 / chess.com format uses equals sign followed by capital letter for promotion, e.g. "j5-j4=Q" instead of "j5j4q"
-void convert_move_to_PGN4_format(string &move)
+// append_PGN4_move appends move to out in PGN4 format, converting it as it's copied.
+void append_PGN4_move(string &out, string_view move)
 {
-   // first, insert dash character if needed
-   size_t i = 0;
-   if ((move.find("-") != string::npos) || (move.length() == 1))
+   if ((move.find('-') != string_view::npos) || (move.length() <= 1))
+   {
+      out += move;
       return;
-   while (isalpha(move[i]))
+   }
+
+   // a dash goes after the from square
+   size_t i = 0;
+   while ((i < move.length()) && isalpha((unsigned char)move[i]))
       i++;
-   while (isdigit(move[i]))
+   while ((i < move.length()) && isdigit((unsigned char)move[i]))
       i++;
-   if ((i == 2) || (i == 3))
-      move.insert(i, "-");
+   bool dash = ((i == 2) || (i == 3));
 
-   // second, check for promotion move
-   i = move.length() - 1;
-   if (isalpha(move[i]) && move[i] != 'O') // O would indicate castling: O-O or O-O-O
+   // a promotion piece is the last character. O would indicate castling: O-O or O-O-O
+   size_t last = move.length() - 1;
+   bool promotion = isalpha((unsigned char)move[last]) && (move[last] != 'O') && !(dash && (i == move.length()));
+   size_t end = promotion ? last : move.length();
+
+   if (dash)
+   {
+      out += move.substr(0, i);
+      out += '-';
+      out += move.substr(i, end - i);
+   }
+   else
+      out += move.substr(0, end);
+   if (promotion)
    {
-      move.insert(i, "=");
-      move[i + 1] = toupper(move[i + 1]);
+      out += '=';
+      out += (char)toupper((unsigned char)move[last]);
    }
 }
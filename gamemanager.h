@@ -1,55 +1,152 @@
+#pragma once
 #include "engine.h"
+#include "board4pc.h"
+#include "chessboard.h"
+#include "logger.h"
+#include "metrics.h"
+#include "openingbook.h"
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <functional>
+#include <string_view>
+#include <charconv>
 
-void convert_move_to_PGN4_format(string &move);
+#define MAX_REPETITION_CYCLE 64
+
+void append_PGN4_move(string &out, string_view move);
+
+// RepetitionDetector detects players repeating a cycle of moves, without knowing the rules of the game.
+// Each ply's move is reduced to a 64-bit hash and kept in a small ring buffer. For every cycle length p being checked,
+// m_run[p] counts how many of the most recent plies repeated the move played p plies earlier. Once that count
+// reaches 2p, the last 3p plies are the same p-ply sequence played three times in a row. This is O(1) per ply for
+// each cycle length, no matter how long the game is.
+class RepetitionDetector
+{
+private:
+   uint64_t m_ring[MAX_REPETITION_CYCLE];
+   uint m_run[MAX_REPETITION_CYCLE + 1];
+   uint m_num_plies;
+   uint m_min_cycle;
+   uint m_max_cycle;
+   uint m_cycle_step;
+   uint m_detected_cycle;
+
+public:
+   RepetitionDetector(void);
+   void configure(uint min_cycle, uint max_cycle, uint cycle_step);
+   void reset(void);
+   bool add_ply(uint64_t hash);
+   bool repetition_detected(void) { return (m_detected_cycle != 0); }
+   uint detected_cycle(void) { return m_detected_cycle; }
+};
+
+#define MOVE_TEXT_MAX 16         // longest coordinate move text: "a10n14q"
+
+// MoveArena holds the moves of a game as 32-bit records. A coordinate move (e.g. "e2e4", "e7e8q", "a10n14q", on
+// boards up to 14x14) is packed as from file/rank, to file/rank and promotion letter. Anything else (e.g. "O-O", "P@e4")
+// is kept as text in m_text, and its record holds the text's offset and length. Each game slot has one arena that is
+// cleared but never shrunk, so after the first few games no memory is allocated for moves.
+class MoveArena
+{
+private:
+   vector<uint32_t> m_moves;
+   string m_text;
+
+public:
+   MoveArena(void);
+   void clear(void);
+   void add(const string &move);
+   size_t size(void) const { return m_moves.size(); }
+   void append_move(size_t i, string &out) const;
+   void append_pgn4_move(size_t i, string &out) const;
+};
 
 class GameManager
 {
+   friend class MicroBench;
+
 public:
    Engine m_engine1;
    Engine m_engine2;
-   uint m_engine1_wins;
-   uint m_engine2_wins;
-   uint m_draws;
-   uint m_engine1_losses_on_time;
-   uint m_engine2_losses_on_time;
-   uint m_illegal_move_games;
-   bool m_thread_running;
+   uint m_slot;                 // index of this game manager in the match manager
+   SlotMetrics *m_metrics;      // this slot's result counters and metrics (owned by the match manager)
+   ResultCounters *m_match_totals;
+   atomic<bool> m_thread_running;
    bool m_swap_sides;
-   bool m_error;
-   bool m_engine_disconnected;
+   atomic<bool> m_error;
+   atomic<bool> m_engine_disconnected;
    string m_fen;
+   string m_opening_moves;      // the book's moves from m_fen, played before the engines take over, e.g. "e2e4 e7e5"
    string m_pgn;
-   atomic<bool> m_pgn_valid;
+   function<bool(uint slot, book_position &opening, bool &swap_sides)> m_claim_next_game;   // gets the slot's next game from the match
+                                                                                             // manager, or returns false if there isn't
+                                                                                             // one to play now
+   function<void(Engine *engine)> m_configure_engine;  // sends the engine's options, after it was restarted
 
 private:
-   string m_move_list;
-   vector<string> m_move_vector;
+   string m_move_list;          // the moves in engine command format, e.g. "e2e4 e7e5 "
+   MoveArena m_moves;
    player_color m_turn;
    uint m_num_moves;
-   uint m_drawish_count;
+   uint m_drawish_count[2];     // consecutive moves by each side with a drawish score
+   uint m_losing_count[2];      // consecutive moves by each side with a score <= -resignscore
+   uint m_winning_count[2];     // consecutive moves by each side with a score >= resignscore
+   const char *m_adjudication;  // description of the score based adjudication that ended the game, or ""
+   RepetitionDetector m_repetition;
+   Board4pc m_board4pc;
+   ChessBoard m_chessboard;
+   bool m_rules_active;         // true if the harness is tracking the game with its own board
+   bool m_tb_adjudicated;
+   const char *m_rules_termination;
    bool m_loss_on_time;
+   const char *m_forfeit;       // why the game was lost by an engine that had to be restarted ("hang", "resource limit"), or ""
+   bool m_engine_hung[2];       // index: engine (FIRST, SECOND). The engine didn't reply in time, and was restarted.
+   bool m_limit_breached[2];    // index: engine. The engine's process ended at its resource limits, and was restarted.
    bool m_repetition_draw;
    chrono::time_point<std::chrono::steady_clock> m_timestamp; // This timestamp is updated whenever either engine's clock should start running.
                                                               // It's also updated when game_runner starts running.
    chrono::milliseconds m_white_clock_ms;
    chrono::milliseconds m_black_clock_ms;
+   bool m_new_game_requested;   // both engines were already sent the new game command, while the last game was finishing
+   chrono::time_point<std::chrono::steady_clock> m_game_end_time;   // when the slot's last game ended, for measuring idle time
+   mutex m_pgn_mutex;
+   string m_pgn_pending;        // finished games' PGN, not yet taken by the match manager
 
 public:
    GameManager(void);
    ~GameManager(void);
-   void game_runner(void);
-   bool is_engine_unresponsive(void);
+   void new_match(void);
+   Task<void> game_runner(void);
+   void kill_hung_engines(void);
+   void take_pgn(string &pgn);
 
 private:
-   game_result run_engine_game(chrono::milliseconds start_time_ms, chrono::milliseconds increment_ms, chrono::milliseconds fixed_time_ms);
+   Task<int> request_new_game(void);
+   void publish_pgn(void);
+   void publish_game_start(Engine *white_engine, Engine *black_engine);
+   void publish_move(Engine *engine, player_color color, chrono::milliseconds elapsed_time_ms, chrono::milliseconds clock_ms);
+   void publish_game_end(game_result result);
+   string termination_reason(game_result result);
+   chrono::steady_clock::time_point move_deadline(Engine *engine, chrono::milliseconds clock_ms);
+   int restart_failed_engine(Engine *engine);
+   Task<int> recover_engine(Engine *engine);
+   Task<game_result> forfeit_game(Engine *engine, Engine *opponent, game_result result);
+   Task<game_result> run_engine_game(chrono::milliseconds start_time_ms, chrono::milliseconds increment_ms, chrono::milliseconds fixed_time_ms);
    game_result determine_game_result(Engine *white_engine, Engine *black_engine);
+   chrono::milliseconds get_move_time(void);
+   chrono::milliseconds add_time(chrono::milliseconds clock_ms, uint moves_made, chrono::milliseconds start_time_ms,
+                                 chrono::milliseconds increment_ms, chrono::milliseconds fixed_time_ms);
+   uint moves_to_go(uint moves_made);
    void store_pgn(game_result result, const string &white_name, const string &black_name,
                   chrono::milliseconds start_time_ms, chrono::milliseconds increment_ms, chrono::milliseconds fixed_time_ms);
    void store_pgn4(game_result result, const string &white_name, const string &black_name,
                    chrono::milliseconds start_time_ms, chrono::milliseconds increment_ms, chrono::milliseconds fixed_time_ms);
    void move_played(const string &move);
+   int start_rules_tracking(void);
+   int play_opening_moves(void);
+   game_result check_move_with_rules(Engine *engine, const string &move);
    bool check_for_repetition_draw(void);
    game_result check_for_adjudication(Engine *white_engine, Engine *black_engine);
+   void update_adjudication_counts(Engine *engine, player_color color);
 };
@@ -0,0 +1,337 @@
+#include "logger.h"
+#include "trace.h"
+#include "events.h"
+#include <thread>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+static LogRing *log_rings = nullptr;    // ring 0 is shared by threads that aren't running a game, ring s + 1 is for slot s
+static uint log_num_rings = 0;
+static atomic_flag log_shared_lock = ATOMIC_FLAG_INIT;
+static atomic<bool> log_running(false);
+static thread log_sink_thread;
+static uint log_sinks = LOG_CONSOLE;
+static ofstream log_files[2];
+static ofstream log_trace_file;
+static chrono::steady_clock::time_point log_start_time;
+
+static thread_local uint t_ring = 0;
+static thread_local uint t_ply = 0;
+
+struct log_entry
+{
+   uint64_t time_us;
+   int slot;
+   int engine;
+   uint ply;
+   log_level level;
+   string text;
+};
+
+static void log_sink(void);
+static void log_output(vector<log_entry> &entries);
+
+LogRing::LogRing(void)
+{
+   m_head = 0;
+   m_tail = 0;
+}
+
+// push is only called by the ring's producer. It returns false if the ring is full.
+bool LogRing::push(const log_record &record)
+{
+   uint head = m_head.load(memory_order_relaxed);
+   if ((head - m_tail.load(memory_order_acquire)) >= LOG_RING_SIZE)
+      return false;
+   m_records[head & (LOG_RING_SIZE - 1)] = record;
+   m_head.store(head + 1, memory_order_release);
+   return true;
+}
+
+// free_records is only called by the ring's producer.
+uint LogRing::free_records(void)
+{
+   return LOG_RING_SIZE - (m_head.load(memory_order_relaxed) - m_tail.load(memory_order_acquire));
+}
+
+// peek and pop are only called by the sink thread.
+const log_record *LogRing::peek(void)
+{
+   uint tail = m_tail.load(memory_order_relaxed);
+   if (tail == m_head.load(memory_order_acquire))
+      return nullptr;
+   return &m_records[tail & (LOG_RING_SIZE - 1)];
+}
+
+void LogRing::pop(void)
+{
+   m_tail.store(m_tail.load(memory_order_relaxed) + 1, memory_order_release);
+}
+
+// Each thread reuses its LogLine buffers, so a log statement doesn't allocate once they have grown. A statement made
+// while another one is being written (e.g. by a function called in its arguments) takes the next buffer.
+static thread_local vector<unique_ptr<ostringstream>> log_line_buffers;
+static thread_local size_t log_line_depth = 0;
+
+LogLine::LogLine(int slot, int engine, log_level level)
+{
+   m_slot = slot;
+   m_engine = engine;
+   m_level = level;
+
+   if (log_line_depth == log_line_buffers.size())
+      log_line_buffers.push_back(make_unique<ostringstream>());
+   m_stream = log_line_buffers[log_line_depth++].get();
+   m_stream->str("");
+   m_stream->clear();
+   m_stream->flags(ios_base::skipws | ios_base::dec);
+   m_stream->precision(6);
+}
+
+LogLine::~LogLine(void)
+{
+   string text = m_stream->str();
+   log_line_depth--;
+   log_write(m_slot, m_engine, m_level, text.c_str(), text.length());
+}
+
+// log_open_trace opens the trace file for --record. It must be called before log_start.
+int log_open_trace(const string &file_name, const vector<string> &args)
+{
+   log_trace_file.open(file_name, ios::out | ios::binary);
+   if (!log_trace_file.is_open() || (trace_write_header(log_trace_file, args) == 0))
+   {
+      cout << "Error: could not open trace file " << file_name << "\n";
+      return 0;
+   }
+   return 1;
+}
+
+bool log_tracing(void)
+{
+   return log_trace_file.is_open();
+}
+
+int log_start(uint num_slots, uint sinks, const string &file_prefix)
+{
+   log_sinks = sinks;
+   if (log_sinks & LOG_FILES)
+   {
+      for (int i = 0; i < 2; i++)
+      {
+         string file_name = file_prefix + to_string(i + 1) + ".log";
+         log_files[i].open(file_name, ios::out);
+         if (!log_files[i].is_open())
+         {
+            cout << "Error: could not open log file " << file_name << "\n";
+            return 0;
+         }
+      }
+   }
+
+   log_num_rings = num_slots + 1;
+   log_rings = new LogRing[log_num_rings];
+   log_start_time = chrono::steady_clock::now();
+   log_running = true;
+   log_sink_thread = thread(log_sink);
+   return 1;
+}
+
+// log_stop writes out everything that has been logged, and stops the sink thread.
+// It must only be called once no game threads are running.
+void log_stop(void)
+{
+   if (!log_running)
+      return;
+   log_running.store(false, memory_order_release);
+   log_sink_thread.join();
+   for (int i = 0; i < 2; i++)
+      if (log_files[i].is_open())
+         log_files[i].close();
+   if (log_trace_file.is_open())
+      log_trace_file.close();
+   delete[] log_rings;
+   log_rings = nullptr;
+}
+
+// log_attach_slot is called by a game (on its worker thread), so it can log to its slot's own ring without locking.
+void log_attach_slot(int slot)
+{
+   t_ring = ((slot >= 0) && ((uint)slot + 1 < log_num_rings)) ? (slot + 1) : 0;
+   t_ply = 0;
+}
+
+void log_set_ply(uint ply)
+{
+   t_ply = ply;
+}
+
+log_context log_get_context(void)
+{
+   return log_context{t_ring, t_ply};
+}
+
+void log_set_context(const log_context &context)
+{
+   t_ring = context.ring;
+   t_ply = context.ply;
+}
+
+void log_write(int slot, int engine, log_level level, const char *text, size_t length)
+{
+   if (!log_running.load(memory_order_acquire))
+   {
+      // before log_start or after log_stop
+      if (level >= LOG_TRACE_TO)
+         return;
+      cout.write(text, length);
+      cout.flush();
+      return;
+   }
+
+   log_record record;
+   record.time_us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - log_start_time).count();
+   record.slot = slot;
+   record.engine = engine;
+   record.level = level;
+   record.ply = t_ply;
+
+   LogRing &ring = log_rings[t_ring];
+   bool shared = (t_ring == 0);
+   if (shared)
+      while (log_shared_lock.test_and_set(memory_order_acquire))
+         this_thread::yield();
+
+   // an event is never waited for: it's dropped if it doesn't fit
+   if ((level == LOG_EVENT) && (ring.free_records() < (length + LOG_TEXT_SIZE - 1) / LOG_TEXT_SIZE))
+   {
+      if (shared)
+         log_shared_lock.clear(memory_order_release);
+      return;
+   }
+
+   do
+   {
+      size_t n = min(length, (size_t)LOG_TEXT_SIZE);
+      memcpy(record.text, text, n);
+      record.length = n;
+      record.continued = (n < length);
+      while (!ring.push(record))
+         this_thread::yield(); // ring is full, wait for the sink thread to catch up
+      text += n;
+      length -= n;
+   } while (length > 0);
+
+   if (shared)
+      log_shared_lock.clear(memory_order_release);
+}
+
+static void log_sink(void)
+{
+   vector<log_entry> entries;
+   vector<string> partial_text(log_num_rings);
+
+   while (true)
+   {
+      bool stopping = !log_running.load(memory_order_acquire);
+
+      for (uint r = 0; r < log_num_rings; r++)
+      {
+         const log_record *record;
+         while ((record = log_rings[r].peek()) != nullptr)
+         {
+            partial_text[r].append(record->text, record->length);
+            if (!record->continued)
+            {
+               entries.push_back({record->time_us, record->slot, record->engine, record->ply, (log_level)record->level, move(partial_text[r])});
+               partial_text[r].clear();
+            }
+            log_rings[r].pop();
+         }
+      }
+
+      if (entries.empty())
+      {
+         if (stopping)
+            break;
+         this_thread::sleep_for(2ms);
+         continue;
+      }
+
+      // Each ring is already in order, but the rings need to be merged.
+      stable_sort(entries.begin(), entries.end(), [](const log_entry &a, const log_entry &b) { return a.time_us < b.time_us; });
+      log_output(entries);
+      entries.clear();
+   }
+}
+
+// publish_error_event publishes an "error" event for each error message (a line starting with "Error").
+static void publish_error_event(const log_entry &e)
+{
+   size_t start = e.text.find_first_not_of('\n');
+   if ((start == string::npos) || (e.text.compare(start, 5, "Error") != 0))
+      return;
+   size_t end = e.text.find_last_not_of('\n');
+   ostringstream event;
+   event << "{\"event\":\"error\",\"slot\":" << e.slot << ",\"engine\":" << e.engine + 1 << ",\"message\":"
+         << json_string{e.text.substr(start, end + 1 - start)} << "}";
+   events_publish(e.time_us, event.str());
+}
+
+static void log_output(vector<log_entry> &entries)
+{
+   string console_text;
+   bool file_written[2] = {false, false};
+   bool trace_written = false;
+
+   for (size_t i = 0; i < entries.size(); i++)
+   {
+      log_entry &e = entries[i];
+      if (e.level == LOG_EVENT)
+      {
+         events_publish(e.time_us, e.text);
+         continue;
+      }
+      if ((e.level == LOG_INFO) && events_enabled())
+         publish_error_event(e);
+      if (e.level >= LOG_TRACE_TO)
+      {
+         trace_write_record(log_trace_file, e.time_us, e.slot, e.engine, e.level, e.text);
+         trace_written = true;
+         continue;
+      }
+
+      string tags;
+      if ((e.level == LOG_DEBUG) || ((log_sinks & LOG_FILES) && (e.engine >= 0)))
+      {
+         char buf[64];
+         snprintf(buf, sizeof(buf), "[%llu.%03llu slot %d ply %u] ", (unsigned long long)(e.time_us / 1000000),
+                  (unsigned long long)((e.time_us / 1000) % 1000), e.slot, e.ply);
+         tags = buf;
+      }
+
+      if (e.level == LOG_INFO)
+         console_text += e.text;
+      else if (log_sinks & LOG_CONSOLE)
+         console_text += tags + e.text;
+
+      if ((log_sinks & LOG_FILES) && (e.engine >= 0) && (e.engine < 2))
+      {
+         log_files[e.engine] << tags << e.text;
+         file_written[e.engine] = true;
+      }
+   }
+
+   if (!console_text.empty())
+   {
+      cout << console_text;
+      cout.flush();
+   }
+   for (int i = 0; i < 2; i++)
+      if (file_written[i])
+         log_files[i].flush();
+   if (trace_written)
+      log_trace_file.flush();
+}
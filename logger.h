@@ -0,0 +1,111 @@
+#pragma once
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+
+using namespace std;
+
+typedef unsigned int uint;
+
+// All console and log file output goes through the logger, so game threads never block on cout.
+// Each game slot has its own single-producer ring of log records, which a background sink thread drains,
+// orders by timestamp, and writes to the selected sinks. Threads that aren't running a game (the main thread)
+// share ring 0, which is protected by a spinlock.
+// Every record is tagged with the slot, engine, ply (of the slot's current game) and a timestamp.
+
+#define LOG_NO_SLOT       -1
+#define LOG_NO_ENGINE     -1
+#define LOG_RING_SIZE     512    // records per ring (must be a power of 2)
+#define LOG_TEXT_SIZE     232    // text bytes per record. Longer text is split over several records.
+
+// log sinks
+#define LOG_CONSOLE       1
+#define LOG_FILES         2      // one file per engine (FIRST, SECOND): <prefix>1.log and <prefix>2.log
+
+enum log_level
+{
+   LOG_INFO,                     // always printed to the console
+   LOG_DEBUG,                    // engine I/O trace (--debug1, --debug2), written to the selected sinks
+   // The following are only written to the trace file (--record), see trace.h
+   LOG_TRACE_TO,                 // line sent to an engine
+   LOG_TRACE_FROM,               // line received from an engine
+   LOG_TRACE_EOF,                // engine disconnected
+   LOG_TRACE_GAME,               // game started in a slot: "<swap sides> <FEN>"
+   LOG_TRACE_CLOCK,              // time (ms) taken by a move, as used for the clocks
+   LOG_TRACE_TIMEOUT,            // an engine's deadline passed while waiting for its output
+   LOG_EVENT                     // JSON event for the --events socket (see events.h). Dropped if the ring is full.
+};
+
+struct log_record
+{
+   uint64_t time_us;             // microseconds since log_start
+   int16_t slot;
+   int8_t engine;
+   uint8_t level : 4;
+   uint8_t continued : 1;        // more text for this line follows in the next record
+   uint32_t ply;
+   uint16_t length;
+   char text[LOG_TEXT_SIZE];
+};
+
+class LogRing
+{
+private:
+   log_record m_records[LOG_RING_SIZE];
+   alignas(64) atomic<uint> m_head;     // next record to write (producer)
+   alignas(64) atomic<uint> m_tail;     // next record to read (sink)
+
+public:
+   LogRing(void);
+   bool push(const log_record &record);
+   uint free_records(void);
+   const log_record *peek(void);
+   void pop(void);
+};
+
+// log_context is a thread's logger state: its ring and the ply it tags records with. A coroutine that moves between
+// threads takes its log_context along (see executor.h).
+struct log_context
+{
+   uint ring;
+   uint ply;
+};
+
+// LogLine collects the text of one log statement, and queues it when the statement ends, e.g.
+//    LogLine(m_slot) << "Error: " << m_name << " disconnected.\n";
+class LogLine
+{
+private:
+   int m_slot;
+   int m_engine;
+   log_level m_level;
+   ostringstream *m_stream;   // the thread's buffer for this statement (nested statements each get their own)
+
+public:
+   LogLine(int slot = LOG_NO_SLOT, int engine = LOG_NO_ENGINE, log_level level = LOG_INFO);
+   ~LogLine(void);
+
+   template <class T> LogLine &operator<<(const T &value)
+   {
+      *m_stream << value;
+      return *this;
+   }
+   LogLine &operator<<(ostream &(*manipulator)(ostream &))
+   {
+      *m_stream << manipulator;
+      return *this;
+   }
+};
+
+int log_open_trace(const string &file_name, const vector<string> &args);
+bool log_tracing(void);
+int log_start(uint num_slots, uint sinks, const string &file_prefix);
+void log_stop(void);
+void log_attach_slot(int slot);
+void log_set_ply(uint ply);
+log_context log_get_context(void);
+void log_set_context(const log_context &context);
+void log_write(int slot, int engine, log_level level, const char *text, size_t length);
@@ -0,0 +1,306 @@
+#include "metrics.h"
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <cmath>
+
+extern struct options_info options;
+
+static_assert(sizeof(result_counts) == RESULT_COUNTS_FIELDS * sizeof(uint64_t), "result_counts must only have uint64_t members");
+
+ResultCounters::ResultCounters(void)
+{
+   reset();
+}
+
+// reset zeroes the counters, e.g. for the next match in daemon mode. No game may be running.
+void ResultCounters::reset(void)
+{
+   m_updates_started = 0;
+   m_updates_finished = 0;
+   for (size_t i = 0; i < RESULT_COUNTS_FIELDS; i++)
+      m_counts[i] = 0;
+}
+
+void ResultCounters::add(const result_counts &delta)
+{
+   uint64_t values[RESULT_COUNTS_FIELDS];
+   memcpy(values, &delta, sizeof(values));
+
+   m_updates_started.fetch_add(1, memory_order_relaxed);
+   atomic_thread_fence(memory_order_release);
+   for (size_t i = 0; i < RESULT_COUNTS_FIELDS; i++)
+      if (values[i])
+         m_counts[i].fetch_add(values[i], memory_order_relaxed);
+   m_updates_finished.fetch_add(1, memory_order_release);
+}
+
+result_counts ResultCounters::snapshot(void) const
+{
+   uint64_t values[RESULT_COUNTS_FIELDS];
+   result_counts counts;
+
+   while (true)
+   {
+      uint64_t finished = m_updates_finished.load(memory_order_acquire);
+      for (size_t i = 0; i < RESULT_COUNTS_FIELDS; i++)
+         values[i] = m_counts[i].load(memory_order_relaxed);
+      atomic_thread_fence(memory_order_acquire);
+      if (m_updates_started.load(memory_order_relaxed) == finished)
+         break;
+      this_thread::yield(); // an update is in progress
+   }
+   memcpy(&counts, values, sizeof(counts));
+   return counts;
+}
+
+SlotMetrics::SlotMetrics(void)
+{
+   reset();
+}
+
+// reset zeroes the slot's counters for the next match (daemon mode). The slot's game must have ended.
+void SlotMetrics::reset(void)
+{
+   results.reset();
+   latency_count = 0;
+   latency_sum_ns = 0;
+   idle_count = 0;
+   idle_ns = 0;
+   for (int i = 0; i < 2; i++)
+   {
+      nodes[i] = 0;
+      search_ms[i] = 0;
+      setup_count[i] = 0;
+      setup_ns[i] = 0;
+   }
+   for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+      latency_buckets[i] = 0;
+}
+
+void SlotMetrics::add_latency(chrono::nanoseconds latency)
+{
+   uint64_t ns = (latency.count() > 0) ? latency.count() : 0;
+   int i;
+   for (i = 0; i < METRICS_LATENCY_BUCKETS - 1; i++)
+      if (ns <= metrics_latency_bounds_us[i] * 1000)
+         break;
+   metrics_add(latency_buckets[i]);
+   metrics_add(latency_sum_ns, ns);
+   metrics_add(latency_count);
+}
+
+void SlotMetrics::add_setup_time(engine_number engine, chrono::nanoseconds setup_time)
+{
+   metrics_add(setup_ns[engine], (setup_time.count() > 0) ? setup_time.count() : 0);
+   metrics_add(setup_count[engine]);
+}
+
+void SlotMetrics::add_idle_time(chrono::nanoseconds idle_time)
+{
+   metrics_add(idle_ns, (idle_time.count() > 0) ? idle_time.count() : 0);
+   metrics_add(idle_count);
+}
+
+static string escape_label(const string &s)
+{
+   string escaped;
+   for (size_t i = 0; i < s.length(); i++)
+   {
+      if ((s[i] == '\\') || (s[i] == '"'))
+         escaped += '\\';
+      escaped += s[i];
+   }
+   return escaped;
+}
+
+void metric_header(ostringstream &out, const char *name, const char *type, const char *help)
+{
+   out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+}
+
+timing_totals sum_timing(const SlotMetrics *slots, uint num_slots)
+{
+   timing_totals totals = {};
+   for (uint i = 0; i < num_slots; i++)
+   {
+      for (int e = 0; e < 2; e++)
+      {
+         totals.nodes[e] += slots[i].nodes[e].load(memory_order_relaxed);
+         totals.search_ms[e] += slots[i].search_ms[e].load(memory_order_relaxed);
+         totals.setup_count[e] += slots[i].setup_count[e].load(memory_order_relaxed);
+         totals.setup_ns[e] += slots[i].setup_ns[e].load(memory_order_relaxed);
+      }
+      totals.latency_count += slots[i].latency_count.load(memory_order_relaxed);
+      totals.latency_sum_ns += slots[i].latency_sum_ns.load(memory_order_relaxed);
+      for (int b = 0; b < METRICS_LATENCY_BUCKETS; b++)
+         totals.latency_buckets[b] += slots[i].latency_buckets[b].load(memory_order_relaxed);
+   }
+   return totals;
+}
+
+// latency_quantile estimates a quantile from the histogram, interpolating linearly within the bucket (as Prometheus'
+// histogram_quantile does).
+double latency_quantile(const uint64_t *buckets, uint64_t count, double q)
+{
+   if (count == 0)
+      return 0.0;
+   double rank = q * (double)count;
+   uint64_t cumulative = 0;
+   for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+   {
+      if ((double)(cumulative + buckets[i]) >= rank)
+      {
+         if (i == METRICS_LATENCY_BUCKETS - 1)
+            return metrics_latency_bounds_us[i - 1] / 1e6;
+         double lower = (i == 0) ? 0.0 : (double)metrics_latency_bounds_us[i - 1];
+         double upper = (double)metrics_latency_bounds_us[i];
+         return (lower + (upper - lower) * (rank - (double)cumulative) / (double)buckets[i]) / 1e6;
+      }
+      cumulative += buckets[i];
+   }
+   return metrics_latency_bounds_us[METRICS_LATENCY_BUCKETS - 2] / 1e6;
+}
+
+// sprt_llr returns the log-likelihood ratio of the SPRT (--sprt) for the hypotheses that the first engine is elo1
+// stronger (H1) or elo0 stronger (H0) than the second engine (logistic Elo), from the wins, draws and losses so far. It
+// uses the normal approximation of the generalized SPRT (GSPRT): LLR = N (s1 - s0) (2s - s0 - s1) / (2 var), where s is
+// the first engine's mean score per game, var the variance of the game scores, and s0, s1 the scores expected with
+// elo0 and elo1. Returns 0 until both engines have won or drawn at least one game.
+double sprt_llr(const result_counts &totals, double elo0, double elo1)
+{
+   double wins = (double)totals.wins[FIRST];
+   double losses = (double)totals.wins[SECOND];
+   double draws = (double)totals.draws;
+   double n = wins + losses + draws;
+   if ((wins + draws == 0.0) || (losses + draws == 0.0))
+      return 0.0;
+   double s = (wins + draws / 2.0) / n;
+   double var = (wins * (1.0 - s) * (1.0 - s) + draws * (0.5 - s) * (0.5 - s) + losses * s * s) / n;
+   if (var <= 0.0)
+      return 0.0;
+   double s0 = 1.0 / (1.0 + pow(10.0, -elo0 / 400.0));
+   double s1 = 1.0 / (1.0 + pow(10.0, -elo1 / 400.0));
+   return n * (s1 - s0) * (2.0 * s - s0 - s1) / (2.0 * var);
+}
+
+// sprt_bounds returns the LLR bounds for the false positive (alpha) and false negative (beta) rates: H0 is accepted at
+// or below lower, and H1 at or above upper.
+void sprt_bounds(double alpha, double beta, double &lower, double &upper)
+{
+   lower = log(beta / (1.0 - alpha));
+   upper = log((1.0 - beta) / alpha);
+}
+
+string format_metrics(const SlotMetrics *slots, uint num_slots, uint active_slots, const result_counts &totals, double plies_per_second)
+{
+   ostringstream out;
+   const char *results[3] = {"win", "draw", "loss"};
+   timing_totals timing = sum_timing(slots, num_slots);
+
+   out.precision(9);
+
+   metric_header(out, "scm_engine_info", "gauge", "Engine file names.");
+   out << "scm_engine_info{engine=\"1\",name=\"" << escape_label(options.engine_file_name_1) << "\"} 1\n";
+   out << "scm_engine_info{engine=\"2\",name=\"" << escape_label(options.engine_file_name_2) << "\"} 1\n";
+
+   vector<result_counts> slot_counts(num_slots);
+   for (uint i = 0; i < num_slots; i++)
+      slot_counts[i] = slots[i].results.snapshot();
+   metric_header(out, "scm_games_started_total", "counter", "Games started in each slot.");
+   for (uint i = 0; i < num_slots; i++)
+      out << "scm_games_started_total{slot=\"" << i << "\"} " << slot_counts[i].games_started << "\n";
+   metric_header(out, "scm_games_completed_total", "counter", "Games completed in each slot.");
+   for (uint i = 0; i < num_slots; i++)
+      out << "scm_games_completed_total{slot=\"" << i << "\"} " << slot_counts[i].games_completed << "\n";
+   metric_header(out, "scm_slot_idle_seconds", "summary", "Time from the end of a game until the next game in the slot started (first move requested).");
+   for (uint i = 0; i < num_slots; i++)
+   {
+      out << "scm_slot_idle_seconds_sum{slot=\"" << i << "\"} " << slots[i].idle_ns.load(memory_order_relaxed) / 1e9 << "\n";
+      out << "scm_slot_idle_seconds_count{slot=\"" << i << "\"} " << slots[i].idle_count.load(memory_order_relaxed) << "\n";
+   }
+   metric_header(out, "scm_active_slots", "gauge", "Number of concurrent games allowed (changed during the match by --adaptive).");
+   out << "scm_active_slots " << active_slots << "\n";
+
+   metric_header(out, "scm_engine_results_total", "counter", "Game results for each engine.");
+   for (int e = 0; e < 2; e++)
+   {
+      uint64_t counts[3] = {totals.wins[e], totals.draws, totals.wins[1 - e]};
+      for (int r = 0; r < 3; r++)
+         out << "scm_engine_results_total{engine=\"" << e + 1 << "\",result=\"" << results[r] << "\"} " << counts[r] << "\n";
+   }
+   metric_header(out, "scm_engine_losses_on_time_total", "counter", "Games lost on time by each engine.");
+   for (int e = 0; e < 2; e++)
+      out << "scm_engine_losses_on_time_total{engine=\"" << e + 1 << "\"} " << totals.losses_on_time[e] << "\n";
+   metric_header(out, "scm_engine_disconnects_total", "counter", "Games ended by each engine crashing or disconnecting.");
+   for (int e = 0; e < 2; e++)
+      out << "scm_engine_disconnects_total{engine=\"" << e + 1 << "\"} " << totals.disconnects[e] << "\n";
+   metric_header(out, "scm_engine_hangs_total", "counter", "Times each engine stopped responding and was restarted.");
+   for (int e = 0; e < 2; e++)
+      out << "scm_engine_hangs_total{engine=\"" << e + 1 << "\"} " << totals.hangs[e] << "\n";
+   metric_header(out, "scm_engine_limit_breaches_total", "counter", "Times each engine's process ended at its resource limits and was restarted.");
+   for (int e = 0; e < 2; e++)
+      out << "scm_engine_limit_breaches_total{engine=\"" << e + 1 << "\"} " << totals.limit_breaches[e] << "\n";
+   metric_header(out, "scm_illegal_move_games_total", "counter", "Games ending in an illegal move.");
+   out << "scm_illegal_move_games_total " << totals.illegal_move_games << "\n";
+
+   metric_header(out, "scm_plies_total", "counter", "Plies played in completed games.");
+   out << "scm_plies_total " << totals.plies << "\n";
+   metric_header(out, "scm_plies_per_second", "gauge", "Plies played per second since the previous update.");
+   out << "scm_plies_per_second " << plies_per_second << "\n";
+
+   metric_header(out, "scm_engine_nodes_total", "counter", "Nodes searched by each engine, as reported by the engine.");
+   for (int e = 0; e < 2; e++)
+      out << "scm_engine_nodes_total{engine=\"" << e + 1 << "\"} " << timing.nodes[e] << "\n";
+   metric_header(out, "scm_engine_nps", "gauge", "Average nodes per second of each engine, as reported by the engine.");
+   for (int e = 0; e < 2; e++)
+      out << "scm_engine_nps{engine=\"" << e + 1 << "\"} " << (timing.search_ms[e] ? (timing.nodes[e] * 1000 / timing.search_ms[e]) : 0) << "\n";
+
+   metric_header(out, "scm_engine_setup_seconds", "summary", "Time from each engine's new game command until it was ready.");
+   for (int e = 0; e < 2; e++)
+   {
+      out << "scm_engine_setup_seconds_sum{engine=\"" << e + 1 << "\"} " << timing.setup_ns[e] / 1e9 << "\n";
+      out << "scm_engine_setup_seconds_count{engine=\"" << e + 1 << "\"} " << timing.setup_count[e] << "\n";
+   }
+
+   // the count is taken from the buckets, so that it matches the +Inf bucket
+   const uint64_t *buckets = timing.latency_buckets;
+   uint64_t count = 0;
+   for (int b = 0; b < METRICS_LATENCY_BUCKETS; b++)
+      count += buckets[b];
+   metric_header(out, "scm_harness_latency_seconds", "histogram", "Time from receiving an engine's move to sending it to the opponent.");
+   uint64_t cumulative = 0;
+   for (int b = 0; b < METRICS_LATENCY_BUCKETS; b++)
+   {
+      cumulative += buckets[b];
+      if (b < METRICS_LATENCY_BUCKETS - 1)
+         out << "scm_harness_latency_seconds_bucket{le=\"" << metrics_latency_bounds_us[b] / 1e6 << "\"} " << cumulative << "\n";
+      else
+         out << "scm_harness_latency_seconds_bucket{le=\"+Inf\"} " << cumulative << "\n";
+   }
+   out << "scm_harness_latency_seconds_sum " << timing.latency_sum_ns / 1e9 << "\n";
+   out << "scm_harness_latency_seconds_count " << count << "\n";
+   metric_header(out, "scm_harness_latency_quantile_seconds", "gauge", "Harness latency percentiles, estimated from the histogram.");
+   const double quantiles[3] = {0.5, 0.9, 0.99};
+   for (int q = 0; q < 3; q++)
+      out << "scm_harness_latency_quantile_seconds{quantile=\"" << quantiles[q] << "\"} " << latency_quantile(buckets, count, quantiles[q]) << "\n";
+
+   return out.str();
+}
+
+int write_metrics_file(const string &file_name, const string &text)
+{
+   string temp_name = file_name + ".tmp";
+   ofstream file(temp_name, ios::out | ios::binary);
+   if (!file.is_open())
+      return 0;
+   file << text;
+   file.close();
+   if (file.fail())
+      return 0;
+#ifdef WIN32
+   remove(file_name.c_str());
+#endif
+   return (rename(temp_name.c_str(), file_name.c_str()) == 0) ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include "engine.h"
+#include <atomic>
+
+// Match metrics for live monitoring (--metrics). The metrics are written to a text file in the Prometheus text
+// exposition format, which is rewritten atomically (written to a temporary file, then renamed) about once a second,
+// so it can be read at any time, e.g. by node_exporter's textfile collector.
+
+#define METRICS_LATENCY_BUCKETS  14
+
+// upper bounds (us) of the harness latency histogram buckets. The last bucket is +Inf.
+const uint64_t metrics_latency_bounds_us[METRICS_LATENCY_BUCKETS - 1] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000};
+
+// result_counts holds a match's (or one slot's) game counts. All members must be uint64_t, see ResultCounters.
+struct result_counts
+{
+   uint64_t games_started;
+   uint64_t games_completed;
+   uint64_t wins[2];                      // index: engine (FIRST, SECOND)
+   uint64_t draws;
+   uint64_t losses_on_time[2];
+   uint64_t illegal_move_games;
+   uint64_t disconnects[2];
+   uint64_t hangs[2];                     // engine restarted because it didn't reply in time (--hangtime)
+   uint64_t limit_breaches[2];            // engine restarted because its process ended at its limits (--limits1, --limits2)
+   uint64_t plies;                        // plies played in completed games
+};
+
+#define RESULT_COUNTS_FIELDS  (sizeof(result_counts) / sizeof(uint64_t))
+
+// ResultCounters keeps result_counts that are updated by game threads and read by the main thread without locks.
+// A reader gets a consistent snapshot (e.g. wins, draws and games completed all from the same set of finished games)
+// by checking, seqlock style, that no update was in progress while it read the counters. Unlike a plain seqlock,
+// updates can come from several threads at once: writers count the updates they start and finish in two separate
+// counters, and a snapshot is only accepted if the number of updates started by the end of the read equals the
+// number finished before it began.
+class ResultCounters
+{
+private:
+   alignas(64) atomic<uint64_t> m_updates_started;
+   atomic<uint64_t> m_updates_finished;
+   alignas(64) atomic<uint64_t> m_counts[RESULT_COUNTS_FIELDS];
+
+public:
+   ResultCounters(void);
+   void reset(void);
+   void add(const result_counts &delta);
+   result_counts snapshot(void) const;
+};
+
+// SlotMetrics holds one game slot's counters. The performance counters each have a single writer (the slot's game
+// thread), so they are updated with a relaxed load and store, without locks or read-modify-write instructions.
+// The metrics writer reads them with relaxed loads.
+struct SlotMetrics
+{
+   ResultCounters results;
+   alignas(64) atomic<uint64_t> nodes[2]; // index: engine (FIRST, SECOND)
+   atomic<uint64_t> search_ms[2];
+   atomic<uint64_t> latency_count;        // harness latency: from receiving an engine's move to sending it to the opponent
+   atomic<uint64_t> latency_sum_ns;
+   atomic<uint64_t> latency_buckets[METRICS_LATENCY_BUCKETS];
+   atomic<uint64_t> setup_count[2];       // new game setups: from the new game command until the engine is ready
+   atomic<uint64_t> setup_ns[2];
+   atomic<uint64_t> idle_count;           // slot idle time: from the end of a game until the next game's first move is requested
+   atomic<uint64_t> idle_ns;
+
+   SlotMetrics(void);
+   void reset(void);
+   void add_latency(chrono::nanoseconds latency);
+   void add_setup_time(engine_number engine, chrono::nanoseconds setup_time);
+   void add_idle_time(chrono::nanoseconds idle_time);
+};
+
+// timing_totals holds the performance counters summed over all slots. The difference between two samples gives the
+// figures for the time in between.
+struct timing_totals
+{
+   uint64_t nodes[2];
+   uint64_t search_ms[2];
+   uint64_t latency_count;
+   uint64_t latency_sum_ns;
+   uint64_t latency_buckets[METRICS_LATENCY_BUCKETS];
+   uint64_t setup_count[2];
+   uint64_t setup_ns[2];
+};
+
+inline void metrics_add(atomic<uint64_t> &counter, uint64_t n = 1)
+{
+   counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+timing_totals sum_timing(const SlotMetrics *slots, uint num_slots);
+double latency_quantile(const uint64_t *buckets, uint64_t count, double q);
+double sprt_llr(const result_counts &totals, double elo0, double elo1);
+void sprt_bounds(double alpha, double beta, double &lower, double &upper);
+void metric_header(ostringstream &out, const char *name, const char *type, const char *help);
+string format_metrics(const SlotMetrics *slots, uint num_slots, uint active_slots, const result_counts &totals, double plies_per_second);
+int write_metrics_file(const string &file_name, const string &text);
@@ -0,0 +1,396 @@
+#include "gamemanager.h"
+#include <boost/program_options.hpp>
+#include <fstream>
+#include <random>
+#include <cstdlib>
+
+// scm-microbench measures the per-line and per-ply helpers used by the harness (protocol parsing, repetition
+// detection and PGN formatting), and reports ns/op and heap allocations per op for each.
+// The corpora are: engine output lines (synthetic by default, or recorded lines from a --debug log file),
+// the 4 player chess FEN book, and 1000-ply random games (standard chess and 4 player chess).
+
+namespace po = boost::program_options;
+
+struct options_info options;   // used by engine.cpp and gamemanager.cpp
+
+// Every heap allocation in the program goes through these, so allocations per op can be counted.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"   // g++ doesn't see that operator new is replaced too
+#endif
+static uint64_t num_allocations = 0;
+
+void *operator new(size_t size)
+{
+   num_allocations++;
+   void *p = malloc(size ? size : 1);
+   if (p == nullptr)
+      throw bad_alloc();
+   return p;
+}
+
+void operator delete(void *p) noexcept
+{
+   free(p);
+}
+
+void operator delete(void *p, size_t size) noexcept
+{
+   (void)size;
+   free(p);
+}
+
+#define GAME_LENGTH 1000
+
+class MicroBench
+{
+private:
+   vector<string> m_uci_output;     // engine output lines, UCI
+   vector<string> m_xb_output;      // engine output lines, xboard
+   vector<string> m_bestmove_lines;
+   vector<string> m_fens;           // 4 player chess FENs, plus some standard chess FENs
+   vector<string> m_chess_game;     // moves of a GAME_LENGTH ply standard chess game
+   vector<string> m_4pc_game;       // moves of a GAME_LENGTH ply 4 player chess game
+   chrono::milliseconds m_min_time;
+   string m_filter;
+
+public:
+   MicroBench(uint min_time_ms, const string &filter);
+   int load_corpora(const string &fens_file_name, const string &output_file_name);
+   void run_all(void);
+
+private:
+   template <class F> void run(const char *name, size_t ops_per_pass, F pass);
+   void make_synthetic_output(void);
+   void make_chess_game(mt19937 &rng);
+   void make_4pc_game(mt19937 &rng);
+};
+
+MicroBench::MicroBench(uint min_time_ms, const string &filter)
+{
+   m_min_time = chrono::milliseconds(min_time_ms);
+   m_filter = filter;
+}
+
+int MicroBench::load_corpora(const string &fens_file_name, const string &output_file_name)
+{
+   string line;
+
+   ifstream fens_file(fens_file_name, ios::in);
+   if (!fens_file.is_open())
+   {
+      cout << "Error: could not open FEN file " << fens_file_name << "\n";
+      return 0;
+   }
+   while (getline(fens_file, line))
+      if (!line.empty())
+         m_fens.push_back(line);
+   m_fens.push_back(fen_start_position);
+   m_fens.push_back("r1bqkb1r/pppp1ppp/2n2n2/4p2Q/2B1P3/8/PPPP1PPP/RNB1K1NR w KQkq - 4 4");
+   m_fens.push_back("8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 b - - 0 1");
+
+   if (!output_file_name.empty())
+   {
+      // Recorded engine output, e.g. a --logsink files log. Only the lines received from an engine are used.
+      ifstream output_file(output_file_name, ios::in);
+      if (!output_file.is_open())
+      {
+         cout << "Error: could not open engine output file " << output_file_name << "\n";
+         return 0;
+      }
+      while (getline(output_file, line))
+      {
+         size_t pos = line.find("FROM ENGINE ");
+         if (pos == string::npos)
+            continue;
+         pos = line.find(": ", pos);
+         if (pos != string::npos)
+            m_uci_output.push_back(line.substr(pos + 2));
+      }
+      if (m_uci_output.empty())
+      {
+         cout << "Error: no \"FROM ENGINE\" lines in " << output_file_name << "\n";
+         return 0;
+      }
+   }
+   make_synthetic_output();
+   for (size_t i = 0; i < m_uci_output.size(); i++)
+      if (m_uci_output[i].rfind("bestmove", 0) == 0)
+         m_bestmove_lines.push_back(m_uci_output[i]);
+
+   mt19937 rng(12345);
+   make_chess_game(rng);
+   make_4pc_game(rng);
+
+   cout << "Corpora: " << m_uci_output.size() << " UCI and " << m_xb_output.size() << " xboard output lines, " << m_fens.size()
+        << " FENs, " << GAME_LENGTH << " ply games.\n";
+   return 1;
+}
+
+// make_synthetic_output generates output like a typical engine's, searching to depth 30 for each of 40 moves.
+void MicroBench::make_synthetic_output(void)
+{
+   const char *pv_moves[] = {"e2e4", "e7e5", "g1f3", "b8c6", "f1b5", "a7a6", "b5a4", "g8f6", "e1g1", "f8e7", "f1e1", "b7b5",
+                             "a4b3", "d7d6", "c2c3", "e8g8", "h2h3", "c6a5", "b3c2", "c7c5", "d2d4", "d8c7", "b1d2", "c5d4"};
+   const char *pv_san[] = {"e4", "e5", "Nf3", "Nc6", "Bb5", "a6", "Ba4", "Nf6", "O-O", "Be7", "Re1", "b5",
+                           "Bb3", "d6", "c3", "O-O", "h3", "Na5", "Bc2", "c5", "d4", "Qc7", "Nbd2", "cxd4"};
+   bool recorded = !m_uci_output.empty();
+   char buf[512];
+
+   for (int move = 0; move < 40; move++)
+   {
+      uint64_t nodes = 0;
+      if (!recorded)
+         m_uci_output.push_back("info string NNUE evaluation using nn-b1a57edbea57.nnue");
+      for (int depth = 1; depth <= 30; depth++)
+      {
+         nodes = nodes * 3 / 2 + 1000;
+         int score = 20 + ((depth * 7 + move * 13) % 40) - 20;
+         string uci_pv, xb_pv;
+         for (int i = 0; (i < depth) && (i < 24); i++)
+         {
+            uci_pv += string(" ") + pv_moves[i];
+            xb_pv += string(" ") + pv_san[i];
+         }
+         if (!recorded)
+         {
+            snprintf(buf, sizeof(buf), "info depth %d seldepth %d multipv 1 score cp %d nodes %llu nps 1500000 hashfull %d tbhits 0 time %llu pv%s",
+                     depth, depth + 6, score, (unsigned long long)nodes, depth * 30, (unsigned long long)(nodes / 1500), uci_pv.c_str());
+            m_uci_output.push_back(buf);
+            if (depth > 20)
+            {
+               snprintf(buf, sizeof(buf), "info depth %d currmove %s currmovenumber %d", depth, pv_moves[depth % 24], depth % 5 + 1);
+               m_uci_output.push_back(buf);
+            }
+         }
+         snprintf(buf, sizeof(buf), "%d %d %llu %llu%s", depth, score, (unsigned long long)(nodes / 15000), (unsigned long long)nodes, xb_pv.c_str());
+         m_xb_output.push_back(buf);
+      }
+      if (!recorded)
+         m_uci_output.push_back(string("bestmove ") + pv_moves[move % 24] + " ponder " + pv_moves[(move + 1) % 24]);
+      m_xb_output.push_back(string("move ") + pv_moves[move % 24]);
+   }
+}
+
+// The games are random legal moves. If a game ends early, it carries on from the start position, since only the move text matters.
+void MicroBench::make_chess_game(mt19937 &rng)
+{
+   ChessBoard board;
+   chess_move moves[MAX_MOVES];
+
+   board.set_start_position();
+   while (m_chess_game.size() < GAME_LENGTH)
+   {
+      uint n = board.generate_legal_moves(moves);
+      if (n == 0)
+      {
+         board.set_start_position();
+         continue;
+      }
+      chess_move &m = moves[rng() % n];
+      string move = square_name(m.from) + square_name(m.to);
+      if (m.promotion != NO_PIECE)
+         move += "pnbrqk"[m.promotion];
+      board.make_move(m);
+      m_chess_game.push_back(move);
+   }
+}
+
+void MicroBench::make_4pc_game(mt19937 &rng)
+{
+   Board4pc board;
+   move_4pc moves[B4_MAX_MOVES];
+
+   board.set_start_position();
+   while (m_4pc_game.size() < GAME_LENGTH)
+   {
+      uint n = board.generate_legal_moves(moves);
+      if ((n == 0) || (board.get_game_result() != UNFINISHED))
+      {
+         board.set_start_position();
+         continue;
+      }
+      move_4pc &m = moves[rng() % n];
+      string move = string(1, 'a' + (m.from % B4_SIZE)) + to_string((m.from / B4_SIZE) + 1) + string(1, 'a' + (m.to % B4_SIZE)) + to_string((m.to / B4_SIZE) + 1);
+      if (m.promotion != NO_PIECE)
+         move += "pnbrqk"[m.promotion];
+      board.make_move(m);
+      m_4pc_game.push_back(move);
+   }
+}
+
+// run calls pass() repeatedly for at least m_min_time (after one warm-up call), and reports the time and heap allocations
+// per op. Each call to pass() must do ops_per_pass ops.
+template <class F> void MicroBench::run(const char *name, size_t ops_per_pass, F pass)
+{
+   if (!m_filter.empty() && (strstr(name, m_filter.c_str()) == nullptr))
+      return;
+
+   pass();
+
+   uint64_t passes = 0;
+   uint64_t allocations_start = num_allocations;
+   auto start = chrono::steady_clock::now();
+   chrono::nanoseconds elapsed;
+   do
+   {
+      pass();
+      passes++;
+      elapsed = chrono::steady_clock::now() - start;
+   } while (elapsed < m_min_time);
+   uint64_t allocations = num_allocations - allocations_start;
+
+   double ops = (double)passes * (double)ops_per_pass;
+   printf("%-44s %12.1f ns/op %10.2f allocs/op\n", name, (double)elapsed.count() / ops, (double)allocations / ops);
+}
+
+void MicroBench::run_all(void)
+{
+   volatile size_t sink = 0;   // keeps results alive, so the work isn't optimized away
+   string s;
+   s.reserve(1024);
+
+   run("get_tokens (UCI output)", m_uci_output.size(), [&]()
+   {
+      for (size_t i = 0; i < m_uci_output.size(); i++)
+         sink = sink + get_tokens(m_uci_output[i]).size();
+   });
+   run("get_tokens (xboard output)", m_xb_output.size(), [&]()
+   {
+      for (size_t i = 0; i < m_xb_output.size(); i++)
+         sink = sink + get_tokens(m_xb_output[i]).size();
+   });
+   run("get_first_token (bestmove)", m_bestmove_lines.size(), [&]()
+   {
+      for (size_t i = 0; i < m_bestmove_lines.size(); i++)
+         sink = sink + get_first_token(m_bestmove_lines[i], 9).length();
+   });
+   run("rstrip + lstrip (UCI output)", m_uci_output.size(), [&]()
+   {
+      for (size_t i = 0; i < m_uci_output.size(); i++)
+      {
+         s.assign(" ");
+         s.append(m_uci_output[i]);
+         s.append(" \r");
+         rstrip(s);
+         lstrip(s);
+         sink = sink + s.length();
+      }
+   });
+
+   Engine engine;
+   engine.m_uci = true;
+   run("Engine::check_engine_output (UCI)", m_uci_output.size(), [&]()
+   {
+      for (size_t i = 0; i < m_uci_output.size(); i++)
+      {
+         engine.m_line.assign(m_uci_output[i]);
+         engine.check_engine_output();
+      }
+      sink = sink + engine.m_score;
+   });
+   engine.m_uci = false;
+   run("Engine::check_engine_output (xboard)", m_xb_output.size(), [&]()
+   {
+      for (size_t i = 0; i < m_xb_output.size(); i++)
+      {
+         engine.m_line.assign(m_xb_output[i]);
+         engine.check_engine_output();
+      }
+      sink = sink + engine.m_score;
+   });
+
+   run("get_color_to_move_from_fen", m_fens.size(), [&]()
+   {
+      for (size_t i = 0; i < m_fens.size(); i++)
+         sink = sink + get_color_to_move_from_fen(m_fens[i]);
+   });
+
+   run("append_PGN4_move", m_4pc_game.size(), [&]()
+   {
+      for (size_t i = 0; i < m_4pc_game.size(); i++)
+      {
+         s.clear();
+         append_PGN4_move(s, m_4pc_game[i]);
+         sink = sink + s.length();
+      }
+   });
+
+   GameManager game;
+   auto start_game = [&]()
+   {
+      game.m_move_list.clear();
+      game.m_moves.clear();
+      game.m_repetition.reset();
+      game.m_num_moves = 0;
+   };
+   run("move_played + check_for_repetition_draw", m_chess_game.size(), [&]()
+   {
+      start_game();
+      for (size_t i = 0; i < m_chess_game.size(); i++)
+      {
+         game.move_played(m_chess_game[i]);
+         sink = sink + game.check_for_repetition_draw();
+      }
+   });
+
+   chrono::milliseconds tc(60000), inc(1000), fixed(0);
+   options.pgn4_format = false;
+   start_game();
+   for (size_t i = 0; i < m_chess_game.size(); i++)
+      game.move_played(m_chess_game[i]);
+   run("store_pgn (1000 plies)", 1, [&]()
+   {
+      game.store_pgn(DRAW, "engine1", "engine2", tc, inc, fixed);
+      sink = sink + game.m_pgn.length();
+   });
+
+   options.pgn4_format = true;
+   start_game();
+   for (size_t i = 0; i < m_4pc_game.size(); i++)
+      game.move_played(m_4pc_game[i]);
+   run("store_pgn4 (1000 plies)", 1, [&]()
+   {
+      game.store_pgn(UNFINISHED, "engine1", "engine2", tc, inc, fixed);
+      sink = sink + game.m_pgn.length();
+   });
+}
+
+int main(int argc, char* argv[])
+{
+   uint time_ms;
+   string fens_file_name, output_file_name, filter;
+
+   try
+   {
+      po::options_description desc("scm-microbench options");
+      desc.add_options()
+         ("help",    "print help message")
+         ("fens",    po::value<string>(&fens_file_name)->default_value("FENs_4PC_balanced.txt"), "4 player chess FEN file")
+         ("output",  po::value<string>(&output_file_name), "recorded engine output to use instead of the synthetic UCI output (\"FROM ENGINE\" lines of a --debug log)")
+         ("time",    po::value<uint>(&time_ms)->default_value(500), "minimum time to run each benchmark (ms)")
+         ("filter",  po::value<string>(&filter), "only run benchmarks whose name contains this text")
+         ;
+
+      po::variables_map var_map;
+      po::store(po::parse_command_line(argc, argv, desc), var_map);
+      po::notify(var_map);
+
+      if (var_map.count("help"))
+      {
+         cout << desc << "\n";
+         return 0;
+      }
+   }
+   catch (exception &e)
+   {
+      cerr << "error: " << e.what() << "\n";
+      return 1;
+   }
+
+   options.max_moves = 1000;
+   MicroBench bench(time_ms, filter);
+   if (bench.load_corpora(fens_file_name, output_file_name) == 0)
+      return 1;
+   bench.run_all();
+   return 0;
+}
@@ -0,0 +1,412 @@
+#include "chessboard.h"
+#include "board4pc.h"
+#include <boost/program_options.hpp>
+#include <random>
+#include <thread>
+
+// scm-mock-engine is a UCI / xboard engine for measuring the harness's own overhead (see bench.sh).
+// It plays random legal moves, either instantly or after a fixed delay, and can send a flood of "info" lines with
+// every move. It can also end the game once a given ply is reached, by reporting mate or stalemate, by resigning,
+// by crashing, by hanging (it stops responding, and has to be killed), or by using memory until an allocation fails
+// (to test --limits1, --limits2). Options are given on the engine's command line, e.g.
+//    scm --e1 "./scm-mock-engine --delay 5 --info 20" --e2 "./scm-mock-engine --end mate --endply 80"
+
+namespace po = boost::program_options;
+
+struct options_info options;   // used by the helpers in engine.cpp
+
+enum mock_ending
+{
+   END_NONE,
+   END_MATE,
+   END_STALEMATE,
+   END_RESIGN,
+   END_CRASH,
+   END_HANG,
+   END_OOM
+};
+
+struct mock_settings
+{
+   uint delay_ms;
+   uint new_game_delay_ms;
+   uint info_lines;
+   int score;
+   mock_ending ending;
+   uint end_ply;
+   bool four_player;
+   uint seed;
+};
+
+class MockEngine
+{
+private:
+   mock_settings m_settings;
+   ChessBoard m_board;
+   Board4pc m_board4pc;
+   string m_position;      // last UCI "position" command, so that only the new moves need to be applied
+   uint m_ply;             // plies played since the game's start position
+   bool m_uci;
+   bool m_force_mode;      // xboard only
+   bool m_hung;            // --end hang: all commands are ignored
+   mt19937 m_rng;
+   string m_output;
+
+public:
+   MockEngine(const mock_settings &settings);
+   void run(void);
+
+private:
+   void uci_command(const string &line, const vector<string> &tokens);
+   void xboard_command(const string &line, const vector<string> &tokens);
+   void set_uci_position(const string &line, const vector<string> &tokens);
+   void new_game(const string &fen);
+   void apply_move(const string &move);
+   string choose_move(void);
+   bool in_check(void);
+   player_color side_to_move(void);
+   void end_game(mock_ending ending);
+   void play(void);
+   void flush(void);
+};
+
+MockEngine::MockEngine(const mock_settings &settings)
+{
+   m_settings = settings;
+   m_ply = 0;
+   m_uci = true;
+   m_force_mode = false;
+   m_hung = false;
+   m_rng.seed(settings.seed);
+   m_output.reserve(1 << 16);
+   new_game("");
+}
+
+void MockEngine::run(void)
+{
+   string line;
+
+   while (getline(cin, line))
+   {
+      rstrip(line);
+      lstrip(line);
+      vector<string> tokens = get_tokens(line);
+      if (tokens.empty() || m_hung)
+         continue;
+      if (tokens[0] == "quit")
+         return;
+      if (tokens[0] == "uci")
+      {
+         m_uci = true;
+         m_output += "id name scm-mock-engine\nid author simplechessmatch\nuciok\n";
+      }
+      else if (tokens[0] == "xboard")
+         m_uci = false;
+      else if (m_uci)
+         uci_command(line, tokens);
+      else
+         xboard_command(line, tokens);
+      flush();
+   }
+}
+
+void MockEngine::uci_command(const string &line, const vector<string> &tokens)
+{
+   if (tokens[0] == "isready")
+      m_output += "readyok\n";
+   else if (tokens[0] == "ucinewgame")
+   {
+      if (m_settings.new_game_delay_ms)
+         this_thread::sleep_for(chrono::milliseconds(m_settings.new_game_delay_ms));
+      new_game("");
+   }
+   else if (tokens[0] == "position")
+      set_uci_position(line, tokens);
+   else if (tokens[0] == "go")
+      play();
+   // setoption, stop, ponderhit etc. are ignored.
+}
+
+void MockEngine::xboard_command(const string &line, const vector<string> &tokens)
+{
+   if (tokens[0] == "protover")
+      m_output += "feature ping=1 setboard=1 usermove=1 colors=0 sigint=0 sigterm=0 myname=\"scm-mock-engine\" done=1\n";
+   else if (tokens[0] == "ping")
+      m_output += "pong " + ((tokens.size() > 1) ? tokens[1] : string("")) + "\n";
+   else if (tokens[0] == "new")
+   {
+      if (m_settings.new_game_delay_ms)
+         this_thread::sleep_for(chrono::milliseconds(m_settings.new_game_delay_ms));
+      new_game("");
+      m_force_mode = false;
+   }
+   else if (tokens[0] == "setboard")
+      new_game(line.substr(9));
+   else if (tokens[0] == "force")
+      m_force_mode = true;
+   else if (tokens[0] == "go")
+   {
+      m_force_mode = false;
+      play();
+   }
+   else if ((tokens[0] == "usermove") && (tokens.size() > 1))
+   {
+      apply_move(tokens[1]);
+      if (!m_force_mode)
+         play();
+   }
+   // level, st, time, otim, post, easy, result, etc. are ignored.
+}
+
+// set_uci_position handles "position startpos|fen <fen> [moves ...]". The harness sends the whole move list every time,
+// so if the command starts with the previous one, only the moves added since then are applied.
+void MockEngine::set_uci_position(const string &line, const vector<string> &tokens)
+{
+   size_t i;
+
+   if (!m_position.empty() && (line.compare(0, m_position.length(), m_position) == 0) &&
+       ((line.length() == m_position.length()) || (line[m_position.length()] == ' ')))
+   {
+      vector<string> new_tokens = get_tokens(line.substr(m_position.length()));
+      for (i = 0; i < new_tokens.size(); i++)
+         if (new_tokens[i] != "moves")
+            apply_move(new_tokens[i]);
+      m_position = line;
+      return;
+   }
+
+   string fen;
+   for (i = 2; (i < tokens.size()) && (tokens[i] != "moves"); i++)
+      fen += ((fen.empty()) ? "" : " ") + tokens[i];
+   new_game((tokens.size() > 1) && (tokens[1] == "fen") ? fen : "");
+   for (i++; i < tokens.size(); i++)
+      apply_move(tokens[i]);
+   m_position = line;
+}
+
+void MockEngine::new_game(const string &fen)
+{
+   m_ply = 0;
+   m_position = "";
+   if (m_settings.four_player)
+   {
+      if (fen.empty() || (m_board4pc.set_fen4(fen) == 0))
+         m_board4pc.set_start_position();
+   }
+   else
+   {
+      if (fen.empty() || (m_board.set_fen(fen) == 0))
+         m_board.set_start_position();
+   }
+}
+
+void MockEngine::apply_move(const string &move)
+{
+   if (m_settings.four_player)
+      m_board4pc.apply_move(move);
+   else
+      m_board.apply_move(move);
+   m_ply++;
+}
+
+// choose_move returns a random legal move, or "" if there are no legal moves.
+string MockEngine::choose_move(void)
+{
+   const char *promotion_chars = "pnbrqk";
+   string move;
+
+   if (m_settings.four_player)
+   {
+      move_4pc moves[B4_MAX_MOVES];
+      uint n = m_board4pc.generate_legal_moves(moves);
+      if (n == 0)
+         return "";
+      move_4pc &m = moves[m_rng() % n];
+      move = string(1, 'a' + (m.from % B4_SIZE)) + to_string((m.from / B4_SIZE) + 1) + string(1, 'a' + (m.to % B4_SIZE)) + to_string((m.to / B4_SIZE) + 1);
+      if (m.promotion != NO_PIECE)
+         move += promotion_chars[m.promotion];
+   }
+   else
+   {
+      chess_move moves[MAX_MOVES];
+      uint n = m_board.generate_legal_moves(moves);
+      if (n == 0)
+         return "";
+      chess_move &m = moves[m_rng() % n];
+      move = square_name(m.from) + square_name(m.to);
+      if (m.promotion != NO_PIECE)
+         move += promotion_chars[m.promotion];
+   }
+   return move;
+}
+
+bool MockEngine::in_check(void)
+{
+   if (m_settings.four_player)
+      return m_board4pc.in_check(m_board4pc.side_to_move());
+   return m_board.in_check(m_board.side_to_move());
+}
+
+// side_to_move returns the color (team, for 4 player chess) of the side the engine is playing for.
+player_color MockEngine::side_to_move(void)
+{
+   if (m_settings.four_player)
+      return Board4pc::team_of(m_board4pc.side_to_move());
+   return m_board.side_to_move();
+}
+
+void MockEngine::end_game(mock_ending ending)
+{
+   bool white = (side_to_move() == WHITE);
+
+   if (ending == END_CRASH)
+   {
+      flush();
+      exit(3);
+   }
+   if (ending == END_HANG)
+   {
+      m_hung = true;
+      return;
+   }
+   if (ending == END_OOM)
+   {
+      flush();
+      vector<vector<char>> blocks;
+      while (true)
+         blocks.emplace_back(64 << 20, 1);   // ends with bad_alloc (or the OOM killer)
+   }
+   if (m_uci)
+   {
+      if (ending == END_MATE)
+         m_output += "info depth 1 score mate 0\nbestmove 0000\n";
+      else if (ending == END_STALEMATE)
+         m_output += "info depth 1 score cp 0\nbestmove 0000\n";
+      else if (m_settings.four_player)
+         m_output += white ? "info string BG won\n" : "info string RY won\n";
+      else
+         m_output += white ? "info string Black won\n" : "info string White won\n";
+   }
+   else
+   {
+      if (ending == END_MATE)
+         m_output += white ? "0-1 {White is mated}\n" : "1-0 {Black is mated}\n";
+      else if (ending == END_STALEMATE)
+         m_output += "1/2-1/2 {Stalemate}\n";
+      else
+         m_output += "resign\n";
+   }
+}
+
+void MockEngine::play(void)
+{
+   if (m_settings.delay_ms)
+      this_thread::sleep_for(chrono::milliseconds(m_settings.delay_ms));
+
+   if ((m_settings.ending != END_NONE) && (m_ply >= m_settings.end_ply))
+   {
+      end_game(m_settings.ending);
+      return;
+   }
+
+   string move = choose_move();
+   if (move.empty())
+   {
+      end_game(in_check() ? END_MATE : END_STALEMATE);
+      return;
+   }
+
+   char buf[256];
+   uint64_t nodes = 0;
+   for (uint depth = 1; depth <= m_settings.info_lines; depth++)
+   {
+      nodes += 1000 * depth;
+      if (m_uci)
+         snprintf(buf, sizeof(buf), "info depth %u seldepth %u multipv 1 score cp %d nodes %llu nps 1000000 hashfull 0 tbhits 0 time %llu pv %s\n",
+                  depth, depth + 4, m_settings.score, (unsigned long long)nodes, (unsigned long long)(nodes / 1000), move.c_str());
+      else
+         snprintf(buf, sizeof(buf), "%u %d %llu %llu %s\n", depth, m_settings.score, (unsigned long long)(nodes / 10000), (unsigned long long)nodes, move.c_str());
+      m_output += buf;
+   }
+
+   if (m_uci)
+      m_output += "bestmove " + move + "\n";
+   else
+   {
+      m_output += "move " + move + "\n";
+      apply_move(move);
+   }
+}
+
+void MockEngine::flush(void)
+{
+   if (m_output.empty())
+      return;
+   cout.write(m_output.data(), m_output.length());
+   cout.flush();
+   m_output.clear();
+}
+
+int main(int argc, char* argv[])
+{
+   mock_settings settings;
+   string ending;
+
+   try
+   {
+      po::options_description desc("scm-mock-engine options");
+      desc.add_options()
+         ("help",    "print help message")
+         ("delay",   po::value<uint>(&settings.delay_ms)->default_value(0), "time to wait before each move (ms)")
+         ("newgame", po::value<uint>(&settings.new_game_delay_ms)->default_value(0), "time taken by each new game command (ms), like an engine clearing big hash tables")
+         ("info",    po::value<uint>(&settings.info_lines)->default_value(1), "number of info lines sent with each move")
+         ("score",   po::value<int>(&settings.score)->default_value(0), "score (centipawns) reported in the info lines")
+         ("end",     po::value<string>(&ending)->default_value("none"), "how to end the game once endply is reached: none, mate, stalemate, resign, crash, hang, or oom (only with a memory limit)")
+         ("endply",  po::value<uint>(&settings.end_ply)->default_value(100), "ply (counted from the start position) at which the game is ended")
+         ("4pc",     "play 4 player chess (teams)")
+         ("seed",    po::value<uint>(&settings.seed)->default_value(0), "random seed. 0 = use a different seed every time")
+         ;
+
+      po::variables_map var_map;
+      po::store(po::parse_command_line(argc, argv, desc), var_map);
+      po::notify(var_map);
+
+      if (var_map.count("help"))
+      {
+         cout << desc << "\n";
+         return 0;
+      }
+      settings.four_player = (var_map.count("4pc") != 0);
+   }
+   catch (exception &e)
+   {
+      cerr << "error: " << e.what() << "\n";
+      return 1;
+   }
+
+   if (ending == "none")
+      settings.ending = END_NONE;
+   else if (ending == "mate")
+      settings.ending = END_MATE;
+   else if (ending == "stalemate")
+      settings.ending = END_STALEMATE;
+   else if (ending == "resign")
+      settings.ending = END_RESIGN;
+   else if (ending == "crash")
+      settings.ending = END_CRASH;
+   else if (ending == "hang")
+      settings.ending = END_HANG;
+   else if (ending == "oom")
+      settings.ending = END_OOM;
+   else
+   {
+      cerr << "error: invalid --end value: " << ending << "\n";
+      return 1;
+   }
+   if (settings.seed == 0)
+      settings.seed = random_device()();
+
+   MockEngine engine(settings);
+   engine.run();
+   return 0;
+}
@@ -0,0 +1,462 @@
+#include "openingbook.h"
+#include "board4pc.h"
+#include "chessboard.h"
+#include "logger.h"
+#include <fstream>
+#include <thread>
+#include <unordered_set>
+#include <algorithm>
+
+extern struct options_info options;
+
+#define MAX_ERRORS_REPORTED 20
+
+OpeningBook::OpeningBook(void)
+{
+}
+
+// load reads the whole file, splits it into entries (lines, or PGN games), checks every entry in parallel, and keeps
+// the valid, unique positions in file order. Empty lines are skipped. Invalid entries are reported with their line
+// numbers and skipped.
+int OpeningBook::load(const string &file_name)
+{
+   ifstream file(file_name, ios::in);
+   if (!file.is_open())
+   {
+      LogLine() << "Error: could not open FEN file " << file_name << "\n";
+      return 0;
+   }
+
+   // A PGN file starts with a tag. Its games are split at the first tag after each game's movetext.
+   vector<book_entry> entries;
+   string line;
+   size_t line_number = 0;
+   bool pgn = false, format_known = false, in_movetext = false;
+   while (getline(file, line))
+   {
+      line_number++;
+      size_t first_char = line.find_first_not_of(" \t\r");
+      if (!format_known && (first_char != string::npos))
+      {
+         pgn = (line[first_char] == '[');
+         format_known = true;
+      }
+      if (!pgn)
+      {
+         entries.push_back({line_number, move(line)});
+         continue;
+      }
+      if ((first_char == string::npos) || (line[first_char] == '%'))
+         continue;
+      bool tag = (line[first_char] == '[');
+      if (entries.empty() || (tag && in_movetext))
+      {
+         entries.push_back({line_number, ""});
+         in_movetext = false;
+      }
+      in_movetext = in_movetext || !tag;
+      entries.back().text += line;
+      entries.back().text += '\n';
+   }
+   if (pgn && (options.fourplayerchess || !options.variant.empty()))
+   {
+      LogLine() << "Error: PGN opening books are only supported for standard chess: " << file_name << "\n";
+      return 0;
+   }
+
+   vector<entry_info> info(entries.size());
+   size_t num_threads = thread::hardware_concurrency();
+   if (num_threads == 0)
+      num_threads = 1;
+   if (num_threads > (entries.size() / 1000) + 1)
+      num_threads = (entries.size() / 1000) + 1;
+
+   vector<thread> threads;
+   size_t chunk = (entries.size() + num_threads - 1) / num_threads;
+   for (size_t t = 0; t < num_threads; t++)
+   {
+      size_t first = t * chunk;
+      size_t last = min(first + chunk, entries.size());
+      threads.push_back(thread(check_entries, cref(entries), pgn, ref(info), first, last));
+   }
+   for (size_t t = 0; t < threads.size(); t++)
+      threads[t].join();
+
+   unordered_set<uint64_t> hashes;
+   uint num_invalid = 0, num_duplicates = 0, num_empty = 0;
+   uint side_count[256] = {0};
+
+   m_positions.clear();
+   m_positions.reserve(entries.size());
+   for (size_t i = 0; i < entries.size(); i++)
+   {
+      if (info[i].empty)
+         num_empty++;
+      else if (!info[i].valid)
+      {
+         if (num_invalid < MAX_ERRORS_REPORTED)
+            LogLine() << "Invalid " << (pgn ? "game" : "FEN") << " on line " << entries[i].line_number << " of " << file_name << ": " << info[i].error << "\n";
+         num_invalid++;
+      }
+      else if (!hashes.insert(info[i].hash).second)
+         num_duplicates++;
+      else
+      {
+         side_count[(unsigned char)info[i].side_to_move]++;
+         m_positions.push_back(move(info[i].position));
+      }
+   }
+   if (num_invalid > MAX_ERRORS_REPORTED)
+      LogLine() << "... and " << (num_invalid - MAX_ERRORS_REPORTED) << " more invalid " << (pgn ? "games" : "lines") << "\n";
+
+   LogLine() << "Loaded " << m_positions.size() << " positions from " << file_name << " (" << entries.size() << (pgn ? " games" : " lines") << "): "
+        << num_invalid << " invalid, " << num_duplicates << " duplicates removed, " << num_empty << " empty lines skipped.\n";
+   LogLine() << "Side to move:";
+   const char *sides = (options.fourplayerchess) ? "RBYG" : "wb";
+   for (const char *s = sides; *s; s++)
+      LogLine() << " " << *s << " " << side_count[(unsigned char)*s];
+   LogLine() << "\n";
+
+   if (m_positions.empty())
+   {
+      LogLine() << "Error: no valid positions in " << file_name << "\n";
+      return 0;
+   }
+   return 1;
+}
+
+void OpeningBook::check_entries(const vector<book_entry> &entries, bool pgn, vector<entry_info> &info, size_t first, size_t last)
+{
+   for (size_t i = first; i < last; i++)
+   {
+      if (pgn)
+         check_pgn_game(entries[i].text, info[i]);
+      else
+         check_line(entries[i].text, info[i]);
+   }
+}
+
+// check_line validates one line: a FEN or EPD position, or "startpos", optionally followed by "moves" and engine format
+// moves. It computes the hash used to find duplicate positions.
+void OpeningBook::check_line(const string &line, entry_info &info)
+{
+   vector<string> tokens = get_tokens(line);
+
+   info.valid = false;
+   info.empty = tokens.empty();
+   info.side_to_move = 0;
+   info.hash = 0;
+   if (info.empty)
+      return;
+
+   size_t moves_index = find(tokens.begin(), tokens.end(), "moves") - tokens.begin();
+   vector<string> moves(tokens.begin() + min(moves_index + 1, tokens.size()), tokens.end());
+   tokens.resize(moves_index);
+   if (tokens.empty())
+   {
+      info.error = "no position";
+      return;
+   }
+
+   string &fen = info.position.fen;
+   string key;
+   if ((tokens.size() == 1) && (tokens[0] == "startpos"))
+   {
+      fen = "";
+      key = "startpos";
+   }
+   else if (options.fourplayerchess)
+   {
+      fen = line.substr(0, line.find(" moves"));
+      rstrip(fen);
+      lstrip(fen);
+      Board4pc board;
+      if (board.set_fen4(fen) == 0)
+      {
+         info.error = board.get_error();
+         return;
+      }
+      // Duplicates are found using the position only, ignoring the points and the halfmove clock (fields 4 and 5, which
+      // set_fen4 has checked are there).
+      size_t field_end[6];
+      size_t pos = 0;
+      for (int f = 0; f < 6; f++)
+      {
+         field_end[f] = fen.find('-', pos);
+         pos = field_end[f] + 1;
+      }
+      key = fen.substr(0, field_end[3]) + fen.substr(field_end[5]);
+   }
+   else if (options.variant.empty())
+   {
+      // EPD: the four position fields are followed by opcodes, e.g. "bm Nf3; id \"test 1\";". The halfmove clock and
+      // move number are taken from the hmvc and fmvn opcodes.
+      if ((tokens.size() > 4) && (tokens[4].find_first_not_of("0123456789") != string::npos))
+      {
+         string halfmove_clock = "0", move_number = "1";
+         size_t pos = 0;
+         for (int f = 0; f < 4; f++)
+            pos = line.find(tokens[f], pos) + tokens[f].length();
+         string opcodes = line.substr(pos, line.find(" moves", pos) - pos);
+         for (size_t start = 0; start < opcodes.length();)
+         {
+            size_t end = opcodes.find(';', start);
+            if (end == string::npos)
+               end = opcodes.length();
+            vector<string> operation = get_tokens(opcodes.substr(start, end - start));
+            if ((operation.size() == 2) && (operation[0] == "hmvc"))
+               halfmove_clock = operation[1];
+            else if ((operation.size() == 2) && (operation[0] == "fmvn"))
+               move_number = operation[1];
+            start = end + 1;
+         }
+         tokens.resize(4);
+         tokens.push_back(halfmove_clock);
+         tokens.push_back(move_number);
+      }
+      fen = tokens[0];
+      for (size_t f = 1; f < tokens.size(); f++)
+         fen += " " + tokens[f];
+      if (validate_fen(fen, info.error) == 0)
+         return;
+      // Duplicates are found using the position only, ignoring the halfmove clock and move number.
+      key = tokens[0] + " " + tokens[1];
+      for (size_t f = 2; (f < 4) && (f < tokens.size()); f++)
+         key += " " + tokens[f];
+   }
+   else
+   {
+      // Variant FENs aren't checked, since the harness doesn't know the variant's rules.
+      fen = line.substr(0, line.find(" moves"));
+      rstrip(fen);
+      lstrip(fen);
+      key = fen;
+   }
+
+   if (check_moves(info, moves, false) == 0)
+      return;
+   info.hash = hash_string(key + " moves " + info.position.moves);
+   info.valid = true;
+}
+
+// check_pgn_game reads a PGN game's start position (FEN tag) and moves. Comments, variations, NAGs, move numbers and
+// the result are skipped.
+void OpeningBook::check_pgn_game(const string &game, entry_info &info)
+{
+   info.valid = false;
+   info.empty = false;
+   info.side_to_move = 0;
+   info.hash = 0;
+   info.position.fen = "";
+
+   vector<string> moves;
+   string token;
+   int variation_depth = 0;
+   for (size_t i = 0; i <= game.length(); i++)
+   {
+      char c = (i < game.length()) ? game[i] : '\n';
+      if (((c == '[') && token.empty() && (variation_depth == 0)) || (c == ';') || (c == '{'))
+      {
+         // a tag, or a comment
+         size_t end = game.find((c == '[') ? ']' : ((c == '{') ? '}' : '\n'), i);
+         if (end == string::npos)
+            end = game.length();
+         if (c == '[')
+         {
+            string tag = game.substr(i + 1, end - i - 1);
+            size_t quote = tag.find('"');
+            if ((tag.compare(0, 4, "FEN ") == 0) && (quote != string::npos))
+               info.position.fen = tag.substr(quote + 1, tag.rfind('"') - quote - 1);
+         }
+         i = end;
+         continue;
+      }
+      if (!isspace((unsigned char)c) && (c != '(') && (c != ')'))
+      {
+         token += c;
+         continue;
+      }
+      int depth = variation_depth;
+      if (c == '(')
+         variation_depth++;
+      else if ((c == ')') && (variation_depth > 0))
+         variation_depth--;
+      if (token.empty())
+         continue;
+      if (depth == 0)
+      {
+         // move numbers may be attached to the move, e.g. "1.e4"
+         size_t start = token.find_first_not_of("0123456789");
+         if ((start != string::npos) && (start > 0) && (token[start] == '.'))
+            token.erase(0, token.find_first_not_of('.', start));
+         else if (start == string::npos)
+            token.clear();
+         bool result = (token == "1-0") || (token == "0-1") || (token == "1/2-1/2") || (token == "*");
+         if (!token.empty() && (token[0] != '$') && (token.find_first_not_of('.') != string::npos) && !result)
+            moves.push_back(token);
+      }
+      token.clear();
+   }
+
+   string key = "startpos";
+   if (!info.position.fen.empty())
+   {
+      if (validate_fen(info.position.fen, info.error) == 0)
+         return;
+      vector<string> fields = get_tokens(info.position.fen);
+      key = fields[0] + " " + fields[1];
+      for (size_t f = 2; (f < 4) && (f < fields.size()); f++)
+         key += " " + fields[f];
+   }
+   if (check_moves(info, moves, true) == 0)
+      return;
+   info.hash = hash_string(key + " moves " + info.position.moves);
+   info.valid = true;
+}
+
+// check_moves plays the entry's moves (at most --bookplies) from its position with the built-in rules, and sets the
+// entry's engine format moves and the side to move after them. SAN moves are converted to engine format.
+// Variant moves can't be checked, and must be in engine format.
+int OpeningBook::check_moves(entry_info &info, const vector<string> &moves, bool san)
+{
+   const string &fen = info.position.fen;
+   size_t num_moves = moves.size();
+   if (options.book_plies && (num_moves > options.book_plies))
+      num_moves = options.book_plies;
+   info.position.moves.clear();
+
+   if (options.fourplayerchess)
+   {
+      Board4pc board;
+      if (fen.empty())
+         board.set_start_position();
+      else
+         board.set_fen4(fen);
+      for (size_t i = 0; i < num_moves; i++)
+      {
+         if (board.apply_move(moves[i]) == 0)
+         {
+            info.error = "illegal move " + moves[i] + " (ply " + to_string(i + 1) + ")";
+            return 0;
+         }
+         info.position.moves += (i ? " " : "") + moves[i];
+      }
+      info.side_to_move = "RBYG"[board.side_to_move()];
+      return 1;
+   }
+
+   if (!options.variant.empty())
+   {
+      player_color color = fen.empty() ? WHITE : get_color_to_move_from_fen(fen);
+      for (size_t i = 0; i < num_moves; i++)
+         info.position.moves += (i ? " " : "") + moves[i];
+      info.side_to_move = ((color == WHITE) == ((num_moves % 2) == 0)) ? 'w' : 'b';
+      return 1;
+   }
+
+   ChessBoard board;
+   if (fen.empty())
+      board.set_start_position();
+   else if (board.set_fen(fen) == 0)
+   {
+      if (num_moves)
+      {
+         info.error = "can't check moves: " + board.get_error();
+         return 0;
+      }
+      info.side_to_move = get_tokens(fen)[1][0];
+      return 1;
+   }
+   for (size_t i = 0; i < num_moves; i++)
+   {
+      chess_move move;
+      if ((san ? board.parse_san(moves[i], move) : board.parse_move(moves[i], move)) == 0)
+      {
+         info.error = (san ? board.get_error() : "illegal move " + moves[i]) + " (ply " + to_string(i + 1) + ")";
+         return 0;
+      }
+      board.make_move(move);
+      info.position.moves += (i ? " " : "") + move_name(move);
+   }
+   info.side_to_move = (board.side_to_move() == WHITE) ? 'w' : 'b';
+   return 1;
+}
+
+// validate_fen checks the syntax of a standard chess FEN. The halfmove clock and move number fields are optional.
+int validate_fen(const string &fen, string &error)
+{
+   vector<string> fields = get_tokens(fen);
+   if ((fields.size() < 2) || (fields.size() > 6))
+   {
+      error = "wrong number of fields";
+      return 0;
+   }
+
+   uint rank = 0, file = 0, white_kings = 0, black_kings = 0;
+   for (size_t i = 0; i < fields[0].length(); i++)
+   {
+      char c = fields[0][i];
+      if (c == '/')
+      {
+         if (file != 8)
+         {
+            error = "wrong number of squares on rank " + to_string(8 - rank);
+            return 0;
+         }
+         rank++;
+         file = 0;
+      }
+      else if ((c >= '1') && (c <= '8'))
+         file += c - '0';
+      else if (strchr("PNBRQKpnbrqk", c) != nullptr)
+      {
+         file++;
+         white_kings += (c == 'K');
+         black_kings += (c == 'k');
+      }
+      else
+      {
+         error = string("invalid character '") + c + "' in board";
+         return 0;
+      }
+      if (file > 8)
+      {
+         error = "too many squares on rank " + to_string(8 - rank);
+         return 0;
+      }
+   }
+   if ((rank != 7) || (file != 8))
+   {
+      error = "board must have 8 ranks of 8 squares";
+      return 0;
+   }
+   if ((white_kings != 1) || (black_kings != 1))
+   {
+      error = "each side must have exactly one king";
+      return 0;
+   }
+   if ((fields[1] != "w") && (fields[1] != "b"))
+   {
+      error = "invalid side to move: " + fields[1];
+      return 0;
+   }
+   // Castling rights may also use Shredder-FEN / X-FEN file letters (Chess960).
+   if ((fields.size() > 2) && (fields[2] != "-") && (fields[2].find_first_not_of("KQkqABCDEFGHabcdefgh") != string::npos))
+   {
+      error = "invalid castling rights: " + fields[2];
+      return 0;
+   }
+   if ((fields.size() > 3) && (fields[3] != "-") &&
+       ((fields[3].length() != 2) || (fields[3][0] < 'a') || (fields[3][0] > 'h') || ((fields[3][1] != '3') && (fields[3][1] != '6'))))
+   {
+      error = "invalid en passant square: " + fields[3];
+      return 0;
+   }
+   for (size_t f = 4; f < fields.size(); f++)
+      if (fields[f].find_first_not_of("0123456789") != string::npos)
+      {
+         error = "invalid move counter: " + fields[f];
+         return 0;
+      }
+   return 1;
+}
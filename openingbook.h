@@ -0,0 +1,52 @@
+#pragma once
+#include "engine.h"
+
+// book_position is an opening: a start position, and the moves played from it before the engines take over.
+struct book_position
+{
+   string fen;          // empty for the standard start position
+   string moves;        // engine format (UCI) moves, separated by spaces, e.g. "e2e4 e7e5", or empty
+};
+
+// OpeningBook holds the opening positions for a match. The whole file is loaded and validated up front,
+// so a malformed entry is reported (with its line number) before any game starts, instead of mid-match.
+// Books can be:
+//    one position per line: a FEN, an EPD line (its hmvc and fmvn opcodes are used, other opcodes are ignored),
+//    or either one followed by "moves" and engine format moves ("startpos moves ..." for the start position)
+//    PGN (if the file starts with a tag): each game's FEN tag (if any) and SAN moves, converted to engine format moves
+// Moves are checked with the built-in rules for standard chess and 4 player chess. --bookplies limits the moves taken.
+class OpeningBook
+{
+private:
+   vector<book_position> m_positions;
+
+   struct book_entry
+   {
+      size_t line_number;  // first line of the entry
+      string text;         // a line, or a PGN game's tags and movetext
+   };
+
+   struct entry_info
+   {
+      bool valid;
+      bool empty;
+      char side_to_move;   // after the moves
+      uint64_t hash;
+      string error;
+      book_position position;
+   };
+
+public:
+   OpeningBook(void);
+   int load(const string &file_name);
+   size_t size(void) { return m_positions.size(); }
+   const book_position &get_position(size_t index) { return m_positions[index]; }
+
+private:
+   static void check_entries(const vector<book_entry> &entries, bool pgn, vector<entry_info> &info, size_t first, size_t last);
+   static void check_line(const string &line, entry_info &info);
+   static void check_pgn_game(const string &game, entry_info &info);
+   static int check_moves(entry_info &info, const vector<string> &moves, bool san);
+};
+
+int validate_fen(const string &fen, string &error);
@@ -0,0 +1,281 @@
+#include "procstats.h"
+#include "metrics.h"
+#include <iomanip>
+#include <cstring>
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+extern struct options_info options;
+
+#ifdef __linux__
+// read_proc_file reads a (small) /proc file into text.
+static int read_proc_file(const char *path, string &text)
+{
+   char buf[4096];
+   int fd = open(path, O_RDONLY | O_CLOEXEC);
+   if (fd < 0)
+      return 0;
+   text.clear();
+   ssize_t n;
+   while ((n = read(fd, buf, sizeof(buf))) > 0)
+      text.append(buf, n);
+   close(fd);
+   return (n == 0);
+}
+
+// status_value returns the number following a field name in a /proc status file, e.g. "voluntary_ctxt_switches:".
+static uint64_t status_value(const string &text, const char *name)
+{
+   size_t pos = text.find(name);
+   if (pos == string::npos)
+      return 0;
+   return strtoull(text.c_str() + pos + strlen(name), nullptr, 10);
+}
+
+// sample_process reads a process's counters. Returns 0 if the process is gone.
+int sample_process(int pid, process_sample &sample)
+{
+   static const uint64_t ns_per_tick = 1000000000ull / sysconf(_SC_CLK_TCK);
+   static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+   char path[64];
+   string text;
+
+   snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+   if (read_proc_file(path, text) == 0)
+      return 0;
+   // the fields following the command name, which is in parentheses and may contain spaces
+   size_t end = text.rfind(')');
+   if (end == string::npos)
+      return 0;
+   vector<string> fields = get_tokens(text.substr(end + 1));
+   if (fields.size() < 22)
+      return 0;
+   sample = {};
+   sample.pid = pid;
+   sample.user_ns = strtoull(fields[11].c_str(), nullptr, 10) * ns_per_tick;     // field 14: utime
+   sample.sys_ns = strtoull(fields[12].c_str(), nullptr, 10) * ns_per_tick;      // field 15: stime
+   sample.threads = (uint)strtoul(fields[17].c_str(), nullptr, 10);               // field 20: num_threads
+   sample.rss_bytes = strtoull(fields[21].c_str(), nullptr, 10) * page_size;     // field 24: rss
+
+   // Context switches and CPU waits are only counted per thread. Those of threads that have exited are lost.
+   snprintf(path, sizeof(path), "/proc/%d/task", pid);
+   DIR *dir = opendir(path);
+   if (dir == nullptr)
+      return 1;
+   struct dirent *entry;
+   while ((entry = readdir(dir)) != nullptr)
+   {
+      if (!isdigit(entry->d_name[0]))
+         continue;
+      snprintf(path, sizeof(path), "/proc/%d/task/%.16s/status", pid, entry->d_name);
+      if (read_proc_file(path, text))
+      {
+         sample.voluntary_switches += status_value(text, "\nvoluntary_ctxt_switches:");
+         sample.involuntary_switches += status_value(text, "\nnonvoluntary_ctxt_switches:");
+      }
+      snprintf(path, sizeof(path), "/proc/%d/task/%.16s/schedstat", pid, entry->d_name);
+      if (read_proc_file(path, text))
+      {
+         // "<time on CPU (ns)> <time waiting for a CPU (ns)> <timeslices>"
+         uint64_t run_ns = 0, wait_ns = 0;
+         if (sscanf(text.c_str(), "%llu %llu", (unsigned long long *)&run_ns, (unsigned long long *)&wait_ns) == 2)
+            sample.run_wait_ns += wait_ns;
+      }
+   }
+   closedir(dir);
+   return 1;
+}
+#else
+int sample_process(int pid, process_sample &sample)
+{
+   (void)pid;
+   (void)sample;
+   return 0;
+}
+#endif
+
+// counter_delta returns the increase of a counter, or 0 if it went down (e.g. when a thread exited).
+static uint64_t counter_delta(uint64_t now, uint64_t before)
+{
+   return (now > before) ? (now - before) : 0;
+}
+
+void UsageSampler::init(uint num_slots)
+{
+   m_usage.assign(num_slots * 2, engine_usage{});
+}
+
+// sample reads an engine process's counters, and adds the increases since its last sample (interval ago) to the engine
+// instance's usage.
+void UsageSampler::sample(Engine &engine, chrono::nanoseconds interval)
+{
+   engine_usage &usage = m_usage[engine.m_slot * 2 + engine.m_number];
+   process_sample sample;
+   int pid = engine.get_pid();
+
+   if ((pid <= 0) || (sample_process(pid, sample) == 0))
+   {
+      usage.have_last = false;
+      return;
+   }
+   if (!usage.have_last || (usage.last.pid != pid))
+   {
+      // a new process: its counters start from this sample
+      usage.last = sample;
+      usage.have_last = true;
+      usage.cores_reported = false;
+      usage.memory_reported = false;
+      return;
+   }
+
+   uint64_t user_ns = counter_delta(sample.user_ns, usage.last.user_ns);
+   uint64_t sys_ns = counter_delta(sample.sys_ns, usage.last.sys_ns);
+   usage.sampled_ns += interval.count();
+   usage.user_ns += user_ns;
+   usage.sys_ns += sys_ns;
+   usage.voluntary_switches += counter_delta(sample.voluntary_switches, usage.last.voluntary_switches);
+   usage.involuntary_switches += counter_delta(sample.involuntary_switches, usage.last.involuntary_switches);
+   usage.run_wait_ns += counter_delta(sample.run_wait_ns, usage.last.run_wait_ns);
+   usage.rss_bytes = sample.rss_bytes;
+   usage.peak_rss_bytes = max(usage.peak_rss_bytes, sample.rss_bytes);
+   usage.threads = sample.threads;
+   usage.peak_threads = max(usage.peak_threads, sample.threads);
+   usage.cores = (interval.count() > 0) ? (double)(user_ns + sys_ns) / (double)interval.count() : 0.0;
+   usage.peak_cores = max(usage.peak_cores, usage.cores);
+   usage.last = sample;
+
+   check_limits(engine, usage);
+}
+
+// check_limits reports an engine process that used more cores than --cores1/--cores2, or more memory than --mem1/--mem2
+// plus --memslack.
+void UsageSampler::check_limits(Engine &engine, engine_usage &usage)
+{
+   uint cores_allowed = (engine.m_number == FIRST) ? options.num_cores_1 : options.num_cores_2;
+   uint mem_allowed_mb = ((engine.m_number == FIRST) ? options.mem_size_1 : options.mem_size_2) + options.mem_slack_mb;
+
+   if ((cores_allowed != 0) && !usage.cores_reported && (usage.cores > cores_allowed + USAGE_CORES_TOLERANCE))
+   {
+      LogLine(engine.m_slot, engine.m_number) << fixed << setprecision(2) << "Warning: " << engine.m_name << " (" << engine.m_ID << ") used "
+                                              << usage.cores << " cores, more than --cores" << engine.m_number + 1 << " (" << cores_allowed << ") allows\n";
+      usage.cores_reported = true;
+      usage.core_warnings++;
+   }
+   if (!usage.memory_reported && (usage.rss_bytes > (uint64_t)mem_allowed_mb << 20))
+   {
+      LogLine(engine.m_slot, engine.m_number) << fixed << setprecision(1) << "Warning: " << engine.m_name << " (" << engine.m_ID << ") uses "
+                                              << (double)usage.rss_bytes / 1048576.0 << " MB, more than --mem" << engine.m_number + 1
+                                              << " + --memslack (" << mem_allowed_mb << " MB)\n";
+      usage.memory_reported = true;
+      usage.memory_warnings++;
+   }
+}
+
+// engine_totals adds up the usage of all instances of an engine (FIRST or SECOND). rss_bytes and threads are summed,
+// the peaks are the largest of any instance.
+engine_usage UsageSampler::engine_totals(engine_number engine) const
+{
+   engine_usage totals = {};
+   for (uint slot = 0; slot < num_slots(); slot++)
+   {
+      const engine_usage &usage = m_usage[slot * 2 + engine];
+      totals.sampled_ns += usage.sampled_ns;
+      totals.user_ns += usage.user_ns;
+      totals.sys_ns += usage.sys_ns;
+      totals.voluntary_switches += usage.voluntary_switches;
+      totals.involuntary_switches += usage.involuntary_switches;
+      totals.run_wait_ns += usage.run_wait_ns;
+      totals.rss_bytes += usage.rss_bytes;
+      totals.peak_rss_bytes = max(totals.peak_rss_bytes, usage.peak_rss_bytes);
+      totals.threads += usage.threads;
+      totals.peak_threads = max(totals.peak_threads, usage.peak_threads);
+      totals.cores += usage.cores;
+      totals.peak_cores = max(totals.peak_cores, usage.peak_cores);
+      totals.core_warnings += usage.core_warnings;
+      totals.memory_warnings += usage.memory_warnings;
+   }
+   return totals;
+}
+
+// format_report describes each engine's average usage per instance, for --stats, followed by the slots that had
+// warnings.
+string UsageSampler::format_report(void) const
+{
+   ostringstream out;
+   uint slots = max(num_slots(), 1u);
+
+   out << fixed;
+   for (int e = 0; e < 2; e++)
+   {
+      engine_usage t = engine_totals((engine_number)e);
+      if (t.sampled_ns == 0)
+         continue;
+      double seconds = (double)t.sampled_ns / 1e9;
+      out << setprecision(2) << "Engine" << e + 1 << " usage (per instance): " << (double)(t.user_ns + t.sys_ns) / (double)t.sampled_ns << " cores (peak "
+          << t.peak_cores << "), " << setprecision(1) << 100.0 * (double)t.sys_ns / (double)max(t.user_ns + t.sys_ns, (uint64_t)1) << "% system, "
+          << (double)t.rss_bytes / slots / 1048576.0 << " MB (peak " << (double)t.peak_rss_bytes / 1048576.0 << " MB), "
+          << (double)t.threads / slots << " threads (peak " << t.peak_threads << "), context switches: " << (double)t.voluntary_switches / seconds
+          << "/s voluntary, " << (double)t.involuntary_switches / seconds << "/s involuntary, waiting for a CPU: "
+          << 100.0 * (double)t.run_wait_ns / (double)t.sampled_ns << "%";
+      if (t.core_warnings || t.memory_warnings)
+         out << "  [too many cores: " << t.core_warnings << ", too much memory: " << t.memory_warnings << "]";
+      out << "\n";
+   }
+   for (uint slot = 0; slot < num_slots(); slot++)
+   {
+      for (int e = 0; e < 2; e++)
+      {
+         const engine_usage &u = m_usage[slot * 2 + e];
+         if ((u.core_warnings == 0) && (u.memory_warnings == 0))
+            continue;
+         out << setprecision(2) << "   slot " << slot << " engine" << e + 1 << ": " << (double)(u.user_ns + u.sys_ns) / (double)max(u.sampled_ns, (uint64_t)1)
+             << " cores (peak " << u.peak_cores << "), " << setprecision(1) << (double)u.rss_bytes / 1048576.0 << " MB (peak "
+             << (double)u.peak_rss_bytes / 1048576.0 << " MB), " << u.peak_threads << " threads  [too many cores: " << u.core_warnings
+             << ", too much memory: " << u.memory_warnings << "]\n";
+      }
+   }
+   return out.str();
+}
+
+// format_metrics returns the usage metrics for each slot and engine, in the Prometheus text format (see metrics.h).
+string UsageSampler::format_metrics(void) const
+{
+   ostringstream out;
+   out.precision(9);
+
+   metric_header(out, "scm_engine_cpu_seconds_total", "counter", "CPU time used by each engine process.");
+   for (uint i = 0; i < m_usage.size(); i++)
+   {
+      out << "scm_engine_cpu_seconds_total{slot=\"" << i / 2 << "\",engine=\"" << i % 2 + 1 << "\",mode=\"user\"} " << m_usage[i].user_ns / 1e9 << "\n";
+      out << "scm_engine_cpu_seconds_total{slot=\"" << i / 2 << "\",engine=\"" << i % 2 + 1 << "\",mode=\"system\"} " << m_usage[i].sys_ns / 1e9 << "\n";
+   }
+   metric_header(out, "scm_engine_cores", "gauge", "CPU cores used by each engine process during the last sample interval.");
+   for (uint i = 0; i < m_usage.size(); i++)
+      out << "scm_engine_cores{slot=\"" << i / 2 << "\",engine=\"" << i % 2 + 1 << "\"} " << m_usage[i].cores << "\n";
+   metric_header(out, "scm_engine_resident_memory_bytes", "gauge", "Resident memory of each engine process.");
+   for (uint i = 0; i < m_usage.size(); i++)
+      out << "scm_engine_resident_memory_bytes{slot=\"" << i / 2 << "\",engine=\"" << i % 2 + 1 << "\"} " << m_usage[i].rss_bytes << "\n";
+   metric_header(out, "scm_engine_threads", "gauge", "Threads of each engine process.");
+   for (uint i = 0; i < m_usage.size(); i++)
+      out << "scm_engine_threads{slot=\"" << i / 2 << "\",engine=\"" << i % 2 + 1 << "\"} " << m_usage[i].threads << "\n";
+   metric_header(out, "scm_engine_context_switches_total", "counter", "Context switches of each engine process's threads.");
+   for (uint i = 0; i < m_usage.size(); i++)
+   {
+      out << "scm_engine_context_switches_total{slot=\"" << i / 2 << "\",engine=\"" << i % 2 + 1 << "\",type=\"voluntary\"} " << m_usage[i].voluntary_switches << "\n";
+      out << "scm_engine_context_switches_total{slot=\"" << i / 2 << "\",engine=\"" << i % 2 + 1 << "\",type=\"involuntary\"} " << m_usage[i].involuntary_switches << "\n";
+   }
+   metric_header(out, "scm_engine_cpu_wait_seconds_total", "counter", "Time each engine process's threads waited for a CPU.");
+   for (uint i = 0; i < m_usage.size(); i++)
+      out << "scm_engine_cpu_wait_seconds_total{slot=\"" << i / 2 << "\",engine=\"" << i % 2 + 1 << "\"} " << m_usage[i].run_wait_ns / 1e9 << "\n";
+   metric_header(out, "scm_engine_usage_warnings_total", "counter", "Engine processes that used more cores or memory than allowed.");
+   for (int e = 0; e < 2; e++)
+   {
+      engine_usage t = engine_totals((engine_number)e);
+      out << "scm_engine_usage_warnings_total{engine=\"" << e + 1 << "\",kind=\"cores\"} " << t.core_warnings << "\n";
+      out << "scm_engine_usage_warnings_total{engine=\"" << e + 1 << "\",kind=\"memory\"} " << t.memory_warnings << "\n";
+   }
+   return out.str();
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include "engine.h"
+
+// Engine process resource usage (--sample). Every --sample ms, the match manager reads each engine process's /proc
+// files (Linux): user and system CPU time, resident memory and thread count from /proc/<pid>/stat, and for each of the
+// process's threads, its voluntary and involuntary context switches (/proc/<pid>/task/<tid>/status) and the time it
+// waited for a CPU (/proc/<pid>/task/<tid>/schedstat). The differences between samples are added up for each engine
+// instance (slot and engine), over all the processes it had (an engine that's restarted is a new process), and shown
+// by --stats and --metrics. An engine that uses more cores than --cores1/--cores2 allow, or more memory than
+// --mem1/--mem2 plus --memslack, is reported once per process.
+
+#define USAGE_CORES_TOLERANCE  0.25   // cores an engine may use beyond --cores1/--cores2 before it's reported
+
+// process_sample is one reading of a process's counters.
+struct process_sample
+{
+   int pid;
+   uint64_t user_ns;
+   uint64_t sys_ns;
+   uint64_t rss_bytes;
+   uint threads;
+   uint64_t voluntary_switches;     // summed over the process's current threads
+   uint64_t involuntary_switches;
+   uint64_t run_wait_ns;
+};
+
+int sample_process(int pid, process_sample &sample);
+
+// engine_usage is one engine instance's usage over the match.
+struct engine_usage
+{
+   process_sample last;             // last sample of the current process
+   bool have_last;                  // false until the current process has been sampled
+   uint64_t sampled_ns;             // time covered by the samples
+   uint64_t user_ns;
+   uint64_t sys_ns;
+   uint64_t voluntary_switches;
+   uint64_t involuntary_switches;
+   uint64_t run_wait_ns;
+   uint64_t rss_bytes;
+   uint64_t peak_rss_bytes;
+   uint threads;
+   uint peak_threads;
+   double cores;                    // cores used during the last sample interval
+   double peak_cores;
+   uint core_warnings;              // processes that used too many cores
+   uint memory_warnings;            // processes that used too much memory
+   bool cores_reported;             // the current process has been reported
+   bool memory_reported;
+};
+
+// UsageSampler samples the engine processes. It's only used by the main thread.
+class UsageSampler
+{
+private:
+   vector<engine_usage> m_usage;    // index: slot * 2 + engine
+
+public:
+   void init(uint num_slots);
+   void sample(Engine &engine, chrono::nanoseconds interval);
+   uint num_slots(void) const { return (uint)(m_usage.size() / 2); }
+   engine_usage engine_totals(engine_number engine) const;
+   string format_report(void) const;
+   string format_metrics(void) const;
+
+private:
+   void check_limits(Engine &engine, engine_usage &usage);
+};
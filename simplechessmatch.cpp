@@ -4,6 +4,8 @@ namespace po = boost::program_options;
 
 struct options_info options;
 MatchManager match_mgr;
+static bool daemon_mode = false;    // --daemon: options are each match's, not the daemon's
+static atomic<bool> interrupted(false);   // Ctrl-C. The signal handler only sets this: nothing else it could do is async-signal-safe
 
 int main(int argc, char* argv[])
 {
@@ -22,26 +24,40 @@ int main(int argc, char* argv[])
    if (parse_cmd_line_options(argc, argv) == 0)
       return 0;
 
-   if (match_mgr.initialize() == 0)
-      return 0;
+   if (!options.daemon_path.empty())
+   {
+      daemon_mode = true;
+      return run_daemon();
+   }
+
+   if (!options.record_filename.empty())
+      if (log_open_trace(options.record_filename, vector<string>(argv + 1, argv + argc)) == 0)
+         return 0;
 
-   cout << "loading engines...\n";
+   if (!options.events_path.empty())
+      if (events_start(options.events_path) == 0)
+         return 0;
 
-   if (match_mgr.load_all_engines() == 0)
+   if (log_start(options.num_threads, options.log_sinks, options.log_prefix) == 0)
    {
-      match_mgr.shut_down_all_engines();
-      match_mgr.cleanup();
+      events_stop();
       return 0;
    }
 
-   cout << "engines loaded.\n";
+   if (match_mgr.initialize() == 0)
+   {
+      log_stop();
+      events_stop();
+      return 0;
+   }
 
-   for (uint i = 0; i < options.num_threads; i++)
+   if (match_mgr.prepare_engines() == 0)
    {
-      match_mgr.set_engine_options(&(match_mgr.m_game_mgr[i].m_engine1));
-      match_mgr.send_engine_custom_commands(&(match_mgr.m_game_mgr[i].m_engine1));
-      match_mgr.set_engine_options(&(match_mgr.m_game_mgr[i].m_engine2));
-      match_mgr.send_engine_custom_commands(&(match_mgr.m_game_mgr[i].m_engine2));
+      match_mgr.shut_down_all_engines();
+      match_mgr.cleanup();
+      log_stop();
+      events_stop();
+      return 0;
    }
 
    match_mgr.main_loop();
@@ -49,20 +65,101 @@ int main(int argc, char* argv[])
    match_mgr.shut_down_all_engines();
    match_mgr.print_results();
    match_mgr.save_pgn();
+   match_mgr.write_metrics(true);
+   match_mgr.publish_stats(true);
+   if (options.print_stats)
+      match_mgr.print_statistics();
+
+   match_mgr.cleanup();
+
+   LogLine() << "Exiting.\n";
+   log_stop();
+   events_stop();
+
+   return 0;
+}
+
+// run_daemon plays the matches queued on the control socket (--daemon, see control.h) one after another, until it's
+// shut down. The daemon's --threads is the number of slots, which the matches' --threads can't be more than.
+int run_daemon(void)
+{
+   if (!options.events_path.empty())
+      if (events_start(options.events_path) == 0)
+         return 0;
+
+   if (log_start(options.num_threads, options.log_sinks, options.log_prefix) == 0)
+   {
+      events_stop();
+      return 0;
+   }
+
+   // without the cgroup, the engines are still limited with rlimits
+   if (!options.cgroup_dir.empty())
+      cgroup_init(options.cgroup_dir);
+
+   if ((control_start(options.daemon_path, parse_match_options) == 0) || (match_mgr.start(options.num_threads, true) == 0))
+   {
+      control_stop();
+      log_stop();
+      events_stop();
+      return 0;
+   }
+
+   LogLine() << "Daemon: " << options.num_threads << " slots, waiting for matches on " << options.daemon_path << "\n";
+
+   match_request request;
+   while (control_next_match(request))
+   {
+      options = move(request.options);
+      match_mgr.run_match(request.id, request.spec);
+   }
 
+   match_mgr.shut_down_all_engines();
    match_mgr.cleanup();
 
-   cout << "Exiting.\n";
+   LogLine() << "Exiting.\n";
+   control_stop();
+   log_stop();
+   events_stop();
 
    return 0;
 }
 
 MatchManager::MatchManager(void)
 {
-   m_total_games_started = 0;
    m_engines_shut_down = false;
    m_game_mgr = nullptr;
-   m_thread = nullptr;
+   m_metrics = nullptr;
+   m_num_slots = 0;
+   m_daemon = false;
+   m_match_id = 0;
+   reset_match();
+}
+
+// reset_match clears the state of the last match (daemon mode plays several with the same slots).
+void MatchManager::reset_match(void)
+{
+   m_total_games_started = 0;
+   m_next_opening_index = 0;
+   m_metrics_plies = 0;
+   m_events_plies = 0;
+   m_last_games_completed = 0;
+   m_active_slots = 0;
+   m_stopping = false;
+   m_fens_exhausted = false;
+   m_next_swap_sides = false;
+   m_sprt_result = nullptr;
+   m_results.clear();
+   m_totals.reset();
+   m_adaptive_slow_start = true;
+   m_adaptive_timing = {};
+   m_adaptive_results = {};
+   m_baseline_nps[0] = m_baseline_nps[1] = 0.0;
+   m_start_time = chrono::steady_clock::now();
+   m_metrics_time = m_start_time;
+   m_events_time = m_start_time;
+   m_usage_time = m_start_time;
+   m_adaptive_time = m_start_time;
 }
 
 MatchManager::~MatchManager(void)
@@ -71,109 +168,272 @@ MatchManager::~MatchManager(void)
 
 void MatchManager::cleanup(void)
 {
-   if (m_FENs_file.is_open())
-      m_FENs_file.close();
    if (m_pgn_file.is_open())
       m_pgn_file.close();
 
-   for (uint i = 0; i < options.num_threads; i++)
-      if (m_thread[i].joinable())
-         m_thread[i].join();
+   // the games end once their engines have quit (shut_down_all_engines)
+   if (m_game_mgr != nullptr)
+      for (uint i = 0; i < m_num_slots; i++)
+         while (m_game_mgr[i].m_thread_running)
+            this_thread::sleep_for(10ms);
+   executor.stop();
 
    delete[] m_game_mgr;
-   delete[] m_thread;
+   delete[] m_metrics;
 }
 
 void MatchManager::main_loop(void)
 {
-   string fen;
-   bool swap_sides = false;
+   m_start_time = chrono::steady_clock::now();
+   m_metrics_time = m_start_time;
+   m_events_time = m_start_time;
+   m_usage_time = m_start_time;
+   m_adaptive_time = m_start_time;
 
+   if (!m_daemon)
+   {
 #if defined(WIN32) || defined(__linux__)
-   // _kbhit is used to detect keypress
-   cout << "\n***** Press any key to exit and terminate match *****\n\n";
+      // _kbhit is used to detect keypress
+      LogLine() << "\n***** Press any key to exit and terminate match *****\n\n";
 #else
-   cout << "\n***** Press Ctrl-C to exit and terminate match *****\n\n";
+      LogLine() << "\n***** Press Ctrl-C to exit and terminate match *****\n\n";
 #endif
+   }
 
    while (!match_completed())
    {
+      // Slots normally claim their next game themselves, when their last game ends. Games are only started here
+      // for slots that are idle: at the start of the match, or after --adaptive allowed more concurrent games.
       for (uint i = 0; i < options.num_threads; i++)
       {
-         if (!new_game_can_start())
+         if (!idle_slot_can_start())
             break;
          if (m_game_mgr[i].m_thread_running == 0)
          {
-            if (m_thread[i].joinable())
-               m_thread[i].join();
-
-            if (!swap_sides)
-               if (get_next_fen(fen) == 0)
+            book_position opening;
+            bool swap_sides;
+            if (!claim_next_game(i, opening, swap_sides, false))
+            {
+               if (m_fens_exhausted)
                   return;
-            m_game_mgr[i].m_fen = fen;
+               continue;
+            }
+            m_game_mgr[i].m_fen = move(opening.fen);
+            m_game_mgr[i].m_opening_moves = move(opening.moves);
             m_game_mgr[i].m_swap_sides = swap_sides;
-            swap_sides = !swap_sides;
-
-            // cout << "Starting thread " << i << ", swap: " << m_game_mgr[i].m_swap_sides << ", FEN: [" << m_game_mgr[i].m_fen << "]\n";
             m_game_mgr[i].m_thread_running = true;
-            m_thread[i] = thread(&GameManager::game_runner, &m_game_mgr[i]);
-            m_total_games_started++;
+            executor.spawn(m_game_mgr[i].game_runner());
          }
       }
-      while (!new_game_can_start() && !match_completed())
+      do
       {
          this_thread::sleep_for(200ms);
          print_results();
          save_pgn();
-         if (_kbhit())
+         sample_usage();
+         write_metrics(false);
+         publish_stats(false);
+         adjust_concurrency();
+         if (m_daemon ? control_cancel_requested(m_match_id) : (interrupted || (_kbhit() != 0)))
+            return;
+         if (m_fens_exhausted)
             return;
          for (uint i = 0; i < options.num_threads; i++)
-            if (m_game_mgr[i].m_engine_disconnected || m_game_mgr[i].is_engine_unresponsive() || (!options.continue_on_error && m_game_mgr[i].m_error))
+         {
+            m_game_mgr[i].kill_hung_engines();
+            if (m_game_mgr[i].m_engine_disconnected || (!options.continue_on_error && m_game_mgr[i].m_error))
                return;
+         }
+      } while (!idle_slot_can_start() && !match_completed());
+   }
+}
+
+// claim_next_game picks the next game (opening and sides) for a slot, and counts it as started. It's called by the main loop
+// for idle slots, and by each slot's game thread when its game ends (replacing is true: the finishing game is still
+// counted as in progress).
+bool MatchManager::claim_next_game(uint slot, book_position &opening, bool &swap_sides, bool replacing)
+{
+   lock_guard<mutex> lock(m_game_mutex);
+
+   check_sprt();
+   if (m_stopping)
+      return false;
+   if (!options.replay_filename.empty())
+   {
+      // each game is replayed in the slot it was recorded in
+      if (!trace_replay.next_game(slot, opening.fen, opening.moves, swap_sides))
+         return false;
+   }
+   else
+   {
+      if ((m_total_games_started >= options.num_games_to_play) || (num_games_in_progress() - (replacing ? 1 : 0) >= m_active_slots))
+         return false;
+      if (!m_next_swap_sides)
+      {
+         if (get_next_opening(m_next_opening) == 0)
+         {
+            m_fens_exhausted = true;
+            return false;
+         }
       }
+      opening = m_next_opening;
+      swap_sides = m_next_swap_sides;
+      m_next_swap_sides = !m_next_swap_sides;
    }
+
+   if (log_tracing())
+   {
+      string text = (swap_sides ? "1 " : "0 ") + opening.fen;
+      if (!opening.moves.empty())
+         text += " moves " + opening.moves;
+      log_write(slot, LOG_NO_ENGINE, LOG_TRACE_GAME, text.c_str(), text.length());
+   }
+   // LogLine() << "Starting game in slot " << slot << ", swap: " << swap_sides << ", FEN: [" << opening.fen << "]\n";
+   // the game must be counted as started before it can finish
+   result_counts started = {};
+   started.games_started = 1;
+   m_metrics[slot].results.add(started);
+   m_totals.add(started);
+   m_total_games_started++;
+   return true;
 }
 
+// match_completed returns true once all the games have been played, or, if the match was stopped early (by the SPRT,
+// or Ctrl-C), the games in progress have ended.
 bool MatchManager::match_completed(void)
 {
-   return ((m_total_games_started >= options.num_games_to_play) && (num_games_in_progress() == 0));
+   return (((m_total_games_started >= options.num_games_to_play) || m_stopping) && (num_games_in_progress() == 0));
 }
 
-bool MatchManager::new_game_can_start(void)
+// match_failed returns true if the match ended because of an engine that disconnected, or an error (without --continue).
+bool MatchManager::match_failed(void)
 {
-   return ((m_total_games_started < options.num_games_to_play) && (num_games_in_progress() < options.num_threads));
+   for (uint i = 0; i < options.num_threads; i++)
+      if (m_game_mgr[i].m_engine_disconnected || (!options.continue_on_error && m_game_mgr[i].m_error))
+         return true;
+   return false;
 }
 
+// idle_slot_can_start returns true if a game could be started in an idle slot.
+bool MatchManager::idle_slot_can_start(void)
+{
+   if (m_stopping)
+      return false;
+   if (!options.replay_filename.empty())
+   {
+      lock_guard<mutex> lock(m_game_mutex);
+      for (uint i = 0; i < options.num_threads; i++)
+         if (!m_game_mgr[i].m_thread_running && trace_replay.has_game(i))
+            return true;
+      return false;
+   }
+   return ((m_total_games_started < options.num_games_to_play) && (num_games_in_progress() < m_active_slots));
+}
+
+// num_games_in_progress uses the match totals, so it doesn't need to check every slot.
 uint MatchManager::num_games_in_progress(void)
 {
-   uint games = 0;
-   for (uint i = 0; i < options.num_threads; i++)
-      if (m_game_mgr[i].m_thread_running)
-         games++;
-   return games;
+   result_counts totals = m_totals.snapshot();
+   return (uint)(totals.games_started - totals.games_completed);
 }
 
+// initialize sets up the match given on the command line.
 int MatchManager::initialize(void)
 {
+   if (new_match() == 0)
+      return 0;
+
+   // without the cgroup, the engines are still limited with rlimits
+   if (!options.cgroup_dir.empty() && options.replay_filename.empty() && (engine_limits_set(options.limits_1) || engine_limits_set(options.limits_2)))
+      cgroup_init(options.cgroup_dir);
+
+   return start(options.num_threads, false);
+}
+
+// start allocates the game slots, and starts the game executor.
+int MatchManager::start(uint num_slots, bool daemon)
+{
+   m_num_slots = num_slots;
+   m_daemon = daemon;
+   m_game_mgr = new GameManager[num_slots];
+   if (m_metrics == nullptr)
+      m_metrics = new SlotMetrics[num_slots];
+   m_engine_config.assign(num_slots * 2, "");
+   for (uint i = 0; i < num_slots; i++)
+   {
+      m_game_mgr[i].m_slot = i;
+      m_game_mgr[i].m_metrics = &m_metrics[i];
+      m_game_mgr[i].m_match_totals = &m_totals;
+      m_game_mgr[i].m_claim_next_game = [this](uint slot, book_position &opening, bool &swap_sides)
+      {
+         return claim_next_game(slot, opening, swap_sides, true);
+      };
+      m_game_mgr[i].m_configure_engine = [this](Engine *engine)
+      {
+         set_engine_options(engine);
+         send_engine_custom_commands(engine);
+      };
+   }
+
+#ifndef WIN32
+   // each game has four pipes to its engines, and their two pidfds
+   struct rlimit limit;
+   if ((getrlimit(RLIMIT_NOFILE, &limit) == 0) && (limit.rlim_cur < limit.rlim_max))
+   {
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &limit);
+   }
+#endif
+
+#ifdef __linux__
+   uint num_workers = (options.num_workers != 0) ? options.num_workers : thread::hardware_concurrency();
+#else
+   uint num_workers = num_slots; // engine output is read with blocking reads: one worker per game
+#endif
+   if (executor.start(min(num_workers, num_slots)) == 0)
+   {
+      LogLine() << "Error: could not start the game executor\n";
+      return 0;
+   }
+
+   return 1;
+}
+
+// new_match sets up a match with the current options: the command line's, or, in daemon mode, each queued match's.
+// No game may be running.
+int MatchManager::new_match(void)
+{
+   reset_match();
+
    if (options.engine_file_name_1.empty() || options.engine_file_name_2.empty())
    {
-      cout << "Error: must specify two engines\n";
+      LogLine() << "Error: must specify two engines\n";
       return 0;
    }
 
-   if (!options.fens_filename.empty())
+   if (!options.syzygy_path.empty())
    {
-      m_FENs_file.open(options.fens_filename, ios::in);
-      if (!m_FENs_file.is_open())
+      if (options.fourplayerchess || !options.variant.empty())
       {
-         cout << "Error: could not open FEN file " << options.fens_filename << "\n";
+         LogLine() << "Error: --syzygy is only supported for standard chess\n";
          return 0;
       }
+      // daemon mode: the tablebases stay loaded for the next match
+      if (options.syzygy_path != m_tablebase_path)
+      {
+         if (tablebase_init(options.syzygy_path) == 0)
+            return 0;
+         m_tablebase_path = options.syzygy_path;
+      }
    }
 
+   if (!options.fens_filename.empty())
+      if (m_book.load(options.fens_filename) == 0)
+         return 0;
+
    if (!options.pgn_filename.empty() && !options.pgn4_filename.empty())
    {
-      cout << "Error: must not choose both PGN and PGN4\n";
+      LogLine() << "Error: must not choose both PGN and PGN4\n";
       return 0;
    }
 
@@ -184,69 +444,187 @@ int MatchManager::initialize(void)
       m_pgn_file.open(filename, ios::out);
       if (!m_pgn_file.is_open())
       {
-         cout << "Error: could not open PGN file " << filename << "\n";
+         LogLine() << "Error: could not open PGN file " << filename << "\n";
          return 0;
       }
    }
    else
       options.pgn4_format = options.fourplayerchess;
 
-   m_game_mgr = new GameManager[options.num_threads];
-   m_thread = new thread[options.num_threads];
+   // the slots are only allocated by start, after the first match has been set up, unless in daemon mode
+   if (m_metrics == nullptr)
+      m_metrics = new SlotMetrics[options.num_threads];
+   for (uint i = 0; i < m_num_slots; i++)
+   {
+      m_metrics[i].reset();
+      m_game_mgr[i].new_match();
+   }
+   m_usage.init(options.num_threads);
+   m_active_slots = options.num_threads;
+   if (options.adaptive_threads && options.replay_filename.empty())
+      m_active_slots = min(options.min_threads, options.num_threads);
 
    return 1;
 }
 
-int MatchManager::load_all_engines(void)
+// engine_config returns the current options that an engine is started and set up with. A daemon mode match keeps a
+// slot's engine from the last match if they are the same.
+string MatchManager::engine_config(engine_number number)
 {
-   for (uint i = 0; i < options.num_threads; i++)
+   bool first = (number == FIRST);
+   const engine_limits &limits = first ? options.limits_1 : options.limits_2;
+   ostringstream config;
+   config << (first ? options.engine_file_name_1 : options.engine_file_name_2) << "\n" << (first ? options.uci_1 : options.uci_2) << " "
+          << (first ? options.num_cores_1 : options.num_cores_2) << " " << (first ? options.mem_size_1 : options.mem_size_2) << " "
+          << limits.mem_mb << " " << limits.cpu_percent << " " << limits.max_procs << " " << limits.set_nice << " " << limits.nice << " " << limits.sched_policy;
+   for (const string &command : first ? options.custom_commands_1 : options.custom_commands_2)
+      config << "\n" << command;
+   return config.str();
+}
+
+// prepare_engines starts the match's engines, and sets their options. In daemon mode, an engine that's still running
+// from the last match with the same configuration is kept; the others are shut down (in parallel) and started again.
+int MatchManager::prepare_engines(void)
+{
+   // engines are indexed slot * 2 + engine number, and their IDs are index + 1
+   auto slot_engine = [this](uint index) -> Engine & { return (index % 2 == FIRST) ? m_game_mgr[index / 2].m_engine1 : m_game_mgr[index / 2].m_engine2; };
+   string config[2] = {engine_config(FIRST), engine_config(SECOND)};
+   vector<uint> to_load;
+   vector<Engine *> quitting;
+   uint kept = 0;
+
+   for (uint i = 0; i < options.num_threads * 2; i++)
    {
-      if (m_game_mgr[i].m_engine1.load_engine(options.engine_file_name_1, i * 2 + 1, FIRST, options.uci_1) == 0)
+      Engine &engine = slot_engine(i);
+      if (!m_engine_config[i].empty() && engine.is_running())
       {
-         cout << "failed to load engine " << options.engine_file_name_1 << "\n";
-         return 0;
+         if (m_engine_config[i] == config[i % 2])
+         {
+            engine.new_match();
+            kept++;
+            continue;
+         }
+         engine.send_quit_cmd();
+         quitting.push_back(&engine);
       }
-      if (m_game_mgr[i].m_engine2.load_engine(options.engine_file_name_2, i * 2 + 2, SECOND, options.uci_2) == 0)
+      m_engine_config[i].clear();
+      to_load.push_back(i);
+   }
+   Engine::wait_for_exit(quitting);
+
+   if (kept != 0)
+      LogLine() << "keeping " << kept << " engines from the last match.\n";
+   if (to_load.empty())
+      return 1;
+
+   LogLine() << "loading engines...\n";
+
+   for (uint i : to_load)
+   {
+      const string &file_name = (i % 2 == FIRST) ? options.engine_file_name_1 : options.engine_file_name_2;
+      if (slot_engine(i).load_engine(file_name, i + 1, i / 2, (engine_number)(i % 2), (i % 2 == FIRST) ? options.uci_1 : options.uci_2) == 0)
       {
-         cout << "failed to load engine " << options.engine_file_name_2 << "\n";
+         LogLine() << "failed to load engine " << file_name << "\n";
          return 0;
       }
    }
+
+   LogLine() << "engines loaded.\n";
+
+   for (uint i : to_load)
+   {
+      set_engine_options(&slot_engine(i));
+      send_engine_custom_commands(&slot_engine(i));
+      m_engine_config[i] = config[i % 2];
+   }
    return 1;
 }
 
+// run_match plays a match queued on the control socket (daemon mode), and reports its results.
+void MatchManager::run_match(uint64_t id, const string &spec)
+{
+   m_match_id = id;
+   LogLine(LOG_NO_SLOT, LOG_NO_ENGINE, LOG_EVENT) << "{\"event\":\"match_start\",\"id\":" << id << ",\"spec\":" << json_string{spec} << "}";
+   LogLine() << "Match " << id << ": " << spec << "\n";
+
+   match_state state = MATCH_FAILED;
+   if ((new_match() != 0) && (prepare_engines() != 0))
+   {
+      main_loop();
+      finish_match(control_cancel_requested(id) || match_failed());
+      state = control_cancel_requested(id) ? MATCH_CANCELLED : (match_failed() ? MATCH_FAILED : MATCH_DONE);
+      print_results();
+      save_pgn();
+      write_metrics(true);
+      if (options.print_stats)
+         print_statistics();
+   }
+   if (m_pgn_file.is_open())
+      m_pgn_file.close();
+
+   publish_stats(true);
+   control_end_match(id, state, m_results);
+   LogLine(LOG_NO_SLOT, LOG_NO_ENGINE, LOG_EVENT) << "{\"event\":\"match_end\",\"id\":" << id << ",\"state\":\"" << match_state_name(state) << "\"}";
+   LogLine() << "Match " << id << " " << match_state_name(state) << ".\n";
+}
+
+// finish_match ends a daemon mode match once main_loop has returned. The games in progress are played to the end, or,
+// if the match was cancelled or failed (abort), their engines are shut down (they're started again for the next match).
+void MatchManager::finish_match(bool abort)
+{
+   m_stopping = true; // no more games are claimed
+   while (true)
+   {
+      if (!abort && control_cancel_requested(m_match_id))
+         abort = true;
+      vector<Engine *> engines;
+      bool running = false;
+      for (uint i = 0; i < options.num_threads; i++)
+      {
+         if (!m_game_mgr[i].m_thread_running)
+            continue;
+         running = true;
+         m_game_mgr[i].kill_hung_engines();
+         if (abort)
+         {
+            for (Engine *engine : {&m_game_mgr[i].m_engine1, &m_game_mgr[i].m_engine2})
+            {
+               if (engine->is_running() && !engine->m_quit_cmd_sent)
+               {
+                  engine->send_quit_cmd();
+                  engines.push_back(engine);
+               }
+            }
+         }
+      }
+      if (!running)
+         break;
+      Engine::wait_for_exit(engines);
+      save_pgn();
+      this_thread::sleep_for(10ms);
+   }
+}
+
 void MatchManager::shut_down_all_engines(void)
 {
    if (m_engines_shut_down)
       return;
 
    m_engines_shut_down = true;
+   m_stopping = true; // no more games are claimed
 
-   for (uint i = 0; i < options.num_threads; i++)
+   vector<Engine *> engines;
+   for (uint i = 0; i < m_num_slots; i++)
    {
       m_game_mgr[i].m_engine1.send_quit_cmd();
       m_game_mgr[i].m_engine2.send_quit_cmd();
+      engines.push_back(&m_game_mgr[i].m_engine1);
+      engines.push_back(&m_game_mgr[i].m_engine2);
    }
 
-   cout << "shutting down engines...\n";
-
-   // poll for all engines shut down, for up to 500 ms.
-   int num_engines_running;
-   for (int x = 0; x < 10; x++)
-   {
-      this_thread::sleep_for(50ms);
-      num_engines_running = 0;
-      for (uint i = 0; i < options.num_threads; i++)
-         num_engines_running += (m_game_mgr[i].m_engine1.is_running() + m_game_mgr[i].m_engine2.is_running());
-      if (num_engines_running == 0)
-         return;
-   }
+   LogLine() << "shutting down engines...\n";
 
-   for (uint i = 0; i < options.num_threads; i++)
-   {
-      m_game_mgr[i].m_engine1.force_exit();
-      m_game_mgr[i].m_engine2.force_exit();
-   }
+   Engine::wait_for_exit(engines);
 }
 
 void MatchManager::set_engine_options(Engine *engine)
@@ -298,25 +676,18 @@ void MatchManager::send_engine_custom_commands(Engine *engine)
 
 void MatchManager::print_results(void)
 {
-   uint engine1_wins, engine2_wins, draws, illegal_move_games, engine1_losses_on_time, engine2_losses_on_time;
-   engine1_wins = engine2_wins = draws = illegal_move_games = engine1_losses_on_time = engine2_losses_on_time = 0;
-
    // don't print results again unless the total number of games completed has changed.
-   static int last_total_games_completed = 0;
-   int total_games_completed = m_total_games_started - num_games_in_progress();
-   if (total_games_completed == last_total_games_completed)
+   result_counts totals = m_totals.snapshot();
+   if (totals.games_completed == m_last_games_completed)
       return;
-   last_total_games_completed = total_games_completed;
+   m_last_games_completed = totals.games_completed;
 
-   for (uint i = 0; i < options.num_threads; i++)
-   {
-      engine1_wins += m_game_mgr[i].m_engine1_wins;
-      engine2_wins += m_game_mgr[i].m_engine2_wins;
-      draws += m_game_mgr[i].m_draws;
-      illegal_move_games += m_game_mgr[i].m_illegal_move_games;
-      engine1_losses_on_time += m_game_mgr[i].m_engine1_losses_on_time;
-      engine2_losses_on_time += m_game_mgr[i].m_engine2_losses_on_time;
-   }
+   uint64_t engine1_wins = totals.wins[FIRST];
+   uint64_t engine2_wins = totals.wins[SECOND];
+   uint64_t draws = totals.draws;
+   uint64_t illegal_move_games = totals.illegal_move_games;
+   uint64_t engine1_losses_on_time = totals.losses_on_time[FIRST];
+   uint64_t engine2_losses_on_time = totals.losses_on_time[SECOND];
 
    double engine1_score = ((double)engine1_wins + (double)draws / 2.0) / (double)(engine1_wins + engine2_wins + draws);
    double engine2_score = 1.0 - engine1_score;
@@ -327,27 +698,244 @@ void MatchManager::print_results(void)
       ss << "  [games ending in illegal move: " << illegal_move_games << "]";
    if ((engine1_losses_on_time != 0) || (engine2_losses_on_time != 0))
       ss << "  [losses on time: " << engine1_losses_on_time << " / " << engine2_losses_on_time <<  "]";
+   if ((totals.hangs[FIRST] != 0) || (totals.hangs[SECOND] != 0))
+      ss << "  [engine restarts: " << totals.hangs[FIRST] << " / " << totals.hangs[SECOND] <<  "]";
+   if ((totals.limit_breaches[FIRST] != 0) || (totals.limit_breaches[SECOND] != 0))
+      ss << "  [limit breaches: " << totals.limit_breaches[FIRST] << " / " << totals.limit_breaches[SECOND] <<  "]";
+   if (options.sprt)
+   {
+      double lower, upper;
+      sprt_bounds(options.sprt_alpha, options.sprt_beta, lower, upper);
+      ss << fixed << setprecision(2) << "  [llr " << sprt_llr(totals, options.sprt_elo0, options.sprt_elo1) << " (" << lower << ", " << upper << ")]";
+   }
 
-   cout << setprecision(4);
-   cout << "Engine1 (" << options.engine_file_name_1 << "): " << engine1_wins << " wins. Engine2 (" << options.engine_file_name_2 << "): " << engine2_wins <<  " wins.  "
-        << draws << " draws.  " << 100.0 * engine1_score << "% - " << 100.0 * engine2_score << "%  elo " << (elo_diff >= 0.0 ? "+" : "") << elo_diff << ss.str() << "\n";
+   LogLine() << setprecision(4) << "Engine1 (" << options.engine_file_name_1 << "): " << engine1_wins << " wins. Engine2 (" << options.engine_file_name_2 << "): " << engine2_wins <<  " wins.  "
+             << draws << " draws.  " << 100.0 * engine1_score << "% - " << 100.0 * engine2_score << "%  elo " << (elo_diff >= 0.0 ? "+" : "") << elo_diff << ss.str() << "\n";
 
    return;
 }
 
-int MatchManager::get_next_fen(string &fen)
+// print_statistics shows the harness's throughput, and how much CPU time the harness itself used (not counting the engines).
+void MatchManager::print_statistics(void)
+{
+   result_counts totals = m_totals.snapshot();
+   uint64_t games = totals.games_completed;
+   uint64_t plies = totals.plies;
+   double seconds = chrono::duration<double>(chrono::steady_clock::now() - m_start_time).count();
+
+   LogLine() << fixed << setprecision(2) << "Statistics: " << games << " games, " << plies << " plies in " << seconds << " s.  "
+             << (double)games / seconds << " games/s, " << (double)plies / seconds << " plies/s\n";
+#ifndef WIN32
+   struct rusage usage;
+   if (getrusage(RUSAGE_SELF, &usage) == 0)
+   {
+      double cpu_seconds = (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) + (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+      LogLine() << fixed << setprecision(2) << "Harness CPU: " << cpu_seconds << " s (" << (100.0 * cpu_seconds / seconds) << "% of one core), "
+                << (plies ? (1e6 * cpu_seconds / (double)plies) : 0.0) << " us/ply\n";
+   }
+#endif
+   if (options.sample_ms)
+      LogLine() << m_usage.format_report();
+}
+
+// sample_usage samples the engine processes' resource usage every --sample ms.
+void MatchManager::sample_usage(void)
+{
+   if (options.sample_ms == 0)
+      return;
+
+   chrono::steady_clock::time_point now = chrono::steady_clock::now();
+   chrono::nanoseconds interval = now - m_usage_time;
+   if (interval < chrono::milliseconds(options.sample_ms))
+      return;
+   m_usage_time = now;
+
+   for (uint i = 0; i < options.num_threads; i++)
+   {
+      m_usage.sample(m_game_mgr[i].m_engine1, interval);
+      m_usage.sample(m_game_mgr[i].m_engine2, interval);
+   }
+}
+
+// write_metrics rewrites the metrics file (--metrics), at most once a second unless force is true.
+void MatchManager::write_metrics(bool force)
+{
+   if (options.metrics_filename.empty())
+      return;
+
+   chrono::steady_clock::time_point now = chrono::steady_clock::now();
+   double seconds = chrono::duration<double>(now - m_metrics_time).count();
+   if (!force && (seconds < 1.0))
+      return;
+
+   result_counts totals = m_totals.snapshot();
+   uint64_t plies = totals.plies;
+   double plies_per_second = (seconds > 0.0) ? ((double)(plies - m_metrics_plies) / seconds) : 0.0;
+   m_metrics_time = now;
+   m_metrics_plies = plies;
+
+   string text = format_metrics(m_metrics, options.num_threads, m_active_slots, totals, plies_per_second);
+   if (options.sample_ms)
+      text += m_usage.format_metrics();
+   if (write_metrics_file(options.metrics_filename, text) == 0)
+      LogLine() << "Error: could not write metrics file " << options.metrics_filename << "\n";
+}
+
+// publish_stats publishes a "stats" event (--events) with the match results so far, and in daemon mode sets them as the
+// running match's results, at most once a second unless final is true (the end of the match).
+void MatchManager::publish_stats(bool final)
 {
-   if (!m_FENs_file.is_open())
+   if (!events_enabled() && !m_daemon)
+      return;
+
+   chrono::steady_clock::time_point now = chrono::steady_clock::now();
+   double seconds = chrono::duration<double>(now - m_events_time).count();
+   if (!final && (seconds < 1.0))
+      return;
+
+   result_counts totals = m_totals.snapshot();
+   double plies_per_second = (seconds > 0.0) ? ((double)(totals.plies - m_events_plies) / seconds) : 0.0;
+   m_events_time = now;
+   m_events_plies = totals.plies;
+
+   string results = results_json(totals, plies_per_second);
+   if (events_enabled())
+      LogLine(LOG_NO_SLOT, LOG_NO_ENGINE, LOG_EVENT) << "{\"event\":\"stats\",\"final\":" << (final ? "true" : "false") << "," << results << "}";
+   m_results = "{" + results + "}";
+   if (m_daemon && !final)
+      control_update_match(m_match_id, m_results);
+}
+
+// results_json returns the match results as the members of a JSON object.
+string MatchManager::results_json(const result_counts &totals, double plies_per_second)
+{
+   uint64_t decided = totals.wins[FIRST] + totals.wins[SECOND] + totals.draws;
+   double engine1_score = decided ? ((double)totals.wins[FIRST] + (double)totals.draws / 2.0) / (double)decided : 0.5;
+   ostringstream results;
+   results << "\"games_started\":" << m_total_games_started
+         << ",\"games_completed\":" << totals.games_completed << ",\"wins\":[" << totals.wins[FIRST] << "," << totals.wins[SECOND] << "],\"draws\":" << totals.draws
+         << ",\"losses_on_time\":[" << totals.losses_on_time[FIRST] << "," << totals.losses_on_time[SECOND] << "],\"disconnects\":[" << totals.disconnects[FIRST]
+         << "," << totals.disconnects[SECOND] << "],\"hangs\":[" << totals.hangs[FIRST] << "," << totals.hangs[SECOND] << "],\"limit_breaches\":[" << totals.limit_breaches[FIRST] << "," << totals.limit_breaches[SECOND] << "],\"illegal_move_games\":" << totals.illegal_move_games << ",\"score\":" << engine1_score << ",\"elo\":";
+   if ((engine1_score > 0.0) && (engine1_score < 1.0))
+      results << 400.0 * log10(engine1_score / (1.0 - engine1_score));
+   else
+      results << "null";
+   results << ",\"plies\":" << totals.plies << ",\"plies_per_second\":" << plies_per_second << ",\"active_slots\":" << m_active_slots;
+   if (options.sprt)
    {
-      fen = "";
+      double lower, upper;
+      sprt_bounds(options.sprt_alpha, options.sprt_beta, lower, upper);
+      results << ",\"sprt\":{\"llr\":" << sprt_llr(totals, options.sprt_elo0, options.sprt_elo1) << ",\"lower\":" << lower << ",\"upper\":" << upper
+              << ",\"result\":" << ((m_sprt_result == nullptr) ? "null" : "\"" + string(m_sprt_result) + "\"") << "}";
+   }
+   return results.str();
+}
+
+// adjust_concurrency is the --adaptive controller. Every ADAPTIVE_INTERVAL_S seconds it checks the timing health of the
+// games played since the last check: no losses on time, the harness latency's 99th percentile within --maxlatency, and
+// each engine's average NPS no more than --maxnpsdrop % below its NPS at --minthreads concurrent games (an engine
+// slowing down means the games are competing for CPU). If timing health is within target, one more concurrent game is
+// allowed (two times as many, until the target is first missed), otherwise a quarter fewer. Games that are already
+// running are never stopped: a slot is only left idle once its game finishes.
+void MatchManager::adjust_concurrency(void)
+{
+   if (!options.adaptive_threads || !options.replay_filename.empty())
+      return;
+
+   chrono::steady_clock::time_point now = chrono::steady_clock::now();
+   double seconds = chrono::duration<double>(now - m_adaptive_time).count();
+   if (seconds < ADAPTIVE_INTERVAL_S)
+      return;
+
+   timing_totals timing = sum_timing(m_metrics, options.num_threads);
+   result_counts totals = m_totals.snapshot();
+   uint64_t buckets[METRICS_LATENCY_BUCKETS];
+   uint64_t moves = 0;
+   for (int b = 0; b < METRICS_LATENCY_BUCKETS; b++)
+   {
+      buckets[b] = timing.latency_buckets[b] - m_adaptive_timing.latency_buckets[b];
+      moves += buckets[b];
+   }
+   uint64_t losses_on_time = (totals.losses_on_time[FIRST] + totals.losses_on_time[SECOND]) -
+                             (m_adaptive_results.losses_on_time[FIRST] + m_adaptive_results.losses_on_time[SECOND]);
+   if ((moves < ADAPTIVE_MIN_MOVES) && (losses_on_time == 0))
+      return; // keep measuring
+
+   double games_per_hour = 3600.0 * (double)(totals.games_completed - m_adaptive_results.games_completed) / seconds;
+   double latency_ms = 1000.0 * latency_quantile(buckets, moves, 0.99);
+   double nps_drop[2] = {0.0, 0.0};
+   for (int e = 0; e < 2; e++)
+   {
+      uint64_t search_ms = timing.search_ms[e] - m_adaptive_timing.search_ms[e];
+      if (search_ms == 0)
+         continue; // the engine doesn't report nodes and time
+      double nps = 1000.0 * (double)(timing.nodes[e] - m_adaptive_timing.nodes[e]) / (double)search_ms;
+      if ((m_active_slots <= options.min_threads) && (nps > m_baseline_nps[e]))
+         m_baseline_nps[e] = nps;
+      if (m_baseline_nps[e] > 0.0)
+         nps_drop[e] = 100.0 * (1.0 - nps / m_baseline_nps[e]);
+   }
+   m_adaptive_time = now;
+   m_adaptive_timing = timing;
+   m_adaptive_results = totals;
+
+   stringstream health;
+   health << fixed << setprecision(1) << "losses on time: " << losses_on_time << ", harness latency p99: " << latency_ms
+          << " ms, NPS drop: " << nps_drop[FIRST] << "% / " << nps_drop[SECOND] << "%, " << setprecision(0) << games_per_hour << " games/hour";
+
+   uint active_slots = m_active_slots;
+   if ((losses_on_time != 0) || (latency_ms > options.max_latency_ms) ||
+       (nps_drop[FIRST] > options.max_nps_drop) || (nps_drop[SECOND] > options.max_nps_drop))
+   {
+      m_adaptive_slow_start = false;
+      active_slots -= max(1u, active_slots / 4);
+      active_slots = max(active_slots, options.min_threads);
+   }
+   else if (m_adaptive_slow_start)
+      active_slots = min(active_slots * 2, options.num_threads);
+   else
+      active_slots = min(active_slots + 1, options.num_threads);
+
+   if (active_slots != m_active_slots)
+   {
+      LogLine() << "Adaptive: " << (active_slots > m_active_slots ? "increasing" : "decreasing") << " concurrent games from "
+                << m_active_slots << " to " << active_slots << " (" << health.str() << ")\n";
+      m_active_slots = active_slots;
+   }
+}
+
+// check_sprt stops the match (no more games are started) once the SPRT (--sprt) accepts H0 or H1. It's checked before
+// each game is claimed, with m_game_mutex held.
+void MatchManager::check_sprt(void)
+{
+   if (!options.sprt || (m_sprt_result != nullptr))
+      return;
+
+   double llr = sprt_llr(m_totals.snapshot(), options.sprt_elo0, options.sprt_elo1);
+   double lower, upper;
+   sprt_bounds(options.sprt_alpha, options.sprt_beta, lower, upper);
+   if ((llr > lower) && (llr < upper))
+      return;
+
+   m_sprt_result = (llr >= upper) ? "H1" : "H0";
+   LogLine() << fixed << setprecision(2) << "SPRT: " << m_sprt_result.load() << " accepted (llr " << llr << ", bounds " << lower << ", " << upper
+             << "). Finishing the games in progress.\n";
+   m_stopping = true;
+}
+
+int MatchManager::get_next_opening(book_position &opening)
+{
+   if (options.fens_filename.empty())
+   {
+      opening = {"", ""};
       return 1;
    }
-   getline(m_FENs_file, fen);
-   if (fen.empty())
+   if (m_next_opening_index >= m_book.size())
    {
-      cout << "Used all FENs.\n";
+      LogLine() << "Used all FENs.\n";
       return 0;
    }
+   opening = m_book.get_position(m_next_opening_index++);
    return 1;
 }
 
@@ -358,88 +946,273 @@ void MatchManager::save_pgn(void)
 
    for (uint i = 0; i < options.num_threads; i++)
    {
-      if (m_game_mgr[i].m_pgn_valid.load(memory_order_acquire))
-      {
-         m_game_mgr[i].m_pgn_valid = false;
-         m_pgn_file << m_game_mgr[i].m_pgn;
-      }
+      m_game_mgr[i].take_pgn(m_pgn_buffer);
+      m_pgn_file.write(m_pgn_buffer.data(), m_pgn_buffer.size());
    }
 }
 
+static vector<string> daemon_args;     // the daemon's command line options: the defaults for its matches' options
+static uint daemon_slots;
+
 int parse_cmd_line_options(int argc, char* argv[])
 {
+   string error;
+   daemon_args.assign(argv + 1, argv + argc);
+   if (parse_options(daemon_args, {}, options, error) == 0)
+   {
+      if (!error.empty())
+         cerr << "error: " << error << "\n";
+      return 0;
+   }
+   daemon_slots = options.num_threads;
+   return 1;
+}
+
+// parse_match_options parses the options of a match queued on the control socket (--daemon). It's called by the control
+// socket's thread.
+int parse_match_options(const vector<string> &args, options_info &match_options, string &error)
+{
+   if (parse_options(args, daemon_args, match_options, error) == 0)
+   {
+      if (error.empty())
+         error = "invalid match options";
+      return 0;
+   }
+   if (match_options.engine_file_name_1.empty() || match_options.engine_file_name_2.empty())
+   {
+      error = "must specify two engines";
+      return 0;
+   }
+   if (match_options.num_threads > daemon_slots)
+   {
+      error = "--threads must not be more than the daemon's (" + to_string(daemon_slots) + ")";
+      return 0;
+   }
+   return 1;
+}
+
+// parse_options parses command line options into opts. It returns 0 if they're invalid (error is then set, unless the
+// error was already reported) or only --help was wanted. default_args, if any, are the options that apply unless args
+// give them again: a daemon mode match's args can't include the options that only apply to the whole daemon.
+int parse_options(const vector<string> &args, const vector<string> &default_args, options_info &opts, string &error)
+{
+   string log_sink;
+   string limits_1;
+   string limits_2;
+   string sprt;
+   bool match_spec = !default_args.empty();
+
    try
    {
       po::options_description desc("Command line options");
       desc.add_options()
          ("help",      "print help message")
-         ("e1",         po::value<string>(&options.engine_file_name_1), "first engine's file name")
-         ("e2",         po::value<string>(&options.engine_file_name_2), "second engine's file name")
+         ("e1",         po::value<string>(&opts.engine_file_name_1), "first engine's file name")
+         ("e2",         po::value<string>(&opts.engine_file_name_2), "second engine's file name")
          ("x1",         "first engine uses xboard protocol. (UCI is the default protocol.)")
          ("x2",         "second engine uses xboard protocol. (UCI is the default protocol.)")
-         ("cores1",     po::value<uint>(&options.num_cores_1)->default_value(1), "first engine number of cores")
-         ("cores2",     po::value<uint>(&options.num_cores_2)->default_value(1), "second engine number of cores")
-         ("mem1",       po::value<uint>(&options.mem_size_1)->default_value(128), "first engine memory usage (MB)")
-         ("mem2",       po::value<uint>(&options.mem_size_2)->default_value(128), "second engine memory usage (MB)")
-         ("custom1",    po::value<vector<string>>(&options.custom_commands_1), "first engine custom command. e.g. --custom1 \"setoption name Style value Risky\"")
-         ("custom2",    po::value<vector<string>>(&options.custom_commands_2), "second engine custom command. Note: --custom1 and --custom2 can be used more than once in the command line.")
+         ("cores1",     po::value<uint>(&opts.num_cores_1)->default_value(1), "first engine number of cores")
+         ("cores2",     po::value<uint>(&opts.num_cores_2)->default_value(1), "second engine number of cores")
+         ("mem1",       po::value<uint>(&opts.mem_size_1)->default_value(128), "first engine memory usage (MB)")
+         ("mem2",       po::value<uint>(&opts.mem_size_2)->default_value(128), "second engine memory usage (MB)")
+         ("memslack",   po::value<uint>(&opts.mem_slack_mb)->default_value(256), "memory (MB) an engine may use beyond --mem1/--mem2 (e.g. for code and evaluation data), before it's reported as using too much")
+         ("limits1",    po::value<string>(&limits_1), "first engine resource limits (Linux), e.g. \"mem=512,cpu=100,procs=8,nice=5,sched=batch\": memory (MB), CPU quota (% of a core), processes and threads, niceness, scheduling class (other, batch, idle). An engine that breaches them loses the game and is restarted.")
+         ("limits2",    po::value<string>(&limits_2), "second engine resource limits")
+         ("cgroup",     po::value<string>(&opts.cgroup_dir), "cgroup v2 directory in which each engine gets its own cgroup for --limits1 and --limits2 (e.g. one delegated by systemd). Without it, mem limits the address space, and cpu and procs aren't enforced.")
+         ("custom1",    po::value<vector<string>>(&opts.custom_commands_1), "first engine custom command. e.g. --custom1 \"setoption name Style value Risky\"")
+         ("custom2",    po::value<vector<string>>(&opts.custom_commands_2), "second engine custom command. Note: --custom1 and --custom2 can be used more than once in the command line.")
          ("debug1",     "enable debug for first engine")
          ("debug2",     "enable debug for second engine")
-         ("tc",         po::value<uint>(&options.tc_ms)->default_value(10000), "time control base time (ms)")
-         ("inc",        po::value<uint>(&options.tc_inc_ms)->default_value(100), "time control increment (ms)")
-         ("fixed",      po::value<uint>(&options.tc_fixed_time_move_ms)->default_value(0), "time control fixed time per move (ms). This must be set to 0, unless engines should simply use a fixed amount of time per move.")
-         ("margin",     po::value<uint>(&options.margin_ms)->default_value(50), "An engine loses on time if its clock goes below zero for this amount of time (ms).")
-         ("games",      po::value<uint>(&options.num_games_to_play)->default_value(1000000), "total number of games to play")
-         ("threads",    po::value<uint>(&options.num_threads)->default_value(1), "number of concurrent games to run")
-         ("maxmoves",   po::value<uint>(&options.max_moves)->default_value(1000), "maximum number of moves per game (total) before adjudicating draw regardless of scores")
+         ("tc",         po::value<uint>(&opts.tc_ms)->default_value(10000), "time control base time (ms)")
+         ("inc",        po::value<uint>(&opts.tc_inc_ms)->default_value(100), "time control increment (ms)")
+         ("fixed",      po::value<uint>(&opts.tc_fixed_time_move_ms)->default_value(0), "time control fixed time per move (ms). This must be set to 0, unless engines should simply use a fixed amount of time per move.")
+         ("movestogo",  po::value<uint>(&opts.tc_moves_to_go)->default_value(0), "classical time control: the base time (--tc) is given again after every movestogo moves by each side. 0 = the base time is only given once.")
+         ("nodes1",     po::value<uint>(&opts.node_limit_1)->default_value(0), "first engine searches this many nodes per move (UCI \"go nodes\", xboard \"nps\"), instead of using its clock. 0 = no node limit.")
+         ("nodes2",     po::value<uint>(&opts.node_limit_2)->default_value(0), "second engine searches this many nodes per move. 0 = no node limit.")
+         ("depth",      po::value<uint>(&opts.depth_limit)->default_value(0), "both engines search to this depth per move (UCI \"go depth\", xboard \"sd\"), instead of using their clocks. 0 = no depth limit.")
+         ("margin",     po::value<uint>(&opts.margin_ms)->default_value(50), "An engine loses on time if its clock goes below zero for this amount of time (ms).")
+         ("hangtime",   po::value<uint>(&opts.hang_time_ms)->default_value(5000), "An engine that doesn't reply to a readiness check within this time (ms) is restarted, and loses the game if it was starting. 0: no limit.")
+         ("games",      po::value<uint>(&opts.num_games_to_play)->default_value(1000000), "total number of games to play")
+         ("sprt",       po::value<string>(&sprt), "stop the match early with a sequential probability ratio test, e.g. \"0,5,0.05,0.05\": elo0,elo1,alpha,beta. The match stops once the results accept H0 (Engine1 is elo0 stronger than Engine2) or H1 (elo1 stronger), with false positive rate alpha and false negative rate beta, or after --games games.")
+         ("threads",    po::value<uint>(&opts.num_threads)->default_value(1), "number of concurrent games to run")
+         ("workers",    po::value<uint>(&opts.num_workers)->default_value(0), "number of worker threads running the games (Linux). 0 = one per CPU core.")
+         ("adaptive",   "adjust the number of concurrent games during the match, between --minthreads and --threads, to keep timing health within target: no losses on time, harness latency within --maxlatency and engine NPS within --maxnpsdrop")
+         ("minthreads", po::value<uint>(&opts.min_threads)->default_value(1), "smallest number of concurrent games for --adaptive. The match starts with this many.")
+         ("maxlatency", po::value<uint>(&opts.max_latency_ms)->default_value(5), "--adaptive target: 99th percentile of the harness latency (ms)")
+         ("maxnpsdrop", po::value<uint>(&opts.max_nps_drop)->default_value(10), "--adaptive target: largest drop of an engine's average NPS (%), compared to its NPS at --minthreads concurrent games")
+         ("maxmoves",   po::value<uint>(&opts.max_moves)->default_value(1000), "maximum number of moves per game (total) before adjudicating draw regardless of scores")
+         ("repcycle",   po::value<uint>(&opts.repetition_cycle)->default_value(0), "longest cycle of moves (plies) to detect as a repetition draw when it is played three times in a row. 0 = default (4, or 8 for 4pc). Max 64.")
          ("earlywin",   "adjudicate win result early if both engines report mate scores")
          ("earlydraw",  "adjudicate draw result early if both engine scores are in range (-drawscore <= score <= drawscore) for a total of drawmoves moves")
-         ("drawscore",  po::value<uint>(&options.draw_score)->default_value(25), "drawscore (centipawns) value for \"earlydraw\" setting")
-         ("drawmoves",  po::value<uint>(&options.draw_moves)->default_value(20), "drawmoves value for \"earlydraw\" setting")
-         ("fens",       po::value<string>(&options.fens_filename), "file containing FENs for opening positions (one FEN per line)")
-         ("variant",    po::value<string>(&options.variant), "variant name")
+         ("drawscore",  po::value<uint>(&opts.draw_score)->default_value(25), "drawscore (centipawns) value for \"earlydraw\" setting")
+         ("drawmoves",  po::value<uint>(&opts.draw_moves)->default_value(20), "drawmoves value for \"earlydraw\" setting")
+         ("drawstart",  po::value<uint>(&opts.draw_start)->default_value(40), "number of moves (total) that must be played before \"earlydraw\" starts counting")
+         ("earlyresign", "adjudicate a loss for a side if its engine's score is <= -resignscore and the opponent's score is >= resignscore, for resignmoves consecutive moves by each side")
+         ("resignscore", po::value<uint>(&opts.resign_score)->default_value(800), "resignscore (centipawns) value for \"earlyresign\" setting")
+         ("resignmoves", po::value<uint>(&opts.resign_moves)->default_value(5), "resignmoves value for \"earlyresign\" setting")
+         ("fens",       po::value<string>(&opts.fens_filename), "opening book: a file of FENs or EPD positions (one per line, optionally followed by \"moves\" and engine format moves), or PGN games (SAN moves)")
+         ("bookplies",  po::value<uint>(&opts.book_plies)->default_value(0), "play at most this many plies of each opening's moves (--fens). 0 = all.")
+         ("variant",    po::value<string>(&opts.variant), "variant name")
          ("4pc",        "enable 4 player chess (teams) mode")
+         ("rules",      "track games with the built-in rules (standard chess, or 4pc teams mode): illegal moves are reported as errors, and checkmate/stalemate/draws are adjudicated immediately")
+         ("syzygy",     po::value<string>(&opts.syzygy_path), "path to Syzygy endgame tablebases. Games are adjudicated as soon as the position is in the tables (standard chess only).")
          ("continue",   "continue match if error occurs (e.g. illegal move)")
          ("pmoves",     "print out all moves")
-         ("pgn",        po::value<string>(&options.pgn_filename), "save games in PGN format to specified file name\n(if file exists it will be overwritten)")
-         ("pgn4",       po::value<string>(&options.pgn4_filename), "save games in PGN4 format to specified file name\n(if file exists it will be overwritten)")
+         ("stats",      "print throughput, harness CPU usage and engine resource usage at the end of the match")
+         ("sample",     po::value<uint>(&opts.sample_ms)->default_value(0), "sample each engine process's CPU, memory, threads and context switches every this many ms (Linux), e.g. 1000, for --stats and --metrics, and report engines using more cores or memory than allowed. 0 = off.")
+         ("pgn",        po::value<string>(&opts.pgn_filename), "save games in PGN format to specified file name\n(if file exists it will be overwritten)")
+         ("pgn4",       po::value<string>(&opts.pgn4_filename), "save games in PGN4 format to specified file name\n(if file exists it will be overwritten)")
+         ("logsink",    po::value<string>(&log_sink)->default_value("console"), "where engine debug output (--debug1, --debug2) is written: console, files, or both")
+         ("logname",    po::value<string>(&opts.log_prefix)->default_value("engine"), "file name prefix for the \"files\" log sink. Each engine's output is written to <logname>1.log and <logname>2.log")
+         ("metrics",    po::value<string>(&opts.metrics_filename), "write match metrics (Prometheus text format) to the specified file, updated every second")
+         ("events",     po::value<string>(&opts.events_path), "publish live match events (game start, moves, game end, stats, errors) as JSON lines to clients of a Unix domain socket at the specified path")
+         ("record",     po::value<string>(&opts.record_filename), "record all engine I/O, with timestamps, to the specified trace file")
+         ("replay",     po::value<string>(&opts.replay_filename), "replay a trace file recorded with --record, instead of running the engines. The recorded command line options are used, unless given again.")
+         ("realtime",   "replay with the recorded engine response times, instead of at full speed")
+         ("daemon",     po::value<string>(&opts.daemon_path), "keep running, and play the matches queued by clients of a control socket (a Unix domain socket at the specified path), reusing the engines from one match to the next. The other options are the defaults for the matches, and --threads is the number of game slots.")
          ;
 
       po::variables_map var_map;
-      po::store(po::parse_command_line(argc, argv, desc), var_map);
+      po::parsed_options parsed = po::command_line_parser(args).options(desc).run();
+      if (match_spec)
+      {
+         for (const po::option &option : parsed.options)
+         {
+            for (const char *key : {"help", "daemon", "record", "replay", "realtime", "events", "logsink", "logname", "workers", "cgroup"})
+            {
+               if (option.string_key == key)
+               {
+                  error = "--" + option.string_key + " can't be set for a match";
+                  return 0;
+               }
+            }
+         }
+      }
+      po::store(parsed, var_map);
+
+      if (match_spec)
+      {
+         // the daemon's options apply unless the match gives them again
+         po::parsed_options defaults = po::command_line_parser(default_args).options(desc).run();
+         for (size_t i = 0; i < defaults.options.size(); i++)
+            if (defaults.options[i].string_key == "daemon")
+               defaults.options.erase(defaults.options.begin() + i--);
+         po::store(defaults, var_map);
+      }
+
+      if (var_map.count("replay"))
+      {
+         if (var_map.count("record"))
+         {
+            error = "--record and --replay can't be used together";
+            return 0;
+         }
+         if (trace_replay.load(var_map["replay"].as<string>()) == 0)
+            return 0;
+         if (trace_replay.num_games() == 0)
+         {
+            error = "the trace file has no games";
+            return 0;
+         }
+         // Options already given take precedence over the recorded ones. The recorded output files aren't reused
+         // (so they aren't overwritten), and the FENs come from the trace.
+         po::parsed_options recorded = po::command_line_parser(trace_replay.args()).options(desc).run();
+         for (size_t i = 0; i < recorded.options.size(); i++)
+         {
+            const string &key = recorded.options[i].string_key;
+            if ((key == "record") || (key == "pgn") || (key == "pgn4") || (key == "fens"))
+               recorded.options.erase(recorded.options.begin() + i--);
+         }
+         po::store(recorded, var_map);
+      }
       po::notify(var_map);
 
       if (var_map.count("help"))
       {
-         cout << desc << "\n";
+         LogLine() << desc << "\n";
+         return 0;
+      }
+
+      if (var_map.count("daemon") && (var_map.count("record") || var_map.count("replay")))
+      {
+         error = "--daemon can't be used with --record or --replay";
+         return 0;
+      }
+
+      opts.uci_1 = (var_map.count("x1") == 0);
+      opts.uci_2 = (var_map.count("x2") == 0);
+      opts.debug_1 = (var_map.count("debug1") != 0);
+      opts.debug_2 = (var_map.count("debug2") != 0);
+      opts.continue_on_error = (var_map.count("continue") != 0);
+      opts.print_moves = (var_map.count("pmoves") != 0);
+      opts.print_stats = (var_map.count("stats") != 0);
+      opts.fourplayerchess = (var_map.count("4pc") != 0);
+      opts.use_rules = (var_map.count("rules") != 0);
+      opts.early_win = (var_map.count("earlywin") != 0);
+      opts.early_draw = (var_map.count("earlydraw") != 0);
+      opts.early_resign = (var_map.count("earlyresign") != 0);
+      opts.replay_realtime = (var_map.count("realtime") != 0);
+      opts.adaptive_threads = (var_map.count("adaptive") != 0);
+
+      if (log_sink == "console")
+         opts.log_sinks = LOG_CONSOLE;
+      else if (log_sink == "files")
+         opts.log_sinks = LOG_FILES;
+      else if (log_sink == "both")
+         opts.log_sinks = LOG_CONSOLE | LOG_FILES;
+      else
+      {
+         error = "invalid --logsink value: " + log_sink;
          return 0;
       }
 
-      options.uci_1 = (var_map.count("x1") == 0);
-      options.uci_2 = (var_map.count("x2") == 0);
-      options.debug_1 = (var_map.count("debug1") != 0);
-      options.debug_2 = (var_map.count("debug2") != 0);
-      options.continue_on_error = (var_map.count("continue") != 0);
-      options.print_moves = (var_map.count("pmoves") != 0);
-      options.fourplayerchess = (var_map.count("4pc") != 0);
-      options.early_win = (var_map.count("earlywin") != 0);
-      options.early_draw = (var_map.count("earlydraw") != 0);
+      if (parse_engine_limits(limits_1, opts.limits_1) == 0)
+      {
+         error = "invalid --limits1 value: " + limits_1;
+         return 0;
+      }
+      if (parse_engine_limits(limits_2, opts.limits_2) == 0)
+      {
+         error = "invalid --limits2 value: " + limits_2;
+         return 0;
+      }
+
+      opts.sprt = !sprt.empty();
+      if (opts.sprt)
+      {
+         char separator[3];
+         if ((sscanf(sprt.c_str(), "%lf%c%lf%c%lf%c%lf", &opts.sprt_elo0, &separator[0], &opts.sprt_elo1, &separator[1], &opts.sprt_alpha, &separator[2], &opts.sprt_beta) != 7) ||
+             (separator[0] != ',') || (separator[1] != ',') || (separator[2] != ',') || (opts.sprt_elo0 >= opts.sprt_elo1) ||
+             (opts.sprt_alpha <= 0.0) || (opts.sprt_alpha >= 0.5) || (opts.sprt_beta <= 0.0) || (opts.sprt_beta >= 0.5))
+         {
+            error = "invalid --sprt value: " + sprt + " (elo0 must be less than elo1, alpha and beta between 0 and 0.5)";
+            return 0;
+         }
+      }
    }
    catch (exception &e)
    {
-      cerr << "error: " << e.what() << "\n";
+      error = e.what();
       return 0;
    }
    catch (...)
    {
-      cerr << "error processing command line options\n";
+      error = "error processing command line options";
       return 0;
    }
 
-   if (options.num_threads > MAX_THREADS)
-      options.num_threads = MAX_THREADS;
-   if (options.num_threads > options.num_games_to_play)
-      options.num_threads = options.num_games_to_play;
+   if (!opts.replay_filename.empty())
+   {
+      opts.num_threads = trace_replay.num_slots();
+      opts.num_games_to_play = trace_replay.num_games();
+   }
+   if (opts.num_threads > MAX_THREADS)
+      opts.num_threads = MAX_THREADS;
+   // the daemon's --threads is its number of slots, whatever its --games
+   if ((opts.num_threads > opts.num_games_to_play) && opts.daemon_path.empty())
+      opts.num_threads = opts.num_games_to_play;
+   if (opts.min_threads == 0)
+      opts.min_threads = 1;
 
    return 1;
 }
@@ -463,8 +1236,10 @@ int _kbhit(void)
       initialized = true;
    }
 
-   int bytesWaiting;
-   ioctl(STDIN, FIONREAD, &bytesWaiting);
+   // ioctl fails if stdin isn't a terminal (e.g. redirected from /dev/null), which isn't a keypress.
+   int bytesWaiting = 0;
+   if (ioctl(STDIN, FIONREAD, &bytesWaiting) < 0)
+      return 0;
    return bytesWaiting;
 }
 #else
@@ -479,12 +1254,19 @@ int _kbhit(void)
 #ifdef WIN32
 BOOL WINAPI ctrl_c_handler(DWORD fdwCtrlType)
 {
-   match_mgr.shut_down_all_engines();
+   if (daemon_mode)
+      control_request_stop();
+   else
+      interrupted = true;
    return true;
 }
 #else
 void ctrl_c_handler(int s)
 {
-   match_mgr.shut_down_all_engines();
+   // the main loop stops the match (and main shuts down the engines)
+   if (daemon_mode)
+      control_request_stop();
+   else
+      interrupted = true;
 }
 #endif
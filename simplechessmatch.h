@@ -1,4 +1,11 @@
+#pragma once
 #include "gamemanager.h"
+#include "openingbook.h"
+#include "tablebase.h"
+#include "trace.h"
+#include "events.h"
+#include "procstats.h"
+#include "control.h"
 #include <boost/program_options.hpp>
 #include <fstream>
 #include <math.h>
@@ -7,14 +14,20 @@
 #include <conio.h>
 #else
 #include <signal.h>
+#include <sys/resource.h>
 #endif
 #ifdef __linux__
 #include <termios.h>
 #endif
 
-#define MAX_THREADS 32
+#define MAX_THREADS 1024
+#define ADAPTIVE_INTERVAL_S 10     // --adaptive measures timing health over windows of at least this many seconds
+#define ADAPTIVE_MIN_MOVES 20      // ... and at least this many moves
 
 int parse_cmd_line_options(int argc, char* argv[]);
+int parse_options(const vector<string> &args, const vector<string> &default_args, options_info &opts, string &error);
+int parse_match_options(const vector<string> &args, options_info &match_options, string &error);
+int run_daemon(void);
 #ifdef WIN32
 BOOL WINAPI ctrl_c_handler(DWORD fdwCtrlType);
 #else
@@ -28,11 +41,40 @@ public:
    GameManager *m_game_mgr;
 
 private:
-   thread *m_thread;
-   uint m_total_games_started;
+   mutex m_game_mutex;                                // held while a game is claimed
+   atomic<uint> m_total_games_started;
+   atomic<bool> m_stopping;                           // no more games may start
+   atomic<bool> m_fens_exhausted;
+   book_position m_next_opening;
+   bool m_next_swap_sides;                            // the next game replays m_next_opening with the sides swapped
    bool m_engines_shut_down;
-   fstream m_FENs_file;
+   uint m_num_slots;                                  // GameManagers allocated: --threads, or the daemon's --threads
+   bool m_daemon;                                     // playing the matches queued on the control socket (--daemon)
+   uint64_t m_match_id;                               // daemon mode: the match being played
+   vector<string> m_engine_config;                    // each slot's engines' configuration when they were started (engine_config)
+   string m_tablebase_path;                           // the Syzygy tablebases loaded
+   OpeningBook m_book;
+   size_t m_next_opening_index;
    fstream m_pgn_file;
+   string m_pgn_buffer;
+   chrono::steady_clock::time_point m_start_time;
+   SlotMetrics *m_metrics;
+   ResultCounters m_totals;                           // totals of all slots' result counters
+   chrono::steady_clock::time_point m_metrics_time;   // when the metrics file was last written
+   uint64_t m_metrics_plies;                          // plies played when the metrics file was last written
+   chrono::steady_clock::time_point m_events_time;    // when the last "stats" event was published
+   uint64_t m_events_plies;                           // plies played when the last "stats" event was published
+   uint64_t m_last_games_completed;                   // games completed when the results were last printed
+   string m_results;                                  // the results last published by publish_stats, as a JSON object
+   atomic<const char *> m_sprt_result;                // "H0" or "H1" once the SPRT (--sprt) has stopped the match
+   UsageSampler m_usage;                              // engine processes' resource usage (--sample)
+   chrono::steady_clock::time_point m_usage_time;     // when the engine processes were last sampled
+   atomic<uint> m_active_slots;                       // number of concurrent games allowed
+   bool m_adaptive_slow_start;                        // --adaptive doubles m_active_slots until timing health is first missed
+   chrono::steady_clock::time_point m_adaptive_time;  // start of the current --adaptive measurement window
+   timing_totals m_adaptive_timing;                   // counters at the start of the window
+   result_counts m_adaptive_results;
+   double m_baseline_nps[2];                          // each engine's NPS at --minthreads concurrent games
 
 public:
    MatchManager(void);
@@ -40,16 +82,31 @@ public:
    void cleanup(void);
    void main_loop(void);
    int initialize(void);
-   int load_all_engines(void);
+   int start(uint num_slots, bool daemon);
+   int new_match(void);
+   int prepare_engines(void);
+   void run_match(uint64_t id, const string &spec);
    void set_engine_options(Engine *engine);
    void send_engine_custom_commands(Engine *engine);
    void print_results(void);
+   void print_statistics(void);
+   void sample_usage(void);
+   void write_metrics(bool force);
+   void publish_stats(bool final);
+   void adjust_concurrency(void);
    void save_pgn(void);
    void shut_down_all_engines(void);
 
 private:
+   void reset_match(void);
+   bool match_failed(void);
+   void finish_match(bool abort);
+   string engine_config(engine_number number);
+   string results_json(const result_counts &totals, double plies_per_second);
    bool match_completed(void);
-   bool new_game_can_start(void);
+   bool idle_slot_can_start(void);
+   void check_sprt(void);
+   bool claim_next_game(uint slot, book_position &opening, bool &swap_sides, bool replacing);
    uint num_games_in_progress(void);
-   int get_next_fen(string &fen);
+   int get_next_opening(book_position &opening);
 };
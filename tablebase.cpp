@@ -0,0 +1,62 @@
+#include "tablebase.h"
+#include "logger.h"
+#ifdef USE_SYZYGY
+#include "tbprobe.h"
+#endif
+
+// tablebase_init loads the Syzygy tables found in path (multiple directories may be separated by ':', or ';' on Windows).
+int tablebase_init(const string &path)
+{
+#ifdef USE_SYZYGY
+   if (!tb_init(path.c_str()) || (TB_LARGEST == 0))
+   {
+      LogLine() << "Error: no Syzygy tablebases found in " << path << "\n";
+      return 0;
+   }
+   LogLine() << "Syzygy tablebases loaded (up to " << TB_LARGEST << " pieces).\n";
+   return 1;
+#else
+   (void)path;
+   LogLine() << "Error: Syzygy tablebase support was not compiled in (build with -DUSE_SYZYGY and Fathom's tbprobe.c)\n";
+   return 0;
+#endif
+}
+
+uint tablebase_max_pieces(void)
+{
+#ifdef USE_SYZYGY
+   return TB_LARGEST;
+#else
+   return 0;
+#endif
+}
+
+// tablebase_probe_wdl returns the game result for the position with perfect play, or UNFINISHED if the position
+// isn't in the tables. Cursed wins and blessed losses (won or lost, but drawn by the 50-move rule) count as draws.
+game_result tablebase_probe_wdl(ChessBoard &board)
+{
+#ifdef USE_SYZYGY
+   if ((board.num_pieces() > TB_LARGEST) || (board.castling_rights() != 0))
+      return UNFINISHED;
+
+   // Fathom only probes WDL tables with the halfmove clock at 0.
+   unsigned wdl = tb_probe_wdl(board.occupied(WHITE), board.occupied(BLACK),
+                               board.pieces(WHITE, KING) | board.pieces(BLACK, KING),
+                               board.pieces(WHITE, QUEEN) | board.pieces(BLACK, QUEEN),
+                               board.pieces(WHITE, ROOK) | board.pieces(BLACK, ROOK),
+                               board.pieces(WHITE, BISHOP) | board.pieces(BLACK, BISHOP),
+                               board.pieces(WHITE, KNIGHT) | board.pieces(BLACK, KNIGHT),
+                               board.pieces(WHITE, PAWN) | board.pieces(BLACK, PAWN),
+                               0, 0, (board.ep_square() >= 0) ? board.ep_square() : 0, board.side_to_move() == WHITE);
+   if (wdl == TB_RESULT_FAILED)
+      return UNFINISHED;
+   if (wdl == TB_WIN)
+      return (board.side_to_move() == WHITE) ? WHITE_WIN : BLACK_WIN;
+   if (wdl == TB_LOSS)
+      return (board.side_to_move() == WHITE) ? BLACK_WIN : WHITE_WIN;
+   return DRAW;
+#else
+   (void)board;
+   return UNFINISHED;
+#endif
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include "chessboard.h"
+
+// Syzygy endgame tablebase probing, for adjudicating games once few enough pieces remain.
+// This requires building with -DUSE_SYZYGY and the Fathom probing code (tbprobe.c / tbprobe.h).
+
+int tablebase_init(const string &path);
+uint tablebase_max_pieces(void);
+game_result tablebase_probe_wdl(ChessBoard &board);
@@ -0,0 +1,186 @@
+#include "trace.h"
+#include "engine.h"
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+
+TraceReplay trace_replay;
+
+static void write_u32(ofstream &file, uint32_t value)
+{
+   file.write((const char *)&value, sizeof(value));
+}
+
+int trace_write_header(ofstream &file, const vector<string> &args)
+{
+   file.write(TRACE_MAGIC, strlen(TRACE_MAGIC));
+   write_u32(file, TRACE_VERSION);
+   write_u32(file, args.size());
+   for (size_t i = 0; i < args.size(); i++)
+   {
+      write_u32(file, args[i].length());
+      file.write(args[i].data(), args[i].length());
+   }
+   return file.good() ? 1 : 0;
+}
+
+void trace_write_record(ofstream &file, uint64_t time_us, int slot, int engine, log_level kind, const string &text)
+{
+   int16_t slot16 = slot;
+   int8_t engine8 = engine;
+   uint8_t kind8 = kind;
+   file.write((const char *)&time_us, sizeof(time_us));
+   file.write((const char *)&slot16, sizeof(slot16));
+   file.write((const char *)&engine8, sizeof(engine8));
+   file.write((const char *)&kind8, sizeof(kind8));
+   write_u32(file, text.length());
+   file.write(text.data(), text.length());
+}
+
+TraceReplay::TraceReplay(void)
+{
+   m_num_games = 0;
+}
+
+int TraceReplay::load(const string &file_name)
+{
+   ifstream file(file_name, ios::in | ios::binary);
+   if (!file.is_open())
+   {
+      LogLine() << "Error: could not open trace file " << file_name << "\n";
+      return 0;
+   }
+
+   char magic[8];
+   uint32_t version = 0, num_args = 0, length;
+   file.read(magic, sizeof(magic));
+   file.read((char *)&version, sizeof(version));
+   file.read((char *)&num_args, sizeof(num_args));
+   if (!file || (memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) || (version != TRACE_VERSION))
+   {
+      LogLine() << "Error: " << file_name << " is not a simplechessmatch trace file (or is from a different version)\n";
+      return 0;
+   }
+   for (uint32_t i = 0; i < num_args; i++)
+   {
+      file.read((char *)&length, sizeof(length));
+      string arg(length, ' ');
+      file.read(&arg[0], length);
+      m_args.push_back(arg);
+   }
+
+   vector<trace_entry> entries;
+   while (true)
+   {
+      trace_entry entry;
+      int16_t slot16;
+      int8_t engine8;
+      uint8_t kind8;
+      file.read((char *)&entry.time_us, sizeof(entry.time_us));
+      file.read((char *)&slot16, sizeof(slot16));
+      file.read((char *)&engine8, sizeof(engine8));
+      file.read((char *)&kind8, sizeof(kind8));
+      file.read((char *)&length, sizeof(length));
+      if (!file)
+         break;
+      entry.text.resize(length);
+      file.read(&entry.text[0], length);
+      if (!file)
+      {
+         LogLine() << "Warning: trace file " << file_name << " is truncated\n";
+         break;
+      }
+      entry.slot = slot16;
+      entry.engine = engine8;
+      entry.kind = (log_level)kind8;
+      if (entry.slot >= 0)
+         entries.push_back(move(entry));
+   }
+
+   // The log sink writes records in batches, so records from different threads may be slightly out of order.
+   stable_sort(entries.begin(), entries.end(), [](const trace_entry &a, const trace_entry &b) { return a.time_us < b.time_us; });
+
+   for (size_t i = 0; i < entries.size(); i++)
+   {
+      trace_entry &entry = entries[i];
+      uint slot = entry.slot;
+      if (m_games.size() <= slot)
+      {
+         m_games.resize(slot + 1);
+         m_clocks.resize(slot + 1);
+         m_engines.resize((slot + 1) * 2);
+      }
+      if (entry.kind == LOG_TRACE_GAME)
+      {
+         m_games[slot].push_back(move(entry));
+         m_num_games++;
+      }
+      else if (entry.kind == LOG_TRACE_CLOCK)
+         m_clocks[slot].push_back(move(entry));
+      else if ((entry.engine == FIRST) || (entry.engine == SECOND))
+      {
+         if (entry.kind == LOG_TRACE_TO)
+            m_engines[slot * 2 + entry.engine].to_engine.push_back(move(entry));
+         else if ((entry.kind == LOG_TRACE_FROM) || (entry.kind == LOG_TRACE_EOF) || (entry.kind == LOG_TRACE_TIMEOUT))
+            m_engines[slot * 2 + entry.engine].from_engine.push_back(move(entry));
+      }
+   }
+
+   LogLine() << "Loaded trace " << file_name << ": " << m_num_games << " games, " << m_games.size() << " slots.\n";
+   return 1;
+}
+
+bool TraceReplay::has_game(uint slot)
+{
+   return (slot < m_games.size()) && !m_games[slot].empty();
+}
+
+// The text of a LOG_TRACE_GAME entry is "<swap sides (0 or 1)> <FEN>", followed by " moves <moves>" if the opening has moves.
+bool TraceReplay::next_game(uint slot, string &fen, string &moves, bool &swap_sides)
+{
+   if (!has_game(slot))
+      return false;
+   const string &text = m_games[slot].front().text;
+   swap_sides = (text[0] == '1');
+   fen = (text.length() > 2) ? text.substr(2) : "";
+   size_t moves_pos = fen.find(" moves ");
+   moves = (moves_pos != string::npos) ? fen.substr(moves_pos + 7) : "";
+   if (moves_pos != string::npos)
+      fen.erase(moves_pos);
+   m_games[slot].pop_front();
+   return true;
+}
+
+bool TraceReplay::next_to_engine(uint slot, int engine, trace_entry &entry)
+{
+   if (slot * 2 + engine >= m_engines.size())
+      return false;
+   deque<trace_entry> &queue = m_engines[slot * 2 + engine].to_engine;
+   if (queue.empty())
+      return false;
+   entry = move(queue.front());
+   queue.pop_front();
+   return true;
+}
+
+bool TraceReplay::next_from_engine(uint slot, int engine, trace_entry &entry)
+{
+   if (slot * 2 + engine >= m_engines.size())
+      return false;
+   deque<trace_entry> &queue = m_engines[slot * 2 + engine].from_engine;
+   if (queue.empty())
+      return false;
+   entry = move(queue.front());
+   queue.pop_front();
+   return true;
+}
+
+// next_clock returns the recorded time (ms) taken by the next move in the slot, or 0 if there are no more.
+int64_t TraceReplay::next_clock(uint slot)
+{
+   if ((slot >= m_clocks.size()) || m_clocks[slot].empty())
+      return 0;
+   int64_t ms = atoll(m_clocks[slot].front().text.c_str());
+   m_clocks[slot].pop_front();
+   return ms;
+}
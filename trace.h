@@ -0,0 +1,59 @@
+#pragma once
+#include "logger.h"
+#include <deque>
+
+// Engine I/O traces. With --record, every line sent to or received from each engine, the start of each game (FEN and
+// colors), and the time each move took are written to a binary trace file by the log sink thread.
+// With --replay, the recorded engine output is fed back to Engine in place of real engine processes, so a match
+// (e.g. a game that ended with an error) can be reproduced exactly, without running the engines.
+//
+// File format (native byte order):
+//    header:  "SCMTRACE", uint32 version, uint32 argument count, then each command line argument as uint32 length + text
+//    records: uint64 time (us), int16 slot, int8 engine, uint8 kind (log_level), uint32 length, text
+
+#define TRACE_MAGIC    "SCMTRACE"
+#define TRACE_VERSION  2
+
+struct trace_entry
+{
+   uint64_t time_us;
+   int slot;
+   int engine;
+   log_level kind;
+   string text;
+};
+
+int trace_write_header(ofstream &file, const vector<string> &args);
+void trace_write_record(ofstream &file, uint64_t time_us, int slot, int engine, log_level kind, const string &text);
+
+// TraceReplay holds a loaded trace, split into a queue for each engine instance and slot.
+// Each queue is only used by one thread at a time (the slot's game thread, or the main thread between games).
+class TraceReplay
+{
+private:
+   struct engine_queues
+   {
+      deque<trace_entry> to_engine;
+      deque<trace_entry> from_engine;   // LOG_TRACE_FROM, LOG_TRACE_EOF and LOG_TRACE_TIMEOUT entries
+   };
+
+   vector<string> m_args;
+   vector<engine_queues> m_engines;       // index: slot * 2 + engine
+   vector<deque<trace_entry>> m_games;    // LOG_TRACE_GAME entries for each slot
+   vector<deque<trace_entry>> m_clocks;   // LOG_TRACE_CLOCK entries for each slot
+   uint m_num_games;
+
+public:
+   TraceReplay(void);
+   int load(const string &file_name);
+   const vector<string> &args(void) { return m_args; }
+   uint num_games(void) { return m_num_games; }
+   uint num_slots(void) { return m_games.size(); }
+   bool has_game(uint slot);
+   bool next_game(uint slot, string &fen, string &moves, bool &swap_sides);
+   bool next_to_engine(uint slot, int engine, trace_entry &entry);
+   bool next_from_engine(uint slot, int engine, trace_entry &entry);
+   int64_t next_clock(uint slot);
+};
+
+extern TraceReplay trace_replay;